@@ -19,7 +19,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <inttypes.h>
-
+#include <pthread.h>
 
 #include "debug.h"
 
@@ -35,15 +35,15 @@ static const char *bunyan_name = NULL;
  * This bunyan code was taken from the humboldt repo, where it used to run in
  * a multithreaded context and used thread-locals here for bunyan_buf etc.
  *
- * Unfortunately, pivy would like to be portable to platforms that don't support
- * thread-local annotations on variables (looking at you OpenBSD), so we've
- * removed those annotations here (and the mutexes) but left the remainder of
- * the code as-is.
+ * pivy would like to be portable to platforms that don't support thread-local
+ * annotations on variables (looking at you OpenBSD), so the per-thread state
+ * (the output buffer and the stack of frames from bunyan_push()) lives in a
+ * struct bunyan_thread hung off a pthread key instead.
  *
- * As a result this version of bunyan.c is completely unsafe to use in the
- * face of multi-threading. This is fine within the pivy repo where all we have
- * is a couple of single-threaded commandline tools, but if you re-use this
- * code elsewhere, beware!
+ * bunyan_log() and bunyan_push()/bunyan_pop() are safe to call from any
+ * thread. The settings (name, level, printer) are process-wide and should be
+ * set up before starting any other threads. The printer may be called from
+ * several threads at once.
  */
 
 /*
@@ -60,8 +60,6 @@ bunyan_default_printer(enum bunyan_log_level lvl, const char *msg)
 }
 
 static bunyan_printer_t bunyan_printer = bunyan_default_printer;
-static char *bunyan_buf = NULL;
-static size_t bunyan_buf_sz = 0;
 
 static enum bunyan_log_level bunyan_min_level = BNY_WARN;
 static boolean_t bunyan_omit_timestamp = B_FALSE;
@@ -89,13 +87,61 @@ struct bunyan_frame {
 	struct bunyan_var *bf_vars;
 	struct bunyan_var *bf_lastvar;
 };
-struct bunyan_stack {
-	struct bunyan_stack *bs_next;
-	struct bunyan_frame *bs_top;
+struct bunyan_thread {
+	char *bt_buf;
+	size_t bt_buf_sz;
+	struct bunyan_frame *bt_top;
 };
 
-static struct bunyan_stack *thstack;
-static struct bunyan_stack *bunyan_stacks;
+static pthread_key_t bunyan_key;
+static pthread_once_t bunyan_key_once = PTHREAD_ONCE_INIT;
+
+static void
+bunyan_frame_free(struct bunyan_frame *frame)
+{
+	struct bunyan_var *var, *nvar;
+
+	for (var = frame->bf_vars; var != NULL; var = nvar) {
+		nvar = var->bv_next;
+		free(var);
+	}
+	free(frame);
+}
+
+static void
+bunyan_thread_free(void *arg)
+{
+	struct bunyan_thread *bt = arg;
+	struct bunyan_frame *frame, *nframe;
+
+	for (frame = bt->bt_top; frame != NULL; frame = nframe) {
+		nframe = frame->bf_next;
+		bunyan_frame_free(frame);
+	}
+	free(bt->bt_buf);
+	free(bt);
+}
+
+static void
+bunyan_key_init(void)
+{
+	VERIFY0(pthread_key_create(&bunyan_key, bunyan_thread_free));
+}
+
+static struct bunyan_thread *
+bunyan_thread(void)
+{
+	struct bunyan_thread *bt;
+
+	VERIFY0(pthread_once(&bunyan_key_once, bunyan_key_init));
+	bt = pthread_getspecific(bunyan_key);
+	if (bt == NULL) {
+		bt = calloc(1, sizeof (struct bunyan_thread));
+		VERIFY(bt != NULL);
+		VERIFY0(pthread_setspecific(bunyan_key, bt));
+	}
+	return (bt);
+}
 
 void
 bunyan_set_level(enum bunyan_log_level level)
@@ -117,17 +163,17 @@ bunyan_get_level(void)
 }
 
 static void
-printf_buf(const char *fmt, ...)
+printf_buf(struct bunyan_thread *bt, const char *fmt, ...)
 {
 	size_t orig, avail;
 	int wrote;
 	char *nbuf;
 	va_list ap, ap2;
 
-	if (bunyan_buf_sz == 0) {
-		bunyan_buf_sz = 1024;
-		bunyan_buf = calloc(bunyan_buf_sz, 1);
-		VERIFY(bunyan_buf != NULL);
+	if (bt->bt_buf_sz == 0) {
+		bt->bt_buf_sz = 1024;
+		bt->bt_buf = calloc(bt->bt_buf_sz, 1);
+		VERIFY(bt->bt_buf != NULL);
 	}
 
 	va_start(ap, fmt);
@@ -135,22 +181,22 @@ printf_buf(const char *fmt, ...)
 	/* Make a backup copy of the args so we can try again if we resize. */
 	va_copy(ap2, ap);
 
-	orig = strlen(bunyan_buf);
-	avail = bunyan_buf_sz - orig;
+	orig = strlen(bt->bt_buf);
+	avail = bt->bt_buf_sz - orig;
 again:
-	wrote = vsnprintf(bunyan_buf + orig, avail, fmt, ap);
+	wrote = vsnprintf(bt->bt_buf + orig, avail, fmt, ap);
 	VERIFY(wrote >= 0);
 	if (wrote >= avail) {
-		while (bunyan_buf_sz < orig + wrote)
-			bunyan_buf_sz *= 2;
-		nbuf = calloc(bunyan_buf_sz, 1);
+		while (bt->bt_buf_sz < orig + wrote)
+			bt->bt_buf_sz *= 2;
+		nbuf = calloc(bt->bt_buf_sz, 1);
 		VERIFY(nbuf != NULL);
-		bcopy(bunyan_buf, nbuf, orig);
+		bcopy(bt->bt_buf, nbuf, orig);
 		nbuf[orig] = 0;
-		free(bunyan_buf);
-		bunyan_buf = nbuf;
+		free(bt->bt_buf);
+		bt->bt_buf = nbuf;
 
-		avail = bunyan_buf_sz - orig;
+		avail = bt->bt_buf_sz - orig;
 		va_end(ap);
 		va_copy(ap, ap2);
 		goto again;
@@ -160,10 +206,10 @@ again:
 }
 
 static void
-reset_buf(void)
+reset_buf(struct bunyan_thread *bt)
 {
-	if (bunyan_buf_sz > 0)
-		bunyan_buf[0] = 0;
+	if (bt->bt_buf_sz > 0)
+		bt->bt_buf[0] = 0;
 }
 
 #if defined(__linux__)
@@ -229,16 +275,15 @@ void
 bunyan_timestamp(char *buffer, size_t len)
 {
 	struct timespec ts;
-	struct tm *info;
+	struct tm info;
 	int w;
 
 	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
-	info = gmtime(&ts.tv_sec);
-	VERIFY(info != NULL);
+	VERIFY(gmtime_r(&ts.tv_sec, &info) != NULL);
 
 	w = snprintf(buffer, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ",
-	    info->tm_year + 1900, info->tm_mon + 1, info->tm_mday,
-	    info->tm_hour, info->tm_min, info->tm_sec, ts.tv_nsec / 1000000);
+	    info.tm_year + 1900, info.tm_mon + 1, info.tm_mday,
+	    info.tm_hour, info.tm_min, info.tm_sec, ts.tv_nsec / 1000000);
 	VERIFY(w < MAX_TS_LEN);
 }
 
@@ -314,6 +359,7 @@ _bunyan_push(const char *func, ...)
 {
 	va_list ap;
 	struct bunyan_frame *frame;
+	struct bunyan_thread *bt = bunyan_thread();
 
 	frame = calloc(1, sizeof (struct bunyan_frame));
 	VERIFY(frame != NULL);
@@ -323,15 +369,8 @@ _bunyan_push(const char *func, ...)
 	bunyan_add_vars_p(frame, ap);
 	va_end(ap);
 
-	if (thstack == NULL) {
-		thstack = calloc(1, sizeof (struct bunyan_stack));
-		VERIFY(thstack != NULL);
-		thstack->bs_next = bunyan_stacks;
-		bunyan_stacks = thstack;
-	}
-
-	frame->bf_next = thstack->bs_top;
-	thstack->bs_top = frame;
+	frame->bf_next = bt->bt_top;
+	bt->bt_top = frame;
 
 	return (frame);
 }
@@ -339,21 +378,16 @@ _bunyan_push(const char *func, ...)
 void
 bunyan_pop(struct bunyan_frame *frame)
 {
-	struct bunyan_var *var, *nvar;
+	struct bunyan_thread *bt = bunyan_thread();
 	VERIFY(frame != NULL);
-	VERIFY(thstack != NULL);
-	VERIFY(thstack->bs_top == frame);
-	thstack->bs_top = frame->bf_next;
-
-	for (var = frame->bf_vars; var != NULL; var = nvar) {
-		nvar = var->bv_next;
-		free(var);
-	}
-	free(frame);
+	VERIFY(bt->bt_top == frame);
+	bt->bt_top = frame->bf_next;
+	bunyan_frame_free(frame);
 }
 
 static void
-print_frame(struct bunyan_frame *frame, uint *pn, struct bunyan_var **evars)
+print_frame(struct bunyan_thread *bt, struct bunyan_frame *frame, uint *pn,
+    struct bunyan_var **evars)
 {
 	struct bunyan_var *var;
 	uint n = *pn;
@@ -362,37 +396,37 @@ print_frame(struct bunyan_frame *frame, uint *pn, struct bunyan_var **evars)
 
 	for (var = frame->bf_vars; var != NULL; var = var->bv_next, ++n) {
 		if (n == 0) {
-			printf_buf(": ");
+			printf_buf(bt, ": ");
 		} else {
-			printf_buf(", ");
+			printf_buf(bt, ", ");
 		}
 
 		switch (var->bv_type) {
 		case BNY_STRING:
-			printf_buf("%s = \"%s\"", var->bv_name,
+			printf_buf(bt, "%s = \"%s\"", var->bv_name,
 			    var->bv_value.bvv_string);
 			break;
 		case BNY_INT:
-			printf_buf("%s = %d", var->bv_name,
+			printf_buf(bt, "%s = %d", var->bv_name,
 			    var->bv_value.bvv_int);
 			break;
 		case BNY_UINT:
-			printf_buf("%s = 0x%x", var->bv_name,
+			printf_buf(bt, "%s = 0x%x", var->bv_name,
 			    var->bv_value.bvv_uint);
 			break;
 		case BNY_UINT64:
-			printf_buf("%s = 0x%" PRIx64, var->bv_name,
+			printf_buf(bt, "%s = 0x%" PRIx64, var->bv_name,
 			    var->bv_value.bvv_uint64);
 			break;
 		case BNY_SIZE_T:
-			printf_buf("%s = %zu", var->bv_name,
+			printf_buf(bt, "%s = %zu", var->bv_name,
 			    var->bv_value.bvv_size_t);
 			break;
 		case BNY_BIN_HEX:
 			wstrval = buf_to_hex(
 			    var->bv_value.bvv_bin_hex.bvvbh_data,
 			    var->bv_value.bvv_bin_hex.bvvbh_len, 1);
-			printf_buf("%s = << %s >>", var->bv_name, wstrval);
+			printf_buf(bt, "%s = << %s >>", var->bv_name, wstrval);
 			free(wstrval);
 			break;
 		case BNY_ERF:
@@ -401,7 +435,7 @@ print_frame(struct bunyan_frame *frame, uint *pn, struct bunyan_var **evars)
 			bcopy(var, evar, sizeof (struct bunyan_var));
 			evar->bv_next = *evars;
 			*evars = evar;
-			printf_buf("%s = %s...", var->bv_name,
+			printf_buf(bt, "%s = %s...", var->bv_name,
 			    errf_name(var->bv_value.bvv_erf));
 			break;
 		default:
@@ -422,47 +456,44 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	uint n = 0;
 	struct bunyan_frame *frame;
 	struct bunyan_var *evars = NULL, *evar, *nevar;
+	struct bunyan_thread *bt = bunyan_thread();
 
-	reset_buf();
+	reset_buf(bt);
 
 	if (!bunyan_omit_timestamp) {
 		char time[MAX_TS_LEN];
 
 		bunyan_timestamp(time, sizeof (time));
-		printf_buf("[%s] ", time);
+		printf_buf(bt, "[%s] ", time);
 	}
 
 	if (bunyan_printer == bunyan_default_printer) {
 		switch (level) {
 		case BNY_TRACE:
-			printf_buf("TRACE: ");
+			printf_buf(bt, "TRACE: ");
 			break;
 		case BNY_DEBUG:
-			printf_buf("DEBUG: ");
+			printf_buf(bt, "DEBUG: ");
 			break;
 		case BNY_INFO:
-			printf_buf("INFO: ");
+			printf_buf(bt, "INFO: ");
 			break;
 		case BNY_WARN:
-			printf_buf("WARN: ");
+			printf_buf(bt, "WARN: ");
 			break;
 		case BNY_ERROR:
-			printf_buf("ERROR: ");
+			printf_buf(bt, "ERROR: ");
 			break;
 		case BNY_FATAL:
-			printf_buf("FATAL: ");
+			printf_buf(bt, "FATAL: ");
 			break;
 		}
 	}
 
-	printf_buf("%s", msg);
+	printf_buf(bt, "%s", msg);
 
-	if (thstack != NULL) {
-		frame = thstack->bs_top;
-		for (; frame != NULL; frame = frame->bf_next) {
-			print_frame(frame, &n, &evars);
-		}
-	}
+	for (frame = bt->bt_top; frame != NULL; frame = frame->bf_next)
+		print_frame(bt, frame, &n, &evars);
 
 	va_start(ap, msg);
 	while (1) {
@@ -480,9 +511,9 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 			break;
 
 		if (n == 0) {
-			printf_buf(": ");
+			printf_buf(bt, ": ");
 		} else {
-			printf_buf(", ");
+			printf_buf(bt, ", ");
 		}
 		++n;
 
@@ -491,34 +522,34 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 		switch (typ) {
 		case BNY_STRING:
 			strval = va_arg(ap, const char *);
-			printf_buf("%s = \"%s\"", propname, strval);
+			printf_buf(bt, "%s = \"%s\"", propname, strval);
 			break;
 		case BNY_INT:
 			intval = va_arg(ap, int);
-			printf_buf("%s = %d", propname, intval);
+			printf_buf(bt, "%s = %d", propname, intval);
 			break;
 		case BNY_UINT:
 			uintval = va_arg(ap, uint);
-			printf_buf("%s = 0x%x", propname, uintval);
+			printf_buf(bt, "%s = 0x%x", propname, uintval);
 			break;
 		case BNY_UINT64:
 			uint64val = va_arg(ap, uint64_t);
-			printf_buf("%s = 0x%" PRIx64, propname, uint64val);
+			printf_buf(bt, "%s = 0x%" PRIx64, propname, uint64val);
 			break;
 		case BNY_SIZE_T:
 			szval = va_arg(ap, size_t);
-			printf_buf("%s = %zu", propname, szval);
+			printf_buf(bt, "%s = %zu", propname, szval);
 			break;
 		case BNY_BIN_HEX:
 			binval = va_arg(ap, const uint8_t *);
 			szval = va_arg(ap, size_t);
 			wstrval = buf_to_hex(binval, szval, 1);
-			printf_buf("%s = << %s >>", propname, wstrval);
+			printf_buf(bt, "%s = << %s >>", propname, wstrval);
 			free(wstrval);
 			break;
 		case BNY_ERF:
 			err = va_arg(ap, errf_t *);
-			printf_buf("%s = %s...", propname, errf_name(err));
+			printf_buf(bt, "%s = %s...", propname, errf_name(err));
 
 			evar = calloc(1, sizeof (struct bunyan_var));
 			VERIFY(evar != NULL);
@@ -532,7 +563,7 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 			pubk = va_arg(ap, struct sshkey *);
 			wstrval = sshkey_fingerprint(pubk, SSH_DIGEST_SHA256,
 			    SSH_FP_BASE64);
-			printf_buf("%s = %s key (%u bits): %s", propname,
+			printf_buf(bt, "%s = %s key (%u bits): %s", propname,
 			    sshkey_type(pubk), sshkey_size(pubk), wstrval);
 			free(wstrval);
 			break;
@@ -541,15 +572,15 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 		}
 	}
 	va_end(ap);
-	printf_buf("\n");
+	printf_buf(bt, "\n");
 
 	for (evar = evars; evar != NULL; evar = nevar) {
 		const char *prefix = "";
 		nevar = evar->bv_next;
-		printf_buf("\t%s = ", evar->bv_name);
+		printf_buf(bt, "\t%s = ", evar->bv_name);
 		err = evar->bv_value.bvv_erf;
 		for (; err != NULL; err = errf_cause(err)) {
-			printf_buf("%s%s: %s\n\t    in %s() at %s:%d\n", prefix,
+			printf_buf(bt, "%s%s: %s\n\t    in %s() at %s:%d\n", prefix,
 			    errf_name(err), errf_message(err),
 			    errf_function(err), errf_file(err), errf_line(err));
 			prefix = "\t  Caused by ";
@@ -560,5 +591,5 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	if (level < bunyan_min_level) {
 		return;
 	}
-	(*bunyan_printer)(level, bunyan_buf);
+	(*bunyan_printer)(level, bt->bt_buf);
 }
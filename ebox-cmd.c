@@ -72,6 +72,7 @@
 #endif
 
 int ebox_authfd = -1;
+static struct piv_agent *ebox_agent = NULL;
 struct piv_ctx *ebox_ctx = NULL;
 char *ebox_pin;
 uint ebox_min_retries = 1;
@@ -247,52 +248,48 @@ again:
 	}
 }
 
-errf_t *
-local_unlock_agent(struct piv_ecdh_box *box)
+/*
+ * Returns our handle on the ssh-agent, connecting to it the first time. The
+ * agent's identity list is fetched once here and re-used for every box we
+ * try to unlock afterwards.
+ */
+static errf_t *
+get_agent(struct piv_agent **pap)
 {
-	struct sshkey *pubkey;
 	errf_t *err;
 	int rc;
-	uint i;
-	struct ssh_identitylist *idl = NULL;
-	boolean_t found = B_FALSE;
 
-	if (ebox_authfd == -1 &&
-	    (rc = ssh_get_authentication_socket(&ebox_authfd)) != 0) {
-		err = ssherrf("ssh_get_authentication_socket", rc);
-		goto out;
+	if (ebox_agent == NULL) {
+		if (ebox_authfd == -1 &&
+		    (rc = ssh_get_authentication_socket(&ebox_authfd)) != 0) {
+			return (ssherrf("ssh_get_authentication_socket", rc));
+		}
+		if ((err = piv_agent_open(ebox_authfd, &ebox_agent)))
+			return (err);
 	}
+	*pap = ebox_agent;
+	return (ERRF_OK);
+}
 
-	pubkey = piv_box_pubkey(box);
+errf_t *
+local_unlock_agent(struct piv_ecdh_box *box)
+{
+	struct piv_agent *pa;
+	const char *comment;
+	errf_t *err;
 
-	rc = ssh_fetch_identitylist(ebox_authfd, &idl);
-	if (rc) {
-		err = ssherrf("ssh_fetch_identitylist", rc);
-		goto out;
-	}
+	if ((err = get_agent(&pa)))
+		return (err);
 
-	for (i = 0; i < idl->nkeys; ++i) {
-		if (sshkey_equal_public(idl->keys[i], pubkey)) {
-			found = B_TRUE;
-			break;
-		}
-	}
-	if (!found) {
-		err = errf("KeyNotFoundError", NULL, "No matching key found in "
-		    "ssh agent");
-		goto out;
-	}
-
-	if (!ebox_batch) {
-		fprintf(stderr, "Using key '%s' in ssh-agent...\n",
-		    idl->comments[i]);
+	if (!piv_agent_has_key(pa, piv_box_pubkey(box), &comment)) {
+		return (errf("KeyNotFoundError", NULL, "No matching key found "
+		    "in ssh agent"));
 	}
 
-	err = piv_box_open_agent(ebox_authfd, box);
+	if (!ebox_batch)
+		fprintf(stderr, "Using key '%s' in ssh-agent...\n", comment);
 
-out:
-	ssh_free_identitylist(idl);
-	return (err);
+	return (piv_box_open_agentc(pa, box));
 }
 
 void
@@ -310,30 +307,18 @@ boolean_t
 can_local_unlock(struct piv_ecdh_box *box)
 {
 	errf_t *err;
-	int rc;
-	uint i;
 	struct piv_slot *slot;
 	struct piv_token *tokens = NULL, *token;
-	struct ssh_identitylist *idl = NULL;
-	struct sshkey *pubkey;
+	struct piv_agent *pa;
 	boolean_t found = B_FALSE;
 
-	if (ebox_authfd != -1 ||
-	    ssh_get_authentication_socket(&ebox_authfd) == 0) {
-		pubkey = piv_box_pubkey(box);
-
-		rc = ssh_fetch_identitylist(ebox_authfd, &idl);
-		if (rc)
+	if ((err = get_agent(&pa)) == ERRF_OK) {
+		if (piv_agent_has_key(pa, piv_box_pubkey(box), NULL)) {
+			found = B_TRUE;
 			goto out;
-
-		for (i = 0; i < idl->nkeys; ++i) {
-			if (sshkey_equal_public(idl->keys[i], pubkey)) {
-				found = B_TRUE;
-				break;
-			}
 		}
-		if (found)
-			goto out;
+	} else {
+		errf_free(err);
 	}
 
 	if (!piv_box_has_guidslot(box))
@@ -388,15 +373,45 @@ can_local_unlock(struct piv_ecdh_box *box)
 out:
 	if (tokens != ebox_enum_tokens)
 		piv_release(tokens);
-	ssh_free_identitylist(idl);
 	return (found);
 }
 
+/*
+ * Checks that the token (which must be selected, in a transaction) holds the
+ * private half of the given Card Authentication Key.
+ */
+static errf_t *
+local_check_cak(struct piv_token *token, struct sshkey *cak)
+{
+	struct piv_slot *cakslot;
+	errf_t *err;
+
+	cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+	if (cakslot == NULL) {
+		err = piv_read_cert(token, PIV_SLOT_CARD_AUTH);
+		if (err) {
+			return (errf("CardAuthenticationError", err,
+			    "Failed to validate CAK"));
+		}
+		cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+	}
+	if (cakslot == NULL) {
+		return (errf("CardAuthenticationError", NULL,
+		    "Failed to validate CAK"));
+	}
+	err = piv_auth_key(token, cakslot, cak);
+	if (err) {
+		return (errf("CardAuthenticationError", err,
+		    "Failed to validate CAK"));
+	}
+	return (ERRF_OK);
+}
+
 errf_t *
 local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 {
 	errf_t *err, *agerr = NULL;
-	struct piv_slot *slot, *cakslot;
+	struct piv_slot *slot;
 	struct piv_token *tokens = NULL, *token;
 
 	agerr = local_unlock_agent(box);
@@ -464,31 +479,9 @@ local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 		goto out;
 	}
 
-	if (cak != NULL) {
-		cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-		if (cakslot == NULL) {
-			err = piv_read_cert(token, PIV_SLOT_CARD_AUTH);
-			if (err) {
-				err = errf("CardAuthenticationError", err,
-				    "Failed to validate CAK");
-				piv_txn_end(token);
-				goto out;
-			}
-			cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-		}
-		if (cakslot == NULL) {
-			err = errf("CardAuthenticationError", NULL,
-			    "Failed to validate CAK");
-			piv_txn_end(token);
-			goto out;
-		}
-		err = piv_auth_key(token, cakslot, cak);
-		if (err) {
-			err = errf("CardAuthenticationError", err,
-			    "Failed to validate CAK");
-			piv_txn_end(token);
-			goto out;
-		}
+	if (cak != NULL && (err = local_check_cak(token, cak))) {
+		piv_txn_end(token);
+		goto out;
 	}
 
 	boolean_t prompt = B_FALSE;
@@ -526,6 +519,301 @@ out:
 	return (err);
 }
 
+/*
+ * Boxes which are all waiting on the same key on the same token (same GUID
+ * and slot), and which expect that token to have the same CAK (or none).
+ * local_unlock_eboxes() opens all of them inside a single transaction, with
+ * one CAK check and one PIN verify.
+ */
+struct unlock_group {
+	struct unlock_group	*ug_next;
+	uint8_t			 ug_guid[GUID_LEN];
+	enum piv_slotid		 ug_slotid;
+	struct sshkey		*ug_cak;
+	const char		*ug_name;
+	struct ebox		**ug_eboxes;
+	struct ebox_config	**ug_configs;
+	uint			 ug_n;
+	uint			 ug_alloc;
+};
+
+static void
+unlock_group_add(struct unlock_group **groups, struct ebox *ebox,
+    struct ebox_config *config)
+{
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct piv_ecdh_box *box;
+	struct unlock_group *ug;
+	struct sshkey *cak;
+	uint nalloc;
+
+	part = ebox_config_next_part(config, NULL);
+	tpart = ebox_part_tpl(part);
+	box = ebox_part_box(part);
+
+	for (ug = *groups; ug != NULL; ug = ug->ug_next) {
+		if (bcmp(ug->ug_guid, piv_box_guid(box), GUID_LEN) != 0 ||
+		    ug->ug_slotid != piv_box_slot(box))
+			continue;
+		/*
+		 * Only the group's CAK gets checked, so a box which names a
+		 * different one (or none at all) can't share its transaction.
+		 */
+		cak = ebox_tpl_part_cak(tpart);
+		if (ug->ug_cak == NULL && cak == NULL)
+			break;
+		if (ug->ug_cak != NULL && cak != NULL &&
+		    sshkey_equal_public(ug->ug_cak, cak))
+			break;
+	}
+	if (ug == NULL) {
+		ug = calloc(1, sizeof (struct unlock_group));
+		VERIFY(ug != NULL);
+		bcopy(piv_box_guid(box), ug->ug_guid, GUID_LEN);
+		ug->ug_slotid = piv_box_slot(box);
+		ug->ug_cak = ebox_tpl_part_cak(tpart);
+		ug->ug_name = ebox_tpl_part_name(tpart);
+		ug->ug_next = *groups;
+		*groups = ug;
+	}
+
+	if (ug->ug_n >= ug->ug_alloc) {
+		nalloc = ug->ug_alloc * 2 + 4;
+		ug->ug_eboxes = recallocarray(ug->ug_eboxes, ug->ug_alloc,
+		    nalloc, sizeof (struct ebox *));
+		ug->ug_configs = recallocarray(ug->ug_configs, ug->ug_alloc,
+		    nalloc, sizeof (struct ebox_config *));
+		VERIFY(ug->ug_eboxes != NULL);
+		VERIFY(ug->ug_configs != NULL);
+		ug->ug_alloc = nalloc;
+	}
+	ug->ug_eboxes[ug->ug_n] = ebox;
+	ug->ug_configs[ug->ug_n] = config;
+	++ug->ug_n;
+}
+
+static void
+unlock_group_free(struct unlock_group *ug)
+{
+	if (ug == NULL)
+		return;
+	free(ug->ug_eboxes);
+	free(ug->ug_configs);
+	free(ug);
+}
+
+static struct piv_ecdh_box *
+unlock_group_box(const struct unlock_group *ug, uint i)
+{
+	return (ebox_part_box(ebox_config_next_part(ug->ug_configs[i], NULL)));
+}
+
+static uint
+unlock_group_finish(struct unlock_group *ug, const boolean_t *opened)
+{
+	errf_t *err;
+	uint i, n = 0;
+
+	for (i = 0; i < ug->ug_n; ++i) {
+		if (!opened[i])
+			continue;
+		err = ebox_unlock(ug->ug_eboxes[i], ug->ug_configs[i]);
+		if (err != ERRF_OK) {
+			warnfx(err, "failed to unlock ebox");
+			errf_free(err);
+			continue;
+		}
+		++n;
+	}
+	return (n);
+}
+
+/*
+ * Opens the group's boxes through the agent, all in one pipelined burst.
+ * Returns the number opened.
+ */
+static uint
+unlock_group_agent(struct unlock_group *ug, boolean_t *opened)
+{
+	struct piv_agent *pa;
+	struct piv_ecdh_box **boxes;
+	errf_t **errs;
+	errf_t *err;
+	uint i, nopened = 0;
+
+	if ((err = get_agent(&pa))) {
+		errf_free(err);
+		return (0);
+	}
+	if (!piv_agent_has_key(pa, piv_box_pubkey(unlock_group_box(ug, 0)),
+	    NULL)) {
+		return (0);
+	}
+
+	boxes = calloc(ug->ug_n, sizeof (struct piv_ecdh_box *));
+	errs = calloc(ug->ug_n, sizeof (errf_t *));
+	VERIFY(boxes != NULL && errs != NULL);
+	for (i = 0; i < ug->ug_n; ++i)
+		boxes[i] = unlock_group_box(ug, i);
+
+	err = piv_box_open_agent_many(pa, boxes, ug->ug_n, errs);
+	errf_free(err);
+	for (i = 0; i < ug->ug_n; ++i) {
+		if (errs[i] == ERRF_OK) {
+			opened[i] = B_TRUE;
+			++nopened;
+		}
+		errf_free(errs[i]);
+	}
+
+	free(boxes);
+	free(errs);
+	return (nopened);
+}
+
+static errf_t *
+unlock_group_card(struct unlock_group *ug, boolean_t *opened)
+{
+	errf_t *err;
+	struct piv_token *tokens = NULL, *token;
+	struct piv_slot *slot;
+	boolean_t prompt = B_FALSE;
+	uint i;
+
+	err = piv_find(ebox_ctx, ug->ug_guid, GUID_LEN, &tokens);
+	if (err)
+		return (err);
+
+	err = piv_box_find_token(tokens, unlock_group_box(ug, 0), &token,
+	    &slot);
+	if (err)
+		goto out;
+
+	if ((err = piv_txn_begin(token)))
+		goto out;
+	if ((err = piv_select(token)))
+		goto outtxn;
+
+	if (ug->ug_cak != NULL && (err = local_check_cak(token, ug->ug_cak)))
+		goto outtxn;
+
+pin:
+	assert_pin(token, slot, ug->ug_name, prompt);
+	for (i = 0; i < ug->ug_n; ++i) {
+		/* Already opened before a PIN retry, or by the agent. */
+		if (opened[i])
+			continue;
+		err = piv_box_open(token, slot, unlock_group_box(ug, i));
+		if (errf_caused_by(err, "PermissionError") && !prompt &&
+		    !ebox_batch) {
+			errf_free(err);
+			prompt = B_TRUE;
+			goto pin;
+		} else if (err) {
+			err = errf("LocalUnlockError", err, "failed to unlock "
+			    "box");
+			goto outtxn;
+		}
+		opened[i] = B_TRUE;
+	}
+	err = ERRF_OK;
+
+outtxn:
+	piv_txn_end(token);
+out:
+	piv_release(tokens);
+	return (err);
+}
+
+/*
+ * Unlock as many of the given eboxes as possible using their primary
+ * configs, without any interaction beyond a PIN prompt.
+ *
+ * Rather than going through local_unlock() once per ebox (which costs a
+ * token lookup, transaction and PIN verify each time), the boxes are grouped
+ * by the token and slot they need and each group is opened in one go. The
+ * eboxes which couldn't be unlocked this way are left locked, and the caller
+ * can fall back to local_unlock()/interactive recovery for them.
+ */
+errf_t *
+local_unlock_eboxes(struct ebox **eboxes, uint n, uint *nunlocked)
+{
+	struct unlock_group *groups = NULL, *ug;
+	struct ebox_config *config;
+	struct ebox_tpl_config *tconfig;
+	struct piv_ecdh_box *box;
+	boolean_t *opened;
+	errf_t *err;
+	uint i;
+
+	*nunlocked = 0;
+
+	for (i = 0; i < n; ++i) {
+		if (ebox_is_unlocked(eboxes[i]))
+			continue;
+		config = NULL;
+		while ((config = ebox_next_config(eboxes[i], config)) != NULL) {
+			tconfig = ebox_config_tpl(config);
+			if (ebox_tpl_config_type(tconfig) != EBOX_PRIMARY)
+				continue;
+			box = ebox_part_box(ebox_config_next_part(config, NULL));
+			if (!piv_box_has_guidslot(box))
+				continue;
+			unlock_group_add(&groups, eboxes[i], config);
+			break;
+		}
+	}
+
+	if (ebox_ctx == NULL && groups != NULL) {
+		ebox_ctx = piv_open();
+		VERIFY(ebox_ctx != NULL);
+		err = piv_establish_context(ebox_ctx, SCARD_SCOPE_SYSTEM);
+		if (err && errf_caused_by(err, "ServiceError")) {
+			errf_free(err);
+		} else if (err) {
+			err = errf("LocalUnlockError", err, "failed to "
+			    "initialise libpcsc");
+			goto out;
+		}
+	}
+
+	while ((ug = groups) != NULL) {
+		groups = ug->ug_next;
+
+		opened = calloc(ug->ug_n, sizeof (boolean_t));
+		VERIFY(opened != NULL);
+
+		/*
+		 * If the key is available in an agent, use that rather than
+		 * touching the card (the agent will already have the PIN).
+		 * Whatever the agent couldn't open, try on the card.
+		 */
+		if (unlock_group_agent(ug, opened) < ug->ug_n) {
+			err = unlock_group_card(ug, opened);
+			if (err && !ebox_batch) {
+				warnfx(err, "failed to unlock %u boxes on "
+				    "token %s", ug->ug_n,
+				    piv_box_guid_hex(unlock_group_box(ug, 0)));
+			}
+			errf_free(err);
+		}
+
+		*nunlocked += unlock_group_finish(ug, opened);
+
+		free(opened);
+		unlock_group_free(ug);
+	}
+	err = ERRF_OK;
+
+out:
+	while ((ug = groups) != NULL) {
+		groups = ug->ug_next;
+		unlock_group_free(ug);
+	}
+	return (err);
+}
+
 void
 add_answer(struct question *q, struct answer *a)
 {
@@ -742,6 +1030,8 @@ struct part_state {
 	struct ebox_part *ps_part;
 	struct answer *ps_ans;
 	enum part_intent ps_intent;
+	pid_t ps_kid;
+	int ps_fd;
 };
 
 static void
@@ -902,6 +1192,224 @@ read_b64_box(struct piv_ecdh_box **outbox)
 	*outbox = box;
 }
 
+#if !defined(__APPLE__)
+/*
+ * Runs in a child process forked by recover_local_start() and unlocks a
+ * single part on its token. To talk to its card in parallel each worker needs
+ * its own PC/SC context (pcsclite serialises calls on one), and the rest of
+ * this file keeps its state (ebox_ctx, ebox_pin) in globals, so parallel
+ * recovery uses processes rather than threads: each worker establishes its
+ * own context and writes the decrypted box contents back to the parent
+ * over fd.
+ */
+static void
+recover_local_child(struct ebox_part *part, const char *pin, int fd)
+{
+	struct ebox_tpl_part *tpart = ebox_part_tpl(part);
+	struct piv_ecdh_box *box = ebox_part_box(part);
+	struct sshkey *cak = ebox_tpl_part_cak(tpart);
+	struct piv_ctx *ctx;
+	struct piv_token *tokens = NULL, *token;
+	struct piv_slot *slot;
+	uint8_t *data = NULL;
+	size_t len = 0, off = 0;
+	ssize_t w;
+	uint retries = ebox_min_retries;
+	errf_t *err;
+
+	ctx = piv_open();
+	VERIFY(ctx != NULL);
+	if ((err = piv_establish_context(ctx, SCARD_SCOPE_SYSTEM)))
+		goto out;
+	if ((err = piv_find(ctx, piv_box_guid(box), GUID_LEN, &tokens)))
+		goto out;
+	if ((err = piv_box_find_token(tokens, box, &token, &slot)))
+		goto out;
+
+	if ((err = piv_txn_begin(token)))
+		goto out;
+	if ((err = piv_select(token)))
+		goto outtxn;
+	if (cak != NULL && (err = local_check_cak(token, cak)))
+		goto outtxn;
+	if (pin != NULL) {
+		err = piv_verify_pin(token, piv_token_default_auth(token),
+		    pin, &retries, B_FALSE);
+		if (err)
+			goto outtxn;
+	}
+	if ((err = piv_box_open(token, slot, box)))
+		goto outtxn;
+	err = piv_box_take_data(box, &data, &len);
+
+outtxn:
+	piv_txn_end(token);
+out:
+	while (err == ERRF_OK && off < len) {
+		w = write(fd, data + off, len - off);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w == -1)
+			err = errfno("write", errno, NULL);
+		else
+			off += w;
+	}
+	if (data != NULL)
+		freezero(data, len);
+	if (err) {
+		warnfx(err, "failed to unlock box on token %s",
+		    piv_box_guid_hex(box));
+		_exit(EXIT_ERROR);
+	}
+	_exit(0);
+}
+
+/*
+ * Prepares a part for parallel recovery: anything the agent can unlock is
+ * done immediately (and we return B_TRUE). Otherwise, if the part's token is
+ * present, we collect (and verify) its PIN here in the parent, so that the
+ * prompts come one at a time, and then fork a worker to do the rest of the
+ * card operations while we move on to the next part.
+ *
+ * Parts we can't start a worker for are left alone for the sequential
+ * local_unlock() loop in interactive_recovery() to deal with.
+ */
+static boolean_t
+recover_local_start(struct part_state *state)
+{
+	struct ebox_part *part = state->ps_part;
+	struct ebox_tpl_part *tpart = ebox_part_tpl(part);
+	struct piv_ecdh_box *box = ebox_part_box(part);
+	struct sshkey *cak = ebox_tpl_part_cak(tpart);
+	struct piv_token *tokens = NULL, *token;
+	struct piv_slot *slot;
+	errf_t *err;
+	pid_t kid;
+	int p[2];
+
+	err = local_unlock_agent(box);
+	if (err == ERRF_OK)
+		return (B_TRUE);
+	errf_free(err);
+
+	if (!piv_box_has_guidslot(box))
+		return (B_FALSE);
+
+	if (ebox_ctx == NULL) {
+		ebox_ctx = piv_open();
+		VERIFY(ebox_ctx != NULL);
+		err = piv_establish_context(ebox_ctx, SCARD_SCOPE_SYSTEM);
+		if (err && !errf_caused_by(err, "ServiceError")) {
+			errf_free(err);
+			release_context();
+			return (B_FALSE);
+		}
+		errf_free(err);
+	}
+
+	if ((err = piv_find(ebox_ctx, piv_box_guid(box), GUID_LEN, &tokens)))
+		goto out;
+	if ((err = piv_box_find_token(tokens, box, &token, &slot)))
+		goto out;
+	if ((err = piv_txn_begin(token)))
+		goto out;
+	if ((err = piv_select(token))) {
+		piv_txn_end(token);
+		goto out;
+	}
+	/* Don't give the PIN to a card which only claims the right GUID. */
+	if (cak != NULL && (err = local_check_cak(token, cak))) {
+		piv_txn_end(token);
+		goto out;
+	}
+	assert_pin(token, slot, ebox_tpl_part_name(tpart), B_FALSE);
+	piv_txn_end(token);
+
+	fflush(stdout);
+	fflush(stderr);
+	if (pipe(p) == -1) {
+		err = errfno("pipe", errno, NULL);
+		goto out;
+	}
+	if ((kid = fork()) == -1) {
+		err = errfno("fork", errno, NULL);
+		close(p[0]);
+		close(p[1]);
+		goto out;
+	}
+	if (kid == 0) {
+		close(p[0]);
+		recover_local_child(part, ebox_pin, p[1]);
+	}
+	close(p[1]);
+	state->ps_kid = kid;
+	state->ps_fd = p[0];
+
+out:
+	if (err) {
+		bunyan_log(BNY_DEBUG, "parallel recovery not possible for part",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+	/* Each part is on a different device, so never re-use the PIN. */
+	free(ebox_pin);
+	ebox_pin = NULL;
+	piv_release(tokens);
+	return (B_FALSE);
+}
+
+/*
+ * Waits for the worker started by recover_local_start() and loads the box
+ * contents it sends back into the part's box. Returns B_TRUE if the box is
+ * now open.
+ */
+static boolean_t
+recover_local_finish(struct part_state *state)
+{
+	struct piv_ecdh_box *box = ebox_part_box(state->ps_part);
+	struct sshbuf *buf;
+	uint8_t rbuf[256];
+	ssize_t r;
+	pid_t ret;
+	int status;
+	boolean_t ok = B_FALSE;
+	errf_t *err;
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+
+	while (1) {
+		r = read(state->ps_fd, rbuf, sizeof (rbuf));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		VERIFY0(sshbuf_put(buf, rbuf, r));
+	}
+	explicit_bzero(rbuf, sizeof (rbuf));
+	close(state->ps_fd);
+	state->ps_fd = -1;
+
+	while ((ret = waitpid(state->ps_kid, &status, 0)) == -1)
+		if (errno != EINTR)
+			break;
+	state->ps_kid = 0;
+
+	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    sshbuf_len(buf) == 0)
+		goto out;
+	if ((err = piv_box_set_datab(box, buf))) {
+		errf_free(err);
+		goto out;
+	}
+	ok = B_TRUE;
+
+out:
+	sshbuf_free(buf);
+	return (ok);
+}
+#endif
+
 errf_t *
 interactive_recovery(struct ebox_config *config, const char *what)
 {
@@ -1000,10 +1508,52 @@ again:
 recover:
 	fprintf(stderr,
 	    "-- Beginning recovery --\n"
-	    "Local devices will be attempted in order before remote "
+	    "Local devices will be attempted before remote "
 	    "challenge-responses are processed.\n\n");
 	ncur = 0;
 
+#if !defined(__APPLE__)
+	/*
+	 * Start a worker for each local device (after asking for its PIN),
+	 * then collect the results. Recovery configs often want parts from
+	 * several tokens plugged in at once, and this way their card
+	 * operations overlap instead of running back to back. Anything which
+	 * fails here gets another go in the sequential loop below.
+	 */
+	release_context();
+	part = NULL;
+	while ((part = ebox_config_next_part(config, part)) != NULL) {
+		state = (struct part_state *)ebox_part_private(part);
+		if (state->ps_intent != INTENT_LOCAL)
+			continue;
+		state->ps_intent = INTENT_NONE;
+		make_answer_text_for_pstate(state);
+		state->ps_intent = INTENT_LOCAL;
+		fprintf(stderr, "-- Local device %s --\n",
+		    state->ps_ans->a_text);
+		if (recover_local_start(state)) {
+			state->ps_intent = INTENT_NONE;
+			fprintf(stderr, "Device box decrypted ok.\n");
+			++ncur;
+		}
+	}
+	part = NULL;
+	while ((part = ebox_config_next_part(config, part)) != NULL) {
+		state = (struct part_state *)ebox_part_private(part);
+		if (state->ps_kid == 0)
+			continue;
+		if (!recover_local_finish(state)) {
+			fprintf(stderr, "Failed to decrypt device box for %s, "
+			    "will retry.\n", state->ps_ans->a_text);
+			continue;
+		}
+		state->ps_intent = INTENT_NONE;
+		fprintf(stderr, "Device box for %s decrypted ok.\n",
+		    state->ps_ans->a_text);
+		++ncur;
+	}
+#endif
+
 	part = NULL;
 	while ((part = ebox_config_next_part(config, part)) != NULL) {
 		state = (struct part_state *)ebox_part_private(part);
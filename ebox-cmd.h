@@ -107,6 +107,7 @@ boolean_t can_local_unlock(struct piv_ecdh_box *box);
 errf_t *local_unlock_agent(struct piv_ecdh_box *box);
 errf_t *local_unlock(struct piv_ecdh_box *box, struct sshkey *cak,
     const char *name);
+errf_t *local_unlock_eboxes(struct ebox **eboxes, uint n, uint *nunlocked);
 errf_t *interactive_recovery(struct ebox_config *config, const char *what);
 
 errf_t *interactive_unlock_ebox(struct ebox *ebox, const char *fn);
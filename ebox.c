@@ -16,8 +16,11 @@
 #include <limits.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/errno.h>
 
+#include <zlib.h>
+
 #include "utils.h"
 #include "debug.h"
 
@@ -173,6 +176,7 @@ struct ebox_stream {
 	char *es_cipher;
 	char *es_mac;
 	size_t es_chunklen;
+	enum ebox_stream_compression es_compress;
 };
 
 struct ebox_stream_chunk {
@@ -196,11 +200,33 @@ enum ebox_part_tag {
 };
 
 #define	EBOX_STREAM_DEFAULT_CHUNK	(128 * 1024)
+/*
+ * Largest chunk size we'll accept in a stream header. Readers size their
+ * buffers from it before any chunk has been authenticated, so it has to stay
+ * well short of anything that could exhaust memory (or SSHBUF_SIZE_MAX).
+ */
+#define	EBOX_STREAM_MAX_CHUNK		(64 * 1024 * 1024)
+/*
+ * Upper bound on chunk size for compressed streams: we have to allocate a
+ * whole chunk's worth of buffer up front to inflate into.
+ */
+#define	EBOX_STREAM_MAX_ZCHUNK		(64 * 1024 * 1024)
+
+/*
+ * Each chunk in a compressed stream starts (inside the encryption) with one
+ * of these, saying how the rest of the chunk plaintext is encoded.
+ */
+enum ebox_chunk_method {
+	EBOX_CHUNK_STORED = 0x00,
+	EBOX_CHUNK_ZLIB = 0x01
+};
 
 enum ebox_version {
 	EBOX_V1 = 0x01,
 	EBOX_V2 = 0x02,
 	EBOX_V3 = 0x03,
+	/* V4 is only used for streams, and adds the compression field. */
+	EBOX_V4 = 0x04,
 	EBOX_VNEXT,
 	EBOX_VMIN = EBOX_V1
 };
@@ -1310,6 +1336,36 @@ ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
 	return (ERRF_OK);
 }
 
+errf_t *
+ebox_stream_set_compression(struct ebox_stream *es,
+    enum ebox_stream_compression comp)
+{
+	switch (comp) {
+	case EBOX_COMPRESS_NONE:
+		es->es_compress = comp;
+		es->es_ebox->e_version = EBOX_V3;
+		break;
+	case EBOX_COMPRESS_ZLIB:
+		if (es->es_chunklen > EBOX_STREAM_MAX_ZCHUNK) {
+			return (errf("ArgumentError", NULL, "stream chunk size "
+			    "(%zu) too large for compression", es->es_chunklen));
+		}
+		es->es_compress = comp;
+		es->es_ebox->e_version = EBOX_V4;
+		break;
+	default:
+		return (argerrf("comp", "a valid ebox_stream_compression",
+		    "%d", comp));
+	}
+	return (ERRF_OK);
+}
+
+enum ebox_stream_compression
+ebox_stream_compression(const struct ebox_stream *es)
+{
+	return (es->es_compress);
+}
+
 errf_t *
 sshbuf_put_ebox_stream(struct sshbuf *buf, struct ebox_stream *es)
 {
@@ -1326,6 +1382,13 @@ sshbuf_put_ebox_stream(struct sshbuf *buf, struct ebox_stream *es)
 	    (rc = sshbuf_put_cstring8(buf, es->es_mac)))
 		return (ssherrf("sshbuf_put_cstring8", rc));
 
+	if (es->es_ebox->e_version >= EBOX_V4) {
+		if ((rc = sshbuf_put_u8(buf, es->es_compress)))
+			return (ssherrf("sshbuf_put_u8", rc));
+	} else {
+		VERIFY3U(es->es_compress, ==, EBOX_COMPRESS_NONE);
+	}
+
 	return (ERRF_OK);
 }
 
@@ -1349,6 +1412,33 @@ sshbuf_put_ebox_stream_chunk(struct sshbuf *buf,
 	return (ERRF_OK);
 }
 
+errf_t *
+ebox_stream_chunk_frame(const struct ebox_stream_chunk *esc,
+    uint8_t hdr[EBOX_STREAM_CHUNK_HDRLEN], const uint8_t **enc, size_t *enclen)
+{
+	uint32_t v;
+
+	if (esc->esc_enc == NULL) {
+		return (argerrf("chunk", "an encrypted chunk",
+		    "a chunk that hasn't had ebox_stream_encrypt_chunk() "
+		    "called yet"));
+	}
+	if (esc->esc_enclen > UINT32_MAX) {
+		return (errf("OverflowError", NULL, "encrypted chunk too "
+		    "large (%zu bytes)", esc->esc_enclen));
+	}
+
+	/* Same layout as sshbuf_put_ebox_stream_chunk() */
+	v = htobe32(esc->esc_seqnr);
+	bcopy(&v, &hdr[0], sizeof (v));
+	v = htobe32(esc->esc_enclen);
+	bcopy(&v, &hdr[4], sizeof (v));
+
+	*enc = esc->esc_enc;
+	*enclen = esc->esc_enclen;
+	return (ERRF_OK);
+}
+
 errf_t *
 sshbuf_get_ebox_stream_chunk(struct sshbuf *buf, const struct ebox_stream *es,
     struct ebox_stream_chunk **chunk)
@@ -1405,6 +1495,7 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 	const struct sshcipher *cipher;
 	int dgalg;
 	uint64_t chunklen;
+	uint8_t comp;
 
 	err = sshbuf_get_ebox(buf, &e);
 	if (err)
@@ -1428,9 +1519,9 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		err = eboxderrf(ssherrf("sshbuf_get_u64", rc));
 		goto out;
 	}
-	if (chunklen > SIZE_MAX) {
+	if (chunklen == 0 || chunklen > EBOX_STREAM_MAX_CHUNK) {
 		err = eboxderrf(errf("OverflowError", NULL,
-		    "stream chunk size (%" PRIu64 ") too large", chunklen));
+		    "stream chunk size (%" PRIu64 ") out of range", chunklen));
 		goto out;
 	}
 	es->es_chunklen = chunklen;
@@ -1454,6 +1545,31 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		goto out;
 	}
 
+	if (es->es_ebox->e_version >= EBOX_V4) {
+		if ((rc = sshbuf_get_u8(buf, &comp))) {
+			err = eboxderrf(ssherrf("sshbuf_get_u8", rc));
+			goto out;
+		}
+		switch (comp) {
+		case EBOX_COMPRESS_NONE:
+			break;
+		case EBOX_COMPRESS_ZLIB:
+			if (es->es_chunklen > EBOX_STREAM_MAX_ZCHUNK) {
+				err = eboxverrf(errf("OverflowError", NULL,
+				    "compressed stream chunk size (%zu) too "
+				    "large", es->es_chunklen));
+				goto out;
+			}
+			break;
+		default:
+			err = eboxverrf(errf("BadAlgorithmError", NULL,
+			    "unsupported stream compression type 0x%02x",
+			    comp));
+			goto out;
+		}
+		es->es_compress = comp;
+	}
+
 	*pes = es;
 	es = NULL;
 	err = NULL;
@@ -1464,6 +1580,95 @@ out:
 	return (err);
 }
 
+/*
+ * In a compressed stream, the chunk plaintext (before padding) is a method
+ * byte followed by either the zlib-compressed data or the data itself, if
+ * compressing it didn't make it any smaller. Each chunk is compressed on its
+ * own, so they can still be decrypted independently.
+ */
+static errf_t *
+chunk_deflate(const struct ebox_stream *es, const uint8_t *data, size_t len,
+    uint8_t **pbody, size_t *pbodylen)
+{
+	uint8_t *body;
+	size_t bodylen;
+	uLongf zlen;
+	int rc;
+
+	if (len > es->es_chunklen) {
+		return (errf("LengthError", NULL, "Chunk length (%zu) is "
+		    "larger than stream chunk size (%zu)", len,
+		    es->es_chunklen));
+	}
+
+	bodylen = 1 + compressBound(len);
+	body = malloc(bodylen);
+	if (body == NULL)
+		return (ERRF_NOMEM);
+
+	zlen = bodylen - 1;
+	rc = compress2(&body[1], &zlen, data, len, Z_DEFAULT_COMPRESSION);
+	if (rc == Z_OK && zlen < len) {
+		body[0] = EBOX_CHUNK_ZLIB;
+		*pbodylen = 1 + zlen;
+	} else {
+		body[0] = EBOX_CHUNK_STORED;
+		bcopy(data, &body[1], len);
+		*pbodylen = 1 + len;
+	}
+
+	*pbody = body;
+	return (ERRF_OK);
+}
+
+static errf_t *
+chunk_inflate(const struct ebox_stream *es, const uint8_t *body,
+    size_t bodylen, uint8_t **pdata, size_t *plen)
+{
+	uint8_t *data;
+	uLongf len;
+	int rc;
+
+	if (bodylen < 1) {
+		return (errf("LengthError", NULL, "Compressed stream chunk "
+		    "is missing its method byte"));
+	}
+
+	switch (body[0]) {
+	case EBOX_CHUNK_STORED:
+		len = bodylen - 1;
+		data = malloc(len > 0 ? len : 1);
+		if (data == NULL)
+			return (ERRF_NOMEM);
+		bcopy(&body[1], data, len);
+		break;
+	case EBOX_CHUNK_ZLIB:
+		/*
+		 * A chunk can never inflate to more than the stream chunk
+		 * size, so uncompress() failing to fit it in that is an error
+		 * (and stops us from being handed a zlib bomb).
+		 */
+		len = es->es_chunklen;
+		data = malloc(len > 0 ? len : 1);
+		if (data == NULL)
+			return (ERRF_NOMEM);
+		rc = uncompress(data, &len, &body[1], bodylen - 1);
+		if (rc != Z_OK) {
+			freezero(data, es->es_chunklen);
+			return (errf("DecompressError", NULL, "Failed to "
+			    "decompress stream chunk (zlib error %d)", rc));
+		}
+		break;
+	default:
+		return (errf("BadAlgorithmError", NULL, "Unsupported stream "
+		    "chunk method 0x%02x", body[0]));
+	}
+
+	*pdata = data;
+	*plen = len;
+	return (ERRF_OK);
+}
+
 errf_t *
 ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 {
@@ -1471,13 +1676,23 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	const struct sshcipher *cipher;
 	int dgalg = -1;
 	size_t blocksz, ivlen, authlen, keylen, plainlen, enclen, maclen;
-	size_t padding, i;
-	uint8_t *key, *plain, *enc, *iv;
+	size_t padding, i, bodylen;
+	uint8_t *key, *plain, *enc, *iv, *body = NULL;
 	struct sshcipher_ctx *cctx = NULL;
 	struct ssh_hmac_ctx *hctx = NULL;
+	errf_t *err;
 
 	es = esc->esc_stream;
-	plainlen = esc->esc_plainlen;
+
+	if (es->es_compress != EBOX_COMPRESS_NONE) {
+		err = chunk_deflate(es, esc->esc_plain, esc->esc_plainlen,
+		    &body, &bodylen);
+		if (err)
+			return (err);
+		plainlen = bodylen;
+	} else {
+		plainlen = esc->esc_plainlen;
+	}
 
 	cipher = cipher_by_name(es->es_cipher);
 	VERIFY(cipher != NULL);
@@ -1515,12 +1730,17 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	padding = blocksz - (plainlen % blocksz);
 	VERIFY3U(padding, <=, blocksz);
 	VERIFY3U(padding, >, 0);
-	plainlen += padding;
-	plain = malloc(plainlen);
+	plain = malloc(plainlen + padding);
 	VERIFY3P(plain, !=, NULL);
-	bcopy(esc->esc_plain, plain, esc->esc_plainlen);
-	for (i = esc->esc_plainlen; i < plainlen; ++i)
+	if (body != NULL) {
+		bcopy(body, plain, plainlen);
+		freezero(body, bodylen);
+	} else {
+		bcopy(esc->esc_plain, plain, plainlen);
+	}
+	for (i = plainlen; i < plainlen + padding; ++i)
 		plain[i] = padding;
+	plainlen += padding;
 
 	enclen = plainlen + authlen + maclen;
 	esc->esc_enc = (enc = malloc(enclen));
@@ -1650,6 +1870,13 @@ ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
 		}
 	}
 
+	if (es->es_compress != EBOX_COMPRESS_NONE) {
+		err = chunk_inflate(es, plain, reallen, &esc->esc_plain,
+		    &esc->esc_plainlen);
+		freezero(plain, plainlen);
+		return (err);
+	}
+
 	esc->esc_plain = plain;
 	esc->esc_plainlen = reallen;
 
@@ -2684,7 +2911,11 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	box = calloc(1, sizeof (struct ebox));
 	VERIFY(box != NULL);
 
-	box->e_version = EBOX_VNEXT - 1;
+	/*
+	 * Nothing in V4 is relevant to non-stream eboxes, so stick to V3 to
+	 * keep them readable by older versions.
+	 */
+	box->e_version = EBOX_V3;
 	box->e_type = EBOX_KEY;
 
 	/* Need a cipher with a 32-byte key, AES256-GCM is the easiest. */
@@ -2812,6 +3043,136 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	return (ERRF_OK);
 }
 
+/*
+ * State shared between the workers of ebox_create_batch(). Each worker
+ * claims the next unprocessed key index and builds that ebox.
+ */
+struct ebox_batch {
+	pthread_mutex_t		 eb_mtx;
+	const struct ebox_tpl	*eb_tpl;
+	const uint8_t *const	*eb_keys;
+	const size_t		*eb_keylens;
+	struct ebox		**eb_eboxes;
+	uint			 eb_n;
+	uint			 eb_next;
+	errf_t			*eb_err;
+};
+
+static void *
+ebox_batch_worker(void *arg)
+{
+	struct ebox_batch *eb = arg;
+	errf_t *err;
+	uint i;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&eb->eb_mtx));
+		if (eb->eb_err != ERRF_OK)
+			i = eb->eb_n;
+		else
+			i = eb->eb_next++;
+		VERIFY0(pthread_mutex_unlock(&eb->eb_mtx));
+		if (i >= eb->eb_n)
+			break;
+
+		err = ebox_create(eb->eb_tpl, eb->eb_keys[i],
+		    eb->eb_keylens[i], NULL, 0, &eb->eb_eboxes[i]);
+		if (err != ERRF_OK) {
+			VERIFY0(pthread_mutex_lock(&eb->eb_mtx));
+			if (eb->eb_err == ERRF_OK)
+				eb->eb_err = err;
+			else
+				errf_free(err);
+			VERIFY0(pthread_mutex_unlock(&eb->eb_mtx));
+		}
+	}
+
+	return (NULL);
+}
+
+errf_t *
+ebox_create_batch(const struct ebox_tpl *tpl, const uint8_t *const *keys,
+    const size_t *keylens, uint n, uint nthreads, struct ebox **eboxes)
+{
+	struct ebox_batch eb;
+	struct ebox_tpl_config *tconfig;
+	struct ebox_tpl_part *tpart;
+	pthread_t *threads;
+	uint i, started;
+	int rc;
+
+	/*
+	 * Check the template once up front, rather than finding out it's no
+	 * good in every worker (ebox_create() assumes it's sane).
+	 */
+	for (tconfig = tpl->et_configs; tconfig != NULL;
+	    tconfig = tconfig->etc_next) {
+		for (tpart = tconfig->etc_parts; tpart != NULL;
+		    tpart = tpart->etp_next) {
+			if (tpart->etp_pubkey == NULL ||
+			    tpart->etp_pubkey->type != KEY_ECDSA) {
+				return (errf("ArgumentError", NULL, "Template "
+				    "part has no ECDSA public key"));
+			}
+		}
+	}
+	for (i = 0; i < n; ++i)
+		eboxes[i] = NULL;
+
+#if !defined(HAVE_ARC4RANDOM)
+	/*
+	 * The arc4random() from openbsd-compat isn't thread-safe, and we
+	 * use it for nonces and IVs.
+	 */
+	nthreads = 1;
+#endif
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > n)
+		nthreads = n;
+
+	bzero(&eb, sizeof (eb));
+	VERIFY0(pthread_mutex_init(&eb.eb_mtx, NULL));
+	eb.eb_tpl = tpl;
+	eb.eb_keys = keys;
+	eb.eb_keylens = keylens;
+	eb.eb_eboxes = eboxes;
+	eb.eb_n = n;
+
+	if (nthreads <= 1) {
+		(void) ebox_batch_worker(&eb);
+		goto out;
+	}
+
+	threads = calloc(nthreads, sizeof (pthread_t));
+	if (threads == NULL) {
+		eb.eb_err = ERRF_NOMEM;
+		goto out;
+	}
+	for (started = 0; started < nthreads; ++started) {
+		rc = pthread_create(&threads[started], NULL,
+		    ebox_batch_worker, &eb);
+		if (rc != 0)
+			break;
+	}
+	/* If we couldn't start any threads, do the work ourselves. */
+	if (started == 0)
+		(void) ebox_batch_worker(&eb);
+	for (i = 0; i < started; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+	free(threads);
+
+out:
+	VERIFY0(pthread_mutex_destroy(&eb.eb_mtx));
+	if (eb.eb_err != ERRF_OK) {
+		for (i = 0; i < n; ++i) {
+			ebox_free(eboxes[i]);
+			eboxes[i] = NULL;
+		}
+	}
+	return (eb.eb_err);
+}
+
 errf_t *
 ebox_unlock(struct ebox *ebox, struct ebox_config *config)
 {
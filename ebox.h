@@ -53,6 +53,11 @@ enum ebox_type {
 	EBOX_STREAM = 0x03
 };
 
+enum ebox_stream_compression {
+	EBOX_COMPRESS_NONE = 0x00,
+	EBOX_COMPRESS_ZLIB = 0x01
+};
+
 enum ebox_config_type {
 	EBOX_PRIMARY = 0x01,
 	EBOX_RECOVERY = 0x02
@@ -155,6 +160,21 @@ errf_t *ebox_create(const struct ebox_tpl *tpl, const uint8_t *key,
     struct ebox **pebox);
 void ebox_free(struct ebox *box);
 
+/*
+ * Creates one ebox per key in keys[] (each of keylens[i] bytes), all from the
+ * same template, using up to nthreads threads. On failure none of the
+ * eboxes[] are left allocated.
+ *
+ * Note that each ebox still gets its own ephemeral keys: sharing them
+ * between eboxes would make the ECDH result for a part the same across all
+ * of them, so anyone who saw one of them being unlocked (e.g. via an agent)
+ * could unlock them all.
+ */
+MUST_CHECK
+errf_t *ebox_create_batch(const struct ebox_tpl *tpl,
+    const uint8_t *const *keys, const size_t *keylens, uint n, uint nthreads,
+    struct ebox **eboxes);
+
 uint ebox_version(const struct ebox *ebox);
 enum ebox_type ebox_type(const struct ebox *ebox);
 uint ebox_ephem_count(const struct ebox *ebox);
@@ -339,14 +359,37 @@ MUST_CHECK
 errf_t *sshbuf_put_ebox_stream_chunk(struct sshbuf *buf,
     struct ebox_stream_chunk *chunk);
 
+/*
+ * Returns the serialised form of an encrypted chunk (as written by
+ * sshbuf_put_ebox_stream_chunk()) as a fixed-size header, which is filled
+ * into hdr, followed by the ciphertext, which is returned by reference
+ * without copying. Useful for writing chunks out with writev().
+ */
+#define	EBOX_STREAM_CHUNK_HDRLEN	8
+MUST_CHECK
+errf_t *ebox_stream_chunk_frame(const struct ebox_stream_chunk *chunk,
+    uint8_t hdr[EBOX_STREAM_CHUNK_HDRLEN], const uint8_t **enc,
+    size_t *enclen);
+
 struct ebox *ebox_stream_ebox(const struct ebox_stream *str);
 const char *ebox_stream_cipher(const struct ebox_stream *str);
 const char *ebox_stream_mac(const struct ebox_stream *str);
 size_t ebox_stream_chunk_size(const struct ebox_stream *str);
+enum ebox_stream_compression ebox_stream_compression(
+    const struct ebox_stream *str);
 size_t ebox_stream_seek_offset(const struct ebox_stream *str, size_t offset);
 
 MUST_CHECK
 errf_t *ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str);
+/*
+ * Compresses each chunk (independently) before it's encrypted. Must be set
+ * before the stream header is written with sshbuf_put_ebox_stream(). Streams
+ * with compression enabled can't be read by versions of pivy which predate
+ * this. Decryption handles compression automatically.
+ */
+MUST_CHECK
+errf_t *ebox_stream_set_compression(struct ebox_stream *str,
+    enum ebox_stream_compression comp);
 MUST_CHECK
 errf_t *ebox_stream_chunk_new(const struct ebox_stream *str, const void *data,
     size_t size, size_t seqnr, struct ebox_stream_chunk **chunk);
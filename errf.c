@@ -91,6 +91,23 @@ struct errf errf_nomem = {
 
 struct errf *ERRF_NOMEM = &errf_nomem;
 
+/*
+ * strerror() may use a static buffer, so use strerror_r() to keep errf
+ * construction safe to use from several threads at once. glibc with
+ * _GNU_SOURCE gives us the GNU variant which returns the string instead.
+ */
+static const char *
+errf_strerror(int eno, char *buf, size_t len)
+{
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+	return (strerror_r(eno, buf, len));
+#else
+	if (strerror_r(eno, buf, len) != 0)
+		snprintf(buf, len, "Unknown error %d", eno);
+	return (buf);
+#endif
+}
+
 const char *
 errf_name(const struct errf *e)
 {
@@ -140,6 +157,7 @@ _errf(const char *name, struct errf *cause, const char *func, const char *file,
 	struct errf *e;
 	int wrote;
 	va_list ap;
+	char ebuf[128];
 
 	e = calloc(1, sizeof (struct errf));
 	if (e == NULL)
@@ -159,7 +177,7 @@ _errf(const char *name, struct errf *cause, const char *func, const char *file,
 		e->errf_message[0] = '\0';
 		wrote = snprintf(e->errf_message, sizeof (e->errf_message),
 		    "vsnprintf returned errno %d (%s): %s", eno, macro,
-		    strerror(eno));
+		    errf_strerror(eno, ebuf, sizeof (ebuf)));
 		if (wrote < 0) {
 			e->errf_message[0] = '\0';
 			strlcpy(e->errf_message, "<vsnprintf failed>",
@@ -182,6 +200,7 @@ _errfno(const char *enofunc, int eno, const char *func, const char *file,
 	int wrote;
 	va_list ap;
 	const char *macro;
+	char ebuf[128];
 
 	macro = errno_to_macro(eno);
 
@@ -198,7 +217,7 @@ _errfno(const char *enofunc, int eno, const char *func, const char *file,
 
 	wrote = snprintf(e->errf_message, sizeof (e->errf_message),
 	    "%s returned errno %d (%s): %s%s", enofunc, eno, macro,
-	    strerror(eno), fmt ? ": " : "");
+	    errf_strerror(eno, ebuf, sizeof (ebuf)), fmt ? ": " : "");
 	if (wrote < 0) {
 		e->errf_message[0] = '\0';
 		strlcpy(e->errf_message, "<vsnprintf failed>",
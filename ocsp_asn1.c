@@ -0,0 +1,128 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2026 The pivy Authors
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include "debug.h"
+
+#include "ocsp_asn1.h"
+
+static const ASN1_TEMPLATE PIVY_OCSP_RESPDATA_seq_tt[] = {
+	{
+		/* ResponderID ::= CHOICE { ..., byKey [2] KeyHash } */
+		.flags = ASN1_TFLG_EXPLICIT,
+		.tag = 2,
+		.offset = offsetof(PIVY_OCSP_RESPDATA, keyhash),
+		.field_name = "keyhash",
+		.item = &ASN1_OCTET_STRING_it
+	},
+	{
+		.offset = offsetof(PIVY_OCSP_RESPDATA, produced_at),
+		.field_name = "produced_at",
+		.item = &ASN1_GENERALIZEDTIME_it
+	},
+	{
+		.flags = ASN1_TFLG_SEQUENCE_OF,
+		.offset = offsetof(PIVY_OCSP_RESPDATA, responses),
+		.field_name = "responses",
+		.item = &OCSP_SINGLERESP_it
+	}
+};
+
+const ASN1_ITEM PIVY_OCSP_RESPDATA_it = {
+	.itype = ASN1_ITYPE_SEQUENCE,
+	.utype = V_ASN1_SEQUENCE,
+	.templates = PIVY_OCSP_RESPDATA_seq_tt,
+	.tcount = sizeof(PIVY_OCSP_RESPDATA_seq_tt) / sizeof(ASN1_TEMPLATE),
+	.size = sizeof(PIVY_OCSP_RESPDATA),
+	.sname = "PIVY_OCSP_RESPDATA"
+};
+
+static const ASN1_TEMPLATE PIVY_OCSP_BASICRESP_seq_tt[] = {
+	{
+		.offset = offsetof(PIVY_OCSP_BASICRESP, tbs),
+		.field_name = "tbs",
+		.item = &PIVY_OCSP_RESPDATA_it
+	},
+	{
+		.offset = offsetof(PIVY_OCSP_BASICRESP, sigalg),
+		.field_name = "sigalg",
+		.item = &X509_ALGOR_it
+	},
+	{
+		.offset = offsetof(PIVY_OCSP_BASICRESP, signature),
+		.field_name = "signature",
+		.item = &ASN1_BIT_STRING_it
+	}
+};
+
+const ASN1_ITEM PIVY_OCSP_BASICRESP_it = {
+	.itype = ASN1_ITYPE_SEQUENCE,
+	.utype = V_ASN1_SEQUENCE,
+	.templates = PIVY_OCSP_BASICRESP_seq_tt,
+	.tcount = sizeof(PIVY_OCSP_BASICRESP_seq_tt) / sizeof(ASN1_TEMPLATE),
+	.size = sizeof(PIVY_OCSP_BASICRESP),
+	.sname = "PIVY_OCSP_BASICRESP"
+};
+
+PIVY_OCSP_BASICRESP *
+PIVY_OCSP_BASICRESP_new(void)
+{
+	return (PIVY_OCSP_BASICRESP *)ASN1_item_new(&PIVY_OCSP_BASICRESP_it);
+}
+
+void
+PIVY_OCSP_BASICRESP_free(PIVY_OCSP_BASICRESP *resp)
+{
+	ASN1_item_free((ASN1_VALUE *)resp, &PIVY_OCSP_BASICRESP_it);
+}
+
+int
+i2d_PIVY_OCSP_RESPDATA(PIVY_OCSP_RESPDATA *rd, unsigned char **out)
+{
+	return ASN1_item_i2d((ASN1_VALUE *)rd, out, &PIVY_OCSP_RESPDATA_it);
+}
+
+int
+i2d_PIVY_OCSP_BASICRESP(PIVY_OCSP_BASICRESP *resp, unsigned char **out)
+{
+	return ASN1_item_i2d((ASN1_VALUE *)resp, out, &PIVY_OCSP_BASICRESP_it);
+}
+
+OCSP_RESPONSE *
+PIVY_OCSP_BASICRESP_to_response(PIVY_OCSP_BASICRESP *resp)
+{
+	unsigned char *der = NULL;
+	const unsigned char *p;
+	int len;
+	OCSP_BASICRESP *bs = NULL;
+	OCSP_RESPONSE *r = NULL;
+
+	len = i2d_PIVY_OCSP_BASICRESP(resp, &der);
+	if (len <= 0)
+		return (NULL);
+
+	/*
+	 * Our structure is encoding-compatible with OCSP_BASICRESP, so round
+	 * trip it through DER to get one OpenSSL will wrap for us.
+	 */
+	p = der;
+	bs = d2i_OCSP_BASICRESP(NULL, &p, len);
+	if (bs == NULL)
+		goto out;
+
+	r = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+
+out:
+	OCSP_BASICRESP_free(bs);
+	OPENSSL_free(der);
+	return (r);
+}
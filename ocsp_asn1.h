@@ -0,0 +1,57 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2026 The pivy Authors
+ */
+
+#if !defined(_OCSP_ASN1_H)
+#define _OCSP_ASN1_H
+
+#include <stdint.h>
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/ossl_typ.h>
+#include <openssl/asn1.h>
+#include <openssl/asn1t.h>
+#include <openssl/ocsp.h>
+
+/*
+ * OpenSSL's OCSP_BASICRESP is opaque and can only be signed through
+ * OCSP_basic_sign(), which wants an EVP_PKEY with the private half present.
+ * These templates give us an encoding-compatible BasicOCSPResponse (RFC6960)
+ * we can fill in and sign ourselves on a PIV card or via the agent. Only
+ * the byKey form of ResponderID is supported.
+ */
+
+extern const ASN1_ITEM PIVY_OCSP_RESPDATA_it;
+extern const ASN1_ITEM PIVY_OCSP_BASICRESP_it;
+
+typedef struct {
+	ASN1_OCTET_STRING *keyhash;
+	ASN1_GENERALIZEDTIME *produced_at;
+	STACK_OF(OCSP_SINGLERESP) *responses;
+} PIVY_OCSP_RESPDATA;
+
+typedef struct {
+	PIVY_OCSP_RESPDATA *tbs;
+	X509_ALGOR *sigalg;
+	ASN1_BIT_STRING *signature;
+} PIVY_OCSP_BASICRESP;
+
+PIVY_OCSP_BASICRESP *PIVY_OCSP_BASICRESP_new(void);
+void PIVY_OCSP_BASICRESP_free(PIVY_OCSP_BASICRESP *);
+
+int i2d_PIVY_OCSP_RESPDATA(PIVY_OCSP_RESPDATA *, unsigned char **);
+int i2d_PIVY_OCSP_BASICRESP(PIVY_OCSP_BASICRESP *, unsigned char **);
+
+/*
+ * Wraps a signed PIVY_OCSP_BASICRESP up into a complete OCSPResponse with
+ * status "successful", ready to be served to clients.
+ */
+OCSP_RESPONSE *PIVY_OCSP_BASICRESP_to_response(PIVY_OCSP_BASICRESP *);
+
+#endif
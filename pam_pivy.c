@@ -64,19 +64,38 @@
 
 #include <pwd.h>
 #include <dirent.h>
+#include <syslog.h>
 
 #define	PAM_SM_AUTH
 #include <security/pam_modules.h>
+#include <security/pam_ext.h>
 
 #define	PIVY_AGENT_ENV_DIR	"%s/.config/pivy-agent"
 #define	PIVY_AGENT_ENV_FILE	"%s/.config/pivy-agent/%s"
 #define	PIVY_AGENT_SOCKET	"%s/piv-ssh-%s.socket"
 #define	SSH_AUTH_KEYS		"%s/.ssh/authorized_keys"
 
+/* Length of a SHA256 key fingerprint, which we use to index keys. */
+#define	KEY_FP_LEN		32
+
 struct keylist {
 	struct sshkey *kl_key;
 	char *kl_comment;
 	struct keylist *kl_next;
+	struct keylist *kl_hnext;
+	uint8_t kl_fp[KEY_FP_LEN];
+};
+
+/*
+ * The keys from authorized_keys, indexed by fingerprint so that checking a
+ * token's slots against them doesn't mean comparing every slot with every
+ * key.
+ */
+struct keyset {
+	struct keylist *ks_keys;
+	struct keylist **ks_buckets;
+	size_t ks_nbuckets;
+	size_t ks_n;
 };
 
 struct tkconfig {
@@ -146,6 +165,183 @@ get_agent_socket(const char *authsocket, int *fdp)
 	return 0;
 }
 
+static uint64_t
+pp_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static int
+key_fp(const struct sshkey *key, uint8_t *fp)
+{
+	u_char *raw = NULL;
+	size_t rlen;
+	int rc;
+
+	rc = sshkey_fingerprint_raw(key, SSH_DIGEST_SHA256, &raw, &rlen);
+	if (rc != 0)
+		return (rc);
+	if (rlen != KEY_FP_LEN) {
+		free(raw);
+		return (SSH_ERR_INTERNAL_ERROR);
+	}
+	bcopy(raw, fp, KEY_FP_LEN);
+	free(raw);
+	return (0);
+}
+
+static size_t
+key_fp_bucket(const uint8_t *fp, size_t nbuckets)
+{
+	uint32_t h;
+
+	bcopy(fp, &h, sizeof (h));
+	return (h & (nbuckets - 1));
+}
+
+static int
+keyset_index(struct keyset *ks)
+{
+	struct keylist *kl;
+	size_t b;
+
+	ks->ks_nbuckets = 16;
+	while (ks->ks_nbuckets < ks->ks_n * 2)
+		ks->ks_nbuckets <<= 1;
+	ks->ks_buckets = calloc(ks->ks_nbuckets, sizeof (struct keylist *));
+	if (ks->ks_buckets == NULL)
+		return (-1);
+	for (kl = ks->ks_keys; kl != NULL; kl = kl->kl_next) {
+		b = key_fp_bucket(kl->kl_fp, ks->ks_nbuckets);
+		kl->kl_hnext = ks->ks_buckets[b];
+		ks->ks_buckets[b] = kl;
+	}
+	return (0);
+}
+
+static struct keylist *
+keyset_find(const struct keyset *ks, const struct sshkey *key)
+{
+	struct keylist *kl;
+	uint8_t fp[KEY_FP_LEN];
+
+	if (key == NULL || ks->ks_buckets == NULL)
+		return (NULL);
+	if (key_fp(key, fp) != 0)
+		return (NULL);
+	kl = ks->ks_buckets[key_fp_bucket(fp, ks->ks_nbuckets)];
+	for (; kl != NULL; kl = kl->kl_hnext) {
+		if (bcmp(kl->kl_fp, fp, KEY_FP_LEN) == 0)
+			return (kl);
+	}
+	return (NULL);
+}
+
+static void
+keyset_free(struct keyset *ks)
+{
+	struct keylist *keyle, *nkeyle;
+
+	for (keyle = ks->ks_keys; keyle != NULL; keyle = nkeyle) {
+		nkeyle = keyle->kl_next;
+		free(keyle->kl_comment);
+		sshkey_free(keyle->kl_key);
+		free(keyle);
+	}
+	free(ks->ks_buckets);
+	bzero(ks, sizeof (*ks));
+}
+
+/*
+ * Has the agent on fd sign a random challenge with key, and checks the
+ * signature.
+ */
+static int
+agent_challenge(int fd, const struct sshkey *key)
+{
+	uint8_t chal[64];
+	u_char *sig = NULL;
+	size_t siglen = 0;
+	const char *alg = NULL;
+	int rc;
+
+	if (key->type == KEY_RSA)
+		alg = "rsa-sha2-256";
+
+	arc4random_buf(chal, sizeof (chal));
+	rc = ssh_agent_sign(fd, key, &sig, &siglen, chal, sizeof (chal),
+	    alg, 0);
+	if (rc == 0) {
+		rc = sshkey_verify(key, sig, siglen, chal, sizeof (chal),
+		    NULL, 0, NULL);
+	}
+	freezero(sig, siglen);
+	return (rc);
+}
+
+/*
+ * Fast path: "key" is a slot key on a token whose CAK we've just checked
+ * ourselves. If the user's pivy-agent for that token is running (and has the
+ * PIN already, or doesn't need it), it can prove possession of the key
+ * without us having to prompt for the PIN. The agent must be running as the
+ * user.
+ *
+ * We never take the agent's word for which keys are on the token: it's only
+ * asked to sign with a key we read from the CAK-verified card.
+ */
+static int
+agent_try_auth(pam_handle_t *pamh, const struct tkconfig *tkc,
+    const struct sshkey *key, uid_t uid, boolean_t debug)
+{
+	struct ssh_identitylist *idl = NULL;
+	struct ucred peer;
+	socklen_t len = sizeof (peer);
+	boolean_t found = B_FALSE;
+	int res = PAM_AUTHINFO_UNAVAIL;
+	int fd = -1, rc;
+	size_t i;
+
+	if (get_agent_socket(tkc->tkc_sockpath, &fd) != 0)
+		return (PAM_AUTHINFO_UNAVAIL);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0 ||
+	    peer.uid != uid) {
+		if (debug) {
+			pam_syslog(pamh, LOG_DEBUG, "agent socket %s is not "
+			    "owned by the user, ignoring", tkc->tkc_sockpath);
+		}
+		goto out;
+	}
+
+	if ((rc = ssh_fetch_identitylist(fd, &idl)) != 0)
+		goto out;
+	for (i = 0; i < idl->nkeys; ++i) {
+		if (sshkey_equal_public(idl->keys[i], key)) {
+			found = B_TRUE;
+			break;
+		}
+	}
+	if (!found)
+		goto out;
+
+	if ((rc = agent_challenge(fd, key)) != 0) {
+		if (debug) {
+			pam_syslog(pamh, LOG_DEBUG, "agent %s: key challenge "
+			    "failed: %s", tkc->tkc_sockpath, ssh_err(rc));
+		}
+		goto out;
+	}
+	res = PAM_SUCCESS;
+
+out:
+	ssh_free_identitylist(idl);
+	close(fd);
+	return (res);
+}
+
 PAM_EXTERN int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
@@ -153,9 +349,10 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	const struct passwd *pwent;
 	int res = PAM_AUTHINFO_UNAVAIL;
 	int rc;
-	struct piv_ctx *ctx;
+	struct piv_ctx *ctx = NULL;
 	struct piv_token *tokens = NULL, *token;
-	struct keylist *keys = NULL, *keyle, *nkeyle;
+	struct keyset ks;
+	struct keylist *keyle;
 	struct tkconfig *tkcs = NULL, *tkc, *ntkc;
 	char *akpath = NULL, *lbuf = NULL, *cp, *spath = NULL, *rdir = NULL;
 	char *pin = NULL;
@@ -165,7 +362,16 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	DIR *d = NULL;
 	FILE *f = NULL;
 	errf_t *err = NULL;
-	int fd;
+	int fd, i;
+	boolean_t debug = B_FALSE;
+	uint64_t t0, tkeys = 0, tagent = 0, tenum = 0, tcard = 0;
+
+	for (i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "debug") == 0)
+			debug = B_TRUE;
+	}
+
+	bzero(&ks, sizeof (ks));
 
 	if ((res = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
 		return (res);
@@ -174,14 +380,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	if (pwent == NULL)
 		return (PAM_AUTHINFO_UNAVAIL);
 
-	ctx = piv_open();
-	if (ctx == NULL)
-		return (PAM_AUTHINFO_UNAVAIL);
-	err = piv_establish_context(ctx, SCARD_SCOPE_SYSTEM);
-	if (err) {
-		errf_free(err);
-		return (PAM_AUTHINFO_UNAVAIL);
-	}
+	t0 = pp_now_us();
 
 	akpath = malloc(PATH_MAX);
 	if (akpath == NULL) {
@@ -206,9 +405,10 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 			res = PAM_AUTHINFO_UNAVAIL;
 			goto out;
 		}
-		keyle->kl_next = keys;
+		keyle->kl_next = ks.ks_keys;
 		keyle->kl_key = sshkey_new(KEY_UNSPEC);
-		if (sshkey_read(keyle->kl_key, &cp) != 0) {
+		if (sshkey_read(keyle->kl_key, &cp) != 0 ||
+		    key_fp(keyle->kl_key, keyle->kl_fp) != 0) {
 			sshkey_free(keyle->kl_key);
 			free(keyle);
 			continue;
@@ -217,15 +417,21 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 			++cp;
 		cp[strlen(cp) - 1] = '\0';
 		keyle->kl_comment = strdup(cp);
-		keys = keyle;
+		ks.ks_keys = keyle;
+		++ks.ks_n;
 	}
 	fclose(f);
 	f = NULL;
 
-	if (keys == NULL) {
+	if (ks.ks_keys == NULL || keyset_index(&ks) != 0) {
 		res = PAM_AUTHINFO_UNAVAIL;
 		goto out;
 	}
+	tkeys = pp_now_us();
+	if (debug) {
+		pam_syslog(pamh, LOG_DEBUG, "read %zu authorized keys in "
+		    "%llu us", ks.ks_n, (unsigned long long)(tkeys - t0));
+	}
 
 	spath = malloc(PATH_MAX);
 	if (spath == NULL) {
@@ -297,12 +503,25 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		d = NULL;
 	}
 
+	ctx = piv_open();
+	if (ctx == NULL) {
+		res = PAM_AUTHINFO_UNAVAIL;
+		goto out;
+	}
+	err = piv_establish_context(ctx, SCARD_SCOPE_SYSTEM);
+	if (err) {
+		errf_free(err);
+		res = PAM_AUTHINFO_UNAVAIL;
+		goto out;
+	}
+
 	err = piv_enumerate(ctx, &tokens);
 	if (err) {
 		errf_free(err);
 		res = PAM_AUTHINFO_UNAVAIL;
 		goto out;
 	}
+	tenum = pp_now_us();
 
 	for (token = tokens; token != NULL; token = piv_token_next(token)) {
 		int found = 0;
@@ -335,19 +554,11 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 				slot = NULL;
 				while ((slot = piv_slot_next(token, slot))) {
-					const struct sshkey *pubk =
-					    piv_slot_pubkey(slot);
-					for (keyle = keys; keyle != NULL;
-					    keyle = keyle->kl_next) {
-						if (sshkey_equal_public(
-						    keyle->kl_key,
-						    pubk)) {
-							found = 1;
-							break;
-						}
-					}
-					if (found)
+					if (keyset_find(&ks,
+					    piv_slot_pubkey(slot)) != NULL) {
+						found = 1;
 						break;
+					}
 				}
 				if (found)
 					break;
@@ -358,6 +569,38 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		if (!found)
 			continue;
 
+		/*
+		 * Let the user's agent prove the slot key if it can, rather
+		 * than prompting for the PIN. It needs the card to do that.
+		 * Only if we really checked the CAK above, though (the card
+		 * might not have one).
+		 */
+		if (piv_get_slot(token, PIV_SLOT_CARD_AUTH) == NULL)
+			goto again;
+		piv_txn_end(token);
+		res = agent_try_auth(pamh, tkc, piv_slot_pubkey(slot),
+		    pwent->pw_uid, debug);
+		tagent = pp_now_us();
+		if (res == PAM_SUCCESS) {
+			if (debug) {
+				pam_syslog(pamh, LOG_DEBUG, "authenticated via "
+				    "agent %s: keys %llu us, enumerate %llu "
+				    "us, card+agent %llu us (total %llu us)",
+				    tkc->tkc_sockpath,
+				    (unsigned long long)(tkeys - t0),
+				    (unsigned long long)(tenum - tkeys),
+				    (unsigned long long)(tagent - tenum),
+				    (unsigned long long)(tagent - t0));
+			}
+			goto out;
+		}
+		if ((err = piv_txn_begin(token)))
+			goto cardfail;
+		if ((err = piv_select(token))) {
+			piv_txn_end(token);
+			goto cardfail;
+		}
+
 again:
 		err = piv_auth_key(token, slot, piv_slot_pubkey(slot));
 		if (errf_caused_by(err, "PermissionError")) {
@@ -431,6 +674,7 @@ again:
 		piv_txn_end(token);
 
 		if (err != NULL) {
+cardfail:
 			errf_free(err);
 			continue;
 		}
@@ -479,22 +723,31 @@ again:
 		}
 
 		res = PAM_SUCCESS;
+		tcard = pp_now_us();
+		if (debug) {
+			pam_syslog(pamh, LOG_DEBUG, "authenticated via token "
+			    "%s: keys %llu us, enumerate %llu us, card "
+			    "%llu us (total %llu us)", piv_token_guid_hex(token),
+			    (unsigned long long)(tkeys - t0),
+			    (unsigned long long)(tenum - tkeys),
+			    (unsigned long long)(tcard - tenum),
+			    (unsigned long long)(tcard - t0));
+		}
 		goto out;
 	}
 
 	res = PAM_AUTHINFO_UNAVAIL;
+	if (debug) {
+		pam_syslog(pamh, LOG_DEBUG, "no usable token found after "
+		    "%llu us", (unsigned long long)(pp_now_us() - t0));
+	}
 
 out:
 	if (f != NULL)
 		fclose(f);
 	if (d != NULL)
 		closedir(d);
-	for (keyle = keys; keyle != NULL; keyle = nkeyle) {
-		nkeyle = keyle->kl_next;
-		free(keyle->kl_comment);
-		sshkey_free(keyle->kl_key);
-		free(keyle);
-	}
+	keyset_free(&ks);
 	for (tkc = tkcs; tkc != NULL; tkc = ntkc) {
 		ntkc = tkc->tkc_next;
 		free(tkc->tkc_source);
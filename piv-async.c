@@ -0,0 +1,361 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2026 The pivy Authors
+ */
+
+/*
+ * Asynchronous (pollable) card operations.
+ *
+ * PCSC has no non-blocking interface -- SCardTransmit() sits there until the
+ * card answers -- so each piv_op runs the whole blocking sequence (begin txn,
+ * SELECT, optional VERIFY, the operation itself, end txn) on a thread of its
+ * own, and writes a byte to a pipe when it's done. The read end of the pipe is
+ * what piv_op_fd() hands out for the caller to poll().
+ *
+ * Operations on the same token queue up behind each other on the token's
+ * transaction lock (see piv_txn_begin()). Operations on tokens from different
+ * piv_ctxs run in parallel.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "debug.h"
+
+#if defined(__APPLE__)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <wintypes.h>
+#include <winscard.h>
+#endif
+
+#include <sys/types.h>
+
+#include "openssh/config.h"
+#include "openssh/sshkey.h"
+#include "openssh/sshbuf.h"
+#include "openssh/ssherr.h"
+#include "openssh/digest.h"
+
+#include "utils.h"
+#include "piv.h"
+
+enum piv_op_type {
+	PIV_OP_SIGN,
+	PIV_OP_ECDH,
+	PIV_OP_READ_CERT,
+	PIV_OP_BOX_OPEN
+};
+
+struct piv_op {
+	enum piv_op_type	 po_type;
+	struct piv_token	*po_token;
+	struct piv_slot		*po_slot;
+	enum piv_slotid		 po_slotid;
+
+	enum piv_pin		 po_pintype;
+	char			*po_pin;
+
+	pthread_t		 po_thread;
+	boolean_t		 po_started;
+	boolean_t		 po_joined;
+	int			 po_rfd;
+	int			 po_wfd;
+
+	errf_t			*po_err;
+	boolean_t		 po_err_taken;
+
+	/* PIV_OP_SIGN */
+	uint8_t			*po_data;
+	size_t			 po_datalen;
+	enum sshdigest_types	 po_hashalg;
+
+	/* PIV_OP_SIGN and PIV_OP_ECDH */
+	uint8_t			*po_out;
+	size_t			 po_outlen;
+
+	/* PIV_OP_ECDH */
+	struct sshkey		*po_pubkey;
+
+	/* PIV_OP_BOX_OPEN */
+	struct piv_ecdh_box	*po_box;
+};
+
+static void *
+piv_op_worker(void *arg)
+{
+	struct piv_op *op = arg;
+	struct piv_token *tk = op->po_token;
+	errf_t *err;
+	const uint8_t done = 1;
+	ssize_t w;
+
+	if ((err = piv_txn_begin(tk)))
+		goto out;
+	if ((err = piv_select(tk)))
+		goto outtxn;
+	if (op->po_pin != NULL) {
+		err = piv_verify_pin(tk, op->po_pintype, op->po_pin, NULL,
+		    B_TRUE);
+		if (err)
+			goto outtxn;
+	}
+
+	switch (op->po_type) {
+	case PIV_OP_SIGN:
+		err = piv_sign(tk, op->po_slot, op->po_data, op->po_datalen,
+		    &op->po_hashalg, &op->po_out, &op->po_outlen);
+		break;
+	case PIV_OP_ECDH:
+		err = piv_ecdh(tk, op->po_slot, op->po_pubkey, &op->po_out,
+		    &op->po_outlen);
+		break;
+	case PIV_OP_READ_CERT:
+		err = piv_read_cert(tk, op->po_slotid);
+		break;
+	case PIV_OP_BOX_OPEN:
+		err = piv_box_open(tk, op->po_slot, op->po_box);
+		break;
+	}
+
+outtxn:
+	piv_txn_end(tk);
+out:
+	op->po_err = err;
+	do {
+		w = write(op->po_wfd, &done, sizeof (done));
+	} while (w == -1 && errno == EINTR);
+	VERIFY(w == sizeof (done));
+	return (NULL);
+}
+
+static struct piv_op *
+piv_op_new(enum piv_op_type type, struct piv_token *tk, enum piv_pin pintype,
+    const char *pin)
+{
+	struct piv_op *op;
+
+	op = calloc(1, sizeof (struct piv_op));
+	if (op == NULL)
+		return (NULL);
+	op->po_type = type;
+	op->po_token = tk;
+	op->po_rfd = -1;
+	op->po_wfd = -1;
+	op->po_pintype = pintype;
+	if (pin != NULL) {
+		op->po_pin = strdup(pin);
+		if (op->po_pin == NULL) {
+			free(op);
+			return (NULL);
+		}
+	}
+	return (op);
+}
+
+static errf_t *
+piv_op_start(struct piv_op *op)
+{
+	int fds[2];
+	int rc;
+
+	if (pipe(fds) != 0)
+		return (errfno("pipe", errno, NULL));
+	op->po_rfd = fds[0];
+	op->po_wfd = fds[1];
+	(void) fcntl(op->po_rfd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(op->po_wfd, F_SETFD, FD_CLOEXEC);
+
+	rc = pthread_create(&op->po_thread, NULL, piv_op_worker, op);
+	if (rc != 0)
+		return (errfno("pthread_create", rc, NULL));
+	op->po_started = B_TRUE;
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+piv_op_submit(struct piv_op *op, struct piv_op **pop)
+{
+	errf_t *err;
+
+	if ((err = piv_op_start(op))) {
+		piv_op_free(op);
+		return (err);
+	}
+	*pop = op;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_op_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
+    size_t datalen, enum sshdigest_types hashalgo, enum piv_pin pintype,
+    const char *pin, struct piv_op **pop)
+{
+	struct piv_op *op;
+
+	op = piv_op_new(PIV_OP_SIGN, tk, pintype, pin);
+	if (op == NULL)
+		return (ERRF_NOMEM);
+	op->po_slot = slot;
+	op->po_hashalg = hashalgo;
+	op->po_data = malloc(datalen);
+	if (op->po_data == NULL && datalen > 0) {
+		piv_op_free(op);
+		return (ERRF_NOMEM);
+	}
+	bcopy(data, op->po_data, datalen);
+	op->po_datalen = datalen;
+
+	return (piv_op_submit(op, pop));
+}
+
+errf_t *
+piv_op_ecdh(struct piv_token *tk, struct piv_slot *slot,
+    struct sshkey *pubkey, enum piv_pin pintype, const char *pin,
+    struct piv_op **pop)
+{
+	struct piv_op *op;
+	int rc;
+
+	op = piv_op_new(PIV_OP_ECDH, tk, pintype, pin);
+	if (op == NULL)
+		return (ERRF_NOMEM);
+	op->po_slot = slot;
+	if ((rc = sshkey_from_private(pubkey, &op->po_pubkey))) {
+		piv_op_free(op);
+		return (ssherrf("sshkey_from_private", rc));
+	}
+
+	return (piv_op_submit(op, pop));
+}
+
+errf_t *
+piv_op_read_cert(struct piv_token *tk, enum piv_slotid slotid,
+    struct piv_op **pop)
+{
+	struct piv_op *op;
+
+	op = piv_op_new(PIV_OP_READ_CERT, tk, PIV_NO_PIN, NULL);
+	if (op == NULL)
+		return (ERRF_NOMEM);
+	op->po_slotid = slotid;
+
+	return (piv_op_submit(op, pop));
+}
+
+errf_t *
+piv_op_box_open(struct piv_token *tk, struct piv_slot *slot,
+    struct piv_ecdh_box *box, enum piv_pin pintype, const char *pin,
+    struct piv_op **pop)
+{
+	struct piv_op *op;
+
+	op = piv_op_new(PIV_OP_BOX_OPEN, tk, pintype, pin);
+	if (op == NULL)
+		return (ERRF_NOMEM);
+	op->po_slot = slot;
+	op->po_box = box;
+
+	return (piv_op_submit(op, pop));
+}
+
+int
+piv_op_fd(const struct piv_op *op)
+{
+	return (op->po_rfd);
+}
+
+boolean_t
+piv_op_done(struct piv_op *op)
+{
+	struct pollfd pfd;
+
+	if (op->po_joined)
+		return (B_TRUE);
+	bzero(&pfd, sizeof (pfd));
+	pfd.fd = op->po_rfd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, 0) > 0);
+}
+
+static void
+piv_op_join(struct piv_op *op)
+{
+	if (!op->po_started || op->po_joined)
+		return;
+	VERIFY0(pthread_join(op->po_thread, NULL));
+	op->po_joined = B_TRUE;
+}
+
+errf_t *
+piv_op_result(struct piv_op *op)
+{
+	piv_op_join(op);
+	VERIFY(!op->po_err_taken);
+	op->po_err_taken = B_TRUE;
+	return (op->po_err);
+}
+
+errf_t *
+piv_op_sign_result(struct piv_op *op, enum sshdigest_types *hashalgo,
+    uint8_t **signature, size_t *siglen)
+{
+	errf_t *err;
+
+	VERIFY3S(op->po_type, ==, PIV_OP_SIGN);
+	if ((err = piv_op_result(op)))
+		return (err);
+	*hashalgo = op->po_hashalg;
+	*signature = op->po_out;
+	*siglen = op->po_outlen;
+	op->po_out = NULL;
+	op->po_outlen = 0;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_op_ecdh_result(struct piv_op *op, uint8_t **secret, size_t *seclen)
+{
+	errf_t *err;
+
+	VERIFY3S(op->po_type, ==, PIV_OP_ECDH);
+	if ((err = piv_op_result(op)))
+		return (err);
+	*secret = op->po_out;
+	*seclen = op->po_outlen;
+	op->po_out = NULL;
+	op->po_outlen = 0;
+	return (ERRF_OK);
+}
+
+void
+piv_op_free(struct piv_op *op)
+{
+	if (op == NULL)
+		return;
+	piv_op_join(op);
+	if (op->po_rfd != -1)
+		(void) close(op->po_rfd);
+	if (op->po_wfd != -1)
+		(void) close(op->po_wfd);
+	if (!op->po_err_taken)
+		errf_free(op->po_err);
+	if (op->po_pin != NULL)
+		freezero(op->po_pin, strlen(op->po_pin));
+	free(op->po_data);
+	freezero(op->po_out, op->po_outlen);
+	sshkey_free(op->po_pubkey);
+	free(op);
+}
@@ -42,6 +42,7 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <dirent.h>
 
 #include <json.h>
 
@@ -80,6 +81,9 @@ json_tokener_get_parse_end(struct json_tokener *tok)
 }
 #endif
 
+/* Default number of entries in a CA log segment before it is sealed. */
+#define	CA_LOG_SEG_ENTRIES_DEFAULT	1024
+
 struct ca_uri {
 	struct ca_uri		*cu_next;
 	char			*cu_uri;
@@ -103,6 +107,11 @@ struct ca {
 	boolean_t		 ca_crls_want_idp;
 
 	unsigned long		 ca_crl_lifetime;
+	unsigned long		 ca_ocsp_lifetime;
+
+	uint			 ca_log_seg;		/* # sealed segments */
+	uint			 ca_log_entries;	/* # in open segment */
+	uint			 ca_log_seg_entries;	/* seal after this */
 
 	boolean_t		 ca_dirty;
 
@@ -233,7 +242,6 @@ struct ca_new_args {
 	struct cert_var_scope	*cna_scope;
 };
 
-static errf_t *scope_to_json(struct cert_var_scope *cvs, json_object **robjp);
 
 static errf_t *agent_sign_json(int fd, struct sshkey *pubkey,
     const char *subprop, json_object *obj);
@@ -262,7 +270,7 @@ errf_t *validate_cstring(const char *buf, size_t len, size_t maxlen);
 static errf_t *ca_log_init(struct ca *ca, struct ca_session *sess,
     BIGNUM *ca_serial, const char *dnstr);
 static errf_t *ca_log_new_cert(struct ca *ca, struct ca_session *sess,
-    const char *tpl, struct cert_var_scope *scope, X509 *cert);
+    const char *tpl, json_object *vars, X509 *cert);
 
 static struct ca_ebox_tpl *get_ebox_tpl(struct ca_ebox_tpl **, const char *,
     int);
@@ -277,6 +285,12 @@ set_ca_ebox_ptr(struct ca_ebox_tpl **ptr, struct ca_ebox_tpl *newval)
 		newval->cet_refcnt++;
 }
 
+uint
+ca_log_segments(const struct ca *ca)
+{
+	return (ca->ca_log_seg);
+}
+
 const char *
 ca_slug(const struct ca *ca)
 {
@@ -315,15 +329,18 @@ ca_dn(const struct ca *ca)
 	return (out);
 }
 
-static errf_t *
-scope_to_json(struct cert_var_scope *cvs, json_object **robjp)
+/*
+ * Adds the variables set in cvs and all of its parents to robj. Parents go
+ * first, so a value set in an inner scope replaces the one it overrides.
+ */
+static void
+scope_chain_to_json(struct cert_var_scope *cvs, json_object *robj)
 {
-	json_object *robj = NULL, *obj;
+	json_object *obj;
 	struct cert_var *cv;
-	errf_t *err;
 
-	robj = json_object_new_object();
-	VERIFY(robj != NULL);
+	if (cvs->cvs_parent != NULL)
+		scope_chain_to_json(cvs->cvs_parent, robj);
 
 	for (cv = cvs->cvs_vars; cv != NULL; cv = cv->cv_next) {
 		char *vstr;
@@ -336,13 +353,6 @@ scope_to_json(struct cert_var_scope *cvs, json_object **robjp)
 		json_object_object_add(robj, cv->cv_name, obj);
 		free(vstr);
 	}
-
-	*robjp = robj;
-	robj = NULL;
-	err = ERRF_OK;
-
-	json_object_put(robj);
-	return (err);
 }
 
 static enum sshdigest_types
@@ -2533,6 +2543,16 @@ ca_generate(const char *path, struct ca_new_args *args, struct piv_token *tkn,
 	json_object_object_add(robj, "crl_lifetime", obj);
 	ca->ca_crl_lifetime = 7*24*3600;
 
+	obj = json_object_new_string("1d");
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "ocsp_lifetime", obj);
+	ca->ca_ocsp_lifetime = 24*3600;
+
+	obj = json_object_new_int64(CA_LOG_SEG_ENTRIES_DEFAULT);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "log_segment_entries", obj);
+	ca->ca_log_seg_entries = CA_LOG_SEG_ENTRIES_DEFAULT;
+
 	err = ca_gen_ebox_tpls(ca, &obj);
 	if (err != ERRF_OK)
 		goto out;
@@ -2988,6 +3008,34 @@ ca_open(const char *path, struct ca **outca)
 		}
 	}
 
+	ca->ca_log_seg_entries = CA_LOG_SEG_ENTRIES_DEFAULT;
+	obj = json_object_object_get(robj, "log_segment_entries");
+	if (obj != NULL) {
+		if (!json_object_is_type(obj, json_type_int) ||
+		    json_object_get_int64(obj) < 0 ||
+		    json_object_get_int64(obj) > UINT_MAX) {
+			err = errf("InvalidProperty", NULL, "CA JSON has "
+			    "invalid 'log_segment_entries' property: '%s'",
+			    json_object_get_string(obj));
+			goto out;
+		}
+		ca->ca_log_seg_entries = json_object_get_int64(obj);
+	}
+
+	ca->ca_ocsp_lifetime = 24*3600;
+	obj = json_object_object_get(robj, "ocsp_lifetime");
+	if (obj != NULL) {
+		p = strdup(json_object_get_string(obj));
+		err = parse_lifetime(p, &ca->ca_ocsp_lifetime);
+		free(p);
+		if (err != ERRF_OK) {
+			err = errf("InvalidProperty", err, "CA JSON has "
+			    "invalid 'ocsp_lifetime' property: '%s'",
+			    json_object_get_string(obj));
+			goto out;
+		}
+	}
+
 	obj = json_object_object_get(robj, "ocsp");
 	if (obj == NULL) {
 		err = errf("MissingProperty", NULL, "CA JSON does not have "
@@ -3307,12 +3355,212 @@ ca_cert_tpl_make_scope(struct ca_cert_tpl *tpl, struct cert_var_scope *parent)
 	return (sc);
 }
 
-errf_t *
-ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
+/*
+ * Computes the chain hash of a log entry (which becomes the prev_hash of the
+ * entry after it) into "ldigest". "tbsbuf" is scratch space.
+ */
+static errf_t *
+ca_log_chain_digest(struct ca *ca, json_object *obj, struct sshbuf *tbsbuf,
+    struct sshbuf *ldigest)
 {
-	FILE *logf = NULL;
+	const char *tmp;
+	uint8_t *rptr;
+	size_t rlen;
+	int rc;
+
+	sshbuf_reset(tbsbuf);
+	tmp = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+	if ((rc = sshbuf_put_cstring8(tbsbuf, "piv-ca-log-chain")) ||
+	    (rc = sshbuf_put_cstring8(tbsbuf, ca->ca_slug)) ||
+	    (rc = sshbuf_put_cstring(tbsbuf, tmp))) {
+		return (ssherrf("sshbuf_put_cstring", rc));
+	}
+
+	sshbuf_reset(ldigest);
+	rlen = ssh_digest_bytes(SSH_DIGEST_SHA512);
+	rc = sshbuf_reserve(ldigest, rlen, &rptr);
+	if (rc != 0)
+		return (ssherrf("sshbuf_reserve", rc));
+	rc = ssh_digest_buffer(SSH_DIGEST_SHA512, tbsbuf, rptr, rlen);
+	if (rc != 0)
+		return (ssherrf("ssh_digest_buffer", rc));
+
+	return (ERRF_OK);
+}
+
+/*
+ * The CA log is split into segments. The open segment is <slug>.log in the
+ * CA base directory, and sealed segments live in log/<slug>-NNNNNN.log.
+ *
+ * Once the open segment holds ca_log_seg_entries entries (the CA's
+ * "log_segment_entries" setting, 0 to never seal), it is sealed by
+ * moving it into log/ and starting a new open segment with a CA-signed
+ * "segment_head" entry. This happens as soon as the entry which fills the
+ * segment has been written (see ca_log_appended()).
+ *
+ * The head's prev_hash is the final chain hash of the sealed segment (so the
+ * chain continues unbroken across segments). The summary of CA state as of
+ * the end of that segment (issued and revoked serials, CRL sequence) goes in
+ * a checkpoint file next to it, log/<slug>-NNNNNN.state, and the head only
+ * carries its hash ("state_hash"), so heads stay the same size however long
+ * the CA has been running.
+ *
+ * This means ca_log_verify() only has to look at the open segment and the
+ * latest checkpoint: the head is signed by the CA, so we can trust its
+ * prev_hash as the start of the chain, and the checkpoint it names as the
+ * history before it. When a segment head starts the chain, the callback sees
+ * it with the checkpoint's "issued", "revoked" and "crls" filled in (heads
+ * from before checkpoints existed carry these inline). ca_log_verify_all()
+ * walks the sealed segments too, for when the full history needs checking.
+ */
+
+static void
+ca_log_state_path(struct ca *ca, uint seg, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/log/%s-%06u.state", ca->ca_base_path,
+	    ca->ca_slug, seg);
+}
+
+/*
+ * Hash of a checkpoint file's contents, as recorded in the "state_hash" of
+ * the segment head which refers to it.
+ */
+static errf_t *
+ca_log_state_hash(struct ca *ca, const char *line, char **hashp)
+{
+	struct sshbuf *tbsbuf;
+	uint8_t dig[SSH_DIGEST_MAX_LENGTH];
+	size_t dlen;
+	errf_t *err;
+	int rc;
+
+	tbsbuf = sshbuf_new();
+	if (tbsbuf == NULL)
+		return (ERRF_NOMEM);
+	if ((rc = sshbuf_put_cstring8(tbsbuf, "piv-ca-log-state")) ||
+	    (rc = sshbuf_put_cstring8(tbsbuf, ca->ca_slug)) ||
+	    (rc = sshbuf_put_cstring(tbsbuf, line))) {
+		err = ssherrf("sshbuf_put_cstring", rc);
+		goto out;
+	}
+	dlen = ssh_digest_bytes(SSH_DIGEST_SHA512);
+	rc = ssh_digest_buffer(SSH_DIGEST_SHA512, tbsbuf, dig, sizeof (dig));
+	if (rc != 0) {
+		err = ssherrf("ssh_digest_buffer", rc);
+		goto out;
+	}
+	sshbuf_reset(tbsbuf);
+	if ((rc = sshbuf_put(tbsbuf, dig, dlen))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	*hashp = sshbuf_dtob64_string(tbsbuf, 0);
+	if (*hashp == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	err = ERRF_OK;
+
+out:
+	explicit_bzero(dig, sizeof (dig));
+	sshbuf_free(tbsbuf);
+	return (err);
+}
+
+/*
+ * Loads the checkpoint named by a segment head, checks it against the head's
+ * "state_hash", and adds its contents to the head object (for the benefit of
+ * log callbacks). Heads without a "state_hash" are left alone.
+ */
+static errf_t *
+ca_log_head_load_state(struct ca *ca, json_object *head)
+{
+	json_object *hobj, *sobj = NULL, *obj;
+	json_object_iter iter;
 	char fname[PATH_MAX];
-	json_object *obj = NULL, *hobj;
+	char *line = NULL, *hash = NULL;
+	size_t linesz = 0;
+	ssize_t llen;
+	FILE *f = NULL;
+	uint seg;
+	errf_t *err;
+
+	hobj = json_object_object_get(head, "state_hash");
+	if (hobj == NULL)
+		return (ERRF_OK);
+	obj = json_object_object_get(head, "segment");
+	if (obj == NULL) {
+		return (errf("LogError", NULL, "Segment head has a "
+		    "state_hash but no segment number"));
+	}
+	seg = (uint)json_object_get_int64(obj);
+
+	ca_log_state_path(ca, seg, fname, sizeof (fname));
+	f = fopen(fname, "r");
+	if (f == NULL) {
+		err = errf("LogError", errfno("fopen", errno, NULL),
+		    "Failed to open CA log checkpoint '%s'", fname);
+		goto out;
+	}
+	llen = getline(&line, &linesz, f);
+	if (llen < 1) {
+		err = errf("LogError", NULL, "CA log checkpoint '%s' is empty",
+		    fname);
+		goto out;
+	}
+	if (line[llen - 1] == '\n')
+		line[--llen] = '\0';
+
+	err = ca_log_state_hash(ca, line, &hash);
+	if (err != ERRF_OK)
+		goto out;
+	if (strcmp(hash, json_object_get_string(hobj)) != 0) {
+		err = errf("LogError", NULL, "CA log checkpoint '%s' does not "
+		    "match the hash in its segment head", fname);
+		goto out;
+	}
+
+	sobj = json_tokener_parse(line);
+	if (sobj == NULL || !json_object_is_type(sobj, json_type_object)) {
+		err = errf("LogError", NULL, "Failed to parse CA log "
+		    "checkpoint '%s'", fname);
+		goto out;
+	}
+	bzero(&iter, sizeof (iter));
+	json_object_object_foreachC(sobj, iter) {
+		if (strcmp(iter.key, "issued") != 0 &&
+		    strcmp(iter.key, "revoked") != 0 &&
+		    strcmp(iter.key, "crls") != 0)
+			continue;
+		json_object_object_add(head, iter.key,
+		    json_object_get(iter.val));
+	}
+	err = ERRF_OK;
+
+out:
+	if (f != NULL)
+		fclose(f);
+	json_object_put(sobj);
+	free(line);
+	free(hash);
+	return (err);
+}
+
+/*
+ * Verifies one log segment file. If "ldigest" is non-empty on entry, the
+ * first entry must chain on from it (we're continuing on from a previous
+ * segment). Otherwise the first entry must either be the initial log entry
+ * or a segment head, whose prev_hash then becomes the start of the chain.
+ *
+ * On return "ldigest" holds the final chain hash of the segment.
+ */
+static errf_t *
+ca_log_verify_file(struct ca *ca, const char *fname, struct sshbuf *ldigest,
+    uint *nentries, json_object **headp, log_iter_cb_t cb, void *cookie)
+{
+	FILE *logf = NULL;
+	json_object *obj = NULL, *hobj, *aobj;
+	boolean_t is_head, chain_start = B_FALSE;
 	struct stat st;
 	int rc;
 	errf_t *err;
@@ -3321,15 +3569,9 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 	const char *p;
 	enum json_tokener_error jerr;
 	struct json_tokener *tok = NULL;
-	struct sshbuf *ldigest = NULL, *tbsbuf = NULL, *hbuf = NULL;
+	struct sshbuf *tbsbuf = NULL, *hbuf = NULL;
 	const char *tmp;
-	uint8_t *rptr;
-	size_t rlen;
-
-	xstrlcpy(fname, ca->ca_base_path, sizeof (fname));
-	xstrlcat(fname, "/", sizeof (fname));
-	xstrlcat(fname, ca->ca_slug, sizeof (fname));
-	xstrlcat(fname, ".log", sizeof (fname));
+	uint n = 0;
 
 	hbuf = sshbuf_new();
 	if (hbuf == NULL) {
@@ -3337,12 +3579,6 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 		goto out;
 	}
 
-	ldigest = sshbuf_new();
-	if (ldigest == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
-
 	tbsbuf = sshbuf_new();
 	if (tbsbuf == NULL) {
 		err = ERRF_NOMEM;
@@ -3382,6 +3618,7 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 	len = st.st_size;
 	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(logf), 0);
 	if (buf == MAP_FAILED) {
+		buf = NULL;
 		err = errf("LogError", errfno("mmap", errno, NULL),
 		    "Failed to open CA log file '%s' for reading",
 		    fname);
@@ -3410,14 +3647,14 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 		if (jerr != json_tokener_success) {
 			err = errf("LogError",
 			    jtokerrf("json_tokener_parse_ex", jerr),
-			    "Failed to parse JSON object at line %zu",
-			    lineno);
+			    "Failed to parse JSON object at %s:%zu",
+			    fname, lineno);
 			goto out;
 		}
 		VERIFY(obj != NULL);
 		if (json_tokener_get_parse_end(tok) < llen) {
-			err = errf("LengthError", NULL, "JSON object at line "
-			    "%zu ended after %zu bytes, expected %zu",
+			err = errf("LengthError", NULL, "JSON object at %s:%zu "
+			    "ended after %zu bytes, expected %zu", fname,
 			    lineno, json_tokener_get_parse_end(tok), llen);
 			goto out;
 		}
@@ -3425,21 +3662,33 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 		err = verify_json(ca->ca_pubkey, "ca", obj);
 		if (err != ERRF_OK) {
 			err = errf("LogError", err,
-			    "Failed to verify JSON object at line %zu",
-			    lineno);
+			    "Failed to verify JSON object at %s:%zu",
+			    fname, lineno);
 			goto out;
 		}
 
 		hobj = json_object_object_get(obj, "prev_hash");
+		aobj = json_object_object_get(obj, "action");
+		is_head = (aobj != NULL && strcmp(json_object_get_string(aobj),
+		    "segment_head") == 0);
+
+		if (is_head && n != 0) {
+			err = errf("LogError", NULL, "Failed to verify JSON "
+			    "object at %s:%zu: segment head in the middle of "
+			    "a segment", fname, lineno);
+			goto out;
+		}
+		if (is_head && headp != NULL)
+			*headp = json_object_get(obj);
 
-		if (hobj == NULL && sshbuf_len(ldigest) == 0)
+		if (hobj == NULL && n == 0 && sshbuf_len(ldigest) == 0)
 			goto no_prev_hash;
 
 		if (hobj == NULL ||
 		    !json_object_is_type(hobj, json_type_string)) {
 			err = errf("LogError", NULL,
-			    "Failed to verify JSON object at line %zu: no "
-			    "prev_hash property", lineno);
+			    "Failed to verify JSON object at %s:%zu: no "
+			    "prev_hash property", fname, lineno);
 			goto out;
 		}
 		tmp = json_object_get_string(hobj);
@@ -3447,46 +3696,59 @@ ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
 		rc = sshbuf_b64tod(hbuf, tmp);
 		if (rc != 0) {
 			err = errf("LogError", ssherrf("sshbuf_b64tod", rc),
-			    "Failed to verify JSON object at line %zu: "
-			    "prev_hash is not a base64 string", lineno);
+			    "Failed to verify JSON object at %s:%zu: "
+			    "prev_hash is not a base64 string", fname, lineno);
 			goto out;
 		}
 
+		if (n == 0 && sshbuf_len(ldigest) == 0) {
+			if (!is_head) {
+				err = errf("LogError", NULL, "Failed to verify "
+				    "JSON object at %s:%zu: log segment does "
+				    "not begin with a segment head", fname,
+				    lineno);
+				goto out;
+			}
+			/*
+			 * The head is signed by the CA, so take its prev_hash
+			 * as the start of the chain for this segment.
+			 */
+			chain_start = B_TRUE;
+			rc = sshbuf_putb(ldigest, hbuf);
+			if (rc != 0) {
+				err = ssherrf("sshbuf_putb", rc);
+				goto out;
+			}
+		}
+
 		rc = sshbuf_cmp(hbuf, 0, sshbuf_ptr(ldigest),
 		    sshbuf_len(ldigest));
 		if (rc != 0) {
 			err = errf("LogError", ssherrf("sshbuf_cmp", rc),
-			    "Failed to verify JSON object at line %zu: "
-			    "prev_hash mismatch", lineno);
+			    "Failed to verify JSON object at %s:%zu: "
+			    "prev_hash mismatch", fname, lineno);
 			goto out;
 		}
 
 no_prev_hash:
-		sshbuf_reset(tbsbuf);
-		tmp = json_object_to_json_string_ext(obj,
-		    JSON_C_TO_STRING_PLAIN);
-		if ((rc = sshbuf_put_cstring8(tbsbuf, "piv-ca-log-chain")) ||
-		    (rc = sshbuf_put_cstring8(tbsbuf, ca->ca_slug)) ||
-		    (rc = sshbuf_put_cstring(tbsbuf, tmp))) {
-			err = ssherrf("sshbuf_put_cstring", rc);
+		err = ca_log_chain_digest(ca, obj, tbsbuf, ldigest);
+		if (err != ERRF_OK)
 			goto out;
-		}
 
-		sshbuf_reset(ldigest);
-		rlen = ssh_digest_bytes(SSH_DIGEST_SHA512);
-		rc = sshbuf_reserve(ldigest, rlen, &rptr);
-		if (rc != 0) {
-			err = ssherrf("sshbuf_reserve", rc);
-			goto out;
-		}
-		rc = ssh_digest_buffer(SSH_DIGEST_SHA512, tbsbuf, rptr, rlen);
-		if (rc != 0) {
-			err = ssherrf("ssh_digest_buffer", rc);
-			goto out;
+		/*
+		 * Only the head which starts the chain needs its checkpoint:
+		 * any later one is summarising entries the callback has
+		 * already seen.
+		 */
+		if (cb != NULL && n == 0 && chain_start) {
+			err = ca_log_head_load_state(ca, obj);
+			if (err != ERRF_OK)
+				goto out;
 		}
 
 		if (cb != NULL)
 			cb(obj, cookie);
+		++n;
 
 		json_object_put(obj);
 		obj = NULL;
@@ -3502,10 +3764,11 @@ no_prev_hash:
 		}
 	} while (pos < len);
 
-	if (final_hash != NULL)
-		*final_hash = sshbuf_dtob64_string(ldigest, 0);
+	err = ERRF_OK;
 
 out:
+	if (nentries != NULL)
+		*nentries = n;
 	if (buf != NULL)
 		munmap(buf, len);
 	if (logf != NULL)
@@ -3515,82 +3778,442 @@ out:
 	json_object_put(obj);
 	sshbuf_free(tbsbuf);
 	sshbuf_free(hbuf);
-	sshbuf_free(ldigest);
 	return (err);
 }
 
+static void
+ca_log_seg_path(struct ca *ca, uint seg, char *buf, size_t len)
+{
+	if (seg == 0) {
+		snprintf(buf, len, "%s/%s.log", ca->ca_base_path, ca->ca_slug);
+	} else {
+		snprintf(buf, len, "%s/log/%s-%06u.log", ca->ca_base_path,
+		    ca->ca_slug, seg);
+	}
+}
+
+/*
+ * Reads and verifies just the segment head at the start of a log segment,
+ * without walking the rest of it.
+ */
 static errf_t *
-ca_sign_json(struct ca *ca, struct ca_session *sess, json_object *obj)
+ca_log_read_head(struct ca *ca, const char *fname, json_object **headp)
 {
-	struct ca_session_agent *a = NULL;
-	struct ca_session_direct *d = NULL;
+	FILE *logf = NULL;
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t llen;
+	json_object *obj = NULL, *aobj;
+	enum json_tokener_error jerr;
+	struct json_tokener *tok = NULL;
 	errf_t *err;
-	boolean_t in_txn = B_FALSE;
 
-	if (sess->cs_type == CA_SESSION_AGENT) {
-		a = &sess->cs_agent;
-		err = agent_sign_json(a->csa_fd, ca->ca_pubkey, "ca", obj);
-		if (err != ERRF_OK) {
-			err = errf("CASignError", err, "Failed to sign JSON "
-			    "using CA key in agent '%s'", ca->ca_slug);
-		}
+	logf = fopen(fname, "r");
+	if (logf == NULL) {
+		err = errf("LogError", errfno("fopen", errno, NULL),
+		    "Failed to open CA log file '%s' for reading",
+		    fname);
 		goto out;
 	}
-	VERIFY(sess->cs_type == CA_SESSION_DIRECT);
-	d = &sess->cs_direct;
 
-	err = piv_txn_begin(d->csd_token);
-	if (err != ERRF_OK) {
-		err = errf("CASignError", err, "Failed to open transaction "
-		    "for CA '%s'", ca->ca_slug);
+	llen = getline(&line, &linesz, logf);
+	if (llen < 1) {
+		err = errf("LogError", NULL, "Log segment '%s' is empty",
+		    fname);
 		goto out;
 	}
-	in_txn = B_TRUE;
+	if (line[llen - 1] == '\n')
+		line[--llen] = '\0';
 
-	err = piv_select(d->csd_token);
-	if (err != ERRF_OK) {
-		err = errf("CASignError", err, "Failed to select PIV applet "
-		    "for CA '%s'", ca->ca_slug);
+	tok = json_tokener_new();
+	if (tok == NULL) {
+		err = errfno("json_tokener_new", errno, NULL);
 		goto out;
 	}
-
-	err = piv_auth_key(d->csd_token, d->csd_cakslot, ca->ca_cak);
-	if (err != ERRF_OK) {
-		err = errf("CASignError", err, "PIV CAK check failed "
-		    "for CA '%s'", ca->ca_slug);
+	obj = json_tokener_parse_ex(tok, line, llen);
+	jerr = json_tokener_get_error(tok);
+	if (jerr != json_tokener_success) {
+		err = errf("LogError", jtokerrf("json_tokener_parse_ex", jerr),
+		    "Failed to parse JSON object at %s:1", fname);
 		goto out;
 	}
+	VERIFY(obj != NULL);
 
-	err = piv_verify_pin(d->csd_token, d->csd_pintype, d->csd_pin,
-	    NULL, B_FALSE);
+	err = verify_json(ca->ca_pubkey, "ca", obj);
 	if (err != ERRF_OK) {
-		err = errf("CASignError", err, "Failed to verify PIN "
-		    "for CA '%s' while signing JSON", ca->ca_slug);
+		err = errf("LogError", err, "Failed to verify JSON object "
+		    "at %s:1", fname);
 		goto out;
 	}
 
-	err = piv_sign_json(d->csd_token, d->csd_slot, "ca", obj);
-	if (err != ERRF_OK) {
-		err = errf("CASignError", err, "Failed to sign JSON "
-		    "with CA '%s'", ca->ca_slug);
+	aobj = json_object_object_get(obj, "action");
+	if (aobj == NULL || strcmp(json_object_get_string(aobj),
+	    "segment_head") != 0 ||
+	    json_object_object_get(obj, "prev_hash") == NULL) {
+		err = errf("LogError", NULL, "Log segment '%s' does not begin "
+		    "with a segment head", fname);
 		goto out;
 	}
 
+	*headp = obj;
+	obj = NULL;
+	err = ERRF_OK;
+
 out:
-	if (in_txn)
-		piv_txn_end(d->csd_token);
+	if (logf != NULL)
+		fclose(logf);
+	if (tok != NULL)
+		json_tokener_free(tok);
+	json_object_put(obj);
+	free(line);
 	return (err);
 }
 
-static errf_t *
-ca_sign_crl(struct ca *ca, struct ca_session *sess, X509_CRL *crl)
+static uint
+ca_log_head_seg(json_object *head)
 {
-	struct ca_session_agent *a = NULL;
-	struct ca_session_direct *d = NULL;
+	json_object *obj;
+
+	if (head == NULL)
+		return (0);
+	obj = json_object_object_get(head, "segment");
+	if (obj == NULL)
+		return (0);
+	return ((uint)json_object_get_int64(obj));
+}
+
+errf_t *
+ca_log_verify(struct ca *ca, char **final_hash, log_iter_cb_t cb, void *cookie)
+{
+	char fname[PATH_MAX];
+	struct sshbuf *ldigest = NULL;
+	json_object *head = NULL;
+	uint n = 0;
 	errf_t *err;
-	boolean_t in_txn = B_FALSE;
 
-	if (sess->cs_type == CA_SESSION_AGENT) {
+	ca_log_seg_path(ca, 0, fname, sizeof (fname));
+
+	ldigest = sshbuf_new();
+	if (ldigest == NULL)
+		return (ERRF_NOMEM);
+
+	err = ca_log_verify_file(ca, fname, ldigest, &n, &head, cb, cookie);
+	if (err != ERRF_OK)
+		goto out;
+
+	ca->ca_log_seg = ca_log_head_seg(head);
+	ca->ca_log_entries = n;
+
+	if (final_hash != NULL)
+		*final_hash = sshbuf_dtob64_string(ldigest, 0);
+
+out:
+	json_object_put(head);
+	sshbuf_free(ldigest);
+	return (err);
+}
+
+errf_t *
+ca_log_verify_all(struct ca *ca, uint *nverified, log_iter_cb_t cb,
+    void *cookie)
+{
+	char fname[PATH_MAX];
+	struct sshbuf *ldigest = NULL;
+	json_object *head = NULL;
+	errf_t *err;
+	uint seg, done = 0;
+	struct stat st;
+
+	err = ca_log_verify(ca, NULL, NULL, NULL);
+	if (err != ERRF_OK)
+		return (err);
+
+	ldigest = sshbuf_new();
+	if (ldigest == NULL)
+		return (ERRF_NOMEM);
+
+	for (seg = 1; seg <= ca->ca_log_seg + 1; ++seg) {
+		ca_log_seg_path(ca, (seg > ca->ca_log_seg) ? 0 : seg, fname,
+		    sizeof (fname));
+		/*
+		 * Older segments may have been archived elsewhere: skip
+		 * any leading ones that are missing, and start the chain
+		 * from the head of the first one we have.
+		 */
+		if (seg <= ca->ca_log_seg && stat(fname, &st) != 0 &&
+		    errno == ENOENT && sshbuf_len(ldigest) == 0) {
+			continue;
+		}
+
+		json_object_put(head);
+		head = NULL;
+		err = ca_log_verify_file(ca, fname, ldigest, NULL, &head,
+		    cb, cookie);
+		if (err != ERRF_OK)
+			goto out;
+		if (seg > 1 && ca_log_head_seg(head) != seg - 1) {
+			err = errf("LogError", NULL, "Log segment '%s' does "
+			    "not begin with the head for segment %u", fname,
+			    seg - 1);
+			goto out;
+		}
+		++done;
+	}
+
+	if (nverified != NULL)
+		*nverified = done;
+	err = ERRF_OK;
+
+out:
+	json_object_put(head);
+	sshbuf_free(ldigest);
+	return (err);
+}
+
+/*
+ * Verifies a single sealed segment on its own, and checks that the head
+ * which sealed it (at the start of the following segment) commits to its
+ * final hash and entry count.
+ */
+errf_t *
+ca_log_verify_segment(struct ca *ca, uint seg, log_iter_cb_t cb, void *cookie)
+{
+	char fname[PATH_MAX], nfname[PATH_MAX];
+	struct sshbuf *ldigest = NULL, *hbuf = NULL;
+	json_object *head = NULL, *obj;
+	errf_t *err;
+	uint n = 0;
+	int rc;
+
+	err = ca_log_verify(ca, NULL, NULL, NULL);
+	if (err != ERRF_OK)
+		return (err);
+
+	if (seg < 1 || seg > ca->ca_log_seg) {
+		return (errf("ArgumentError", NULL, "CA '%s' has no sealed "
+		    "log segment %u (has %u)", ca->ca_slug, seg,
+		    ca->ca_log_seg));
+	}
+
+	ldigest = sshbuf_new();
+	hbuf = sshbuf_new();
+	if (ldigest == NULL || hbuf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	ca_log_seg_path(ca, seg, fname, sizeof (fname));
+	err = ca_log_verify_file(ca, fname, ldigest, &n, NULL, cb, cookie);
+	if (err != ERRF_OK)
+		goto out;
+
+	ca_log_seg_path(ca, (seg == ca->ca_log_seg) ? 0 : seg + 1, nfname,
+	    sizeof (nfname));
+	err = ca_log_read_head(ca, nfname, &head);
+	if (err != ERRF_OK)
+		goto out;
+
+	if (ca_log_head_seg(head) != seg) {
+		err = errf("LogError", NULL, "Log segment '%s' does not begin "
+		    "with the head for segment %u", nfname, seg);
+		goto out;
+	}
+	obj = json_object_object_get(head, "entries");
+	if (obj == NULL || (uint)json_object_get_int64(obj) != n) {
+		err = errf("LogError", NULL, "Log segment %u has %u entries, "
+		    "but its head records a different count", seg, n);
+		goto out;
+	}
+	obj = json_object_object_get(head, "prev_hash");
+	VERIFY(obj != NULL);
+	rc = sshbuf_b64tod(hbuf, json_object_get_string(obj));
+	if (rc != 0) {
+		err = errf("LogError", ssherrf("sshbuf_b64tod", rc),
+		    "Segment head in '%s' has invalid prev_hash", nfname);
+		goto out;
+	}
+	if (sshbuf_len(hbuf) != sshbuf_len(ldigest) ||
+	    sshbuf_cmp(hbuf, 0, sshbuf_ptr(ldigest),
+	    sshbuf_len(ldigest)) != 0) {
+		err = errf("LogError", NULL, "Final hash of log segment %u "
+		    "does not match its segment head", seg);
+		goto out;
+	}
+
+	err = ERRF_OK;
+
+out:
+	json_object_put(head);
+	sshbuf_free(ldigest);
+	sshbuf_free(hbuf);
+	return (err);
+}
+
+static errf_t *
+ca_sign_json(struct ca *ca, struct ca_session *sess, json_object *obj)
+{
+	struct ca_session_agent *a = NULL;
+	struct ca_session_direct *d = NULL;
+	errf_t *err;
+	boolean_t in_txn = B_FALSE;
+
+	if (sess->cs_type == CA_SESSION_AGENT) {
+		a = &sess->cs_agent;
+		err = agent_sign_json(a->csa_fd, ca->ca_pubkey, "ca", obj);
+		if (err != ERRF_OK) {
+			err = errf("CASignError", err, "Failed to sign JSON "
+			    "using CA key in agent '%s'", ca->ca_slug);
+		}
+		goto out;
+	}
+	VERIFY(sess->cs_type == CA_SESSION_DIRECT);
+	d = &sess->cs_direct;
+
+	err = piv_txn_begin(d->csd_token);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to open transaction "
+		    "for CA '%s'", ca->ca_slug);
+		goto out;
+	}
+	in_txn = B_TRUE;
+
+	err = piv_select(d->csd_token);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to select PIV applet "
+		    "for CA '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	err = piv_auth_key(d->csd_token, d->csd_cakslot, ca->ca_cak);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "PIV CAK check failed "
+		    "for CA '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	err = piv_verify_pin(d->csd_token, d->csd_pintype, d->csd_pin,
+	    NULL, B_FALSE);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to verify PIN "
+		    "for CA '%s' while signing JSON", ca->ca_slug);
+		goto out;
+	}
+
+	err = piv_sign_json(d->csd_token, d->csd_slot, "ca", obj);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to sign JSON "
+		    "with CA '%s'", ca->ca_slug);
+		goto out;
+	}
+
+out:
+	if (in_txn)
+		piv_txn_end(d->csd_token);
+	return (err);
+}
+
+/*
+ * Opens a transaction on a direct session's token, selects the applet, checks
+ * the CAK and verifies the PIN, ready for a run of signing operations. On
+ * success the caller must piv_txn_end() when done; on failure the transaction
+ * has already been closed. "what" is used in the PIN error message.
+ */
+static errf_t *
+ca_direct_sign_begin(struct ca *ca, struct ca_session_direct *d,
+    const char *what)
+{
+	errf_t *err;
+
+	err = piv_txn_begin(d->csd_token);
+	if (err != ERRF_OK) {
+		return (errf("CASignError", err, "Failed to open transaction "
+		    "for CA '%s'", ca->ca_slug));
+	}
+
+	err = piv_select(d->csd_token);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to select PIV applet "
+		    "for CA '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	err = piv_auth_key(d->csd_token, d->csd_cakslot, ca->ca_cak);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "PIV CAK check failed "
+		    "for CA '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	err = piv_verify_pin(d->csd_token, d->csd_pintype, d->csd_pin,
+	    NULL, B_FALSE);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to verify PIN "
+		    "for CA '%s' while signing %s", ca->ca_slug, what);
+		goto out;
+	}
+
+	return (ERRF_OK);
+
+out:
+	piv_txn_end(d->csd_token);
+	return (err);
+}
+
+/*
+ * For signing a run of JSON objects (e.g. log entries which chain on from
+ * each other, so have to be signed one at a time) without re-opening the
+ * card transaction and re-verifying the PIN for every one.
+ */
+static errf_t *
+ca_sign_json_begin(struct ca *ca, struct ca_session *sess)
+{
+	if (sess->cs_type == CA_SESSION_AGENT)
+		return (ERRF_OK);
+	VERIFY(sess->cs_type == CA_SESSION_DIRECT);
+	return (ca_direct_sign_begin(ca, &sess->cs_direct, "JSON"));
+}
+
+static errf_t *
+ca_sign_json_next(struct ca *ca, struct ca_session *sess, json_object *obj)
+{
+	struct ca_session_direct *d;
+	errf_t *err;
+
+	if (sess->cs_type == CA_SESSION_AGENT) {
+		err = agent_sign_json(sess->cs_agent.csa_fd, ca->ca_pubkey,
+		    "ca", obj);
+		if (err != ERRF_OK) {
+			err = errf("CASignError", err, "Failed to sign JSON "
+			    "using CA key in agent '%s'", ca->ca_slug);
+		}
+		return (err);
+	}
+	d = &sess->cs_direct;
+
+	err = piv_sign_json(d->csd_token, d->csd_slot, "ca", obj);
+	if (err != ERRF_OK) {
+		err = errf("CASignError", err, "Failed to sign JSON "
+		    "with CA '%s'", ca->ca_slug);
+	}
+	return (err);
+}
+
+static void
+ca_sign_json_end(struct ca_session *sess)
+{
+	if (sess->cs_type == CA_SESSION_DIRECT)
+		piv_txn_end(sess->cs_direct.csd_token);
+}
+
+static errf_t *
+ca_sign_crl(struct ca *ca, struct ca_session *sess, X509_CRL *crl)
+{
+	struct ca_session_agent *a = NULL;
+	struct ca_session_direct *d = NULL;
+	errf_t *err;
+	boolean_t in_txn = B_FALSE;
+
+	if (sess->cs_type == CA_SESSION_AGENT) {
 		a = &sess->cs_agent;
 		err = agent_sign_crl(a->csa_fd, ca->ca_pubkey, crl);
 		if (err != ERRF_OK) {
@@ -3911,25 +4534,379 @@ add_timestamp(json_object *obj)
 	json_object_object_add(obj, "time_secs", prop);
 }
 
-static errf_t *
-ca_log_init(struct ca *ca, struct ca_session *sess, BIGNUM *ca_serial,
-    const char *dnstr)
+/*
+ * Summary of CA state written to a segment's checkpoint when it's sealed, so
+ * that ca_log_verify() callbacks can see everything which happened in sealed
+ * segments without having to walk them.
+ */
+struct log_seal_state {
+	json_object	*lss_issued;	/* array of serial hex strings */
+	json_object	*lss_revoked;	/* object: serial hex => time_secs */
+	json_object	*lss_crls;	/* object: count, seq, until, time */
+};
+
+static void
+ca_log_seal_iter(json_object *entry, void *cookie)
 {
-	json_object *robj = NULL, *obj = NULL;
-	FILE *logf;
-	char fname[PATH_MAX];
-	errf_t *err;
-	const char *line;
-	size_t done;
-	char *serialhex = NULL;
+	struct log_seal_state *lss = cookie;
+	json_object *obj, *sobj, *tobj;
+	json_object_iter iter;
+	const char *v;
+	size_t i;
+	int64_t val;
 
-	xstrlcpy(fname, ca->ca_base_path, sizeof (fname));
-	xstrlcat(fname, "/", sizeof (fname));
-	xstrlcat(fname, ca->ca_slug, sizeof (fname));
-	xstrlcat(fname, ".log", sizeof (fname));
+	obj = json_object_object_get(entry, "action");
+	if (obj == NULL)
+		return;
+	v = json_object_get_string(obj);
 
-	logf = fopen(fname, "w");
-	if (logf == NULL) {
+	if (strcmp(v, "segment_head") == 0) {
+		obj = json_object_object_get(entry, "issued");
+		for (i = 0; obj != NULL && i < json_object_array_length(obj);
+		    ++i) {
+			sobj = json_object_array_get_idx(obj, i);
+			json_object_array_add(lss->lss_issued,
+			    json_object_get(sobj));
+		}
+		obj = json_object_object_get(entry, "revoked");
+		if (obj != NULL) {
+			bzero(&iter, sizeof (iter));
+			json_object_object_foreachC(obj, iter) {
+				json_object_object_add(lss->lss_revoked,
+				    iter.key, json_object_get(iter.val));
+			}
+		}
+		obj = json_object_object_get(entry, "crls");
+		if (obj != NULL) {
+			bzero(&iter, sizeof (iter));
+			json_object_object_foreachC(obj, iter) {
+				json_object_object_add(lss->lss_crls,
+				    iter.key, json_object_get(iter.val));
+			}
+		}
+
+	} else if (strcmp(v, "issue_cert") == 0) {
+		sobj = json_object_object_get(entry, "serial");
+		if (sobj != NULL) {
+			json_object_array_add(lss->lss_issued,
+			    json_object_get(sobj));
+		}
+
+	} else if (strcmp(v, "revoke_cert") == 0) {
+		sobj = json_object_object_get(entry, "serial");
+		tobj = json_object_object_get(entry, "time_secs");
+		if (sobj == NULL || tobj == NULL)
+			return;
+		/* Keep the earliest revocation time for a serial. */
+		v = json_object_get_string(sobj);
+		if (json_object_object_get(lss->lss_revoked, v) != NULL)
+			return;
+		json_object_object_add(lss->lss_revoked, v,
+		    json_object_get(tobj));
+
+	} else if (strcmp(v, "gen_crl") == 0) {
+		obj = json_object_object_get(lss->lss_crls, "count");
+		val = (obj == NULL) ? 0 : json_object_get_int64(obj);
+		json_object_object_add(lss->lss_crls, "count",
+		    json_object_new_int64(val + 1));
+
+		sobj = json_object_object_get(entry, "seq");
+		obj = json_object_object_get(lss->lss_crls, "seq");
+		if (sobj != NULL && (obj == NULL ||
+		    json_object_get_int64(sobj) > json_object_get_int64(obj))) {
+			json_object_object_add(lss->lss_crls, "seq",
+			    json_object_get(sobj));
+		}
+
+		sobj = json_object_object_get(entry, "until");
+		obj = json_object_object_get(lss->lss_crls, "until");
+		if (sobj != NULL && (obj == NULL ||
+		    json_object_get_int64(sobj) > json_object_get_int64(obj))) {
+			json_object_object_add(lss->lss_crls, "until",
+			    json_object_get(sobj));
+		}
+
+		sobj = json_object_object_get(entry, "time");
+		if (sobj != NULL) {
+			json_object_object_add(lss->lss_crls, "time",
+			    json_object_get(sobj));
+		}
+	}
+}
+
+/*
+ * Writes the checkpoint for sealed segment "seg" (see the comment above
+ * ca_log_verify_file()), and returns the hash for its segment head.
+ */
+static errf_t *
+ca_log_write_state(struct ca *ca, uint seg, struct log_seal_state *lss,
+    char **hashp)
+{
+	json_object *sobj, *obj;
+	char fname[PATH_MAX], tfname[PATH_MAX];
+	const char *line;
+	FILE *f = NULL;
+	size_t done;
+	errf_t *err;
+
+	sobj = json_object_new_object();
+	if (sobj == NULL)
+		return (ERRF_NOMEM);
+
+	obj = json_object_new_int64(seg);
+	VERIFY(obj != NULL);
+	json_object_object_add(sobj, "segment", obj);
+	json_object_object_add(sobj, "issued", json_object_get(lss->lss_issued));
+	json_object_object_add(sobj, "revoked",
+	    json_object_get(lss->lss_revoked));
+	json_object_object_add(sobj, "crls", json_object_get(lss->lss_crls));
+
+	line = json_object_to_json_string_ext(sobj, JSON_C_TO_STRING_PLAIN);
+	err = ca_log_state_hash(ca, line, hashp);
+	if (err != ERRF_OK)
+		goto out;
+
+	ca_log_state_path(ca, seg, fname, sizeof (fname));
+	snprintf(tfname, sizeof (tfname), "%s.new", fname);
+
+	f = fopen(tfname, "w");
+	if (f == NULL) {
+		err = errf("LogError", errfno("fopen", errno, NULL),
+		    "Failed to open CA log checkpoint '%s'", tfname);
+		goto out;
+	}
+	done = fwrite(line, 1, strlen(line), f);
+	if (done < strlen(line) || fputs("\n", f) < 0) {
+		err = errfno("fwrite", errno, "writing CA log checkpoint");
+		goto out;
+	}
+	if (fclose(f) != 0) {
+		f = NULL;
+		err = errfno("fclose", errno, "writing CA log checkpoint");
+		goto out;
+	}
+	f = NULL;
+	if (rename(tfname, fname) != 0) {
+		err = errf("LogError", errfno("rename", errno, NULL),
+		    "Failed to write CA log checkpoint '%s'", fname);
+		goto out;
+	}
+	err = ERRF_OK;
+
+out:
+	if (f != NULL)
+		fclose(f);
+	if (err != ERRF_OK) {
+		(void) unlink(tfname);
+		free(*hashp);
+		*hashp = NULL;
+	}
+	json_object_put(sobj);
+	return (err);
+}
+
+/*
+ * Seals the open log segment if it has reached the configured number of
+ * entries.
+ */
+static errf_t *
+ca_log_maybe_seal(struct ca *ca, struct ca_session *sess)
+{
+	struct log_seal_state lss;
+	json_object *robj = NULL, *obj;
+	char fname[PATH_MAX], sfname[PATH_MAX], tfname[PATH_MAX];
+	char *final_hash = NULL, *state_hash = NULL;
+	FILE *logf = NULL;
+	const char *line;
+	size_t done;
+	uint seg, nentries;
+	boolean_t linked = B_FALSE;
+	errf_t *err;
+	int rc;
+
+	if (ca->ca_log_seg_entries == 0 ||
+	    ca->ca_log_entries < ca->ca_log_seg_entries) {
+		return (ERRF_OK);
+	}
+
+	tfname[0] = '\0';
+	bzero(&lss, sizeof (lss));
+	lss.lss_issued = json_object_new_array();
+	lss.lss_revoked = json_object_new_object();
+	lss.lss_crls = json_object_new_object();
+	VERIFY(lss.lss_issued != NULL);
+	VERIFY(lss.lss_revoked != NULL);
+	VERIFY(lss.lss_crls != NULL);
+
+	err = ca_log_verify(ca, &final_hash, ca_log_seal_iter, &lss);
+	if (err != ERRF_OK) {
+		err = errf("CALogError", err, "Failed to verify CA log "
+		    "before sealing segment: '%s'", ca->ca_slug);
+		goto out;
+	}
+	/* Someone else may have sealed it in the meantime. */
+	if (ca->ca_log_entries < ca->ca_log_seg_entries) {
+		err = ERRF_OK;
+		goto out;
+	}
+	seg = ca->ca_log_seg + 1;
+	nentries = ca->ca_log_entries;
+
+	snprintf(sfname, sizeof (sfname), "%s/log", ca->ca_base_path);
+	rc = mkdir(sfname, 0700);
+	if (rc != 0 && errno != EEXIST) {
+		err = errfno("mkdir", errno, "%s", sfname);
+		goto out;
+	}
+
+	err = ca_log_write_state(ca, seg, &lss, &state_hash);
+	if (err != ERRF_OK)
+		goto out;
+
+	robj = json_object_new_object();
+	if (robj == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	obj = json_object_new_string(final_hash);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "prev_hash", obj);
+
+	add_timestamp(robj);
+
+	obj = json_object_new_string("segment_head");
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "action", obj);
+
+	obj = json_object_new_int64(seg);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "segment", obj);
+
+	obj = json_object_new_int64(nentries);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "entries", obj);
+
+	obj = json_object_new_string(state_hash);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "state_hash", obj);
+
+	err = ca_sign_json(ca, sess, robj);
+	if (err != ERRF_OK) {
+		err = errf("CALogError", err, "Failed to sign CA log segment "
+		    "head for '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	ca_log_seg_path(ca, 0, fname, sizeof (fname));
+	ca_log_seg_path(ca, seg, sfname, sizeof (sfname));
+	snprintf(tfname, sizeof (tfname), "%s.new", fname);
+
+	logf = fopen(tfname, "w");
+	if (logf == NULL) {
+		err = errf("LogError", errfno("fopen", errno, NULL),
+		    "Failed to open new CA log segment '%s'", tfname);
+		goto out;
+	}
+
+	line = json_object_to_json_string_ext(robj, JSON_C_TO_STRING_PLAIN);
+	done = fwrite(line, 1, strlen(line), logf);
+	if (done < strlen(line)) {
+		err = errf("ShortWrite", NULL, "wrote %zu bytes instead of "
+		    "%zu", done, strlen(line));
+		goto out;
+	}
+	if (fputs("\n", logf) < 0) {
+		err = errfno("fputs", errno, "writing log json");
+		goto out;
+	}
+	if (fclose(logf) != 0) {
+		logf = NULL;
+		err = errfno("fclose", errno, "writing log json");
+		goto out;
+	}
+	logf = NULL;
+
+	/*
+	 * link() rather than rename() so we never clobber an existing
+	 * sealed segment, and so the open log path is never missing.
+	 */
+	if (link(fname, sfname) != 0) {
+		err = errf("LogError", errfno("link", errno, NULL),
+		    "Failed to archive CA log segment to '%s'", sfname);
+		goto out;
+	}
+	linked = B_TRUE;
+
+	if (rename(tfname, fname) != 0) {
+		err = errf("LogError", errfno("rename", errno, NULL),
+		    "Failed to start new CA log segment '%s'", fname);
+		goto out;
+	}
+	linked = B_FALSE;
+
+	ca->ca_log_seg = seg;
+	ca->ca_log_entries = 1;
+	err = ERRF_OK;
+
+out:
+	if (logf != NULL)
+		fclose(logf);
+	if (err != ERRF_OK) {
+		if (tfname[0] != '\0')
+			(void) unlink(tfname);
+		if (linked)
+			(void) unlink(sfname);
+	}
+	free(final_hash);
+	free(state_hash);
+	json_object_put(robj);
+	json_object_put(lss.lss_issued);
+	json_object_put(lss.lss_revoked);
+	json_object_put(lss.lss_crls);
+	return (err);
+}
+
+/*
+ * Called once "n" new entries have been written to the open segment (and the
+ * file closed), so that the entry which fills a segment seals it straight
+ * away. A failure to seal doesn't undo the entries we've written: it's
+ * logged, and ca_log_maybe_seal() before the next append tries again.
+ */
+static void
+ca_log_appended(struct ca *ca, struct ca_session *sess, uint n)
+{
+	errf_t *err;
+
+	ca->ca_log_entries += n;
+	err = ca_log_maybe_seal(ca, sess);
+	if (err != ERRF_OK) {
+		bunyan_log(BNY_WARN, "failed to seal CA log segment",
+		    "ca", BNY_STRING, ca->ca_slug,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+}
+
+static errf_t *
+ca_log_init(struct ca *ca, struct ca_session *sess, BIGNUM *ca_serial,
+    const char *dnstr)
+{
+	json_object *robj = NULL, *obj = NULL;
+	FILE *logf;
+	char fname[PATH_MAX];
+	errf_t *err;
+	const char *line;
+	size_t done;
+	char *serialhex = NULL;
+
+	xstrlcpy(fname, ca->ca_base_path, sizeof (fname));
+	xstrlcat(fname, "/", sizeof (fname));
+	xstrlcat(fname, ca->ca_slug, sizeof (fname));
+	xstrlcat(fname, ".log", sizeof (fname));
+
+	logf = fopen(fname, "w");
+	if (logf == NULL) {
 		err = errf("LogError", errfno("fopen", errno, NULL),
 		    "Failed to open CA log file '%s' for reading",
 		    fname);
@@ -4006,6 +4983,10 @@ ca_log_crl_gen(struct ca *ca, struct ca_session *sess, X509_CRL *crl, uint seq)
 	time_t t;
 	STACK_OF(X509_REVOKED) *revoked;
 
+	err = ca_log_maybe_seal(ca, sess);
+	if (err != ERRF_OK)
+		goto out;
+
 	err = ca_log_verify(ca, &prev_hash, NULL, NULL);
 	if (err != ERRF_OK) {
 		err = errf("CALogError", err, "Failed to verify CA log "
@@ -4113,7 +5094,14 @@ ca_log_crl_gen(struct ca *ca, struct ca_session *sess, X509_CRL *crl, uint seq)
 		err = errfno("fputs", errno, "writing log json");
 		goto out;
 	}
+	if (fclose(logf) != 0) {
+		logf = NULL;
+		err = errfno("fclose", errno, "writing log json");
+		goto out;
+	}
+	logf = NULL;
 
+	ca_log_appended(ca, sess, 1);
 	err = ERRF_OK;
 
 out:
@@ -4138,6 +5126,10 @@ ca_log_revoke_serial(struct ca *ca, struct ca_session *sess, BIGNUM *serial)
 	char *prev_hash = NULL;
 	char *serialhex = NULL;
 
+	err = ca_log_maybe_seal(ca, sess);
+	if (err != ERRF_OK)
+		goto out;
+
 	err = ca_log_verify(ca, &prev_hash, NULL, NULL);
 	if (err != ERRF_OK) {
 		err = errf("CALogError", err, "Failed to verify CA log "
@@ -4208,7 +5200,14 @@ ca_log_revoke_serial(struct ca *ca, struct ca_session *sess, BIGNUM *serial)
 		err = errfno("fputs", errno, "writing log json");
 		goto out;
 	}
+	if (fclose(logf) != 0) {
+		logf = NULL;
+		err = errfno("fclose", errno, "writing log json");
+		goto out;
+	}
+	logf = NULL;
 
+	ca_log_appended(ca, sess, 1);
 	err = ERRF_OK;
 
 out:
@@ -4221,56 +5220,273 @@ out:
 	return (err);
 }
 
+static void
+ca_log_revoked_iter(json_object *entry, void *cookie)
+{
+	json_object *revoked = cookie;
+	json_object *obj;
+	json_object_iter iter;
+	const char *v;
+
+	obj = json_object_object_get(entry, "action");
+	if (obj == NULL)
+		return;
+	v = json_object_get_string(obj);
+
+	if (strcmp(v, "segment_head") == 0) {
+		obj = json_object_object_get(entry, "revoked");
+		if (obj == NULL)
+			return;
+		bzero(&iter, sizeof (iter));
+		json_object_object_foreachC(obj, iter) {
+			json_object_object_add(revoked, iter.key,
+			    json_object_new_boolean(1));
+		}
+
+	} else if (strcmp(v, "revoke_cert") == 0) {
+		obj = json_object_object_get(entry, "serial");
+		if (obj == NULL)
+			return;
+		json_object_object_add(revoked, json_object_get_string(obj),
+		    json_object_new_boolean(1));
+	}
+}
+
+/*
+ * Revokes a whole list of serials at once. The new entries are signed under a
+ * single card transaction (chaining each one on from the last), and then
+ * they're appended to the log in one write.
+ *
+ * A batch never runs past the end of a log segment: if it won't fit in the
+ * room left in the open segment, we write as much as fits, seal, and carry
+ * on with the rest in the next segment.
+ *
+ * Serials which are already revoked (or repeated in the list) are skipped.
+ */
 static errf_t *
-ca_log_cert_action(struct ca *ca, struct ca_session *sess, const char *action,
-    const char *tpl, struct cert_var_scope *scope, X509 *cert)
+ca_log_revoke_serials(struct ca *ca, struct ca_session *sess,
+    BIGNUM *const *serials, uint nserials, uint *nrevoked)
 {
-	json_object *robj = NULL, *obj = NULL;
+	json_object *revoked = NULL, *robj = NULL, *obj = NULL;
+	struct sshbuf *lines = NULL, *tbsbuf = NULL, *ldigest = NULL;
 	FILE *logf = NULL;
 	char fname[PATH_MAX];
 	const char *line;
 	size_t done;
 	errf_t *err;
 	char *prev_hash = NULL;
-	char *dnstr = NULL;
-	ASN1_INTEGER *serialasn1;
-	BIGNUM *serial = NULL;
 	char *serialhex = NULL;
+	boolean_t in_sign = B_FALSE;
+	uint i = 0, n = 0, nchunk, room;
 
-	err = ca_log_verify(ca, &prev_hash, NULL, NULL);
-	if (err != ERRF_OK) {
-		err = errf("CALogError", err, "Failed to verify CA log "
-		    "before writing new entry: '%s'", ca->ca_slug);
+	revoked = json_object_new_object();
+	lines = sshbuf_new();
+	tbsbuf = sshbuf_new();
+	ldigest = sshbuf_new();
+	if (revoked == NULL || lines == NULL || tbsbuf == NULL ||
+	    ldigest == NULL) {
+		err = ERRF_NOMEM;
 		goto out;
 	}
 
-	xstrlcpy(fname, ca->ca_base_path, sizeof (fname));
-	xstrlcat(fname, "/", sizeof (fname));
-	xstrlcat(fname, ca->ca_slug, sizeof (fname));
-	xstrlcat(fname, ".log", sizeof (fname));
+	while (i < nserials) {
+		err = ca_log_maybe_seal(ca, sess);
+		if (err != ERRF_OK)
+			goto out;
 
-	logf = fopen(fname, "a");
-	if (logf == NULL) {
-		err = errf("LogError", errfno("fopen", errno, NULL),
-		    "Failed to open CA log file '%s' for appending",
-		    fname);
-		goto out;
-	}
+		free(prev_hash);
+		prev_hash = NULL;
+		err = ca_log_verify(ca, &prev_hash, ca_log_revoked_iter,
+		    revoked);
+		if (err != ERRF_OK) {
+			err = errf("CALogError", err, "Failed to verify CA "
+			    "log before writing new entries: '%s'",
+			    ca->ca_slug);
+			goto out;
+		}
 
-	robj = json_object_new_object();
-	if (robj == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
+		room = UINT_MAX;
+		if (ca->ca_log_seg_entries != 0) {
+			VERIFY(ca->ca_log_entries < ca->ca_log_seg_entries);
+			room = ca->ca_log_seg_entries - ca->ca_log_entries;
+		}
 
-	if (prev_hash != NULL) {
-		obj = json_object_new_string(prev_hash);
-		VERIFY(obj != NULL);
-		json_object_object_add(robj, "prev_hash", obj);
-		obj = NULL;
-	}
+		err = ca_sign_json_begin(ca, sess);
+		if (err != ERRF_OK)
+			goto out;
+		in_sign = B_TRUE;
+
+		sshbuf_reset(lines);
+		for (nchunk = 0; i < nserials && nchunk < room; ++i) {
+			serialhex = BN_bn2hex(serials[i]);
+			VERIFY(serialhex != NULL);
+
+			if (json_object_object_get(revoked, serialhex) !=
+			    NULL) {
+				free(serialhex);
+				serialhex = NULL;
+				continue;
+			}
 
-	add_timestamp(robj);
+			robj = json_object_new_object();
+			if (robj == NULL) {
+				err = ERRF_NOMEM;
+				goto out;
+			}
+
+			if (prev_hash != NULL) {
+				obj = json_object_new_string(prev_hash);
+				VERIFY(obj != NULL);
+				json_object_object_add(robj, "prev_hash", obj);
+				obj = NULL;
+			}
+
+			add_timestamp(robj);
+
+			obj = json_object_new_string("revoke_cert");
+			VERIFY(obj != NULL);
+			json_object_object_add(robj, "action", obj);
+			obj = NULL;
+
+			obj = json_object_new_string(serialhex);
+			VERIFY(obj != NULL);
+			json_object_object_add(robj, "serial", obj);
+			obj = NULL;
+
+			err = ca_sign_json_next(ca, sess, robj);
+			if (err != ERRF_OK) {
+				err = errf("CALogError", err, "Failed to sign "
+				    "CA log entry for '%s' about cert serial "
+				    "'%s'", ca->ca_slug, serialhex);
+				goto out;
+			}
+
+			err = ca_log_chain_digest(ca, robj, tbsbuf, ldigest);
+			if (err != ERRF_OK)
+				goto out;
+			free(prev_hash);
+			prev_hash = sshbuf_dtob64_string(ldigest, 0);
+			VERIFY(prev_hash != NULL);
+
+			line = json_object_to_json_string_ext(robj,
+			    JSON_C_TO_STRING_PLAIN);
+			VERIFY0(sshbuf_put(lines, line, strlen(line)));
+			VERIFY0(sshbuf_put_u8(lines, '\n'));
+
+			json_object_object_add(revoked, serialhex,
+			    json_object_new_boolean(1));
+			json_object_put(robj);
+			robj = NULL;
+			free(serialhex);
+			serialhex = NULL;
+			++nchunk;
+		}
+
+		ca_sign_json_end(sess);
+		in_sign = B_FALSE;
+
+		if (nchunk == 0)
+			break;
+
+		ca_log_seg_path(ca, 0, fname, sizeof (fname));
+
+		logf = fopen(fname, "a");
+		if (logf == NULL) {
+			err = errf("LogError", errfno("fopen", errno, NULL),
+			    "Failed to open CA log file '%s' for appending",
+			    fname);
+			goto out;
+		}
+
+		done = fwrite(sshbuf_ptr(lines), 1, sshbuf_len(lines), logf);
+		if (done < sshbuf_len(lines)) {
+			err = errfno("fwrite", errno, "writing log json");
+			goto out;
+		}
+		if (fclose(logf) != 0) {
+			logf = NULL;
+			err = errfno("fclose", errno, "writing log json");
+			goto out;
+		}
+		logf = NULL;
+		n += nchunk;
+		ca_log_appended(ca, sess, nchunk);
+	}
+
+	err = ERRF_OK;
+
+out:
+	/* Whatever we wrote before an error is still in the log. */
+	*nrevoked = n;
+	if (in_sign)
+		ca_sign_json_end(sess);
+	free(serialhex);
+	free(prev_hash);
+	if (logf != NULL)
+		fclose(logf);
+	json_object_put(obj);
+	json_object_put(robj);
+	json_object_put(revoked);
+	sshbuf_free(lines);
+	sshbuf_free(tbsbuf);
+	sshbuf_free(ldigest);
+	return (err);
+}
+
+static errf_t *
+ca_log_cert_action(struct ca *ca, struct ca_session *sess, const char *action,
+    const char *tpl, json_object *vars, X509 *cert)
+{
+	json_object *robj = NULL, *obj = NULL;
+	FILE *logf = NULL;
+	char fname[PATH_MAX];
+	const char *line;
+	size_t done;
+	errf_t *err;
+	char *prev_hash = NULL;
+	char *dnstr = NULL;
+	ASN1_INTEGER *serialasn1;
+	BIGNUM *serial = NULL;
+	char *serialhex = NULL;
+
+	err = ca_log_maybe_seal(ca, sess);
+	if (err != ERRF_OK)
+		goto out;
+
+	err = ca_log_verify(ca, &prev_hash, NULL, NULL);
+	if (err != ERRF_OK) {
+		err = errf("CALogError", err, "Failed to verify CA log "
+		    "before writing new entry: '%s'", ca->ca_slug);
+		goto out;
+	}
+
+	xstrlcpy(fname, ca->ca_base_path, sizeof (fname));
+	xstrlcat(fname, "/", sizeof (fname));
+	xstrlcat(fname, ca->ca_slug, sizeof (fname));
+	xstrlcat(fname, ".log", sizeof (fname));
+
+	logf = fopen(fname, "a");
+	if (logf == NULL) {
+		err = errf("LogError", errfno("fopen", errno, NULL),
+		    "Failed to open CA log file '%s' for appending",
+		    fname);
+		goto out;
+	}
+
+	robj = json_object_new_object();
+	if (robj == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	if (prev_hash != NULL) {
+		obj = json_object_new_string(prev_hash);
+		VERIFY(obj != NULL);
+		json_object_object_add(robj, "prev_hash", obj);
+		obj = NULL;
+	}
+
+	add_timestamp(robj);
 
 	obj = json_object_new_string(action);
 	VERIFY(obj != NULL);
@@ -4293,14 +5509,9 @@ ca_log_cert_action(struct ca *ca, struct ca_session *sess, const char *action,
 		obj = NULL;
 	}
 
-	if (scope != NULL) {
-		while (scope_parent(scope) != NULL)
-			scope = scope_parent(scope);
-		err = scope_to_json(scope, &obj);
-		if (err != ERRF_OK)
-			goto out;
-		json_object_object_add(robj, "variables", obj);
-		obj = NULL;
+	if (vars != NULL) {
+		json_object_object_add(robj, "variables",
+		    json_object_get(vars));
 	}
 
 	serialasn1 = X509_get_serialNumber(cert);
@@ -4336,7 +5547,14 @@ ca_log_cert_action(struct ca *ca, struct ca_session *sess, const char *action,
 		err = errfno("fputs", errno, "writing log json");
 		goto out;
 	}
+	if (fclose(logf) != 0) {
+		logf = NULL;
+		err = errfno("fclose", errno, "writing log json");
+		goto out;
+	}
+	logf = NULL;
 
+	ca_log_appended(ca, sess, 1);
 	err = ERRF_OK;
 
 out:
@@ -4353,9 +5571,9 @@ out:
 
 static errf_t *
 ca_log_new_cert(struct ca *ca, struct ca_session *sess, const char *tpl,
-    struct cert_var_scope *scope, X509 *cert)
+    json_object *vars, X509 *cert)
 {
-	return (ca_log_cert_action(ca, sess, "issue_cert", tpl, scope, cert));
+	return (ca_log_cert_action(ca, sess, "issue_cert", tpl, vars, cert));
 }
 
 static errf_t *
@@ -4370,19 +5588,52 @@ struct crl_gen_state {
 	uint		 cgs_last_seq;
 };
 
+static void
+crl_gen_add_revoked(struct crl_gen_state *cgs, const char *v, time_t t)
+{
+	X509_REVOKED *rev = NULL;
+	BIGNUM *serial = NULL;
+	ASN1_INTEGER *asn1_serial = NULL;
+	ASN1_TIME *asn1_time = NULL;
+	int rc;
+
+	rc = BN_hex2bn(&serial, v);
+	if (rc == 0 || rc < strlen(v))
+		goto out;
+	asn1_serial = BN_to_ASN1_INTEGER(serial, NULL);
+	if (asn1_serial == NULL)
+		goto out;
+
+	asn1_time = ASN1_TIME_set(NULL, t);
+
+	rev = X509_REVOKED_new();
+	VERIFY(rev != NULL);
+
+	rc = X509_REVOKED_set_serialNumber(rev, asn1_serial);
+	VERIFY(rc == 1);
+
+	rc = X509_REVOKED_set_revocationDate(rev, asn1_time);
+	VERIFY(rc == 1);
+
+	rc = X509_CRL_add0_revoked(cgs->cgs_crl, rev);
+	VERIFY(rc == 1);
+	rev = NULL;
+
+out:
+	ASN1_INTEGER_free(asn1_serial);
+	BN_free(serial);
+	ASN1_TIME_free(asn1_time);
+}
+
 void
 ca_generate_crl_log_iter(json_object *entry, void *cookie)
 {
 	struct crl_gen_state *cgs = cookie;
-	json_object *obj;
+	json_object *obj, *sobj;
+	json_object_iter iter;
 	const char *v;
 	time_t t;
 	uint seq;
-	X509_REVOKED *rev = NULL;
-	BIGNUM *serial = NULL;
-	ASN1_INTEGER *asn1_serial = NULL;
-	ASN1_TIME *asn1_time = NULL;
-	int rc;
 
 	obj = json_object_object_get(entry, "action");
 	if (obj == NULL)
@@ -4391,182 +5642,1044 @@ ca_generate_crl_log_iter(json_object *entry, void *cookie)
 	if (strcmp(v, "revoke_cert") == 0) {
 		obj = json_object_object_get(entry, "serial");
 		VERIFY(obj != NULL);
+		v = json_object_get_string(obj);
+
+		obj = json_object_object_get(entry, "time_secs");
+		VERIFY(obj != NULL);
+		t = (time_t)json_object_get_int64(obj);
+
+		crl_gen_add_revoked(cgs, v, t);
+
+	} else if (strcmp(v, "segment_head") == 0) {
+		obj = json_object_object_get(entry, "revoked");
+		if (obj != NULL) {
+			bzero(&iter, sizeof (iter));
+			json_object_object_foreachC(obj, iter) {
+				t = (time_t)json_object_get_int64(iter.val);
+				crl_gen_add_revoked(cgs, iter.key, t);
+			}
+		}
+
+		obj = json_object_object_get(entry, "crls");
+		if (obj == NULL)
+			return;
+		sobj = json_object_object_get(obj, "until");
+		if (sobj != NULL) {
+			t = (time_t)json_object_get_int64(sobj);
+			if (t > cgs->cgs_last)
+				cgs->cgs_last = t;
+		}
+		sobj = json_object_object_get(obj, "seq");
+		if (sobj != NULL) {
+			seq = (uint)json_object_get_int64(sobj);
+			if (seq > cgs->cgs_last_seq)
+				cgs->cgs_last_seq = seq;
+		}
+
+	} else if (strcmp(v, "gen_crl") == 0) {
+		obj = json_object_object_get(entry, "until");
+		VERIFY(obj != NULL);
+		t = (time_t)json_object_get_int64(obj);
+		if (t > cgs->cgs_last)
+			cgs->cgs_last = t;
+
+		obj = json_object_object_get(entry, "seq");
+		if (obj != NULL) {
+			seq = (uint)json_object_get_int64(obj);
+			if (seq > cgs->cgs_last_seq)
+				cgs->cgs_last_seq = seq;
+		}
+	}
+}
+
+errf_t *
+ca_generate_crl(struct ca *ca, struct ca_session *sess, X509_CRL *crl)
+{
+	errf_t *err;
+	int rc;
+	ASN1_TIME *last = NULL, *until = NULL;
+	struct timespec ts;
+	struct crl_gen_state cgs;
+	ASN1_INTEGER *seq_asn1 = NULL;
+	BIGNUM *seq_bn = NULL;
+	uint seq;
+	struct sshbuf *buf = NULL;
+	char *dpath = NULL, *opath = NULL;
+	FILE *crlf = NULL;
+	ISSUING_DIST_POINT *idp = NULL;
+	struct ca_uri *uri;
+
+	VERIFY(X509_CRL_set_version(crl, 1) == 1);
+	rc = X509_CRL_set_issuer_name(crl, ca->ca_dn);
+	if (rc != 1) {
+		make_sslerrf(err, "X509_CRL_set_issuer_name", "setting issuer "
+		    "name for CRL");
+		goto out;
+	}
+
+	if (ca->ca_crls_want_idp) {
+		idp = ISSUING_DIST_POINT_new();
+		VERIFY(idp != NULL);
+
+		idp->distpoint = DIST_POINT_NAME_new();
+		idp->distpoint->type = 0;
+		idp->distpoint->name.fullname = GENERAL_NAMES_new();
+		for (uri = ca->ca_crls; uri != NULL; uri = uri->cu_next) {
+			GENERAL_NAME *nm = GENERAL_NAME_new();
+			ASN1_IA5STRING *nmstr = ASN1_IA5STRING_new();
+			VERIFY(nm != NULL);
+			VERIFY(nmstr != NULL);
+			ASN1_STRING_set(nmstr, uri->cu_uri, -1);
+			GENERAL_NAME_set0_value(nm, GEN_URI, nmstr);
+			sk_GENERAL_NAME_push(idp->distpoint->name.fullname, nm);
+		}
+
+		rc = X509_CRL_add1_ext_i2d(crl, NID_issuing_distribution_point,
+		    idp, 1, 0);
+		if (rc != 1) {
+			make_sslerrf(err, "X509_CRL_add1_ext_i2d",
+			    "adding CRL dist points");
+			goto out;
+		}
+	}
+
+	bzero(&cgs, sizeof (cgs));
+	cgs.cgs_crl = crl;
+
+	err = ca_log_verify(ca, NULL, ca_generate_crl_log_iter, &cgs);
+	if (err != ERRF_OK)
+		return (err);
+
+	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
+	if (cgs.cgs_last == 0)
+		cgs.cgs_last = ts.tv_sec;
+	if (cgs.cgs_last > ts.tv_sec)
+		cgs.cgs_last = ts.tv_sec;
+	last = ASN1_TIME_set(NULL, cgs.cgs_last);
+	until = ASN1_TIME_set(NULL, ts.tv_sec + ca->ca_crl_lifetime);
+	seq = cgs.cgs_last_seq + 1;
+
+	seq_bn = BN_new();
+	VERIFY(seq_bn != NULL);
+	VERIFY(BN_set_word(seq_bn, seq) == 1);
+	seq_asn1 = BN_to_ASN1_INTEGER(seq_bn, NULL);
+	VERIFY(seq_asn1 != NULL);
+
+	VERIFY(X509_CRL_set1_lastUpdate(crl, last) == 1);
+	VERIFY(X509_CRL_set1_nextUpdate(crl, until) == 1);
+
+	rc = X509_CRL_add1_ext_i2d(crl, NID_crl_number, seq_asn1, 0, 0);
+	if (rc != 1) {
+		make_sslerrf(err, "X509_CRL_add1_ext_i2d",
+		    "adding CRL sequence number");
+		goto out;
+	}
+
+	VERIFY(X509_CRL_sort(crl) == 1);
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+
+	VERIFY0(sshbuf_putf(buf, "%s/crl", ca->ca_base_path));
+	dpath = sshbuf_dup_string(buf);
+	rc = mkdir(dpath, 0700);
+	if (rc != 0 && errno != EEXIST) {
+		err = errfno("mkdir", rc, "%s", dpath);
+		goto out;
+	}
+
+	sshbuf_reset(buf);
+	VERIFY0(sshbuf_putf(buf, "%s/crl/%s-%06d.crl", ca->ca_base_path,
+	    ca->ca_slug, seq));
+	opath = sshbuf_dup_string(buf);
+
+	crlf = fopen(opath, "w");
+	if (crlf == NULL) {
+		err = errfno("fopen", errno, "%s", opath);
+		goto out;
+	}
+
+	err = ca_sign_crl(ca, sess, crl);
+	if (err != ERRF_OK)
+		goto out;
+
+	PEM_write_X509_CRL(crlf, crl);
+	fprintf(stderr, "Wrote revocation list to %s\n", opath);
+
+	err = ca_log_crl_gen(ca, sess, crl, seq);
+
+out:
+	if (crlf != NULL)
+		fclose(crlf);
+	ASN1_TIME_free(last);
+	ASN1_TIME_free(until);
+	ASN1_INTEGER_free(seq_asn1);
+	BN_free(seq_bn);
+	sshbuf_free(buf);
+	free(dpath);
+	free(opath);
+	ISSUING_DIST_POINT_free(idp);
+	return (err);
+}
+
+/*
+ * Pre-signed OCSP responses.
+ *
+ * We keep one complete DER OCSPResponse per serial number under
+ * <base>/ocsp/<serialhex>.der. These are produced in bulk by
+ * ca_ocsp_refresh() (driven by the revocation state in the CA log) and
+ * served as-is by ca_ocsp_respond(), so the responder itself never needs to
+ * talk to the card. This is the "pre-produced response" profile of RFC5019:
+ * request nonces are not echoed back.
+ */
+
+struct ocsp_serial {
+	char		*os_serial;	/* hex, as it appears in the log */
+	boolean_t	 os_revoked;
+	time_t		 os_revtime;
+};
+
+struct ocsp_gen_state {
+	struct ocsp_serial	*ogs_serials;
+	size_t			 ogs_count;
+	size_t			 ogs_alloc;
+	errf_t			*ogs_err;
+};
+
+static void ocsp_gen_state_add(struct ocsp_gen_state *, const char *,
+    boolean_t, time_t);
+static void ocsp_log_iter_head(json_object *, struct ocsp_gen_state *);
+
+static void
+ca_ocsp_log_iter(json_object *entry, void *cookie)
+{
+	struct ocsp_gen_state *ogs = cookie;
+	json_object *obj, *obj2;
+	const char *v;
+	boolean_t revoke;
+
+	obj = json_object_object_get(entry, "action");
+	if (obj == NULL)
+		return;
+	v = json_object_get_string(obj);
+	if (strcmp(v, "segment_head") == 0) {
+		ocsp_log_iter_head(entry, ogs);
+		return;
+	} else if (strcmp(v, "issue_cert") == 0) {
+		revoke = B_FALSE;
+	} else if (strcmp(v, "revoke_cert") == 0) {
+		revoke = B_TRUE;
+	} else {
+		return;
+	}
+
+	obj = json_object_object_get(entry, "serial");
+	if (obj == NULL)
+		return;
+	obj2 = json_object_object_get(entry, "time_secs");
+	if (revoke && obj2 == NULL) {
+		if (ogs->ogs_err == ERRF_OK) {
+			ogs->ogs_err = errf("CALogError", NULL, "Log entry "
+			    "revoking serial %s has no 'time_secs'",
+			    json_object_get_string(obj));
+		}
+		return;
+	}
+
+	ocsp_gen_state_add(ogs, json_object_get_string(obj), revoke,
+	    revoke ? (time_t)json_object_get_int64(obj2) : 0);
+}
+
+static void
+ocsp_gen_state_add(struct ocsp_gen_state *ogs, const char *serial,
+    boolean_t revoke, time_t revtime)
+{
+	struct ocsp_serial *os;
+
+	if (ogs->ogs_count + 1 > ogs->ogs_alloc) {
+		size_t nalloc = ogs->ogs_alloc * 2;
+		if (nalloc == 0)
+			nalloc = 64;
+		os = recallocarray(ogs->ogs_serials, ogs->ogs_alloc, nalloc,
+		    sizeof (struct ocsp_serial));
+		VERIFY(os != NULL);
+		ogs->ogs_serials = os;
+		ogs->ogs_alloc = nalloc;
+	}
+	os = &ogs->ogs_serials[ogs->ogs_count++];
+
+	os->os_serial = strdup(serial);
+	VERIFY(os->os_serial != NULL);
+	os->os_revoked = revoke;
+	os->os_revtime = revtime;
+}
+
+/* Segment heads summarise the serials issued/revoked in sealed segments. */
+static void
+ocsp_log_iter_head(json_object *entry, struct ocsp_gen_state *ogs)
+{
+	json_object *obj;
+	json_object_iter iter;
+	size_t i;
+
+	obj = json_object_object_get(entry, "issued");
+	for (i = 0; obj != NULL && i < json_object_array_length(obj); ++i) {
+		ocsp_gen_state_add(ogs, json_object_get_string(
+		    json_object_array_get_idx(obj, i)), B_FALSE, 0);
+	}
+	obj = json_object_object_get(entry, "revoked");
+	if (obj != NULL) {
+		bzero(&iter, sizeof (iter));
+		json_object_object_foreachC(obj, iter) {
+			ocsp_gen_state_add(ogs, iter.key, B_TRUE,
+			    (time_t)json_object_get_int64(iter.val));
+		}
+	}
+}
+
+static int
+ocsp_serial_cmp(const void *a, const void *b)
+{
+	const struct ocsp_serial *osa = a, *osb = b;
+	int rc;
+
+	rc = strcasecmp(osa->os_serial, osb->os_serial);
+	if (rc != 0)
+		return (rc);
+	/* Sort revocations after issuance for the same serial. */
+	return ((int)osa->os_revoked - (int)osb->os_revoked);
+}
+
+/*
+ * Sorts the serials we collected from the log and collapses duplicates, so
+ * that we're left with one entry per serial reflecting its final status.
+ */
+static void
+ocsp_gen_state_collapse(struct ocsp_gen_state *ogs)
+{
+	size_t i, j;
+	struct ocsp_serial *os, *last = NULL;
+
+	qsort(ogs->ogs_serials, ogs->ogs_count, sizeof (struct ocsp_serial),
+	    ocsp_serial_cmp);
+
+	for (i = 0, j = 0; i < ogs->ogs_count; ++i) {
+		os = &ogs->ogs_serials[i];
+		if (last != NULL &&
+		    strcasecmp(last->os_serial, os->os_serial) == 0) {
+			if (os->os_revoked && (!last->os_revoked ||
+			    os->os_revtime < last->os_revtime)) {
+				last->os_revoked = B_TRUE;
+				last->os_revtime = os->os_revtime;
+			}
+			free(os->os_serial);
+			continue;
+		}
+		ogs->ogs_serials[j] = *os;
+		last = &ogs->ogs_serials[j++];
+	}
+	ogs->ogs_count = j;
+}
+
+static void
+ocsp_gen_state_free(struct ocsp_gen_state *ogs)
+{
+	size_t i;
+	for (i = 0; i < ogs->ogs_count; ++i)
+		free(ogs->ogs_serials[i].os_serial);
+	free(ogs->ogs_serials);
+	errf_free(ogs->ogs_err);
+}
+
+static errf_t *
+read_der_file(const char *fname, uint8_t **out, size_t *outlen)
+{
+	FILE *f = NULL;
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t done;
+	errf_t *err;
+
+	f = fopen(fname, "r");
+	if (f == NULL) {
+		err = errfno("fopen", errno, "opening '%s'", fname);
+		goto out;
+	}
+
+	if (fstat(fileno(f), &st) != 0) {
+		err = errfno("fstat", errno, "stat'ing '%s'", fname);
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		err = errf("InvalidFileType", NULL, "file '%s' is not "
+		    "a regular file", fname);
+		goto out;
+	}
+	if (st.st_size < 1 || st.st_size > 64*1024) {
+		err = errf("InvalidFileContent", NULL, "file '%s' has "
+		    "invalid size (%zu bytes)", fname, (size_t)st.st_size);
+		goto out;
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	done = fread(buf, 1, st.st_size, f);
+	if (done < st.st_size) {
+		err = errf("ShortRead", NULL, "expected to read %zu bytes, "
+		    "but only read %zu", (size_t)st.st_size, done);
+		goto out;
+	}
+
+	*out = buf;
+	buf = NULL;
+	*outlen = done;
+	err = ERRF_OK;
+
+out:
+	if (f != NULL)
+		fclose(f);
+	free(buf);
+	return (err);
+}
+
+/*
+ * Checks whether an existing cached response for this serial still reflects
+ * its status in the log, and has at least half of its lifetime remaining.
+ */
+static boolean_t
+ca_ocsp_resp_fresh(struct ca *ca, const char *path,
+    const struct ocsp_serial *os, time_t now)
+{
+	uint8_t *der = NULL;
+	const uint8_t *p;
+	size_t len;
+	errf_t *err;
+	OCSP_RESPONSE *resp = NULL;
+	OCSP_BASICRESP *bs = NULL;
+	OCSP_SINGLERESP *sr;
+	ASN1_GENERALIZEDTIME *nextupd = NULL;
+	ASN1_TIME *limit = NULL;
+	int status, reason;
+	boolean_t fresh = B_FALSE;
+
+	err = read_der_file(path, &der, &len);
+	if (err != ERRF_OK) {
+		errf_free(err);
+		return (B_FALSE);
+	}
+
+	p = der;
+	resp = d2i_OCSP_RESPONSE(NULL, &p, len);
+	if (resp == NULL)
+		goto out;
+	bs = OCSP_response_get1_basic(resp);
+	if (bs == NULL)
+		goto out;
+	sr = OCSP_resp_get0(bs, 0);
+	if (sr == NULL)
+		goto out;
+
+	status = OCSP_single_get0_status(sr, &reason, NULL, NULL, &nextupd);
+	if (status != (os->os_revoked ? V_OCSP_CERTSTATUS_REVOKED :
+	    V_OCSP_CERTSTATUS_GOOD)) {
+		goto out;
+	}
+	if (nextupd == NULL)
+		goto out;
+
+	limit = ASN1_TIME_set(NULL, now + ca->ca_ocsp_lifetime / 2);
+	VERIFY(limit != NULL);
+	if (ASN1_TIME_compare(nextupd, limit) <= 0)
+		goto out;
+
+	fresh = B_TRUE;
+
+out:
+	ASN1_TIME_free(limit);
+	OCSP_BASICRESP_free(bs);
+	OCSP_RESPONSE_free(resp);
+	free(der);
+	return (fresh);
+}
+
+static errf_t *
+ca_ocsp_make_resp(struct ca *ca, const struct ocsp_serial *os, time_t now,
+    PIVY_OCSP_BASICRESP **outp)
+{
+	errf_t *err;
+	int rc;
+	BIGNUM *serial_bn = NULL;
+	ASN1_INTEGER *serial = NULL;
+	OCSP_CERTID *cid = NULL;
+	OCSP_BASICRESP *tmp = NULL;
+	OCSP_SINGLERESP *sr;
+	ASN1_TIME *thisupd = NULL, *nextupd = NULL, *revtime = NULL;
+	PIVY_OCSP_BASICRESP *resp = NULL;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = sizeof (md);
+
+	rc = BN_hex2bn(&serial_bn, os->os_serial);
+	if (rc == 0 || rc < strlen(os->os_serial)) {
+		err = errf("InvalidSerial", NULL, "Invalid serial in CA log: "
+		    "'%s'", os->os_serial);
+		goto out;
+	}
+	serial = BN_to_ASN1_INTEGER(serial_bn, NULL);
+	VERIFY(serial != NULL);
+
+	cid = OCSP_cert_id_new(EVP_sha1(), X509_get_subject_name(ca->ca_cert),
+	    X509_get0_pubkey_bitstr(ca->ca_cert), serial);
+	if (cid == NULL) {
+		make_sslerrf(err, "OCSP_cert_id_new", "building OCSP cert id");
+		goto out;
+	}
+
+	thisupd = ASN1_TIME_set(NULL, now);
+	nextupd = ASN1_TIME_set(NULL, now + ca->ca_ocsp_lifetime);
+	VERIFY(thisupd != NULL);
+	VERIFY(nextupd != NULL);
+	if (os->os_revoked) {
+		revtime = ASN1_TIME_set(NULL, os->os_revtime);
+		VERIFY(revtime != NULL);
+	}
+
+	/*
+	 * Let OpenSSL build the SingleResponse for us on a scratch
+	 * OCSP_BASICRESP, then take a copy of it into our own structure.
+	 */
+	tmp = OCSP_BASICRESP_new();
+	VERIFY(tmp != NULL);
+	sr = OCSP_basic_add1_status(tmp, cid, os->os_revoked ?
+	    V_OCSP_CERTSTATUS_REVOKED : V_OCSP_CERTSTATUS_GOOD,
+	    OCSP_REVOKED_STATUS_NOSTATUS, revtime, thisupd, nextupd);
+	if (sr == NULL) {
+		make_sslerrf(err, "OCSP_basic_add1_status", "building OCSP "
+		    "response for serial %s", os->os_serial);
+		goto out;
+	}
+
+	resp = PIVY_OCSP_BASICRESP_new();
+	VERIFY(resp != NULL);
+
+	rc = X509_pubkey_digest(ca->ca_cert, EVP_sha1(), md, &mdlen);
+	if (rc != 1) {
+		make_sslerrf(err, "X509_pubkey_digest", "hashing CA key");
+		goto out;
+	}
+	VERIFY(ASN1_OCTET_STRING_set(resp->tbs->keyhash, md, mdlen) == 1);
+	VERIFY(ASN1_GENERALIZEDTIME_set(resp->tbs->produced_at, now) != NULL);
+
+	sr = ASN1_item_dup(ASN1_ITEM_rptr(OCSP_SINGLERESP), sr);
+	VERIFY(sr != NULL);
+	VERIFY(sk_OCSP_SINGLERESP_push(resp->tbs->responses, sr) != 0);
+
+	*outp = resp;
+	resp = NULL;
+	err = ERRF_OK;
+
+out:
+	PIVY_OCSP_BASICRESP_free(resp);
+	OCSP_BASICRESP_free(tmp);
+	ASN1_TIME_free(thisupd);
+	ASN1_TIME_free(nextupd);
+	ASN1_TIME_free(revtime);
+	OCSP_CERTID_free(cid);
+	ASN1_INTEGER_free(serial);
+	BN_free(serial_bn);
+	return (err);
+}
+
+/*
+ * Signs a whole batch of OCSP responses. For direct sessions we only open
+ * the transaction, check the CAK and verify the PIN once for the batch.
+ */
+static errf_t *
+ca_sign_ocsp_resps(struct ca *ca, struct ca_session *sess,
+    PIVY_OCSP_BASICRESP **resps, size_t n)
+{
+	struct ca_session_agent *a = NULL;
+	struct ca_session_direct *d = NULL;
+	errf_t *err = ERRF_OK;
+	boolean_t in_txn = B_FALSE;
+	size_t i;
+
+	if (n == 0)
+		return (ERRF_OK);
+
+	if (sess->cs_type == CA_SESSION_AGENT) {
+		a = &sess->cs_agent;
+		for (i = 0; i < n; ++i) {
+			err = agent_sign_ocsp_resp(a->csa_fd, ca->ca_pubkey,
+			    resps[i]);
+			if (err != ERRF_OK) {
+				err = errf("CASignError", err, "Failed to sign "
+				    "OCSP response using CA key in agent '%s'",
+				    ca->ca_slug);
+				goto out;
+			}
+		}
+		goto out;
+	}
+	VERIFY(sess->cs_type == CA_SESSION_DIRECT);
+	d = &sess->cs_direct;
+
+	err = ca_direct_sign_begin(ca, d, "OCSP responses");
+	if (err != ERRF_OK)
+		goto out;
+	in_txn = B_TRUE;
+
+	for (i = 0; i < n; ++i) {
+		err = piv_sign_ocsp_resp(d->csd_token, d->csd_slot,
+		    ca->ca_pubkey, resps[i]);
+		if (err != ERRF_OK) {
+			err = errf("CASignError", err, "Failed to sign OCSP "
+			    "response with CA '%s'", ca->ca_slug);
+			goto out;
+		}
+	}
+
+out:
+	if (in_txn)
+		piv_txn_end(d->csd_token);
+	return (err);
+}
+
+static errf_t *
+ca_ocsp_write_resp(const char *dpath, const char *serial,
+    PIVY_OCSP_BASICRESP *bresp)
+{
+	errf_t *err;
+	OCSP_RESPONSE *resp = NULL;
+	uint8_t *der = NULL;
+	int len;
+	char tpath[PATH_MAX], opath[PATH_MAX];
+	FILE *f = NULL;
+
+	resp = PIVY_OCSP_BASICRESP_to_response(bresp);
+	if (resp == NULL) {
+		make_sslerrf(err, "PIVY_OCSP_BASICRESP_to_response",
+		    "encoding OCSP response for serial %s", serial);
+		goto out;
+	}
+	len = i2d_OCSP_RESPONSE(resp, &der);
+	if (len <= 0) {
+		make_sslerrf(err, "i2d_OCSP_RESPONSE", "encoding OCSP response "
+		    "for serial %s", serial);
+		goto out;
+	}
+
+	snprintf(opath, sizeof (opath), "%s/%s.der", dpath, serial);
+	snprintf(tpath, sizeof (tpath), "%s/.%s.der.tmp", dpath, serial);
+
+	/*
+	 * Write to a temporary file and rename() it into place so that a
+	 * running responder never picks up a partially written response.
+	 */
+	f = fopen(tpath, "w");
+	if (f == NULL) {
+		err = errfno("fopen", errno, "%s", tpath);
+		goto out;
+	}
+	if (fwrite(der, 1, len, f) < len) {
+		err = errfno("fwrite", errno, "%s", tpath);
+		goto out;
+	}
+	if (fclose(f) != 0) {
+		f = NULL;
+		err = errfno("fclose", errno, "%s", tpath);
+		goto out;
+	}
+	f = NULL;
+	if (rename(tpath, opath) != 0) {
+		err = errfno("rename", errno, "%s", opath);
+		goto out;
+	}
+
+	err = ERRF_OK;
+
+out:
+	if (f != NULL) {
+		fclose(f);
+		(void) unlink(tpath);
+	}
+	OPENSSL_free(der);
+	OCSP_RESPONSE_free(resp);
+	return (err);
+}
+
+errf_t *
+ca_ocsp_refresh(struct ca *ca, struct ca_session *sess, boolean_t force,
+    uint *nsigned, uint *ntotal)
+{
+	errf_t *err;
+	struct ocsp_gen_state ogs;
+	PIVY_OCSP_BASICRESP **resps = NULL;
+	struct ocsp_serial **due = NULL;
+	size_t ndue = 0, i;
+	struct timespec ts;
+	char *dpath = NULL, *opath = NULL;
+	struct sshbuf *buf = NULL;
+	int rc;
+
+	bzero(&ogs, sizeof (ogs));
+
+	err = ca_log_verify(ca, NULL, ca_ocsp_log_iter, &ogs);
+	if (err != ERRF_OK)
+		goto out;
+	if (ogs.ogs_err != ERRF_OK) {
+		err = ogs.ogs_err;
+		ogs.ogs_err = ERRF_OK;
+		goto out;
+	}
+	ocsp_gen_state_collapse(&ogs);
+
+	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+
+	VERIFY0(sshbuf_putf(buf, "%s/ocsp", ca->ca_base_path));
+	dpath = sshbuf_dup_string(buf);
+	rc = mkdir(dpath, 0755);
+	if (rc != 0 && errno != EEXIST) {
+		err = errfno("mkdir", errno, "%s", dpath);
+		goto out;
+	}
+
+	due = calloc(ogs.ogs_count + 1, sizeof (struct ocsp_serial *));
+	resps = calloc(ogs.ogs_count + 1, sizeof (PIVY_OCSP_BASICRESP *));
+	if (due == NULL || resps == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ogs.ogs_count; ++i) {
+		struct ocsp_serial *os = &ogs.ogs_serials[i];
+
+		sshbuf_reset(buf);
+		VERIFY0(sshbuf_putf(buf, "%s/%s.der", dpath, os->os_serial));
+		free(opath);
+		opath = sshbuf_dup_string(buf);
+
+		if (!force && ca_ocsp_resp_fresh(ca, opath, os, ts.tv_sec))
+			continue;
+
+		err = ca_ocsp_make_resp(ca, os, ts.tv_sec, &resps[ndue]);
+		if (err != ERRF_OK)
+			goto out;
+		due[ndue++] = os;
+	}
+
+	err = ca_sign_ocsp_resps(ca, sess, resps, ndue);
+	if (err != ERRF_OK)
+		goto out;
+
+	for (i = 0; i < ndue; ++i) {
+		err = ca_ocsp_write_resp(dpath, due[i]->os_serial, resps[i]);
+		if (err != ERRF_OK)
+			goto out;
+	}
+
+	if (nsigned != NULL)
+		*nsigned = ndue;
+	if (ntotal != NULL)
+		*ntotal = ogs.ogs_count;
+	err = ERRF_OK;
+
+out:
+	if (resps != NULL) {
+		for (i = 0; i < ndue; ++i)
+			PIVY_OCSP_BASICRESP_free(resps[i]);
+	}
+	free(resps);
+	free(due);
+	ocsp_gen_state_free(&ogs);
+	sshbuf_free(buf);
+	free(dpath);
+	free(opath);
+	return (err);
+}
 
-		v = json_object_get_string(obj);
-		rc = BN_hex2bn(&serial, v);
-		if (rc == 0 || rc < strlen(v))
-			goto revoke_out;
-		asn1_serial = BN_to_ASN1_INTEGER(serial, NULL);
-		if (asn1_serial == NULL)
-			goto revoke_out;
+struct ca_ocsp_entry {
+	struct ca_ocsp_entry	*coe_next;
+	char			*coe_serial;
+	uint8_t			*coe_der;
+	size_t			 coe_len;
+};
 
-		obj = json_object_object_get(entry, "time_secs");
-		VERIFY(obj != NULL);
-		t = (time_t)json_object_get_int64(obj);
+#define	CA_OCSP_CACHE_BUCKETS	1024
 
-		asn1_time = ASN1_TIME_set(NULL, t);
+struct ca_ocsp_cache {
+	char			*coc_path;
+	time_t			 coc_mtime;
+	time_t			 coc_loaded;
 
-		rev = X509_REVOKED_new();
-		VERIFY(rev != NULL);
+	OCSP_CERTID		*coc_issuer;
+	uint			 coc_count;
+	struct ca_ocsp_entry	*coc_buckets[CA_OCSP_CACHE_BUCKETS];
 
-		rc = X509_REVOKED_set_serialNumber(rev, asn1_serial);
-		VERIFY(rc == 1);
+	uint8_t			*coc_malformed;
+	size_t			 coc_malformed_len;
+	uint8_t			*coc_unauth;
+	size_t			 coc_unauth_len;
+};
 
-		rc = X509_REVOKED_set_revocationDate(rev, asn1_time);
-		VERIFY(rc == 1);
+static uint
+ca_ocsp_cache_hash(const char *serial)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	for (; *serial != '\0'; ++serial) {
+		h ^= (uint8_t)toupper(*serial);
+		h *= 16777619u;
+	}
+	return (h % CA_OCSP_CACHE_BUCKETS);
+}
 
-		rc = X509_CRL_add0_revoked(cgs->cgs_crl, rev);
-		VERIFY(rc == 1);
-		rev = NULL;
+static errf_t *
+ca_ocsp_status_resp(int status, uint8_t **out, size_t *outlen)
+{
+	OCSP_RESPONSE *resp;
+	errf_t *err;
+	int len;
 
-revoke_out:
-		ASN1_INTEGER_free(asn1_serial);
-		BN_free(serial);
-		ASN1_TIME_free(asn1_time);
+	resp = OCSP_response_create(status, NULL);
+	if (resp == NULL) {
+		make_sslerrf(err, "OCSP_response_create", "building OCSP "
+		    "error response");
+		return (err);
+	}
+	*out = NULL;
+	len = i2d_OCSP_RESPONSE(resp, out);
+	OCSP_RESPONSE_free(resp);
+	if (len <= 0) {
+		make_sslerrf(err, "i2d_OCSP_RESPONSE", "encoding OCSP error "
+		    "response");
+		return (err);
+	}
+	*outlen = len;
+	return (ERRF_OK);
+}
 
-	} else if (strcmp(v, "gen_crl") == 0) {
-		obj = json_object_object_get(entry, "until");
-		VERIFY(obj != NULL);
-		t = (time_t)json_object_get_int64(obj);
-		if (t > cgs->cgs_last)
-			cgs->cgs_last = t;
+void
+ca_ocsp_cache_free(struct ca_ocsp_cache *coc)
+{
+	struct ca_ocsp_entry *coe, *ncoe;
+	uint i;
 
-		obj = json_object_object_get(entry, "seq");
-		if (obj != NULL) {
-			seq = (uint)json_object_get_int64(obj);
-			if (seq > cgs->cgs_last_seq)
-				cgs->cgs_last_seq = seq;
+	if (coc == NULL)
+		return;
+	for (i = 0; i < CA_OCSP_CACHE_BUCKETS; ++i) {
+		for (coe = coc->coc_buckets[i]; coe != NULL; coe = ncoe) {
+			ncoe = coe->coe_next;
+			free(coe->coe_serial);
+			free(coe->coe_der);
+			free(coe);
 		}
 	}
+	OPENSSL_free(coc->coc_malformed);
+	OPENSSL_free(coc->coc_unauth);
+	OCSP_CERTID_free(coc->coc_issuer);
+	free(coc->coc_path);
+	free(coc);
+}
+
+boolean_t
+ca_ocsp_cache_stale(const struct ca_ocsp_cache *coc)
+{
+	struct stat st;
+
+	if (stat(coc->coc_path, &st) != 0)
+		return (coc->coc_mtime != 0);
+	/*
+	 * Responses are rename()d into place by ca_ocsp_refresh(), which
+	 * bumps the directory mtime. Only whole seconds are portable, so
+	 * anything modified in the same second as we loaded also counts.
+	 */
+	return (st.st_mtime != coc->coc_mtime ||
+	    st.st_mtime >= coc->coc_loaded);
+}
+
+uint
+ca_ocsp_cache_count(const struct ca_ocsp_cache *coc)
+{
+	return (coc->coc_count);
 }
 
 errf_t *
-ca_generate_crl(struct ca *ca, struct ca_session *sess, X509_CRL *crl)
+ca_ocsp_cache_load(struct ca *ca, struct ca_ocsp_cache **outp)
 {
+	struct ca_ocsp_cache *coc;
+	struct ca_ocsp_entry *coe;
 	errf_t *err;
-	int rc;
-	ASN1_TIME *last = NULL, *until = NULL;
-	struct timespec ts;
-	struct crl_gen_state cgs;
-	ASN1_INTEGER *seq_asn1 = NULL;
-	BIGNUM *seq_bn = NULL;
-	uint seq;
-	struct sshbuf *buf = NULL;
-	char *dpath = NULL, *opath = NULL;
-	FILE *crlf = NULL;
-	ISSUING_DIST_POINT *idp = NULL;
-	struct ca_uri *uri;
+	char dpath[PATH_MAX], fpath[PATH_MAX];
+	struct stat st;
+	DIR *dir = NULL;
+	struct dirent *ent;
+	ASN1_INTEGER *zero = NULL;
+	size_t nlen;
+	uint h;
 
-	VERIFY(X509_CRL_set_version(crl, 1) == 1);
-	rc = X509_CRL_set_issuer_name(crl, ca->ca_dn);
-	if (rc != 1) {
-		make_sslerrf(err, "X509_CRL_set_issuer_name", "setting issuer "
-		    "name for CRL");
+	coc = calloc(1, sizeof (struct ca_ocsp_cache));
+	if (coc == NULL)
+		return (ERRF_NOMEM);
+
+	zero = ASN1_INTEGER_new();
+	VERIFY(zero != NULL);
+	coc->coc_issuer = OCSP_cert_id_new(EVP_sha1(),
+	    X509_get_subject_name(ca->ca_cert),
+	    X509_get0_pubkey_bitstr(ca->ca_cert), zero);
+	if (coc->coc_issuer == NULL) {
+		make_sslerrf(err, "OCSP_cert_id_new", "building OCSP cert id");
 		goto out;
 	}
 
-	if (ca->ca_crls_want_idp) {
-		idp = ISSUING_DIST_POINT_new();
-		VERIFY(idp != NULL);
+	err = ca_ocsp_status_resp(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST,
+	    &coc->coc_malformed, &coc->coc_malformed_len);
+	if (err != ERRF_OK)
+		goto out;
+	err = ca_ocsp_status_resp(OCSP_RESPONSE_STATUS_UNAUTHORIZED,
+	    &coc->coc_unauth, &coc->coc_unauth_len);
+	if (err != ERRF_OK)
+		goto out;
 
-		idp->distpoint = DIST_POINT_NAME_new();
-		idp->distpoint->type = 0;
-		idp->distpoint->name.fullname = GENERAL_NAMES_new();
-		for (uri = ca->ca_crls; uri != NULL; uri = uri->cu_next) {
-			GENERAL_NAME *nm = GENERAL_NAME_new();
-			ASN1_IA5STRING *nmstr = ASN1_IA5STRING_new();
-			VERIFY(nm != NULL);
-			VERIFY(nmstr != NULL);
-			ASN1_STRING_set(nmstr, uri->cu_uri, -1);
-			GENERAL_NAME_set0_value(nm, GEN_URI, nmstr);
-			sk_GENERAL_NAME_push(idp->distpoint->name.fullname, nm);
+	snprintf(dpath, sizeof (dpath), "%s/ocsp", ca->ca_base_path);
+	coc->coc_path = strdup(dpath);
+	if (coc->coc_path == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	coc->coc_loaded = time(NULL);
+	if (stat(dpath, &st) == 0)
+		coc->coc_mtime = st.st_mtime;
+
+	dir = opendir(dpath);
+	if (dir == NULL && errno == ENOENT) {
+		/* No responses generated yet: empty cache. */
+		goto done;
+	}
+	if (dir == NULL) {
+		err = errfno("opendir", errno, "%s", dpath);
+		goto out;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		nlen = strlen(ent->d_name);
+		if (ent->d_name[0] == '.' || nlen < 5 ||
+		    strcmp(&ent->d_name[nlen - 4], ".der") != 0) {
+			continue;
 		}
 
-		rc = X509_CRL_add1_ext_i2d(crl, NID_issuing_distribution_point,
-		    idp, 1, 0);
-		if (rc != 1) {
-			make_sslerrf(err, "X509_CRL_add1_ext_i2d",
-			    "adding CRL dist points");
+		coe = calloc(1, sizeof (struct ca_ocsp_entry));
+		if (coe == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		coe->coe_serial = strndup(ent->d_name, nlen - 4);
+		if (coe->coe_serial == NULL) {
+			free(coe);
+			err = ERRF_NOMEM;
 			goto out;
 		}
-	}
 
-	bzero(&cgs, sizeof (cgs));
-	cgs.cgs_crl = crl;
+		snprintf(fpath, sizeof (fpath), "%s/%s", dpath, ent->d_name);
+		err = read_der_file(fpath, &coe->coe_der, &coe->coe_len);
+		if (err != ERRF_OK) {
+			free(coe->coe_serial);
+			free(coe);
+			goto out;
+		}
 
-	err = ca_log_verify(ca, NULL, ca_generate_crl_log_iter, &cgs);
-	if (err != ERRF_OK)
-		return (err);
+		h = ca_ocsp_cache_hash(coe->coe_serial);
+		coe->coe_next = coc->coc_buckets[h];
+		coc->coc_buckets[h] = coe;
+		++coc->coc_count;
+	}
 
-	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
-	if (cgs.cgs_last == 0)
-		cgs.cgs_last = ts.tv_sec;
-	if (cgs.cgs_last > ts.tv_sec)
-		cgs.cgs_last = ts.tv_sec;
-	last = ASN1_TIME_set(NULL, cgs.cgs_last);
-	until = ASN1_TIME_set(NULL, ts.tv_sec + ca->ca_crl_lifetime);
-	seq = cgs.cgs_last_seq + 1;
+done:
+	*outp = coc;
+	coc = NULL;
+	err = ERRF_OK;
 
-	seq_bn = BN_new();
-	VERIFY(seq_bn != NULL);
-	VERIFY(BN_set_word(seq_bn, seq) == 1);
-	seq_asn1 = BN_to_ASN1_INTEGER(seq_bn, NULL);
-	VERIFY(seq_asn1 != NULL);
+out:
+	if (dir != NULL)
+		closedir(dir);
+	ASN1_INTEGER_free(zero);
+	ca_ocsp_cache_free(coc);
+	return (err);
+}
 
-	VERIFY(X509_CRL_set1_lastUpdate(crl, last) == 1);
-	VERIFY(X509_CRL_set1_nextUpdate(crl, until) == 1);
+errf_t *
+ca_ocsp_respond(struct ca_ocsp_cache *coc, const uint8_t *req, size_t reqlen,
+    const uint8_t **resp, size_t *resplen)
+{
+	const uint8_t *p = req;
+	OCSP_REQUEST *oreq = NULL;
+	OCSP_ONEREQ *one;
+	OCSP_CERTID *cid;
+	ASN1_INTEGER *serial = NULL;
+	BIGNUM *serial_bn = NULL;
+	char *serialhex = NULL;
+	struct ca_ocsp_entry *coe;
+	errf_t *err;
 
-	rc = X509_CRL_add1_ext_i2d(crl, NID_crl_number, seq_asn1, 0, 0);
-	if (rc != 1) {
-		make_sslerrf(err, "X509_CRL_add1_ext_i2d",
-		    "adding CRL sequence number");
+	*resp = coc->coc_malformed;
+	*resplen = coc->coc_malformed_len;
+
+	oreq = d2i_OCSP_REQUEST(NULL, &p, reqlen);
+	if (oreq == NULL) {
+		make_sslerrf(err, "d2i_OCSP_REQUEST", "parsing OCSP request");
 		goto out;
 	}
-
-	VERIFY(X509_CRL_sort(crl) == 1);
-
-	buf = sshbuf_new();
-	VERIFY(buf != NULL);
-
-	VERIFY0(sshbuf_putf(buf, "%s/crl", ca->ca_base_path));
-	dpath = sshbuf_dup_string(buf);
-	rc = mkdir(dpath, 0700);
-	if (rc != 0 && errno != EEXIST) {
-		err = errfno("mkdir", rc, "%s", dpath);
+	if (OCSP_request_onereq_count(oreq) < 1) {
+		err = errf("OCSPMalformedRequest", NULL, "OCSP request "
+		    "contains no certificate IDs");
 		goto out;
 	}
+	/*
+	 * Pre-signed responses only ever cover one certificate, so answer
+	 * for the first one the client asked about (as RFC5019 allows).
+	 */
+	one = OCSP_request_onereq_get0(oreq, 0);
+	cid = OCSP_onereq_get0_id(one);
 
-	sshbuf_reset(buf);
-	VERIFY0(sshbuf_putf(buf, "%s/crl/%s-%06d.crl", ca->ca_base_path,
-	    ca->ca_slug, seq));
-	opath = sshbuf_dup_string(buf);
+	*resp = coc->coc_unauth;
+	*resplen = coc->coc_unauth_len;
 
-	crlf = fopen(opath, "w");
-	if (crlf == NULL) {
-		err = errfno("fopen", errno, "%s", opath);
+	if (OCSP_id_issuer_cmp(coc->coc_issuer, cid) != 0) {
+		err = errf("OCSPUnauthorized", NULL, "OCSP request is for a "
+		    "different issuer (or not using SHA1 cert IDs)");
 		goto out;
 	}
 
-	err = ca_sign_crl(ca, sess, crl);
-	if (err != ERRF_OK)
-		goto out;
+	VERIFY(OCSP_id_get0_info(NULL, NULL, NULL, &serial, cid) == 1);
+	serial_bn = ASN1_INTEGER_to_BN(serial, NULL);
+	VERIFY(serial_bn != NULL);
+	serialhex = BN_bn2hex(serial_bn);
+	VERIFY(serialhex != NULL);
 
-	PEM_write_X509_CRL(crlf, crl);
-	fprintf(stderr, "Wrote revocation list to %s\n", opath);
+	coe = coc->coc_buckets[ca_ocsp_cache_hash(serialhex)];
+	for (; coe != NULL; coe = coe->coe_next) {
+		if (strcasecmp(coe->coe_serial, serialhex) == 0)
+			break;
+	}
+	if (coe == NULL) {
+		err = errf("OCSPUnauthorized", NULL, "No cached OCSP response "
+		    "for serial %s", serialhex);
+		goto out;
+	}
 
-	err = ca_log_crl_gen(ca, sess, crl, seq);
+	*resp = coe->coe_der;
+	*resplen = coe->coe_len;
+	err = ERRF_OK;
 
 out:
-	if (crlf != NULL)
-		fclose(crlf);
-	ASN1_TIME_free(last);
-	ASN1_TIME_free(until);
-	ASN1_INTEGER_free(seq_asn1);
-	BN_free(seq_bn);
-	sshbuf_free(buf);
-	free(dpath);
-	free(opath);
-	ISSUING_DIST_POINT_free(idp);
+	OPENSSL_free(serialhex);
+	BN_free(serial_bn);
+	OCSP_REQUEST_free(oreq);
 	return (err);
 }
 
@@ -4842,6 +6955,7 @@ ca_config_write(struct ca *ca, struct ca_session *sess)
 	json_object *robj = NULL, *obj = NULL;
 	char *dnstr = NULL;
 	char *crltime = NULL;
+	char *ocsptime = NULL;
 	char *slotid = NULL;
 	struct sshbuf *buf = NULL;
 	int rc;
@@ -4904,6 +7018,16 @@ ca_config_write(struct ca *ca, struct ca_session *sess)
 	VERIFY(obj != NULL);
 	json_object_object_add(robj, "crl_lifetime", obj);
 
+	ocsptime = unparse_lifetime(ca->ca_ocsp_lifetime);
+	VERIFY(ocsptime != NULL);
+	obj = json_object_new_string(ocsptime);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "ocsp_lifetime", obj);
+
+	obj = json_object_new_int64(ca->ca_log_seg_entries);
+	VERIFY(obj != NULL);
+	json_object_object_add(robj, "log_segment_entries", obj);
+
 	if (ca->ca_slot != PIV_SLOT_SIGNATURE) {
 		slotid = piv_slotid_to_string(ca->ca_slot);
 		VERIFY(slotid != NULL);
@@ -4987,6 +7111,7 @@ out:
 	free(dnstr);
 	sshbuf_free(buf);
 	free(crltime);
+	free(ocsptime);
 	free(slotid);
 	return (err);
 }
@@ -4999,21 +7124,13 @@ ca_cert_sign(struct ca_session *sess, struct ca_cert_tpl *tpl,
 }
 
 errf_t *
-ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
+ca_cert_prepare_req(struct ca *ca, struct ca_cert_tpl *tpl,
     struct cert_var_scope *certscope, X509_REQ *req, X509 *cert)
 {
-	struct ca *ca = sess->cs_ca;
 	errf_t *err;
-	EVP_PKEY *pkey;
+	EVP_PKEY *pkey = NULL;
 	BIGNUM *serial = NULL;
 	ASN1_INTEGER *serial_asn1 = NULL;
-	char *slug = NULL, *dpath = NULL, *rpath = NULL, *cpath = NULL;
-	struct sshbuf *buf;
-	int rc;
-	FILE *reqf = NULL, *certf = NULL;
-
-	buf = sshbuf_new();
-	VERIFY(buf != NULL);
 
 	if (!(tpl->cct_flags & CCTF_ALLOW_REQS)) {
 		err = errf("InvalidTemplateError", NULL, "CA cert template "
@@ -5022,6 +7139,11 @@ ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
 	}
 
 	pkey = X509_REQ_get_pubkey(req);
+	if (pkey == NULL) {
+		make_sslerrf(err, "X509_REQ_get_pubkey", "getting public "
+		    "key from cert req");
+		goto out;
+	}
 
 	err = scope_populate_req(certscope, req);
 	if (err != ERRF_OK)
@@ -5066,8 +7188,51 @@ ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
 					X509_add_ext(cert, ext, -1);
 			}
 		}
+		sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
 	}
 
+	err = ERRF_OK;
+
+out:
+	EVP_PKEY_free(pkey);
+	BN_free(serial);
+	ASN1_INTEGER_free(serial_asn1);
+	return (err);
+}
+
+errf_t *
+ca_cert_sign_prepared(struct ca_session *sess, X509 *cert)
+{
+	return (ca_sign_cert(sess->cs_ca, sess, cert));
+}
+
+errf_t *
+ca_cert_log_vars(struct cert_var_scope *certscope, json_object **varsp)
+{
+	json_object *robj;
+
+	robj = json_object_new_object();
+	if (robj == NULL)
+		return (ERRF_NOMEM);
+	scope_chain_to_json(certscope, robj);
+	*varsp = robj;
+	return (ERRF_OK);
+}
+
+errf_t *
+ca_cert_record_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
+    json_object *vars, X509_REQ *req, X509 *cert)
+{
+	struct ca *ca = sess->cs_ca;
+	errf_t *err;
+	char *slug = NULL, *dpath = NULL, *rpath = NULL, *cpath = NULL;
+	struct sshbuf *buf;
+	int rc;
+	FILE *reqf = NULL, *certf = NULL;
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+
 	slug = calc_cert_slug_X509(cert);
 	VERIFY(slug != NULL);
 
@@ -5105,14 +7270,10 @@ ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
 	PEM_write_X509_REQ(reqf, req);
 	fprintf(stderr, "Wrote request to %s\n", rpath);
 
-	err = ca_sign_cert(ca, sess, cert);
-	if (err != ERRF_OK)
-		goto out;
-
 	PEM_write_X509(certf, cert);
 	fprintf(stderr, "Wrote certificate to %s\n", cpath);
 
-	err = ca_log_new_cert(ca, sess, tpl->cct_name, certscope, cert);
+	err = ca_log_new_cert(ca, sess, tpl->cct_name, vars, cert);
 	if (err != ERRF_OK)
 		goto out;
 
@@ -5123,13 +7284,34 @@ out:
 		fclose(reqf);
 	if (certf != NULL)
 		fclose(certf);
-	BN_free(serial);
 	sshbuf_free(buf);
 	free(dpath);
 	free(rpath);
 	free(cpath);
 	free(slug);
-	ASN1_INTEGER_free(serial_asn1);
+	return (err);
+}
+
+errf_t *
+ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
+    struct cert_var_scope *certscope, X509_REQ *req, X509 *cert)
+{
+	json_object *vars = NULL;
+	errf_t *err;
+
+	err = ca_cert_prepare_req(sess->cs_ca, tpl, certscope, req, cert);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_cert_log_vars(certscope, &vars);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_cert_sign_prepared(sess, cert);
+	if (err == ERRF_OK)
+		err = ca_cert_record_req(sess, tpl, vars, req, cert);
+
+	json_object_put(vars);
 	return (err);
 }
 
@@ -5145,6 +7327,13 @@ ca_revoke_cert_serial(struct ca *ca, struct ca_session *sess, BIGNUM *serial)
 	return (ca_log_revoke_serial(ca, sess, serial));
 }
 
+errf_t *
+ca_revoke_cert_serials(struct ca *ca, struct ca_session *sess,
+    BIGNUM *const *serials, uint nserials, uint *nrevoked)
+{
+	return (ca_log_revoke_serials(ca, sess, serials, nserials, nrevoked));
+}
+
 errf_t *
 scope_populate_gn(struct cert_var_scope *scope, GENERAL_NAME *gn)
 {
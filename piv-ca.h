@@ -30,6 +30,7 @@
 #include "errf.h"
 #include "piv.h"
 #include "ebox.h"
+#include "ocsp_asn1.h"
 
 /*
  * Certificate templates and variable expansion
@@ -38,6 +39,7 @@
 struct cert_var_scope;
 struct cert_var;
 struct cert_tpl;
+struct cert_tpl_plan;
 
 enum requirement_type {
 	REQUIRED_FOR_CERT,
@@ -84,12 +86,28 @@ errf_t			*scope_set(struct cert_var_scope *scope,
 errf_t			*scope_eval(struct cert_var_scope *scope,
     const char *name, char **out);
 void			 scope_free_root(struct cert_var_scope *scope);
+void			 scope_free(struct cert_var_scope *scope);
 
 errf_t			*cert_tpl_populate(const struct cert_tpl *tpl,
     struct cert_var_scope *scope, X509 *cert);
 errf_t			*cert_tpl_populate_req(const struct cert_tpl *tpl,
     struct cert_var_scope *cvs, X509_REQ *req);
 
+/*
+ * Compiles a template against a fixed parent scope, caching everything which
+ * can be evaluated from it. Per-request scopes should be made beneath
+ * cert_tpl_plan_scope(), and freed (with scope_free()) before the plan is.
+ */
+errf_t			*cert_tpl_compile(const struct cert_tpl *tpl,
+    struct cert_var_scope *parent, struct cert_tpl_plan **out);
+struct cert_var_scope	*cert_tpl_plan_scope(struct cert_tpl_plan *plan);
+const struct cert_tpl	*cert_tpl_plan_tpl(const struct cert_tpl_plan *plan);
+errf_t			*cert_tpl_plan_populate(struct cert_tpl_plan *plan,
+    struct cert_var_scope *scope, X509 *cert);
+errf_t			*cert_tpl_plan_populate_req(struct cert_tpl_plan *plan,
+    struct cert_var_scope *scope, X509_REQ *req);
+void			 cert_tpl_plan_free(struct cert_tpl_plan *plan);
+
 struct cert_var		*scope_all_vars(struct cert_var_scope *scope);
 struct cert_var		*scope_undef_vars(struct cert_var_scope *scope);
 
@@ -107,6 +125,11 @@ errf_t	*agent_sign_crl(int fd, struct sshkey *pubkey, X509_CRL *crl);
 errf_t	*piv_sign_crl(struct piv_token *tkn, struct piv_slot *slot,
     struct sshkey *pubkey, X509_CRL *crl);
 
+errf_t	*agent_sign_ocsp_resp(int fd, struct sshkey *pubkey,
+    PIVY_OCSP_BASICRESP *resp);
+errf_t	*piv_sign_ocsp_resp(struct piv_token *tkn, struct piv_slot *slot,
+    struct sshkey *pubkey, PIVY_OCSP_BASICRESP *resp);
+
 errf_t	*scope_populate_req(struct cert_var_scope *scope, X509_REQ *req);
 
 /*
@@ -216,11 +239,45 @@ char		*ca_dn(const struct ca *ca);
 errf_t		*ca_generate_crl(struct ca *ca, struct ca_session *sess,
     X509_CRL *crl);
 
+/*
+ * Re-signs the cached OCSP response for every serial in the CA log which is
+ * missing, has changed status or is past half of its lifetime (or all of
+ * them if "force" is set), using a single card transaction.
+ */
+errf_t		*ca_ocsp_refresh(struct ca *ca, struct ca_session *sess,
+    boolean_t force, uint *nsigned, uint *ntotal);
+
+struct ca_ocsp_cache;
+
+errf_t		*ca_ocsp_cache_load(struct ca *ca, struct ca_ocsp_cache **out);
+uint		 ca_ocsp_cache_count(const struct ca_ocsp_cache *cache);
+void		 ca_ocsp_cache_free(struct ca_ocsp_cache *cache);
+/* Returns B_TRUE if the on-disk cache has changed since it was loaded. */
+boolean_t	 ca_ocsp_cache_stale(const struct ca_ocsp_cache *cache);
+/*
+ * Looks up the cached response for a DER OCSPRequest. On error, *resp is
+ * still set to an appropriate OCSP error response (malformedRequest or
+ * unauthorized) which can be sent to the client.
+ */
+errf_t		*ca_ocsp_respond(struct ca_ocsp_cache *cache,
+    const uint8_t *req, size_t reqlen, const uint8_t **resp, size_t *resplen);
+
 typedef struct json_object json_object;
 typedef void (*log_iter_cb_t)(json_object *entry, void *cookie);
 
+/*
+ * Verifies the open segment of the CA log (whose first entry is a CA-signed
+ * head summarising all sealed segments before it).
+ */
 errf_t 		*ca_log_verify(struct ca *ca, char **final_hash,
     log_iter_cb_t cb, void *cookie);
+/* Verifies all available log segments as one chain. */
+errf_t		*ca_log_verify_all(struct ca *ca, uint *nverified,
+    log_iter_cb_t cb, void *cookie);
+/* Verifies one sealed segment against the head which sealed it. */
+errf_t		*ca_log_verify_segment(struct ca *ca, uint seg,
+    log_iter_cb_t cb, void *cookie);
+uint		 ca_log_segments(const struct ca *ca);
 
 void		 ca_close(struct ca *ca);
 
@@ -236,6 +293,12 @@ errf_t		*ca_revoke_cert(struct ca *ca, struct ca_session *sess,
     X509 *cert);
 errf_t		*ca_revoke_cert_serial(struct ca *ca, struct ca_session *sess,
     BIGNUM *serial);
+/*
+ * Revokes many serials with a single log verify and append. Serials which are
+ * already revoked are skipped; *nrevoked is set to the number newly revoked.
+ */
+errf_t		*ca_revoke_cert_serials(struct ca *ca, struct ca_session *sess,
+    BIGNUM *const *serials, uint nserials, uint *nrevoked);
 
 struct cert_var_scope	*ca_make_scope(struct ca *ca,
     struct cert_var_scope *parent);
@@ -255,6 +318,14 @@ const char		*ca_cert_tpl_help(const struct ca_cert_tpl *tpl);
 enum ca_cert_type	 ca_cert_tpl_type(const struct ca_cert_tpl *tpl);
 enum ca_cert_tpl_flags	 ca_cert_tpl_flags(const struct ca_cert_tpl *tpl);
 const struct cert_tpl	*ca_cert_tpl_tpl(const struct ca_cert_tpl *tpl);
+
+/*
+ * To compile a plan for a CA cert template, use a scope from
+ * ca_cert_tpl_make_scope() as the parent, so that the plan sees the
+ * template's own variables. Per-request scopes then go beneath the plan's
+ * scope with scope_new_for_tpl(): setting the template's variables again
+ * below the plan would stop it being used.
+ */
 struct cert_var_scope	*ca_cert_tpl_make_scope(struct ca_cert_tpl *tpl,
     struct cert_var_scope *parent);
 
@@ -315,6 +386,23 @@ errf_t 	*ca_cert_sign(struct ca_session *sess, struct ca_cert_tpl *tpl,
 errf_t	*ca_cert_sign_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
     struct cert_var_scope *certscope, X509_REQ *req, X509 *out);
 
+/*
+ * ca_cert_sign_req() split into its three stages, so that the host-side work
+ * for one request (ca_cert_prepare_req, which doesn't touch the card) can
+ * overlap with card signing for another.
+ *
+ * ca_cert_log_vars() snapshots the variables that ca_cert_record_req() puts
+ * in the CA log (everything set in certscope and its parents), so that the
+ * scope can be released (or changed) before the record step runs.
+ */
+errf_t	*ca_cert_prepare_req(struct ca *ca, struct ca_cert_tpl *tpl,
+    struct cert_var_scope *certscope, X509_REQ *req, X509 *out);
+errf_t	*ca_cert_log_vars(struct cert_var_scope *certscope,
+    json_object **varsp);
+errf_t	*ca_cert_sign_prepared(struct ca_session *sess, X509 *cert);
+errf_t	*ca_cert_record_req(struct ca_session *sess, struct ca_cert_tpl *tpl,
+    json_object *vars, X509_REQ *req, X509 *cert);
+
 struct provision_args	*pva_new(void);
 void	 pva_free(struct provision_args *);
 
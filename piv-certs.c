@@ -94,6 +94,8 @@ static struct cert_var *find_var(struct cert_var *, const char *);
 
 static errf_t *load_ossl_config(const char *section,
     struct cert_var_scope *cs, CONF **out);
+static errf_t *gen_sid_ext(struct cert_var_scope *, X509_EXTENSION **);
+static errf_t *build_smime_caps(X509_EXTENSION **);
 
 errf_t *read_text_file(const char *path, char **out, size_t *outlen);
 errf_t *validate_cstring(const char *buf, size_t len, size_t maxlen);
@@ -591,6 +593,28 @@ scope_free_root(struct cert_var_scope *rcvs)
 	free(rcvs);
 }
 
+void
+scope_free(struct cert_var_scope *cvs)
+{
+	struct cert_var_scope **pcvs;
+
+	if (cvs == NULL)
+		return;
+	VERIFY(cvs->cvs_parent != NULL);
+	VERIFY(cvs->cvs_children == NULL);
+	VERIFY(cvs->cvs_plan == NULL);
+
+	pcvs = &cvs->cvs_parent->cvs_children;
+	while (*pcvs != cvs) {
+		VERIFY(*pcvs != NULL);
+		pcvs = &(*pcvs)->cvs_next;
+	}
+	*pcvs = cvs->cvs_next;
+
+	cert_var_free_chain(cvs->cvs_vars);
+	free(cvs);
+}
+
 errf_t *
 cert_var_eval(struct cert_var *var, char **out)
 {
@@ -1222,113 +1246,490 @@ out:
 	return (err);
 }
 
+/*
+ * Compiled template plans.
+ *
+ * When issuing a lot of certs from the same template, most of the work done
+ * by the populate functions is identical each time: the same lifetime and DN
+ * strings get parsed, the same OpenSSL config gets loaded, and the same
+ * extensions get built from scratch. A plan evaluates everything which comes
+ * from a fixed parent scope once, and keeps the results.
+ *
+ * The plan owns an empty scope beneath the fixed parent, and per-request
+ * scopes are made beneath that. Variable references are bound in the scope
+ * where the referencing variable was set, so any variable which has no value
+ * between the request scope and the plan's scope evaluates to the same thing
+ * for every request and can use the cached result. Anything else takes the
+ * normal (uncached) path.
+ */
+#define	PLAN_MAX_EXTS	16
+
+struct plan_ext {
+	int			 pe_nid;
+	char			*pe_value;
+	X509_EXTENSION		*pe_ext;
+};
+
+struct cert_tpl_plan {
+	const struct cert_tpl	*ctp_tpl;
+	struct cert_var_scope	*ctp_scope;
+
+	boolean_t		 ctp_have_lifetime;
+	unsigned long		 ctp_lifetime;
+
+	X509_NAME		*ctp_dn;
+
+	boolean_t		 ctp_have_policies;
+	X509_EXTENSION		*ctp_policies;
+
+	boolean_t		 ctp_have_sid;
+	X509_EXTENSION		*ctp_sid;
+
+	X509_EXTENSION		*ctp_smime;
+
+	uint			 ctp_nexts;
+	struct plan_ext		 ctp_exts[PLAN_MAX_EXTS];
+};
+
+/*
+ * Finds the plan covering the scope "cs", as long as the variable "name" (if
+ * given) hasn't been set anywhere beneath the plan's scope.
+ */
+static struct cert_tpl_plan *
+scope_plan(struct cert_var_scope *cs, const char *name)
+{
+	struct cert_var *cv;
+
+	for (; cs != NULL; cs = cs->cvs_parent) {
+		if (cs->cvs_plan != NULL)
+			return (cs->cvs_plan);
+		if (name == NULL)
+			continue;
+		cv = find_var(cs->cvs_vars, name);
+		if (cv != NULL && cv->cv_value != NULL)
+			return (NULL);
+	}
+
+	return (NULL);
+}
+
+/*
+ * As for scope_plan(), but also checks that nothing beneath the plan's scope
+ * would change what load_ossl_config() loads.
+ */
+static struct cert_tpl_plan *
+scope_plan_config(struct cert_var_scope *cs0, const char *name)
+{
+	struct cert_tpl_plan *plan;
+	struct cert_var_scope *cs;
+	struct cert_var *cv;
+
+	plan = scope_plan(cs0, name);
+	if (plan == NULL)
+		return (NULL);
+
+	for (cs = cs0; cs != plan->ctp_scope; cs = cs->cvs_parent) {
+		for (cv = cs->cvs_vars; cv != NULL; cv = cv->cv_next) {
+			if (cv->cv_value == NULL)
+				continue;
+			if (cv->cv_name[0] == '@' ||
+			    strcmp(cv->cv_name, "openssl_config_file") == 0)
+				return (NULL);
+		}
+	}
+
+	return (plan);
+}
+
 static errf_t *
-populate_common(struct cert_var_scope *cs, X509 *cert, char *basic, char *ku,
-    char *eku)
+tpl_eval_lifetime(struct cert_var_scope *cs, unsigned long *secs)
 {
+	struct cert_tpl_plan *plan;
+	char *lifetime;
 	errf_t *err;
-	char *lifetime, *dnstr, *policies = NULL;
-	unsigned long lifetime_secs;
-	X509_EXTENSION *ext;
-	X509V3_CTX x509ctx;
-	X509_NAME *subj;
-	CONF *config = NULL;
+
+	plan = scope_plan(cs, "lifetime");
+	if (plan != NULL && plan->ctp_have_lifetime) {
+		*secs = plan->ctp_lifetime;
+		return (ERRF_OK);
+	}
 
 	err = scope_eval(cs, "lifetime", &lifetime);
 	if (err != ERRF_OK) {
 		return (errf("MissingParameter", err, "certificate 'lifetime' "
 		    "is required"));
 	}
-	err = parse_lifetime(lifetime, &lifetime_secs);
-	if (err != NULL)
-		return (err);
+	err = parse_lifetime(lifetime, secs);
 	free(lifetime);
 
-	VERIFY(X509_gmtime_adj(X509_get_notBefore(cert), 0) != NULL);
-	VERIFY(X509_gmtime_adj(X509_get_notAfter(cert), lifetime_secs) != NULL);
+	return (err);
+}
 
-	subj = X509_NAME_new();
-	VERIFY(subj != NULL);
+static errf_t *
+tpl_eval_dn(struct cert_var_scope *cs, X509_NAME **out)
+{
+	struct cert_tpl_plan *plan;
+	X509_NAME *subj;
+	char *dnstr;
+	errf_t *err;
+
+	plan = scope_plan(cs, "dn");
+	if (plan != NULL && plan->ctp_dn != NULL) {
+		subj = X509_NAME_dup(plan->ctp_dn);
+		VERIFY(subj != NULL);
+		*out = subj;
+		return (ERRF_OK);
+	}
 
 	err = scope_eval(cs, "dn", &dnstr);
 	if (err != ERRF_OK) {
-		X509_NAME_free(subj);
 		return (errf("MissingParameter", err, "certificate 'dn' "
 		    "is required"));
 	}
 
+	subj = X509_NAME_new();
+	VERIFY(subj != NULL);
+
 	err = parse_dn(dnstr, subj);
 	if (err != ERRF_OK) {
 		X509_NAME_free(subj);
-		return (errf("InvalidDN", err, "failed to parse certificate "
-		    "'dn' value: '%s'", dnstr));
+		err = errf("InvalidDN", err, "failed to parse certificate "
+		    "'dn' value: '%s'", dnstr);
+		free(dnstr);
+		return (err);
 	}
 	free(dnstr);
 
-	VERIFY(X509_set_subject_name(cert, subj) == 1);
-	X509_NAME_free(subj);
+	*out = subj;
+	return (ERRF_OK);
+}
 
-	err = scope_eval(cs, "cert_policies", &policies);
-	if (err == ERRF_OK) {
+/*
+ * Builds one of the basicConstraints, keyUsage or extKeyUsage extensions from
+ * its config string. These strings are (almost) always fixed per-template, so
+ * a plan caches the results by value.
+ */
+static errf_t *
+tpl_ext_conf(struct cert_var_scope *cs, X509V3_CTX *x509ctx, int nid,
+    const char *value, const char *what, X509_EXTENSION **out)
+{
+	struct cert_tpl_plan *plan;
+	struct plan_ext *pe;
+	X509_EXTENSION *ext;
+	CONF *config = NULL;
+	errf_t *err;
+	uint i;
+
+	/*
+	 * A value referring to a config section has to be built against the
+	 * config as this scope sees it, so don't cache it.
+	 */
+	if (strchr(value, '@') != NULL) {
 		OPENSSL_load_builtin_modules();
 
 		err = load_ossl_config("piv_ca", cs, &config);
 		if (err != ERRF_OK)
 			return (err);
 
-		X509V3_set_nconf(&x509ctx, config);
-	} else {
-		X509V3_set_ctx_nodb(&x509ctx);
+		X509V3_set_nconf(x509ctx, config);
+		ext = X509V3_EXT_conf_nid(NULL, x509ctx, nid, (char *)value);
+		X509V3_set_ctx_nodb(x509ctx);
+		NCONF_free(config);
+		if (ext == NULL) {
+			make_sslerrf(err, "X509V3_EXT_conf_nid",
+			    "parsing %s extension", what);
+			return (err);
+		}
+		*out = ext;
+		return (ERRF_OK);
+	}
+
+	plan = scope_plan(cs, NULL);
+	if (plan != NULL) {
+		for (i = 0; i < plan->ctp_nexts; ++i) {
+			pe = &plan->ctp_exts[i];
+			if (pe->pe_nid != nid || strcmp(pe->pe_value, value) != 0)
+				continue;
+			ext = X509_EXTENSION_dup(pe->pe_ext);
+			VERIFY(ext != NULL);
+			*out = ext;
+			return (ERRF_OK);
+		}
+	}
+
+	ext = X509V3_EXT_conf_nid(NULL, x509ctx, nid, (char *)value);
+	if (ext == NULL) {
+		make_sslerrf(err, "X509V3_EXT_conf_nid",
+		    "parsing %s extension", what);
+		return (err);
+	}
+
+	if (plan != NULL && plan->ctp_nexts < PLAN_MAX_EXTS) {
+		pe = &plan->ctp_exts[plan->ctp_nexts++];
+		pe->pe_nid = nid;
+		pe->pe_value = strdup(value);
+		VERIFY(pe->pe_value != NULL);
+		pe->pe_ext = X509_EXTENSION_dup(ext);
+		VERIFY(pe->pe_ext != NULL);
+	}
+
+	*out = ext;
+	return (ERRF_OK);
+}
+
+/*
+ * Builds the certificatePolicies extension from "cert_policies" (evaluated
+ * against the OpenSSL config). Sets *out to NULL if there are no policies.
+ */
+static errf_t *
+tpl_policies_ext(struct cert_var_scope *cs, X509_EXTENSION **out)
+{
+	struct cert_tpl_plan *plan;
+	char *policies;
+	X509_EXTENSION *ext;
+	X509V3_CTX x509ctx;
+	CONF *config = NULL;
+	errf_t *err;
+
+	plan = scope_plan_config(cs, "cert_policies");
+	if (plan != NULL && plan->ctp_have_policies) {
+		ext = NULL;
+		if (plan->ctp_policies != NULL) {
+			ext = X509_EXTENSION_dup(plan->ctp_policies);
+			VERIFY(ext != NULL);
+		}
+		*out = ext;
+		return (ERRF_OK);
+	}
+
+	err = scope_eval(cs, "cert_policies", &policies);
+	if (err != ERRF_OK) {
+		errf_free(err);
+		*out = NULL;
+		return (ERRF_OK);
+	}
+
+	OPENSSL_load_builtin_modules();
+
+	err = load_ossl_config("piv_ca", cs, &config);
+	if (err != ERRF_OK) {
+		free(policies);
+		return (err);
+	}
+
+	X509V3_set_nconf(&x509ctx, config);
+	X509V3_set_ctx(&x509ctx, NULL, NULL, NULL, NULL, 0);
+
+	ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_certificate_policies,
+	    policies);
+	NCONF_free(config);
+	free(policies);
+	if (ext == NULL) {
+		make_sslerrf(err, "X509V3_EXT_conf_nid",
+		    "parsing certificatePolicies extension");
+		return (err);
+	}
+
+	*out = ext;
+	return (ERRF_OK);
+}
+
+static errf_t *
+tpl_sid_ext(struct cert_var_scope *cs, X509_EXTENSION **out)
+{
+	struct cert_tpl_plan *plan;
+	X509_EXTENSION *ext;
+
+	plan = scope_plan(cs, "ad_sid");
+	if (plan != NULL && plan->ctp_have_sid) {
+		ext = NULL;
+		if (plan->ctp_sid != NULL) {
+			ext = X509_EXTENSION_dup(plan->ctp_sid);
+			VERIFY(ext != NULL);
+		}
+		*out = ext;
+		return (ERRF_OK);
+	}
+
+	return (gen_sid_ext(cs, out));
+}
+
+static errf_t *
+tpl_smime_caps(struct cert_var_scope *cs, X509_EXTENSION **out)
+{
+	struct cert_tpl_plan *plan;
+
+	plan = scope_plan(cs, NULL);
+	if (plan != NULL && plan->ctp_smime != NULL) {
+		*out = X509_EXTENSION_dup(plan->ctp_smime);
+		VERIFY(*out != NULL);
+		return (ERRF_OK);
+	}
+
+	return (build_smime_caps(out));
+}
+
+errf_t *
+cert_tpl_compile(const struct cert_tpl *tpl, struct cert_var_scope *parent,
+    struct cert_tpl_plan **out)
+{
+	struct cert_tpl_plan *plan;
+	struct cert_var_scope *cs;
+	errf_t *err;
+
+	VERIFY(parent != NULL);
+
+	plan = calloc(1, sizeof (struct cert_tpl_plan));
+	VERIFY(plan != NULL);
+	plan->ctp_tpl = tpl;
+
+	cs = scope_new_empty(parent);
+	VERIFY(cs != NULL);
+	plan->ctp_scope = cs;
+
+	/*
+	 * Anything which doesn't evaluate from the fixed scope is just left
+	 * out of the plan: it may well be set per-request.
+	 */
+	err = tpl_eval_lifetime(cs, &plan->ctp_lifetime);
+	if (err == ERRF_OK)
+		plan->ctp_have_lifetime = B_TRUE;
+	errf_free(err);
+
+	err = tpl_eval_dn(cs, &plan->ctp_dn);
+	errf_free(err);
+
+	err = tpl_policies_ext(cs, &plan->ctp_policies);
+	if (err == ERRF_OK)
+		plan->ctp_have_policies = B_TRUE;
+	errf_free(err);
+
+	err = gen_sid_ext(cs, &plan->ctp_sid);
+	if (err == ERRF_OK)
+		plan->ctp_have_sid = B_TRUE;
+	errf_free(err);
+
+	err = build_smime_caps(&plan->ctp_smime);
+	if (err != ERRF_OK) {
+		cert_tpl_plan_free(plan);
+		return (err);
 	}
+
+	cs->cvs_plan = plan;
+	*out = plan;
+
+	return (ERRF_OK);
+}
+
+struct cert_var_scope *
+cert_tpl_plan_scope(struct cert_tpl_plan *plan)
+{
+	return (plan->ctp_scope);
+}
+
+const struct cert_tpl *
+cert_tpl_plan_tpl(const struct cert_tpl_plan *plan)
+{
+	return (plan->ctp_tpl);
+}
+
+errf_t *
+cert_tpl_plan_populate(struct cert_tpl_plan *plan,
+    struct cert_var_scope *cvs, X509 *cert)
+{
+	return (plan->ctp_tpl->ct_populate(cvs, cert));
+}
+
+errf_t *
+cert_tpl_plan_populate_req(struct cert_tpl_plan *plan,
+    struct cert_var_scope *cvs, X509_REQ *req)
+{
+	return (plan->ctp_tpl->ct_populate_req(cvs, req));
+}
+
+void
+cert_tpl_plan_free(struct cert_tpl_plan *plan)
+{
+	uint i;
+
+	if (plan == NULL)
+		return;
+
+	for (i = 0; i < plan->ctp_nexts; ++i) {
+		free(plan->ctp_exts[i].pe_value);
+		X509_EXTENSION_free(plan->ctp_exts[i].pe_ext);
+	}
+	X509_NAME_free(plan->ctp_dn);
+	X509_EXTENSION_free(plan->ctp_policies);
+	X509_EXTENSION_free(plan->ctp_sid);
+	X509_EXTENSION_free(plan->ctp_smime);
+
+	plan->ctp_scope->cvs_plan = NULL;
+	scope_free(plan->ctp_scope);
+
+	free(plan);
+}
+
+static errf_t *
+populate_common(struct cert_var_scope *cs, X509 *cert, char *basic, char *ku,
+    char *eku)
+{
+	errf_t *err;
+	unsigned long lifetime_secs;
+	X509_EXTENSION *ext;
+	X509V3_CTX x509ctx;
+	X509_NAME *subj;
+
+	err = tpl_eval_lifetime(cs, &lifetime_secs);
+	if (err != ERRF_OK)
+		return (err);
+
+	VERIFY(X509_gmtime_adj(X509_get_notBefore(cert), 0) != NULL);
+	VERIFY(X509_gmtime_adj(X509_get_notAfter(cert), lifetime_secs) != NULL);
+
+	err = tpl_eval_dn(cs, &subj);
+	if (err != ERRF_OK)
+		return (err);
+
+	VERIFY(X509_set_subject_name(cert, subj) == 1);
+	X509_NAME_free(subj);
+
+	X509V3_set_ctx_nodb(&x509ctx);
 	X509V3_set_ctx(&x509ctx, cert, cert, NULL, NULL, 0);
 
 	if (basic != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_basic_constraints,
-		    (char *)basic);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing basicConstraints extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_basic_constraints, basic,
+		    "basicConstraints", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		X509_add_ext(cert, ext, -1);
 		X509_EXTENSION_free(ext);
 	}
 
 	if (ku != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_key_usage,
-		    (char *)ku);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing keyUsage extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_key_usage, ku,
+		    "keyUsage", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		X509_add_ext(cert, ext, -1);
 		X509_EXTENSION_free(ext);
 	}
 
 	if (eku != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_ext_key_usage,
-		    (char *)eku);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing extKeyUsage extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_ext_key_usage, eku,
+		    "extKeyUsage", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		X509_add_ext(cert, ext, -1);
 		X509_EXTENSION_free(ext);
 	}
 
-	if (policies != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx,
-		    NID_certificate_policies, (char *)policies);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing certificatePolicies extension");
-			return (err);
-		}
+	err = tpl_policies_ext(cs, &ext);
+	if (err != ERRF_OK)
+		return (err);
+	if (ext != NULL) {
 		X509_add_ext(cert, ext, -1);
 		X509_EXTENSION_free(ext);
-		free(policies);
 	}
 
 	return (ERRF_OK);
@@ -1605,7 +2006,7 @@ populate_common_princs(struct cert_var_scope *cs, X509 *cert)
 
 	sk_GENERAL_NAME_pop_free(gns, GENERAL_NAME_free);
 
-	err = gen_sid_ext(cs, &ext);
+	err = tpl_sid_ext(cs, &ext);
 	if (err != ERRF_OK)
 		return (err);
 	if (ext != NULL) {
@@ -1846,7 +2247,7 @@ populate_user_email(struct cert_var_scope *cs, X509 *cert)
 	X509_add_ext(cert, ext, -1);
 	X509_EXTENSION_free(ext);
 
-	err = build_smime_caps(&ext);
+	err = tpl_smime_caps(cs, &ext);
 	if (err != ERRF_OK)
 		return (err);
 	VERIFY(ext != NULL);
@@ -2189,91 +2590,49 @@ rpopulate_common(struct cert_var_scope *cs, X509_REQ *req,
     STACK_OF(X509_EXTENSION) *exts, char *basic, char *ku, char *eku)
 {
 	errf_t *err;
-	char *dnstr, *policies = NULL;
 	X509_EXTENSION *ext;
 	X509V3_CTX x509ctx;
 	X509_NAME *subj;
-	CONF *config = NULL;
-
-	subj = X509_NAME_new();
-	VERIFY(subj != NULL);
 
-	err = scope_eval(cs, "dn", &dnstr);
-	if (err != ERRF_OK) {
-		X509_NAME_free(subj);
-		return (errf("MissingParameter", err, "certificate 'dn' "
-		    "is required"));
-	}
-
-	err = parse_dn(dnstr, subj);
-	if (err != ERRF_OK) {
-		X509_NAME_free(subj);
-		return (errf("InvalidDN", err, "failed to parse certificate "
-		    "'dn' value: '%s'", dnstr));
-	}
-	free(dnstr);
+	err = tpl_eval_dn(cs, &subj);
+	if (err != ERRF_OK)
+		return (err);
 
 	VERIFY(X509_REQ_set_subject_name(req, subj) == 1);
 	X509_NAME_free(subj);
 
-	err = scope_eval(cs, "cert_policies", &policies);
-	if (err == ERRF_OK) {
-		OPENSSL_load_builtin_modules();
-
-		err = load_ossl_config("piv_ca", cs, &config);
-		if (err != ERRF_OK)
-			return (err);
-
-		X509V3_set_nconf(&x509ctx, config);
-	} else {
-		X509V3_set_ctx_nodb(&x509ctx);
-	}
+	X509V3_set_ctx_nodb(&x509ctx);
 	X509V3_set_ctx(&x509ctx, NULL, NULL, req, NULL, 0);
 
 	if (basic != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_basic_constraints,
-		    (char *)basic);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing basicConstraints extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_basic_constraints, basic,
+		    "basicConstraints", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		VERIFY(sk_X509_EXTENSION_push(exts, ext) != 0);
 	}
 
 	if (ku != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_key_usage,
-		    (char *)ku);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing keyUsage extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_key_usage, ku,
+		    "keyUsage", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		VERIFY(sk_X509_EXTENSION_push(exts, ext) != 0);
 	}
 
 	if (eku != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx, NID_ext_key_usage,
-		    (char *)eku);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing extKeyUsage extension");
+		err = tpl_ext_conf(cs, &x509ctx, NID_ext_key_usage, eku,
+		    "extKeyUsage", &ext);
+		if (err != ERRF_OK)
 			return (err);
-		}
 		VERIFY(sk_X509_EXTENSION_push(exts, ext) != 0);
 	}
 
-	if (policies != NULL) {
-		ext = X509V3_EXT_conf_nid(NULL, &x509ctx,
-		    NID_certificate_policies, (char *)policies);
-		if (ext == NULL) {
-			make_sslerrf(err, "X509V3_EXT_conf_nid",
-			    "parsing certificatePolicies extension");
-			return (err);
-		}
+	err = tpl_policies_ext(cs, &ext);
+	if (err != ERRF_OK)
+		return (err);
+	if (ext != NULL)
 		VERIFY(sk_X509_EXTENSION_push(exts, ext) != 0);
-		free(policies);
-	}
 
 	return (ERRF_OK);
 }
@@ -2303,7 +2662,7 @@ rpopulate_common_princs(struct cert_var_scope *cs, X509_REQ *req,
 
 	sk_GENERAL_NAME_pop_free(gns, GENERAL_NAME_free);
 
-	err = gen_sid_ext(cs, &ext);
+	err = tpl_sid_ext(cs, &ext);
 	if (err != ERRF_OK)
 		return (err);
 	if (ext != NULL)
@@ -2505,7 +2864,7 @@ rpopulate_user_email(struct cert_var_scope *cs, X509_REQ *req)
 	VERIFY(ext != NULL);
 	VERIFY(sk_X509_EXTENSION_push(exts, ext) != 0);
 
-	err = build_smime_caps(&ext);
+	err = tpl_smime_caps(cs, &ext);
 	if (err != ERRF_OK)
 		return (err);
 	VERIFY(ext != NULL);
@@ -3366,6 +3725,156 @@ out:
 	return (err);
 }
 
+static errf_t *
+ocsp_resp_set_algo(PIVY_OCSP_BASICRESP *resp, struct sshkey *pubkey, int nid)
+{
+	errf_t *err;
+	ASN1_OBJECT *algobj;
+	int rc;
+
+	algobj = OBJ_nid2obj(nid);
+	if (algobj == NULL) {
+		make_sslerrf(err, "OBJ_nid2obj", "setting signing algo");
+		return (err);
+	}
+
+	rc = X509_ALGOR_set0(resp->sigalg, algobj,
+	    pubkey->type == KEY_RSA ? V_ASN1_NULL : V_ASN1_UNDEF, NULL);
+	if (rc != 1) {
+		make_sslerrf(err, "X509_ALGOR_set0", "setting signing algo");
+		return (err);
+	}
+
+	return (ERRF_OK);
+}
+
+errf_t *
+agent_sign_ocsp_resp(int fd, struct sshkey *pubkey,
+    PIVY_OCSP_BASICRESP *resp)
+{
+	errf_t *err;
+	int rc;
+	enum sshdigest_types wantalg, hashalg;
+	int nid;
+	EVP_PKEY *pkey;
+	uint8_t *tbs = NULL, *sig = NULL;
+	int tbslen;
+	size_t siglen;
+	const char *alg = NULL;
+	struct sshbuf *sshsig = NULL, *asn1sig = NULL;
+
+	VERIFY(pubkey != NULL);
+
+	if (pubkey->type == KEY_RSA)
+		alg = "rsa-sha2-256";
+
+	err = set_pkey_from_sshkey(pubkey, NULL, &pkey, &wantalg, &nid);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ocsp_resp_set_algo(resp, pubkey, nid);
+	if (err != ERRF_OK)
+		goto out;
+
+	tbslen = i2d_PIVY_OCSP_RESPDATA(resp->tbs, &tbs);
+	if (tbslen <= 0) {
+		make_sslerrf(err, "i2d_PIVY_OCSP_RESPDATA",
+		    "encoding to-be-signed OCSP response");
+		goto out;
+	}
+
+	rc = ssh_agent_sign(fd, pubkey, &sig, &siglen, tbs, tbslen, alg, 0);
+	if (rc != 0) {
+		err = ssherrf("ssh_agent_sign", rc);
+		goto out;
+	}
+
+	sshsig = sshbuf_from(sig, siglen);
+	VERIFY(sshsig != NULL);
+
+	asn1sig = sshbuf_new();
+	VERIFY(asn1sig != NULL);
+
+	rc = sshkey_sig_to_asn1(pubkey, sshsig, &hashalg, asn1sig);
+	if (rc != 0) {
+		err = ssherrf("sshkey_sig_to_asn1", rc);
+		goto out;
+	}
+
+	if (hashalg != wantalg) {
+		err = errf("SignAlgoMismatch", NULL, "Agent could not sign "
+		    "with the requested hash algorithm");
+		goto out;
+	}
+
+	ASN1_STRING_set(resp->signature, sshbuf_ptr(asn1sig),
+	    sshbuf_len(asn1sig));
+	resp->signature->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(asn1sig);
+	sshbuf_free(sshsig);
+	EVP_PKEY_free(pkey);
+	OPENSSL_free(tbs);
+	free(sig);
+	return (err);
+}
+
+errf_t *
+piv_sign_ocsp_resp(struct piv_token *tkn, struct piv_slot *slot,
+    struct sshkey *pubkey, PIVY_OCSP_BASICRESP *resp)
+{
+	errf_t *err;
+	enum sshdigest_types wantalg, hashalg;
+	int nid;
+	EVP_PKEY *pkey;
+	uint8_t *tbs = NULL, *sig = NULL;
+	int tbslen;
+	size_t siglen = 0;
+
+	VERIFY(pubkey != NULL);
+
+	err = set_pkey_from_sshkey(pubkey, NULL, &pkey, &wantalg, &nid);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ocsp_resp_set_algo(resp, pubkey, nid);
+	if (err != ERRF_OK)
+		goto out;
+
+	tbslen = i2d_PIVY_OCSP_RESPDATA(resp->tbs, &tbs);
+	if (tbslen <= 0) {
+		make_sslerrf(err, "i2d_PIVY_OCSP_RESPDATA",
+		    "encoding to-be-signed OCSP response");
+		goto out;
+	}
+
+	hashalg = wantalg;
+
+	err = piv_sign(tkn, slot, tbs, tbslen, &hashalg, &sig, &siglen);
+	if (err != ERRF_OK)
+		goto out;
+
+	if (hashalg != wantalg) {
+		err = errf("SignAlgoMismatch", NULL, "Card could not sign "
+		    "with the requested hash algorithm");
+		goto out;
+	}
+
+	ASN1_STRING_set(resp->signature, sig, siglen);
+	resp->signature->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+
+	err = ERRF_OK;
+
+out:
+	EVP_PKEY_free(pkey);
+	OPENSSL_free(tbs);
+	freezero(sig, siglen);
+	return (err);
+}
+
 errf_t *
 piv_sign_cert_req(struct piv_token *tkn, struct piv_slot *slot,
     struct sshkey *pubkey, X509_REQ *req)
@@ -85,6 +85,11 @@ enum piv_cert_comp {
 enum piv_certinfo_flags {
 	PIV_CI_X509 = (1 << 2),
 	PIV_CI_COMPTYPE = 0x03,
+	/*
+	 * Not stored on the card: tells piv_write_cert() to pick PIV_COMP_GZIP
+	 * or PIV_COMP_NONE itself, by size and whether gzip actually helps.
+	 */
+	PIV_CI_COMPAUTO = (1 << 8),
 };
 
 enum vvtype {
@@ -106,6 +111,7 @@ struct cert_var_scope {
         struct cert_var_scope   *cvs_children;
         struct cert_var_scope   *cvs_next;
         struct cert_var         *cvs_vars;
+        struct cert_tpl_plan    *cvs_plan;
 };
 
 struct cert_var {
@@ -25,6 +25,8 @@
 #include <stddef.h>
 #include <errno.h>
 #include <strings.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include "debug.h"
 
@@ -65,8 +67,14 @@
 
 /* Contains structs apdubuf, piv_ecdh_box, and enum piv_box_version */
 #include "piv-internal.h"
+#include "pivy-probes.h"
 
 #define	PIV_MAX_CERT_LEN		16384
+/*
+ * Below this a cert is only a few GET DATA chunks anyway, and gzip's header
+ * and trailer eat most of what deflate saves.
+ */
+#define	PIV_COMP_AUTO_MIN		1024
 
 const uint8_t AID_PIV[] = {
 	0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00
@@ -84,8 +92,24 @@ struct apdu {
 	struct apdubuf a_cmd;
 	uint16_t a_sw;
 	struct apdubuf a_reply;
+
+	/*
+	 * Set on apdus from piv_apdu_take(): the token whose free list this
+	 * goes back onto in piv_apdu_free().
+	 */
+	struct piv_token *a_token;
+	struct apdu *a_next;
 };
 
+/* Longest short-form command APDU: header, Lc, 255 bytes of data and Le. */
+#define	APDU_MAX_CMD	(5 + 255 + 1)
+
+/* How many idle apdus (and reply buffers) a token keeps around. */
+#define	PIV_APDU_CACHE	2
+
+static struct apdu *piv_apdu_take(struct piv_token *, enum iso_class,
+    enum iso_ins, uint8_t, uint8_t);
+
 /* Tags used in the GENERAL AUTHENTICATE command. */
 enum gen_auth_tag {
 	GA_TAG_WITNESS = 0x80,
@@ -116,6 +140,12 @@ struct piv_slot {
 struct piv_token {
 	struct piv_ctx *pt_ctx;
 
+	/*
+	 * Held from piv_txn_begin() until piv_txn_end(), so that only one
+	 * thread at a time can be talking to the card.
+	 */
+	pthread_mutex_t pt_lock;
+
 	/* piv_ctx list of all tokens created. */
 	struct piv_token *pt_lib_prev;
 	struct piv_token *pt_lib_next;
@@ -141,6 +171,11 @@ struct piv_token {
 	 * Do we need to reset at the end of this txn?
 	 */
 	boolean_t pt_reset;
+	/*
+	 * Bumped each time piv_txn_begin() finds the card was reset under us
+	 * and has to SCardReconnect() (see piv_token_card_state()).
+	 */
+	uint pt_reconnects;
 	/*
 	 * Do we have an auth'd PIN that we should try to reset at the end of
 	 * this txn?
@@ -197,6 +232,19 @@ struct piv_token {
 
 	boolean_t pt_ykserial_valid;	/* YubiKey serial # only on YK5 */
 	uint32_t pt_ykserial;
+
+	/*
+	 * APDU scratch space, only touched while in a transaction (so under
+	 * pt_lock). pt_cmdbuf holds the encoded command in
+	 * piv_apdu_transceive(), and pt_apdu_free is a list of idle apdus
+	 * with MAX_APDU_SIZE reply buffers attached, for piv_apdu_take().
+	 * Both are zeroed after each use.
+	 */
+	uint8_t pt_cmdbuf[APDU_MAX_CMD];
+	struct apdu *pt_apdu_free;
+	uint pt_apdu_nfree;
+	uint64_t pt_apdu_allocs;
+	uint64_t pt_apdu_reuses;
 };
 
 enum piv_pinfo_kv_type {
@@ -236,7 +284,17 @@ struct piv_pinfo {
 	struct piv_pinfo_kv	*pp_kv;
 };
 
+/*
+ * A piv_ctx and the tokens hanging off it may be used from several threads.
+ * pc_lock protects the PCSC context state and the pc_tokens list (and the
+ * pt_lib_prev/pt_lib_next links in each token), while each token's pt_lock
+ * is held for the duration of a transaction on it.
+ *
+ * Note that pcsclite serialises calls made on the same SCARDCONTEXT, so to
+ * talk to several tokens in parallel, use a separate piv_ctx per thread.
+ */
 struct piv_ctx {
+	pthread_mutex_t		 pc_lock;
 	boolean_t		 pc_scard_init;
 	boolean_t		 pc_scard_owned;
 	boolean_t		 pc_scard_nordr;
@@ -250,11 +308,67 @@ piv_open(void)
 {
 	struct piv_ctx *ctx;
 	ctx = calloc(1, sizeof (*ctx));
+	if (ctx == NULL)
+		return (NULL);
+	if (pthread_mutex_init(&ctx->pc_lock, NULL) != 0) {
+		free(ctx);
+		return (NULL);
+	}
 	return (ctx);
 }
 
 static void piv_release_one(struct piv_token *pk);
 
+static struct piv_token *
+piv_token_new(struct piv_ctx *ctx)
+{
+	struct piv_token *pk;
+	pthread_mutexattr_t attr;
+
+	pk = calloc(1, sizeof (struct piv_token));
+	if (pk == NULL)
+		return (NULL);
+	pk->pt_ctx = ctx;
+
+	/*
+	 * Use an error-checking mutex so that a nested piv_txn_begin() from
+	 * the same thread still trips a VERIFY instead of deadlocking.
+	 */
+	VERIFY0(pthread_mutexattr_init(&attr));
+	VERIFY0(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK));
+	VERIFY0(pthread_mutex_init(&pk->pt_lock, &attr));
+	VERIFY0(pthread_mutexattr_destroy(&attr));
+
+	return (pk);
+}
+
+static void
+piv_token_free(struct piv_token *pk)
+{
+	struct apdu *a;
+
+	while ((a = pk->pt_apdu_free) != NULL) {
+		pk->pt_apdu_free = a->a_next;
+		freezero(a->a_reply.b_data, a->a_reply.b_size);
+		free(a);
+	}
+	VERIFY0(pthread_mutex_destroy(&pk->pt_lock));
+	free(pk);
+}
+
+/* Must be called with pk->pt_ctx->pc_lock held. */
+static void
+piv_token_link(struct piv_token *pk)
+{
+	struct piv_ctx *ctx = pk->pt_ctx;
+
+	pk->pt_lib_prev = NULL;
+	pk->pt_lib_next = ctx->pc_tokens;
+	if (ctx->pc_tokens != NULL)
+		ctx->pc_tokens->pt_lib_prev = pk;
+	ctx->pc_tokens = pk;
+}
+
 void
 piv_close(struct piv_ctx *ctx)
 {
@@ -267,21 +381,37 @@ piv_close(struct piv_ctx *ctx)
 		npt = pt->pt_lib_next;
 		piv_release_one(pt);
 	}
+	VERIFY0(pthread_mutex_destroy(&ctx->pc_lock));
 	free(ctx);
 }
 
 void
 piv_set_context(struct piv_ctx *ctx, SCARDCONTEXT sctx)
 {
+	VERIFY0(pthread_mutex_lock(&ctx->pc_lock));
 	VERIFY(!ctx->pc_scard_init);
 	ctx->pc_scard_init = B_TRUE;
 	ctx->pc_scard_owned = B_FALSE;
 	ctx->pc_scard_nordr = B_FALSE;
 	ctx->pc_scard = sctx;
+	VERIFY0(pthread_mutex_unlock(&ctx->pc_lock));
 }
 
+static errf_t *piv_establish_context_locked(struct piv_ctx *, DWORD);
+
 errf_t *
 piv_establish_context(struct piv_ctx *ctx, DWORD scope)
+{
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&ctx->pc_lock));
+	err = piv_establish_context_locked(ctx, scope);
+	VERIFY0(pthread_mutex_unlock(&ctx->pc_lock));
+	return (err);
+}
+
+static errf_t *
+piv_establish_context_locked(struct piv_ctx *ctx, DWORD scope)
 {
 	DWORD rv;
 	VERIFY(!ctx->pc_scard_init);
@@ -494,6 +624,14 @@ piv_token_is_ykpiv(const struct piv_token *token)
 	return (token->pt_ykpiv);
 }
 
+void
+piv_token_apdu_stats(const struct piv_token *tk, uint64_t *allocated,
+    uint64_t *reused)
+{
+	*allocated = tk->pt_apdu_allocs;
+	*reused = tk->pt_apdu_reuses;
+}
+
 const uint8_t *
 ykpiv_token_version(const struct piv_token *token)
 {
@@ -629,7 +767,7 @@ ykpiv_get_version(struct piv_token *pk)
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_VER, 0x00, 0x00);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_VER, 0x00, 0x00);
 
 	err = piv_apdu_transceive_chain(pk, apdu);
 	if (err) {
@@ -677,7 +815,7 @@ ykpiv_read_serial(struct piv_token *pt)
 
 	VERIFY(pt->pt_intxn);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_SERIAL, 0x00, 0x00);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GET_SERIAL, 0x00, 0x00);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -728,7 +866,7 @@ piv_read_discov(struct piv_token *pk)
 	tlv_write_u8to32(tlv, PIV_TAG_DISCOV);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -860,7 +998,7 @@ piv_read_keyhist(struct piv_token *pk)
 	tlv_write_u8to32(tlv, PIV_TAG_KEYHIST);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -983,7 +1121,7 @@ piv_read_chuid(struct piv_token *pk)
 
 	bunyan_log(BNY_DEBUG, "reading CHUID file", NULL);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -1084,8 +1222,35 @@ invdata:
 	goto out;
 }
 
+static errf_t *piv_enumerate_locked(struct piv_ctx *, struct piv_token **);
+static errf_t *piv_find_locked(struct piv_ctx *, const uint8_t *, size_t,
+    struct piv_token **);
+
 errf_t *
 piv_enumerate(struct piv_ctx *ctx, struct piv_token **tokens)
+{
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&ctx->pc_lock));
+	err = piv_enumerate_locked(ctx, tokens);
+	VERIFY0(pthread_mutex_unlock(&ctx->pc_lock));
+	return (err);
+}
+
+errf_t *
+piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
+    struct piv_token **token)
+{
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&ctx->pc_lock));
+	err = piv_find_locked(ctx, guid, guidlen, token);
+	VERIFY0(pthread_mutex_unlock(&ctx->pc_lock));
+	return (err);
+}
+
+static errf_t *
+piv_enumerate_locked(struct piv_ctx *ctx, struct piv_token **tokens)
 {
 	DWORD rv, readersLen = 0;
 	LPTSTR readers, thisrdr;
@@ -1097,7 +1262,7 @@ piv_enumerate(struct piv_ctx *ctx, struct piv_token **tokens)
 
 	if (!ctx->pc_scard_init && ctx->pc_scard_nordr) {
 		/* Previous attempt got "no readers" error */
-		err = piv_establish_context(ctx, ctx->pc_scard_scope);
+		err = piv_establish_context_locked(ctx, ctx->pc_scard_scope);
 		if (err) {
 			err = errf("PCSCContextError", err,
 			    "PCSC context is not functional");
@@ -1115,13 +1280,14 @@ piv_enumerate(struct piv_ctx *ctx, struct piv_token **tokens)
 	}
 
 	for (key = ctx->pc_tokens; key != NULL; key = key->pt_lib_next) {
-		if (key->pt_intxn) {
+		if (pthread_mutex_trylock(&key->pt_lock) != 0) {
 			return (errf("TransactionError", NULL,
 			    "Another token belonging to this context is "
 			    "currently in a transaction, can't use "
 			    "piv_enumerate"));
 		}
 		(void) SCardDisconnect(key->pt_cardhdl, SCARD_RESET_CARD);
+		VERIFY0(pthread_mutex_unlock(&key->pt_lock));
 	}
 
 	rv = SCardListReaders(ctx->pc_scard, NULL, NULL, &readersLen);
@@ -1162,12 +1328,9 @@ piv_enumerate(struct piv_ctx *ctx, struct piv_token **tokens)
 			continue;
 		}
 
-		key = calloc(1, sizeof (struct piv_token));
-		key->pt_ctx = ctx;
-		key->pt_lib_next = ctx->pc_tokens;
-		if (ctx->pc_tokens != NULL)
-			ctx->pc_tokens->pt_lib_prev = key;
-		ctx->pc_tokens = key;
+		key = piv_token_new(ctx);
+		VERIFY(key != NULL);
+		piv_token_link(key);
 		key->pt_cardhdl = card;
 		key->pt_rdrname = strdup(thisrdr);
 		key->pt_proto = activeProtocol;
@@ -1251,8 +1414,8 @@ piv_enumerate(struct piv_ctx *ctx, struct piv_token **tokens)
 	return (ERRF_OK);
 }
 
-errf_t *
-piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
+static errf_t *
+piv_find_locked(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
     struct piv_token **token)
 {
 	DWORD rv, readersLen = 0;
@@ -1262,7 +1425,7 @@ piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
 
 	if (!ctx->pc_scard_init && ctx->pc_scard_nordr) {
 		/* Previous attempt got "no readers" error */
-		err = piv_establish_context(ctx, ctx->pc_scard_scope);
+		err = piv_establish_context_locked(ctx, ctx->pc_scard_scope);
 		if (err) {
 			err = errf("PCSCContextError", err,
 			    "PCSC context is not functional");
@@ -1304,7 +1467,7 @@ piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
 		return (pcscerrf("SCardListReaders", rv));
 	}
 
-	key = calloc(1, sizeof (struct piv_token));
+	key = piv_token_new(ctx);
 	VERIFY(key != NULL);
 
 	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
@@ -1357,18 +1520,19 @@ piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
 				(void) SCardDisconnect(card, SCARD_RESET_CARD);
 				free((char *)key->pt_rdrname);
 				piv_chuid_free(key->pt_chuid);
-				free(key);
+				piv_token_free(key);
 				piv_txn_end(found);
 				(void) SCardDisconnect(found->pt_cardhdl,
 				    SCARD_RESET_CARD);
 				free((char *)found->pt_rdrname);
-				free(found);
+				piv_token_free(found);
 				free(readers);
 				return (errf("DuplicateError", NULL,
 				    "More than one PIV token matched GUID"));
 			}
 			found = key;
-			key = calloc(1, sizeof (struct piv_token));
+			key = piv_token_new(ctx);
+			VERIFY(key != NULL);
 			continue;
 		} else if (err) {
 			bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
@@ -1385,18 +1549,19 @@ piv_find(struct piv_ctx *ctx, const uint8_t *guid, size_t guidlen,
 			(void) SCardDisconnect(card, SCARD_RESET_CARD);
 			free((char *)key->pt_rdrname);
 			piv_chuid_free(key->pt_chuid);
-			free(key);
+			piv_token_free(key);
 			piv_txn_end(found);
 			(void) SCardDisconnect(found->pt_cardhdl,
 			    SCARD_RESET_CARD);
 			free((char *)found->pt_rdrname);
-			free(found);
+			piv_token_free(found);
 			free(readers);
 			return (errf("DuplicateError", NULL,
 			    "More than one PIV token matched GUID"));
 		}
 		found = key;
-		key = calloc(1, sizeof (struct piv_token));
+		key = piv_token_new(ctx);
+		VERIFY(key != NULL);
 		continue;
 
 nope:
@@ -1405,12 +1570,14 @@ nopenotxn:
 		(void) SCardDisconnect(card, SCARD_RESET_CARD);
 		free((char *)key->pt_rdrname);
 		piv_chuid_free(key->pt_chuid);
-		bzero(key, sizeof (struct piv_token));
+		piv_token_free(key);
+		key = piv_token_new(ctx);
+		VERIFY(key != NULL);
 	}
 
 	free((char *)key->pt_rdrname);
 	piv_chuid_free(key->pt_chuid);
-	free(key);
+	piv_token_free(key);
 
 	if (found == NULL) {
 		free(readers);
@@ -1419,10 +1586,6 @@ nopenotxn:
 	}
 
 	key = found;
-	key->pt_lib_next = ctx->pc_tokens;
-	if (ctx->pc_tokens != NULL)
-		ctx->pc_tokens->pt_lib_prev = key;
-	ctx->pc_tokens = key;
 	err = ERRF_OK;
 
 	if (err == ERRF_OK) {
@@ -1462,14 +1625,17 @@ nopenotxn:
 
 	if (err) {
 		bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-		    "due to error", "reader", BNY_STRING, thisrdr,
+		    "due to error", "reader", BNY_STRING, key->pt_rdrname,
 		    "error", BNY_ERF, err, NULL);
-		errf_free(err);
 		(void) SCardDisconnect(key->pt_cardhdl, SCARD_RESET_CARD);
 		free((char *)key->pt_rdrname);
-		free(key);
+		piv_chuid_free(key->pt_chuid);
+		piv_token_free(key);
+		free(readers);
+		return (err);
 	}
 
+	piv_token_link(key);
 	*token = key;
 	free(readers);
 	return (ERRF_OK);
@@ -1498,14 +1664,16 @@ piv_release_one(struct piv_token *pk)
 	free(pk->pt_guidhex);
 	piv_chuid_free(pk->pt_chuid);
 
+	VERIFY0(pthread_mutex_lock(&pk->pt_ctx->pc_lock));
 	if (pk->pt_lib_prev != NULL)
 		pk->pt_lib_prev->pt_lib_next = pk->pt_lib_next;
 	if (pk->pt_lib_next != NULL)
 		pk->pt_lib_next->pt_lib_prev = pk->pt_lib_prev;
 	if (pk->pt_lib_prev == NULL)
 		pk->pt_ctx->pc_tokens = pk->pt_lib_next;
+	VERIFY0(pthread_mutex_unlock(&pk->pt_ctx->pc_lock));
 
-	free(pk);
+	piv_token_free(pk);
 }
 
 void
@@ -1613,9 +1781,60 @@ piv_apdu_make(enum iso_class cls, enum iso_ins ins, uint8_t p1, uint8_t p2)
 	return (a);
 }
 
+/*
+ * Like piv_apdu_make(), but for use inside a transaction on pk: the apdu
+ * comes with a reply buffer attached, and both are recycled through the
+ * token's free list by piv_apdu_free() rather than going back to the
+ * allocator. The apdu must be freed before the transaction ends.
+ */
+static struct apdu *
+piv_apdu_take(struct piv_token *pk, enum iso_class cls, enum iso_ins ins,
+    uint8_t p1, uint8_t p2)
+{
+	struct apdu *a;
+
+	VERIFY(pk->pt_intxn);
+
+	if ((a = pk->pt_apdu_free) != NULL) {
+		pk->pt_apdu_free = a->a_next;
+		--pk->pt_apdu_nfree;
+		++pk->pt_apdu_reuses;
+		a->a_next = NULL;
+	} else {
+		++pk->pt_apdu_allocs;
+		a = calloc(1, sizeof (struct apdu));
+		VERIFY(a != NULL);
+		a->a_reply.b_data = calloc(1, MAX_APDU_SIZE);
+		VERIFY(a->a_reply.b_data != NULL);
+		a->a_reply.b_size = MAX_APDU_SIZE;
+		a->a_token = pk;
+	}
+	a->a_cls = cls;
+	a->a_ins = ins;
+	a->a_p1 = p1;
+	a->a_p2 = p2;
+	return (a);
+}
+
 void
 piv_apdu_free(struct apdu *a)
 {
+	struct piv_token *pk = a->a_token;
+	uint8_t *buf;
+
+	if (pk != NULL && pk->pt_apdu_nfree < PIV_APDU_CACHE) {
+		VERIFY(pk->pt_intxn);
+		buf = a->a_reply.b_data;
+		explicit_bzero(buf, MAX_APDU_SIZE);
+		bzero(a, sizeof (struct apdu));
+		a->a_reply.b_data = buf;
+		a->a_reply.b_size = MAX_APDU_SIZE;
+		a->a_token = pk;
+		a->a_next = pk->pt_apdu_free;
+		pk->pt_apdu_free = a;
+		++pk->pt_apdu_nfree;
+		return;
+	}
 	if (a->a_reply.b_data != NULL) {
 		freezero(a->a_reply.b_data, a->a_reply.b_size);
 	}
@@ -1645,10 +1864,9 @@ piv_apdu_get_reply(const struct apdu *apdu, size_t *len)
 }
 
 static uint8_t *
-apdu_to_buffer(struct apdu *apdu, uint *outlen)
+apdu_to_buffer(struct apdu *apdu, uint8_t buf[APDU_MAX_CMD], uint *outlen)
 {
 	struct apdubuf *d = &(apdu->a_cmd);
-	uint8_t *buf = calloc(1, 6 + d->b_len);
 	buf[0] = apdu->a_cls;
 	buf[1] = apdu->a_ins;
 	buf[2] = apdu->a_p1;
@@ -1733,10 +1951,8 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 
 	VERIFY(key->pt_intxn == B_TRUE);
 
-	cmd = apdu_to_buffer(apdu, &cmdLen);
-	VERIFY(cmd != NULL);
-	if (cmd == NULL || cmdLen < 5)
-		return (ERRF_NOMEM);
+	cmd = apdu_to_buffer(apdu, key->pt_cmdbuf, &cmdLen);
+	VERIFY(cmdLen >= 5);
 
 	if (r->b_data == NULL) {
 		r->b_data = calloc(1, MAX_APDU_SIZE);
@@ -1753,9 +1969,12 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 		    NULL);
 	}
 
+	PIVY_PROBE5(apdu__start, key->pt_rdrname, apdu->a_cls, apdu->a_ins,
+	    cmdLen - 5, apdu->a_le);
+
 	rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
 	    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
-	freezero(cmd, cmdLen);
+	explicit_bzero(cmd, cmdLen);
 
 	if (piv_full_apdu_debug) {
 		bunyan_log(BNY_TRACE, "received APDU",
@@ -1764,6 +1983,8 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	}
 
 	if (rv != SCARD_S_SUCCESS) {
+		PIVY_PROBE5(apdu__done, key->pt_rdrname, apdu->a_ins, 0, 0,
+		    (long)rv);
 		err = pcscrerrf("SCardTransmit", key->pt_rdrname, rv);
 		bunyan_log(BNY_DEBUG, "SCardTransmit failed",
 		    "error", BNY_ERF, err, NULL);
@@ -1779,6 +2000,9 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	apdu->a_sw = (r->b_data[r->b_offset + recvLength] << 8) |
 	    r->b_data[r->b_offset + recvLength + 1];
 
+	PIVY_PROBE5(apdu__done, key->pt_rdrname, apdu->a_ins, apdu->a_sw,
+	    (size_t)r->b_len, (long)rv);
+
 	bunyan_log(BNY_DEBUG, "APDU exchanged",
 	    "class", BNY_UINT, (uint)apdu->a_cls,
 	    "ins", BNY_UINT, (uint)apdu->a_ins,
@@ -1895,10 +2119,12 @@ again:
 errf_t *
 piv_txn_begin(struct piv_token *key)
 {
-	VERIFY(key->pt_intxn == B_FALSE);
 	LONG rv;
 	errf_t *err;
 	DWORD activeProtocol = 0;
+
+	VERIFY0(pthread_mutex_lock(&key->pt_lock));
+	VERIFY(key->pt_intxn == B_FALSE);
 retry:
 	rv = SCardBeginTransaction(key->pt_cardhdl);
 	if (rv == SCARD_W_RESET_CARD) {
@@ -1906,19 +2132,23 @@ retry:
 		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD,
 		    &activeProtocol);
 		if (rv == SCARD_S_SUCCESS) {
+			++key->pt_reconnects;
 			goto retry;
 		} else {
 			err = ioerrf(pcscerrf("SCardReconnect", rv),
 			    key->pt_rdrname);
+			VERIFY0(pthread_mutex_unlock(&key->pt_lock));
 			return (err);
 		}
 	}
 	if (rv != SCARD_S_SUCCESS) {
 		err = ioerrf(pcscerrf("SCardBeginTransaction", rv),
 		    key->pt_rdrname);
+		VERIFY0(pthread_mutex_unlock(&key->pt_lock));
 		return (err);
 	}
 	key->pt_intxn = B_TRUE;
+	PIVY_PROBE1(txn__begin, key->pt_rdrname);
 	return (0);
 }
 
@@ -1941,6 +2171,8 @@ piv_txn_end(struct piv_token *key)
 	if (key->pt_used_pin != PIV_NO_PIN)
 		disp = SCARD_RESET_CARD;
 
+	PIVY_PROBE2(txn__end, key->pt_rdrname, disp == SCARD_RESET_CARD);
+
 	rv = SCardEndTransaction(key->pt_cardhdl, disp);
 	if (rv != SCARD_S_SUCCESS) {
 		bunyan_log(BNY_ERROR, "SCardEndTransaction failed",
@@ -1951,6 +2183,84 @@ piv_txn_end(struct piv_token *key)
 	key->pt_intxn = B_FALSE;
 	key->pt_reset = B_FALSE;
 	key->pt_used_pin = PIV_NO_PIN;
+	VERIFY0(pthread_mutex_unlock(&key->pt_lock));
+}
+
+struct piv_card_state {
+	SCARDHANDLE	pcs_cardhdl;
+	uint		pcs_reconnects;
+	DWORD		pcs_events;
+	uint8_t		pcs_atr[MAX_ATR_SIZE];
+	DWORD		pcs_atrlen;
+};
+
+errf_t *
+piv_token_card_state(struct piv_token *tk, struct piv_card_state **pstate)
+{
+	struct piv_card_state *st;
+	SCARD_READERSTATE rs;
+	DWORD state, proto;
+	LONG rv;
+	errf_t *err;
+
+	VERIFY(tk->pt_intxn == B_TRUE);
+
+	st = calloc(1, sizeof (struct piv_card_state));
+	if (st == NULL)
+		return (ERRF_NOMEM);
+	st->pcs_cardhdl = tk->pt_cardhdl;
+	st->pcs_reconnects = tk->pt_reconnects;
+
+	/*
+	 * SCardStatus() fails with SCARD_W_RESET_CARD or SCARD_W_REMOVED_CARD
+	 * if anything happened to the card since our handle last saw it.
+	 */
+	st->pcs_atrlen = sizeof (st->pcs_atr);
+	rv = SCardStatus(tk->pt_cardhdl, NULL, NULL, &state, &proto,
+	    st->pcs_atr, &st->pcs_atrlen);
+	if (rv != SCARD_S_SUCCESS) {
+		err = ioerrf(pcscerrf("SCardStatus", rv), tk->pt_rdrname);
+		free(st);
+		return (err);
+	}
+
+	/*
+	 * pcsclite (and winscard) keep a count of card events on the reader
+	 * in the upper 16 bits of dwEventState.
+	 */
+	bzero(&rs, sizeof (rs));
+	rs.szReader = tk->pt_rdrname;
+	rs.dwCurrentState = SCARD_STATE_UNAWARE;
+	VERIFY0(pthread_mutex_lock(&tk->pt_ctx->pc_lock));
+	rv = SCardGetStatusChange(tk->pt_ctx->pc_scard, 0, &rs, 1);
+	VERIFY0(pthread_mutex_unlock(&tk->pt_ctx->pc_lock));
+	if (rv != SCARD_S_SUCCESS) {
+		err = ioerrf(pcscerrf("SCardGetStatusChange", rv),
+		    tk->pt_rdrname);
+		free(st);
+		return (err);
+	}
+	st->pcs_events = rs.dwEventState >> 16;
+
+	*pstate = st;
+	return (ERRF_OK);
+}
+
+boolean_t
+piv_card_state_equal(const struct piv_card_state *a,
+    const struct piv_card_state *b)
+{
+	return (a->pcs_cardhdl == b->pcs_cardhdl &&
+	    a->pcs_reconnects == b->pcs_reconnects &&
+	    a->pcs_events == b->pcs_events &&
+	    a->pcs_atrlen == b->pcs_atrlen &&
+	    bcmp(a->pcs_atr, b->pcs_atr, a->pcs_atrlen) == 0);
+}
+
+void
+piv_card_state_free(struct piv_card_state *st)
+{
+	free(st);
 }
 
 errf_t *
@@ -1961,7 +2271,7 @@ piv_clear_pin(struct piv_token *pk, enum piv_pin type)
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_VERIFY, 0xFF, type);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_VERIFY, 0xFF, type);
 
 	err = piv_apdu_transceive_chain(pk, apdu);
 	if (err) {
@@ -2006,7 +2316,7 @@ piv_select(struct piv_token *tk)
 
 	VERIFY(tk->pt_intxn == B_TRUE);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SELECT, SEL_APP_AID, 0);
+	apdu = piv_apdu_take(tk, CLA_ISO, INS_SELECT, SEL_APP_AID, 0);
 	apdu->a_cmd.b_data = (uint8_t *)AID_PIV;
 	apdu->a_cmd.b_len = sizeof (AID_PIV);
 
@@ -2100,7 +2410,7 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, keyalg,
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GEN_AUTH, keyalg,
 	    PIV_SLOT_ADMIN);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -2198,7 +2508,7 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 
 	pt->pt_reset = B_TRUE;
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, keyalg,
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GEN_AUTH, keyalg,
 	    PIV_SLOT_ADMIN);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -2274,7 +2584,7 @@ piv_write_pinfo(struct piv_token *pt, const struct piv_pinfo *pinfo)
 	tlv_write(tlv, (uint8_t *)data, len);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2335,7 +2645,7 @@ piv_write_chuid(struct piv_token *pt, const struct piv_chuid *chuid)
 	tlv_write(tlv, (uint8_t *)data, len);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2405,7 +2715,7 @@ piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
 	tlv_write(tlv, (uint8_t *)data, len);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2663,7 +2973,7 @@ piv_generate(struct piv_token *pt, enum piv_slotid slotid, enum piv_alg alg,
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2698,7 +3008,7 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 		    pt->pt_ykver[0], pt->pt_ykver[1], pt->pt_ykver[2]));
 	}
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_METADATA, 0x00, slot->ps_slot);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GET_METADATA, 0x00, slot->ps_slot);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -2913,7 +3223,7 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	}
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -3010,7 +3320,7 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 		goto out;
 	}
 
-	apdu = piv_apdu_make(CLA_ISO, INS_IMPORT_ASYM, alg, slotid);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_IMPORT_ASYM, alg, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -3102,6 +3412,53 @@ piv_write_keyhistory(struct piv_token *pt, uint oncard, uint offcard,
 	return (err);
 }
 
+/*
+ * Compresses a certificate the way piv_read_cert() expects to find it when
+ * CertInfo says PIV_COMP_GZIP: a single gzip member (windowBits 31).
+ */
+static errf_t *
+piv_cert_deflate(const uint8_t *data, size_t datalen, uint8_t **pout,
+    size_t *poutlen)
+{
+	z_stream strm;
+	uint8_t *out;
+	size_t outlen;
+	int rc;
+
+	bzero(&strm, sizeof (strm));
+	rc = deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8,
+	    Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) {
+		return (errf("CompressionError", NULL, "deflateInit2 "
+		    "failed: %d", rc));
+	}
+
+	outlen = deflateBound(&strm, datalen);
+	out = malloc(outlen);
+	if (out == NULL) {
+		VERIFY0(deflateEnd(&strm));
+		return (ERRF_NOMEM);
+	}
+
+	strm.avail_in = datalen;
+	strm.next_in = (uint8_t *)data;
+	strm.avail_out = outlen;
+	strm.next_out = out;
+
+	rc = deflate(&strm, Z_FINISH);
+	if (rc != Z_STREAM_END) {
+		(void) deflateEnd(&strm);
+		free(out);
+		return (errf("CompressionError", NULL, "deflate failed: %d",
+		    rc));
+	}
+	*poutlen = outlen - strm.avail_out;
+	*pout = out;
+	VERIFY0(deflateEnd(&strm));
+
+	return (ERRF_OK);
+}
+
 errf_t *
 piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
     const uint8_t *data, size_t datalen, uint flags)
@@ -3109,6 +3466,8 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 	errf_t *err;
 	struct tlv_state *tlv;
 	uint tag;
+	uint8_t *zdata = NULL;
+	size_t zlen = 0;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
@@ -3135,18 +3494,48 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 		    "%02x", slotid));
 	}
 
+	if ((flags & PIV_CI_COMPTYPE) != PIV_COMP_NONE &&
+	    (flags & PIV_CI_COMPTYPE) != PIV_COMP_GZIP) {
+		return (argerrf("flags", "a supported compression type",
+		    "%x", flags & PIV_CI_COMPTYPE));
+	}
+
 	if (data != NULL && datalen > 0) {
+		if ((flags & PIV_CI_COMPAUTO) != 0) {
+			flags &= ~PIV_CI_COMPTYPE;
+			if (datalen >= PIV_COMP_AUTO_MIN)
+				flags |= PIV_COMP_GZIP;
+		}
+		if ((flags & PIV_CI_COMPTYPE) == PIV_COMP_GZIP) {
+			err = piv_cert_deflate(data, datalen, &zdata, &zlen);
+			if (err) {
+				return (errf("WriteCertError", err, "Failed to "
+				    "compress cert for slot %02x",
+				    (uint)slotid));
+			}
+			bunyan_log(BNY_DEBUG, "compressed cert",
+			    "uncompressed_len", BNY_UINT, (uint)datalen,
+			    "compressed_len", BNY_UINT, (uint)zlen, NULL);
+			if ((flags & PIV_CI_COMPAUTO) != 0 && zlen >= datalen) {
+				flags &= ~PIV_CI_COMPTYPE;
+			} else {
+				data = zdata;
+				datalen = zlen;
+			}
+		}
+
 		tlv = tlv_init_write();
 		tlv_push(tlv, 0x70);
 		tlv_write(tlv, data, datalen);
 		tlv_pop(tlv);
 		tlv_push(tlv, 0x71);
-		tlv_write_byte(tlv, (uint8_t)flags);
+		tlv_write_byte(tlv, (uint8_t)(flags & 0xFF));
 		tlv_pop(tlv);
 
 		err = piv_write_file(pk, tag, tlv_buf(tlv), tlv_len(tlv));
 
 		tlv_free(tlv);
+		free(zdata);
 	} else {
 		err = piv_write_file(pk, tag, NULL, 0);
 	}
@@ -3171,7 +3560,8 @@ ykpiv_attest(struct piv_token *pt, struct piv_slot *slot, uint8_t **data,
 	if (!pt->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_ATTEST, (uint8_t)slot->ps_slot, 0x00);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_ATTEST, (uint8_t)slot->ps_slot,
+	    0x00);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -3239,7 +3629,7 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 	tlv_write_u8to32(tlv, tag);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -3369,12 +3759,14 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 	}
 	tlv_pop(tlv);
 
+	PIVY_PROBE2(read__cert__start, pk->pt_rdrname, slotid);
+
 	bunyan_log(BNY_DEBUG, "reading cert file",
 	    "slot", BNY_UINT, (uint)slotid,
 	    "cdata", BNY_BIN_HEX, tlv_buf(tlv), tlv_len(tlv),
 	    NULL);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -3614,6 +4006,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 	}
 
 out:
+	PIVY_PROBE3(read__cert__done, pk->pt_rdrname, slotid, err != ERRF_OK);
 	free(buf);
 	tlv_free(tlv);
 	piv_apdu_free(apdu);
@@ -3750,7 +4143,7 @@ piv_change_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 		pinbuf[i] = newpin[i - 8];
 	VERIFY(newpin[i - 8] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_CHANGE_PIN, 0x00, type);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_CHANGE_PIN, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 16;
 
@@ -3825,7 +4218,7 @@ piv_reset_pin(struct piv_token *pk, enum piv_pin type, const char *puk,
 		pinbuf[i] = newpin[i - 8];
 	VERIFY(newpin[i - 8] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_RESET_PIN, 0x00, type);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_RESET_PIN, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 16;
 
@@ -3882,7 +4275,7 @@ ykpiv_reset(struct piv_token *pt)
 	if (!pt->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_RESET, 0, 0);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_RESET, 0, 0);
 
 	err = piv_apdu_transceive(pt, apdu);
 	if (err) {
@@ -3927,7 +4320,8 @@ ykpiv_set_pin_retries(struct piv_token *pk, uint pintries, uint puktries)
 	if (!pk->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SET_PIN_RETRIES, pintries, puktries);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_SET_PIN_RETRIES, pintries,
+	    puktries);
 
 	err = piv_apdu_transceive_chain(pk, apdu);
 	if (err) {
@@ -3995,7 +4389,7 @@ ykpiv_set_admin(struct piv_token *pk, const uint8_t *key, size_t keylen,
 	databuf[2] = keylen;
 	bcopy(key, &databuf[3], keylen);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SET_MGMT, 0xFF, p2);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_SET_MGMT, 0xFF, p2);
 	apdu->a_cmd.b_data = databuf;
 	apdu->a_cmd.b_len = 3 + keylen;
 
@@ -4073,7 +4467,7 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 	 * 3 and 4 we want to do it only if canskip is set.
 	 */
 	if (pin == NULL || canskip || (retries != NULL && *retries > 0)) {
-		apdu = piv_apdu_make(CLA_ISO, INS_VERIFY, 0x00, type);
+		apdu = piv_apdu_take(pk, CLA_ISO, INS_VERIFY, 0x00, type);
 
 		err = piv_apdu_transceive_chain(pk, apdu);
 		if (err) {
@@ -4179,11 +4573,14 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 		pinbuf[i] = pin[i];
 	VERIFY(pin[i] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_VERIFY, 0x00, type);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_VERIFY, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 8;
 
+	PIVY_PROBE2(verify__pin__start, pk->pt_rdrname, type);
 	err = piv_apdu_transceive_chain(pk, apdu);
+	PIVY_PROBE3(verify__pin__done, pk->pt_rdrname, type,
+	    (err == ERRF_OK) ? apdu->a_sw : 0);
 	if (err) {
 		err = ioerrf(err, pk->pt_rdrname);
 		bunyan_log(BNY_WARN, "piv_verify_pin.transceive failed",
@@ -4230,6 +4627,81 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 	return (err);
 }
 
+/*
+ * Fills in "buf" (the "inplen"-byte input to an RSA private key operation)
+ * with the PKCS#1 v1.5 signature padding and DigestInfo around a digest.
+ * "digest" may point into "buf".
+ *
+ * ECDSA is so much nicer than this. Why can't we just use it? Oh,
+ * because Java ruined everything. Right.
+ */
+static void
+piv_sign_pkcs1_pad(enum sshdigest_types hashalgo, const uint8_t *digest,
+    size_t dglen, uint8_t *buf, size_t inplen)
+{
+	int nid;
+	size_t nread;
+	/*
+	 * Roll up your sleeves, folks, we're going in (to the dank
+	 * and musty corners of OpenSSL where few dare tread)
+	 */
+	X509_SIG *digestInfo;
+	X509_ALGOR *algor;
+	ASN1_OCTET_STRING *dgstr;
+	uint8_t *tmp, *out;
+
+	tmp = calloc(1, dglen);
+	VERIFY(tmp != NULL);
+	out = NULL;
+
+	/*
+	 * XXX: I thought this should be sha256WithRSAEncryption (etc)
+	 *      rather than just NID_sha256 but that doesn't work
+	 */
+	switch (hashalgo) {
+	case SSH_DIGEST_SHA1:
+		nid = NID_sha1;
+		break;
+	case SSH_DIGEST_SHA256:
+		nid = NID_sha256;
+		break;
+	case SSH_DIGEST_SHA512:
+		nid = NID_sha512;
+		break;
+	default:
+		VERIFY(0);
+		nid = -1;
+	}
+	bcopy(digest, tmp, dglen);
+
+	digestInfo = X509_SIG_new();
+	VERIFY(digestInfo != NULL);
+
+	X509_SIG_getm(digestInfo, &algor, &dgstr);
+
+	VERIFY(X509_ALGOR_set0(algor, OBJ_nid2obj(nid), V_ASN1_NULL,
+	    NULL) == 1);
+	VERIFY(ASN1_OCTET_STRING_set(dgstr, tmp, (int)dglen) == 1);
+
+	nread = i2d_X509_SIG(digestInfo, &out);
+	VERIFY3U(nread + 11, <=, inplen);
+
+	/*
+	 * There is another undocumented openssl function that does
+	 * this padding bit, but eh.
+	 */
+	memset(buf, 0xFF, inplen);
+	buf[0] = 0x00;
+	/* The second byte is the block type -- 0x01 here means 0xFF */
+	buf[1] = 0x01;
+	buf[inplen - nread - 1] = 0x00;
+	bcopy(out, buf + (inplen - nread), nread);
+
+	free(tmp);
+	OPENSSL_free(out);
+	X509_SIG_free(digestInfo);
+}
+
 errf_t *
 piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
     size_t datalen, enum sshdigest_types *hashalgo, uint8_t **signature,
@@ -4239,7 +4711,7 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 	errf_t *err;
 	struct ssh_digest_ctx *hctx;
 	uint8_t *buf;
-	size_t nread, dglen, inplen;
+	size_t dglen, inplen;
 	boolean_t cardhash = B_FALSE, ch_sha256 = B_FALSE, ch_sha384 = B_FALSE;
 	enum piv_alg oldalg;
 
@@ -4396,71 +4868,10 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 	/*
 	 * If it's an RSA signature, we have to generate the PKCS#1 style
 	 * padded signing blob around the hash.
-	 *
-	 * ECDSA is so much nicer than this. Why can't we just use it? Oh,
-	 * because Java ruined everything. Right.
 	 */
 	if (slot->ps_alg == PIV_ALG_RSA1024 ||
 	    slot->ps_alg == PIV_ALG_RSA2048) {
-		int nid;
-		/*
-		 * Roll up your sleeves, folks, we're going in (to the dank
-		 * and musty corners of OpenSSL where few dare tread)
-		 */
-		X509_SIG *digestInfo;
-		X509_ALGOR *algor;
-		ASN1_OCTET_STRING *digest;
-		uint8_t *tmp, *out;
-
-		tmp = calloc(1, inplen);
-		VERIFY(tmp != NULL);
-		out = NULL;
-
-		/*
-		 * XXX: I thought this should be sha256WithRSAEncryption (etc)
-		 *      rather than just NID_sha256 but that doesn't work
-		 */
-		switch (*hashalgo) {
-		case SSH_DIGEST_SHA1:
-			nid = NID_sha1;
-			break;
-		case SSH_DIGEST_SHA256:
-			nid = NID_sha256;
-			break;
-		case SSH_DIGEST_SHA512:
-			nid = NID_sha512;
-			break;
-		default:
-			VERIFY(0);
-			nid = -1;
-		}
-		bcopy(buf, tmp, dglen);
-
-		digestInfo = X509_SIG_new();
-		VERIFY(digestInfo != NULL);
-
-		X509_SIG_getm(digestInfo, &algor, &digest);
-
-		VERIFY(X509_ALGOR_set0(algor, OBJ_nid2obj(nid), V_ASN1_NULL,
-		    NULL) == 1);
-		VERIFY(ASN1_OCTET_STRING_set(digest, tmp, (int)dglen) == 1);
-
-		nread = i2d_X509_SIG(digestInfo, &out);
-
-		/*
-		 * There is another undocumented openssl function that does
-		 * this padding bit, but eh.
-		 */
-		memset(buf, 0xFF, inplen);
-		buf[0] = 0x00;
-		/* The second byte is the block type -- 0x01 here means 0xFF */
-		buf[1] = 0x01;
-		buf[inplen - nread - 1] = 0x00;
-		bcopy(out, buf + (inplen - nread), nread);
-
-		free(tmp);
-		OPENSSL_free(out);
-		X509_SIG_free(digestInfo);
+		piv_sign_pkcs1_pad(*hashalgo, buf, dglen, buf, inplen);
 	}
 
 	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
@@ -4475,47 +4886,129 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 }
 
 errf_t *
-piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
-    const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen)
+piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types hashalgo, const uint8_t *digest, size_t dglen,
+    uint8_t **signature, size_t *siglen)
 {
 	errf_t *err;
-	struct apdu *apdu;
-	struct tlv_state *tlv;
-	uint tag;
-	uint8_t *buf = NULL;
-
-	VERIFY(pk->pt_intxn == B_TRUE);
-
-	tlv = tlv_init_write();
-	tlv_push(tlv, 0x7C);
-	/* Push an empty RESPONSE tag to say that's what we're asking for. */
-	tlv_push(tlv, GA_TAG_RESPONSE);
-	tlv_pop(tlv);
-	/* And now push the data we're providing (the CHALLENGE). */
-	tlv_push(tlv, GA_TAG_CHALLENGE);
-	tlv_write(tlv, hash, hashlen);
-	tlv_pop(tlv);
-	tlv_pop(tlv);
+	uint8_t *buf;
+	size_t inplen;
+	int i;
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, pc->ps_alg, pc->ps_slot);
-	apdu->a_cmd.b_data = tlv_buf(tlv);
-	apdu->a_cmd.b_len = tlv_len(tlv);
+	VERIFY(tk->pt_intxn);
 
-	err = piv_apdu_transceive_chain(pk, apdu);
-	if (err) {
-		err = ioerrf(err, pk->pt_rdrname);
-		bunyan_log(BNY_WARN, "piv_sign_prehash.transceive_apdu failed",
-		    "error", BNY_ERF, err, NULL);
-		goto out;
+	if (dglen != ssh_digest_bytes(hashalgo)) {
+		return (argerrf("dglen", "the digest length of hashalgo",
+		    "%zu", dglen));
 	}
 
-	tlv_free(tlv);
-	tlv = NULL;
-
-	if (apdu->a_sw == SW_NO_ERROR ||
-	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
-	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
+	switch (slot->ps_alg) {
+	case PIV_ALG_RSA1024:
+		inplen = 128;
+		if (hashalgo != SSH_DIGEST_SHA1 &&
+		    hashalgo != SSH_DIGEST_SHA256)
+			goto badhash;
+		break;
+	case PIV_ALG_RSA2048:
+		inplen = 256;
+		if (hashalgo != SSH_DIGEST_SHA1 &&
+		    hashalgo != SSH_DIGEST_SHA256 &&
+		    hashalgo != SSH_DIGEST_SHA512)
+			goto badhash;
+		break;
+	case PIV_ALG_ECCP256:
+	case PIV_ALG_ECCP384:
+		inplen = (slot->ps_alg == PIV_ALG_ECCP256) ? 32 : 48;
+		/* See piv_sign(): these cards can't sign a host hash. */
+		for (i = 0; i < tk->pt_alg_count; ++i) {
+			switch (tk->pt_algs[i]) {
+			case PIV_ALG_ECCP256_SHA1:
+			case PIV_ALG_ECCP256_SHA256:
+			case PIV_ALG_ECCP384_SHA1:
+			case PIV_ALG_ECCP384_SHA256:
+			case PIV_ALG_ECCP384_SHA384:
+				return (errf("NotSupportedError", NULL,
+				    "PIV device '%s' only supports "
+				    "hash-on-card ECDSA", tk->pt_rdrname));
+			default:
+				break;
+			}
+		}
+		break;
+	default:
+		return (errf("NotSupportedError", NULL, "Unsupported key "
+		    "algorithm used in slot %x (%d) of PIV device '%s'",
+		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
+	}
+
+	buf = calloc(1, inplen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+
+	if (slot->ps_alg == PIV_ALG_RSA1024 ||
+	    slot->ps_alg == PIV_ALG_RSA2048) {
+		piv_sign_pkcs1_pad(hashalgo, digest, dglen, buf, inplen);
+	} else {
+		/* ECDSA uses the leftmost bits of a longer hash. */
+		bcopy(digest, buf, (dglen < inplen) ? dglen : inplen);
+	}
+
+	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
+	free(buf);
+
+	return (err);
+
+badhash:
+	return (errf("NotSupportedError", NULL, "Hash algorithm %s is not "
+	    "supported with key algorithm %s", ssh_digest_alg_name(hashalgo),
+	    piv_alg_to_string(slot->ps_alg)));
+}
+
+errf_t *
+piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
+    const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen)
+{
+	errf_t *err;
+	struct apdu *apdu;
+	struct tlv_state *tlv;
+	uint tag;
+	uint8_t *buf = NULL;
+
+	VERIFY(pk->pt_intxn == B_TRUE);
+
+	PIVY_PROBE4(sign__start, pk->pt_rdrname, pc->ps_slot, pc->ps_alg,
+	    hashlen);
+
+	tlv = tlv_init_write();
+	tlv_push(tlv, 0x7C);
+	/* Push an empty RESPONSE tag to say that's what we're asking for. */
+	tlv_push(tlv, GA_TAG_RESPONSE);
+	tlv_pop(tlv);
+	/* And now push the data we're providing (the CHALLENGE). */
+	tlv_push(tlv, GA_TAG_CHALLENGE);
+	tlv_write(tlv, hash, hashlen);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GEN_AUTH, pc->ps_alg, pc->ps_slot);
+	apdu->a_cmd.b_data = tlv_buf(tlv);
+	apdu->a_cmd.b_len = tlv_len(tlv);
+
+	err = piv_apdu_transceive_chain(pk, apdu);
+	if (err) {
+		err = ioerrf(err, pk->pt_rdrname);
+		bunyan_log(BNY_WARN, "piv_sign_prehash.transceive_apdu failed",
+		    "error", BNY_ERF, err, NULL);
+		goto out;
+	}
+
+	tlv_free(tlv);
+	tlv = NULL;
+
+	if (apdu->a_sw == SW_NO_ERROR ||
+	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
+	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
+		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
 		    apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
@@ -4564,6 +5057,7 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	}
 
 out:
+	PIVY_PROBE3(sign__done, pk->pt_rdrname, pc->ps_slot, err != ERRF_OK);
 	free(buf);
 	tlv_free(tlv);
 	piv_apdu_free(apdu);
@@ -4589,6 +5083,8 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 
 	VERIFY(pk->pt_intxn);
 
+	PIVY_PROBE3(ecdh__start, pk->pt_rdrname, slot->ps_slot, slot->ps_alg);
+
 	sbuf = sshbuf_new();
 	VERIFY(sbuf != NULL);
 	VERIFY3S(pubkey->type, ==, KEY_ECDSA);
@@ -4610,7 +5106,7 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 
 	buf = NULL;
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, slot->ps_alg,
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GEN_AUTH, slot->ps_alg,
 	    slot->ps_slot);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -4669,6 +5165,7 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	}
 
 out:
+	PIVY_PROBE3(ecdh__done, pk->pt_rdrname, slot->ps_slot, err != ERRF_OK);
 	free(buf);
 	tlv_free(tlv);
 	piv_apdu_free(apdu);
@@ -6095,7 +6592,7 @@ piv_read_pinfo(struct piv_token *pk, struct piv_pinfo **outp)
 	tlv_write_u8to32(tlv, PIV_TAG_PRINTINFO);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -6768,45 +7265,171 @@ piv_pinfo_get_kv(const struct piv_pinfo *pp, const char *key, size_t *len)
 	return (kv->ppk_data);
 }
 
-errf_t *
-piv_box_open_agent(int fd, struct piv_ecdh_box *box)
+/*
+ * Depth of the request pipeline in piv_box_open_agent_many(). We write this
+ * many requests before reading any replies back, which keeps everything
+ * comfortably within the socket buffers on both ends (so neither we nor the
+ * agent can block writing while the other is also writing).
+ */
+#define	PIV_AGENT_PIPELINE	32
+
+/* Upper limit on an agent reply, same as OpenSSH's authfd.c */
+#define	PIV_AGENT_MAX_REPLY	(256 * 1024)
+
+/* One for each of the curves PIV supports (P-256, P-384, P-521) */
+#define	PIV_AGENT_NTMP		3
+
+struct piv_agent_tmpkey {
+	uint			 pat_bits;
+	struct sshkey		*pat_priv;
+	struct sshkey		*pat_pub;
+};
+
+struct piv_agent {
+	int			 pa_fd;
+	struct ssh_identitylist	*pa_idl;
+	boolean_t		 pa_has_rebox;
+	boolean_t		 pa_has_ecdh;
+	/* Ephemeral keys the agent re-boxes to, one per curve. */
+	struct piv_agent_tmpkey	 pa_tmp[PIV_AGENT_NTMP];
+};
+
+/*
+ * The agent socket may be non-blocking (e.g. if the caller got it from
+ * ssh_get_authentication_socket() and set it that way), so on EAGAIN we
+ * wait for it to become ready rather than spinning.
+ */
+static errf_t *
+agent_wait(int fd, short events)
 {
-	struct piv_ecdh_box *rebox = NULL;
-	struct sshkey *pubkey, *temp = NULL, *temppub = NULL;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, -1) == -1) {
+		if (errno != EINTR)
+			return (errfno("poll", errno, "waiting for SSH agent"));
+	}
+	return (ERRF_OK);
+}
+
+static errf_t *
+agent_write(int fd, const uint8_t *buf, size_t len)
+{
+	size_t off;
+	ssize_t w;
 	errf_t *err;
-	int rc;
-	uint i;
+
+	for (off = 0; off < len; ) {
+		w = write(fd, buf + off, len - off);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w == -1 && errno == EAGAIN) {
+			if ((err = agent_wait(fd, POLLOUT)))
+				return (err);
+			continue;
+		}
+		if (w == -1)
+			return (errfno("write", errno, "writing to SSH agent"));
+		if (w == 0) {
+			return (errf("SSHAgentError", NULL, "SSH agent "
+			    "connection closed"));
+		}
+		off += w;
+	}
+	return (ERRF_OK);
+}
+
+static errf_t *
+agent_send(int fd, const struct sshbuf *msg)
+{
+	uint8_t lenbuf[4];
 	size_t len;
-	uint8_t code;
-	uint32_t nexts;
-	char *extname;
-	int has_rebox = 0, has_ecdh = 0;
-	struct ssh_identitylist *idl = NULL;
-	struct sshbuf *req = NULL, *buf = NULL, *boxbuf = NULL, *reply = NULL;
-	struct sshbuf *datab = NULL;
-	uint8_t *sec = NULL;
-	size_t seclen;
-	boolean_t found = B_FALSE;
+	errf_t *err;
 
-	pubkey = piv_box_pubkey(box);
+	len = sshbuf_len(msg);
+	lenbuf[0] = (len >> 24) & 0xff;
+	lenbuf[1] = (len >> 16) & 0xff;
+	lenbuf[2] = (len >> 8) & 0xff;
+	lenbuf[3] = len & 0xff;
 
-	rc = ssh_fetch_identitylist(fd, &idl);
-	if (rc) {
-		err = ssherrf("ssh_fetch_identitylist", rc);
-		goto out;
-	}
+	if ((err = agent_write(fd, lenbuf, sizeof (lenbuf))))
+		return (err);
+	return (agent_write(fd, sshbuf_ptr(msg), len));
+}
 
-	for (i = 0; i < idl->nkeys; ++i) {
-		if (sshkey_equal_public(idl->keys[i], pubkey)) {
-			found = B_TRUE;
-			break;
+static errf_t *
+agent_read(int fd, uint8_t *buf, size_t len)
+{
+	size_t off;
+	ssize_t r;
+	errf_t *err;
+
+	for (off = 0; off < len; ) {
+		r = read(fd, buf + off, len - off);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN) {
+			if ((err = agent_wait(fd, POLLIN)))
+				return (err);
+			continue;
+		}
+		if (r == -1)
+			return (errfno("read", errno, "reading from SSH agent"));
+		if (r == 0) {
+			return (errf("SSHAgentError", NULL, "SSH agent "
+			    "connection closed"));
 		}
+		off += r;
 	}
-	if (!found) {
-		err = errf("KeyNotFound", NULL, "No matching key found in "
-		    "SSH agent");
-		goto out;
+	return (ERRF_OK);
+}
+
+static errf_t *
+agent_recv(int fd, struct sshbuf *reply)
+{
+	uint8_t lenbuf[4], buf[4096];
+	size_t len, n;
+	errf_t *err;
+	int rc;
+
+	sshbuf_reset(reply);
+	if ((err = agent_read(fd, lenbuf, sizeof (lenbuf))))
+		return (err);
+	len = ((size_t)lenbuf[0] << 24) | ((size_t)lenbuf[1] << 16) |
+	    ((size_t)lenbuf[2] << 8) | lenbuf[3];
+	if (len > PIV_AGENT_MAX_REPLY) {
+		return (errf("SSHAgentError", NULL, "SSH agent reply too "
+		    "long (%zu bytes)", len));
+	}
+	while (len > 0) {
+		n = (len > sizeof (buf)) ? sizeof (buf) : len;
+		if ((err = agent_read(fd, buf, n)))
+			goto out;
+		if ((rc = sshbuf_put(reply, buf, n))) {
+			err = ssherrf("sshbuf_put", rc);
+			goto out;
+		}
+		len -= n;
 	}
+	err = ERRF_OK;
+out:
+	explicit_bzero(buf, sizeof (buf));
+	return (err);
+}
+
+static errf_t *
+agent_query_exts(struct piv_agent *pa)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	errf_t *err;
+	int rc;
+	uint i;
+	uint8_t code;
+	uint32_t nexts;
+	char *extname;
+	size_t len;
 
 	req = sshbuf_new();
 	reply = sshbuf_new();
@@ -6827,7 +7450,7 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 		err = ssherrf("sshbuf_put_u32", rc);
 		goto out;
 	}
-	rc = ssh_request_reply(fd, req, reply);
+	rc = ssh_request_reply(pa->pa_fd, req, reply);
 	if (rc) {
 		err = ssherrf("ssh_request_reply", rc);
 		goto out;
@@ -6852,15 +7475,148 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 			goto out;
 		}
 		if (strcmp("ecdh-rebox@joyent.com", extname) == 0)
-			has_rebox = 1;
+			pa->pa_has_rebox = B_TRUE;
 		else if (strcmp("ecdh@joyent.com", extname) == 0)
-			has_ecdh = 1;
+			pa->pa_has_ecdh = B_TRUE;
 		free(extname);
 		extname = NULL;
 	}
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	return (err);
+}
+
+errf_t *
+piv_agent_open(int fd, struct piv_agent **pap)
+{
+	struct piv_agent *pa;
+	errf_t *err;
+	int rc;
+
+	pa = calloc(1, sizeof (struct piv_agent));
+	if (pa == NULL)
+		return (ERRF_NOMEM);
+	pa->pa_fd = fd;
+
+	rc = ssh_fetch_identitylist(fd, &pa->pa_idl);
+	if (rc) {
+		err = ssherrf("ssh_fetch_identitylist", rc);
+		goto out;
+	}
+
+	/*
+	 * An agent without the query extension (or without the ECDH ones)
+	 * is still useful to have a handle on, we just won't be able to
+	 * open any boxes with it.
+	 */
+	err = agent_query_exts(pa);
+	if (errf_caused_by(err, "NotSupportedError")) {
+		errf_free(err);
+		err = ERRF_OK;
+	}
+
+out:
+	if (err) {
+		piv_agent_close(pa);
+		return (err);
+	}
+	*pap = pa;
+	return (ERRF_OK);
+}
+
+void
+piv_agent_close(struct piv_agent *pa)
+{
+	uint i;
+
+	if (pa == NULL)
+		return;
+	for (i = 0; i < PIV_AGENT_NTMP; ++i) {
+		sshkey_free(pa->pa_tmp[i].pat_priv);
+		sshkey_free(pa->pa_tmp[i].pat_pub);
+	}
+	ssh_free_identitylist(pa->pa_idl);
+	free(pa);
+}
+
+boolean_t
+piv_agent_has_key(const struct piv_agent *pa, const struct sshkey *pubkey,
+    const char **comment)
+{
+	uint i;
+
+	for (i = 0; i < pa->pa_idl->nkeys; ++i) {
+		if (sshkey_equal_public(pa->pa_idl->keys[i], pubkey)) {
+			if (comment != NULL)
+				*comment = pa->pa_idl->comments[i];
+			return (B_TRUE);
+		}
+	}
+	return (B_FALSE);
+}
+
+static errf_t *
+agent_tmpkey(struct piv_agent *pa, uint bits, struct piv_agent_tmpkey **patp)
+{
+	struct piv_agent_tmpkey *pat;
+	uint i;
+	int rc;
+
+	for (i = 0; i < PIV_AGENT_NTMP; ++i) {
+		pat = &pa->pa_tmp[i];
+		if (pat->pat_bits == bits) {
+			*patp = pat;
+			return (ERRF_OK);
+		}
+		if (pat->pat_bits == 0)
+			break;
+	}
+	if (i >= PIV_AGENT_NTMP) {
+		return (errf("NotSupportedError", NULL, "unsupported curve "
+		    "size %u", bits));
+	}
+
+	rc = sshkey_generate(KEY_ECDSA, bits, &pat->pat_priv);
+	if (rc)
+		return (ssherrf("sshkey_generate", rc));
+	if ((rc = sshkey_demote(pat->pat_priv, &pat->pat_pub))) {
+		sshkey_free(pat->pat_priv);
+		pat->pat_priv = NULL;
+		return (ssherrf("sshkey_demote", rc));
+	}
+	pat->pat_bits = bits;
+	*patp = pat;
+	return (ERRF_OK);
+}
+
+/*
+ * Writes the request to open box (either an ecdh-rebox@ or ecdh@ extension
+ * request, preferring rebox) into req.
+ */
+static errf_t *
+agent_box_request(struct piv_agent *pa, struct piv_ecdh_box *box,
+    struct sshbuf *req)
+{
+	struct sshkey *pubkey;
+	struct piv_agent_tmpkey *pat;
+	struct sshbuf *buf = NULL, *boxbuf = NULL;
+	errf_t *err;
+	int rc;
+
+	pubkey = piv_box_pubkey(box);
+	if (!piv_agent_has_key(pa, pubkey, NULL)) {
+		return (errf("KeyNotFound", NULL, "No matching key found in "
+		    "SSH agent"));
+	}
+	if (!pa->pa_has_rebox && !pa->pa_has_ecdh) {
+		return (errf("NotSupportedError", NULL, "SSH agent does not "
+		    "support ECDH extensions"));
+	}
 
 	sshbuf_reset(req);
-	sshbuf_reset(reply);
 	buf = sshbuf_new();
 	boxbuf = sshbuf_new();
 	if (buf == NULL || boxbuf == NULL) {
@@ -6868,16 +7624,9 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 		goto out;
 	}
 
-	if (has_rebox) {
-		rc = sshkey_generate(KEY_ECDSA, sshkey_size(pubkey), &temp);
-		if (rc) {
-			err = ssherrf("sshkey_generate", rc);
-			goto out;
-		}
-		if ((rc = sshkey_demote(temp, &temppub))) {
-			err = ssherrf("sshkey_demote", rc);
+	if (pa->pa_has_rebox) {
+		if ((err = agent_tmpkey(pa, sshkey_size(pubkey), &pat)))
 			goto out;
-		}
 
 		if ((rc = sshbuf_put_u8(req, SSH_AGENTC_EXTENSION))) {
 			err = ssherrf("sshbuf_put_u8", rc);
@@ -6900,7 +7649,7 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 			goto out;
 		}
 		sshbuf_reset(boxbuf);
-		if ((rc = sshkey_putb(temppub, boxbuf))) {
+		if ((rc = sshkey_putb(pat->pat_pub, boxbuf))) {
 			err = ssherrf("sshkey_putb", rc);
 			goto out;
 		}
@@ -6917,23 +7666,85 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 			err = ssherrf("sshbuf_put_stringb", rc);
 			goto out;
 		}
+		err = ERRF_OK;
+		goto out;
+	}
 
-		rc = ssh_request_reply(fd, req, reply);
-		if (rc) {
-			err = ssherrf("ssh_request_reply", rc);
-			goto out;
-		}
+	if ((rc = sshkey_putb(pubkey, boxbuf))) {
+		err = ssherrf("sshkey_putb", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_stringb(buf, boxbuf))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+	sshbuf_reset(boxbuf);
+	if ((rc = sshkey_putb(box->pdb_ephem_pub, boxbuf))) {
+		err = ssherrf("sshkey_putb", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_stringb(buf, boxbuf))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_u32(buf, 0))) {
+		err = ssherrf("sshbuf_put_u32", rc);
+		goto out;
+	}
 
-		if ((rc = sshbuf_get_u8(reply, &code))) {
-			err = ssherrf("sshbuf_get_u8", rc);
-			goto out;
-		}
+	if ((rc = sshbuf_put_u8(req, SSH_AGENTC_EXTENSION))) {
+		err = ssherrf("sshbuf_put_u8", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_cstring(req, "ecdh@joyent.com"))) {
+		err = ssherrf("sshbuf_put_cstring", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_stringb(req, buf))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(buf);
+	sshbuf_free(boxbuf);
+	return (err);
+}
+
+/*
+ * Processes the agent's reply to a request made by agent_box_request(),
+ * opening the box.
+ */
+static errf_t *
+agent_box_reply(struct piv_agent *pa, struct piv_ecdh_box *box,
+    struct sshbuf *reply)
+{
+	struct piv_ecdh_box *rebox = NULL;
+	struct piv_agent_tmpkey *pat;
+	struct sshbuf *boxbuf = NULL, *datab = NULL;
+	uint8_t *sec = NULL;
+	size_t seclen;
+	uint8_t code;
+	errf_t *err;
+	int rc;
+
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+
+	if (pa->pa_has_rebox) {
 		if (code != SSH_AGENT_SUCCESS) {
 			err = errf("SSHAgentError", NULL, "SSH agent returned "
 			    "message code %d to rebox request", (int)code);
 			goto out;
 		}
-		sshbuf_reset(boxbuf);
+		boxbuf = sshbuf_new();
+		if (boxbuf == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
 		if ((rc = sshbuf_get_stringb(reply, boxbuf))) {
 			err = ssherrf("sshbuf_get_stringb", rc);
 			goto out;
@@ -6942,94 +7753,140 @@ piv_box_open_agent(int fd, struct piv_ecdh_box *box)
 		if ((err = sshbuf_get_piv_box(boxbuf, &rebox)))
 			goto out;
 
-		if ((err = piv_box_open_offline(temp, rebox)))
+		if ((err = agent_tmpkey(pa, sshkey_size(piv_box_pubkey(box)),
+		    &pat)))
+			goto out;
+		if ((err = piv_box_open_offline(pat->pat_priv, rebox)))
 			goto out;
 
 		if ((err = piv_box_take_datab(rebox, &datab)))
 			goto out;
 
-		if ((err = piv_box_set_datab(box, datab)))
-			goto out;
+		err = piv_box_set_datab(box, datab);
+		goto out;
+	}
 
-		err = ERRF_OK;
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to ECDH request", (int)code);
+		goto out;
+	}
+	if ((rc = sshbuf_get_string(reply, &sec, &seclen))) {
+		err = ssherrf("sshbuf_get_string", rc);
 		goto out;
 	}
 
-	if (has_ecdh) {
-		if ((rc = sshkey_putb(pubkey, boxbuf))) {
-			err = ssherrf("sshkey_putb", rc);
-			goto out;
-		}
-		if ((rc = sshbuf_put_stringb(buf, boxbuf))) {
-			err = ssherrf("sshbuf_put_stringb", rc);
-			goto out;
-		}
-		sshbuf_reset(boxbuf);
-		if ((rc = sshkey_putb(box->pdb_ephem_pub, boxbuf))) {
-			err = ssherrf("sshkey_putb", rc);
-			goto out;
-		}
-		if ((rc = sshbuf_put_stringb(buf, boxbuf))) {
-			err = ssherrf("sshbuf_put_stringb", rc);
-			goto out;
-		}
-		if ((rc = sshbuf_put_u32(buf, 0))) {
-			err = ssherrf("sshbuf_put_u32", rc);
-			goto out;
-		}
+	err = piv_box_open_common(sec, seclen, box);
 
-		if ((rc = sshbuf_put_u8(req, SSH_AGENTC_EXTENSION))) {
-			err = ssherrf("sshbuf_put_u8", rc);
-			goto out;
-		}
-		if ((rc = sshbuf_put_cstring(req, "ecdh@joyent.com"))) {
-			err = ssherrf("sshbuf_put_cstring", rc);
-			goto out;
-		}
-		if ((rc = sshbuf_put_stringb(req, buf))) {
-			err = ssherrf("sshbuf_put_stringb", rc);
-			goto out;
-		}
+out:
+	sshbuf_free(boxbuf);
+	sshbuf_free(datab);
+	piv_box_free(rebox);
+	return (err);
+}
 
-		rc = ssh_request_reply(fd, req, reply);
-		if (rc) {
-			err = ssherrf("ssh_request_reply", rc);
-			goto out;
-		}
+errf_t *
+piv_box_open_agent_many(struct piv_agent *pa, struct piv_ecdh_box **boxes,
+    uint n, errf_t **errs)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	boolean_t *sent = NULL;
+	errf_t *err;
+	uint base, lim, i;
 
-		if ((rc = sshbuf_get_u8(reply, &code))) {
-			err = ssherrf("sshbuf_get_u8", rc);
-			goto out;
+	for (i = 0; i < n; ++i)
+		errs[i] = NULL;
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	sent = calloc(n, sizeof (boolean_t));
+	if (req == NULL || reply == NULL || sent == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	for (base = 0; base < n; base = lim) {
+		lim = base + PIV_AGENT_PIPELINE;
+		if (lim > n)
+			lim = n;
+
+		for (i = base; i < lim; ++i) {
+			errs[i] = agent_box_request(pa, boxes[i], req);
+			if (errs[i] != ERRF_OK)
+				continue;
+			if ((err = agent_send(pa->pa_fd, req)))
+				goto out;
+			sent[i] = B_TRUE;
 		}
-		if (code != SSH_AGENT_SUCCESS) {
-			err = errf("SSHAgentError", NULL, "SSH agent returned "
-			    "message code %d to ECDH request", (int)code);
-			goto out;
+		for (i = base; i < lim; ++i) {
+			if (!sent[i])
+				continue;
+			if ((err = agent_recv(pa->pa_fd, reply)))
+				goto out;
+			sent[i] = B_FALSE;
+			errs[i] = agent_box_reply(pa, boxes[i], reply);
 		}
-		if ((rc = sshbuf_get_string(reply, &sec, &seclen))) {
-			err = ssherrf("sshbuf_get_string", rc);
-			goto out;
+	}
+	err = ERRF_OK;
+
+out:
+	/*
+	 * If the connection failed part-way, make sure every box we didn't
+	 * get to has an error of its own.
+	 */
+	for (i = 0; err != ERRF_OK && i < n; ++i) {
+		if (errs[i] == ERRF_OK && piv_box_sealed(boxes[i])) {
+			errs[i] = errf("SSHAgentError", NULL, "SSH agent "
+			    "connection failed before box was opened");
 		}
+	}
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	free(sent);
+	return (err);
+}
+
+errf_t *
+piv_box_open_agentc(struct piv_agent *pa, struct piv_ecdh_box *box)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	errf_t *err;
+	int rc;
 
-		err = piv_box_open_common(sec, seclen, box);
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	if (req == NULL || reply == NULL) {
+		err = ERRF_NOMEM;
 		goto out;
 	}
 
-	err = errf("NotSupportedError", NULL, "SSH agent does not support "
-	    "ECDH extensions");
+	if ((err = agent_box_request(pa, box, req)))
+		goto out;
+
+	rc = ssh_request_reply(pa->pa_fd, req, reply);
+	if (rc) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+
+	err = agent_box_reply(pa, box, reply);
 
 out:
 	sshbuf_free(req);
 	sshbuf_free(reply);
-	sshbuf_free(buf);
-	sshbuf_free(boxbuf);
-	sshbuf_free(datab);
+	return (err);
+}
 
-	sshkey_free(temp);
-	sshkey_free(temppub);
+errf_t *
+piv_box_open_agent(int fd, struct piv_ecdh_box *box)
+{
+	struct piv_agent *pa;
+	errf_t *err;
 
-	ssh_free_identitylist(idl);
-	piv_box_free(rebox);
+	if ((err = piv_agent_open(fd, &pa)))
+		return (err);
+	err = piv_box_open_agentc(pa, box);
+	piv_agent_close(pa);
 	return (err);
 }
 
@@ -7049,7 +7906,7 @@ piv_read_cardcap(struct piv_token *pk, struct piv_cardcap **outp)
 	tlv_write_u8to32(tlv, PIV_TAG_CARDCAP);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -7134,7 +7991,7 @@ piv_write_cardcap(struct piv_token *pt, const struct piv_cardcap *pinfo)
 	tlv_write(tlv, (uint8_t *)data, len);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_take(pt, CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -100,6 +100,16 @@
  * YubicoPIV-specific commands and options are generally prefixed with "YK"
  * (e.g. ykpiv_generate for the version of the piv_generate function with
  * YubicoPIV extensions).
+ *
+ * Threading: a piv_ctx and its tokens may be shared between threads. The
+ * piv_ctx functions (piv_enumerate, piv_find, piv_release etc) lock the
+ * context internally, and piv_txn_begin() takes a per-token lock which is held
+ * until piv_txn_end() (which must be called from the same thread). Only the
+ * thread holding a token's transaction may use it for anything which requires
+ * a transaction. piv_close() must not race with any other use of the context.
+ *
+ * pcsclite serialises all calls made on one SCARDCONTEXT, so to operate on
+ * several tokens in parallel, give each thread its own piv_ctx.
  */
 
 /*
@@ -430,6 +440,9 @@ uint32_t ykpiv_token_serial(const struct piv_token *token);
 /*
  * Gets a reference to a particular key/cert slot on the card. This must have
  * been enumerated using piv_read_cert, or else this will return NULL.
+ *
+ * Not safe against a piv_op_read_cert() running on the same token (see the
+ * comment above piv_op_sign()).
  */
 struct piv_slot *piv_get_slot(struct piv_token *tk, enum piv_slotid slotid);
 
@@ -491,6 +504,9 @@ enum piv_slot_auth piv_slot_get_auth(struct piv_token *key,
  * Begins a new transaction on the card. Needs to be called before any
  * interaction with the card is possible.
  *
+ * If another thread has a transaction open on this token, blocks until it
+ * calls piv_txn_end().
+ *
  * Errors:
  *  - IOError: general communication failure
  */
@@ -505,6 +521,36 @@ void piv_txn_end(struct piv_token *key);
 /* Returns true if the token is in an open transaction (from piv_txn_begin) */
 boolean_t piv_token_in_txn(const struct piv_token *token);
 
+/*
+ * A snapshot of the physical card session behind a token: the PCSC handle,
+ * the reader's card event counter, the card's ATR, and how many times the
+ * handle has had to be reconnected after a reset. If two snapshots taken
+ * from the same token compare equal, the card has not been removed,
+ * swapped or reset in between. This lets callers skip re-proving things
+ * about the card (e.g. piv_auth_key() against the CAK) on every use.
+ *
+ * Must be called inside a transaction.
+ *
+ * Errors:
+ *  - IOError: the card was removed or reset, or PCSC failed
+ */
+struct piv_card_state;
+
+MUST_CHECK
+errf_t *piv_token_card_state(struct piv_token *tk,
+    struct piv_card_state **pstate);
+boolean_t piv_card_state_equal(const struct piv_card_state *a,
+    const struct piv_card_state *b);
+void piv_card_state_free(struct piv_card_state *st);
+
+/*
+ * Returns how many APDU buffers the token has had to allocate, and how many
+ * times one was reused from its free list instead. Once the free list has
+ * warmed up, repeated operations should only ever add to "reused".
+ */
+void piv_token_apdu_stats(const struct piv_token *tk, uint64_t *allocated,
+    uint64_t *reused);
+
 /*
  * Selects the PIV applet on the card. You should run this first in each
  * txn to prepare the card for other PIV commands.
@@ -653,6 +699,11 @@ errf_t *ykpiv_import(struct piv_token *tk, enum piv_slotid slotid,
  * Loads a certificate for a given slot on the token.
  *
  * "flags" should include bits from enum piv_certinfo_flags (and piv_cert_comp).
+ * With PIV_COMP_GZIP the cert is gzip-compressed before it's written (and
+ * piv_read_cert() inflates it again), which saves GET DATA round trips on
+ * every read and lets large certs fit on cards with small objects. Setting
+ * PIV_CI_COMPAUTO instead compresses only certs of 1k or more, and only if
+ * that makes them smaller.
  *
  * Errors:
  *  - IOError: general card communication failure
@@ -660,6 +711,8 @@ errf_t *ykpiv_import(struct piv_token *tk, enum piv_slotid slotid,
  *  - PermissionError: admin authentication required to write a cert
  *  - NotSupportedError: slot unsupported
  *  - APDUError: other card error
+ *  - ArgumentError: unknown compression type in flags
+ *  - WriteCertError: compressing the cert failed
  */
 MUST_CHECK
 errf_t *piv_write_cert(struct piv_token *tk, enum piv_slotid slotid,
@@ -963,6 +1016,29 @@ MUST_CHECK
 errf_t *piv_sign_prehash(struct piv_token *tk, struct piv_slot *slot,
     const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen);
 
+/*
+ * Signs a digest the caller has already computed (e.g. incrementally over
+ * a large file with ssh_digest_update()), using the key in "slot".
+ *
+ * Unlike piv_sign_prehash(), which sends its input to the card untouched,
+ * this does the same per-algorithm work as piv_sign() does after hashing
+ * (PKCS#1 padding for RSA, fitting the hash to the curve size for EC), so
+ * the resulting signature is the same as piv_sign() over the whole data
+ * with the same "hashalgo".
+ *
+ * "dglen" must be ssh_digest_bytes(hashalgo).
+ *
+ * Errors:
+ *   - same as piv_sign(), plus
+ *   - NotSupportedError: the card can only do hash-on-card ECDSA, or
+ *                        "hashalgo" can't be used with this key algorithm
+ *   - ArgumentError: "dglen" doesn't match "hashalgo"
+ */
+MUST_CHECK
+errf_t *piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types hashalgo, const uint8_t *digest, size_t dglen,
+    uint8_t **signature, size_t *siglen);
+
 /*
  * Performs an ECDH key derivation between the private key on the token and
  * the given EC public key.
@@ -1040,6 +1116,21 @@ errf_t *piv_box_take_datab(struct piv_ecdh_box *box, struct sshbuf **buf);
 MUST_CHECK
 errf_t *piv_box_open_agent(int fd, struct piv_ecdh_box *box);
 
+/*
+ * A handle on an ssh-agent connection (normally to pivy-agent) for opening
+ * boxes. It fetches the agent's identity list and supported extensions once
+ * when opened, rather than on every box like piv_box_open_agent() does. The
+ * fd is not closed by piv_agent_close().
+ */
+struct piv_agent;
+
+MUST_CHECK
+errf_t *piv_agent_open(int fd, struct piv_agent **pa);
+void piv_agent_close(struct piv_agent *pa);
+
+boolean_t piv_agent_has_key(const struct piv_agent *pa,
+    const struct sshkey *pubkey, const char **comment);
+
 /*
  * Errors:
  *  - KeyNotFound
@@ -1047,7 +1138,86 @@ errf_t *piv_box_open_agent(int fd, struct piv_ecdh_box *box);
  *  - SSHAgentError
  */
 MUST_CHECK
-errf_t *piv_box_open_agent(int fd, struct piv_ecdh_box *box);
+errf_t *piv_box_open_agentc(struct piv_agent *pa, struct piv_ecdh_box *box);
+
+/*
+ * Opens n boxes via the agent, pipelining the requests. errs[i] is set to
+ * the result for boxes[i] (with the same errors as piv_box_open_agentc()).
+ * The return value is an error only if the agent connection itself failed,
+ * in which case every box which was not opened also has an error in errs.
+ */
+MUST_CHECK
+errf_t *piv_box_open_agent_many(struct piv_agent *pa,
+    struct piv_ecdh_box **boxes, uint n, errf_t **errs);
+
+/*
+ * Asynchronous operations on a token.
+ *
+ * Each of the piv_op_* submit functions starts the operation in the
+ * background and returns a handle at once. The whole sequence (transaction,
+ * piv_select(), optional PIN VERIFY, the operation itself) happens inside it,
+ * so the token must not be in a transaction in the calling thread. If pin is
+ * non-NULL it's verified (as pintype) before the operation.
+ *
+ * piv_op_fd() returns an fd which polls readable once the operation is done
+ * (don't read from it or close it). Then collect the result with
+ * piv_op_result() (or piv_op_sign_result()/piv_op_ecdh_result(), which also
+ * hand over the output) and release the handle with piv_op_free(). The
+ * result functions block until the operation is done if called early, and
+ * may be called only once per op. piv_op_free() also waits for completion:
+ * operations can't be cancelled once they're on the card.
+ *
+ * Operations on the same token run one at a time, in no particular order.
+ * The token, slot and box passed in must remain valid until the op is done,
+ * and the box must not be touched until then. Data and public keys are
+ * copied.
+ *
+ * piv_op_read_cert() updates the token's slot list from the worker thread,
+ * just as piv_read_cert() would: it may add a slot, and it frees and replaces
+ * the cert, public key and subject/issuer strings of an existing one. So
+ * while a read_cert op on a token is outstanding, don't call piv_get_slot(),
+ * piv_slot_next() or piv_force_slot() on that token, and don't use anything
+ * previously returned by the piv_slot_* accessors for the slot being read
+ * (re-fetch them once the op is done). Nothing locks these against the
+ * worker: the token's lock is held for whole transactions, including ones
+ * the caller itself is in the middle of.
+ *
+ * Errors from submission:
+ *  - SystemError (or errno macro): couldn't create the pipe or thread
+ * The results have the same errors as piv_sign(), piv_ecdh(),
+ * piv_read_cert(), piv_box_open() and piv_verify_pin().
+ */
+struct piv_op;
+
+MUST_CHECK
+errf_t *piv_op_sign(struct piv_token *tk, struct piv_slot *slot,
+    const uint8_t *data, size_t datalen, enum sshdigest_types hashalgo,
+    enum piv_pin pintype, const char *pin, struct piv_op **op);
+MUST_CHECK
+errf_t *piv_op_ecdh(struct piv_token *tk, struct piv_slot *slot,
+    struct sshkey *pubkey, enum piv_pin pintype, const char *pin,
+    struct piv_op **op);
+MUST_CHECK
+errf_t *piv_op_read_cert(struct piv_token *tk, enum piv_slotid slotid,
+    struct piv_op **op);
+MUST_CHECK
+errf_t *piv_op_box_open(struct piv_token *tk, struct piv_slot *slot,
+    struct piv_ecdh_box *box, enum piv_pin pintype, const char *pin,
+    struct piv_op **op);
+
+int piv_op_fd(const struct piv_op *op);
+/* Returns B_TRUE if the op is done (i.e. its result won't block). */
+boolean_t piv_op_done(struct piv_op *op);
+
+MUST_CHECK
+errf_t *piv_op_result(struct piv_op *op);
+MUST_CHECK
+errf_t *piv_op_sign_result(struct piv_op *op, enum sshdigest_types *hashalgo,
+    uint8_t **signature, size_t *siglen);
+MUST_CHECK
+errf_t *piv_op_ecdh_result(struct piv_op *op, uint8_t **secret,
+    size_t *seclen);
+void piv_op_free(struct piv_op *op);
 
 MUST_CHECK
 errf_t *sshbuf_put_piv_box(struct sshbuf *buf, struct piv_ecdh_box *box);
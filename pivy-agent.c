@@ -109,6 +109,7 @@
 #include "piv.h"
 #include "errf.h"
 #include "slot-spec.h"
+#include "pivy-probes.h"
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -134,6 +135,10 @@
 #include <libproc.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #include "openssh/digest.h"
 #include "openssh/cipher.h"
 #include "openssh/ssherr.h"
@@ -234,14 +239,29 @@ typedef enum sessbind {
 	SESSBIND_FWD
 } sessbind_t;
 
+/*
+ * We keep an entry for each client process (identified by pid and start
+ * time) which has connected to us, so we can track how many connections it
+ * has made and when the user last approved it. Entries are hashed by pid.
+ */
 typedef struct pid_entry {
-	boolean_t	pe_valid;
-	uint64_t	pe_time;
-	pid_t		pe_pid;
-	uint64_t	pe_start_time;
-	uint		pe_conn_count;
-	uint64_t	pe_last_auth;
+	struct pid_entry	*pe_next;
+	uint64_t		 pe_time;
+	pid_t			 pe_pid;
+	uint64_t		 pe_start_time;
+	uint			 pe_refcnt;
+	uint			 pe_conn_count;
+	uint64_t		 pe_last_auth;
+	int			 pe_pidfd;
+	boolean_t		 pe_resolved;
+	char			*pe_exepath;
+	char			*pe_exeargs;
 } pid_entry_t;
+#define	PID_MOD		256
+/* Max number of pidfds we'll hold open for pid entries */
+#define	PIDFD_MAX	256
+/* Idle time (ms) before we check whether a pid entry's process has exited */
+#define	PID_EXPIRE_TIME	30000
 
 typedef struct socket_entry {
 	int 		 se_fd;
@@ -249,8 +269,6 @@ typedef struct socket_entry {
 	pid_t		 se_pid;
 	uid_t		 se_uid;
 	gid_t		 se_gid;
-	char		*se_exepath;
-	char		*se_exeargs;
 	authz_t		 se_authz;
 	struct sshbuf	*se_input;
 	struct sshbuf	*se_output;
@@ -258,6 +276,7 @@ typedef struct socket_entry {
 	pid_entry_t	*se_pid_ent;
 	uint		 se_pid_idx;
 	sessbind_t	 se_sbind;
+	uint64_t	 se_rx_us;
 #if defined(__sun)
 	zoneid_t	 se_zid;
 	char		 se_zname[128];
@@ -267,8 +286,88 @@ typedef struct socket_entry {
 u_int sockets_alloc = 0;
 socket_entry_t *sockets = NULL;
 
-pid_entry_t *pids = NULL;
-uint pids_alloc = 0;
+static pid_entry_t *pids[PID_MOD] = { NULL };
+static uint pidfds_open = 0;
+static uint64_t pids_next_expire = 0;
+
+/*
+ * Request statistics, exported through the stats@arekinath.github.io
+ * extension (see "pivy-tool agent-stats").
+ *
+ * Latency histograms have power-of-two buckets: bucket i counts events
+ * which took between 2^i and 2^(i+1) microseconds (bucket 0 also counts
+ * anything quicker than that).
+ */
+#define	STATS_NBUCKETS		32
+#define	STATS_MAX_MSGTYPES	32
+
+typedef struct stat_hist {
+	const char	*sh_name;
+	uint64_t	 sh_count;
+	uint64_t	 sh_fail;
+	uint64_t	 sh_total_us;
+	uint64_t	 sh_max_us;
+	uint64_t	 sh_buckets[STATS_NBUCKETS];
+} stat_hist_t;
+
+enum stat_phase {
+	PH_QUEUE = 0,
+	PH_TXN_OPEN,
+	PH_SELECT,
+	PH_PIN_VERIFY,
+	PH_CARD_OP,
+	PH_TOUCH_WAIT,
+	PH_ASKPASS,
+	PH_CONFIRM,
+	PH__MAX
+};
+
+static stat_hist_t phase_stats[PH__MAX] = {
+	[PH_QUEUE] = { .sh_name = "queue" },
+	[PH_TXN_OPEN] = { .sh_name = "txn-open" },
+	[PH_SELECT] = { .sh_name = "select" },
+	[PH_PIN_VERIFY] = { .sh_name = "pin-verify" },
+	[PH_CARD_OP] = { .sh_name = "card-op" },
+	[PH_TOUCH_WAIT] = { .sh_name = "touch-wait" },
+	[PH_ASKPASS] = { .sh_name = "askpass" },
+	[PH_CONFIRM] = { .sh_name = "confirm" },
+};
+
+enum stat_counter {
+	ST_REQUESTS = 0,
+	ST_FAILURES,
+	ST_PIN_PROMPTS,
+	ST_TOUCH_WAITS,
+	ST_TXN_OPENS,
+	ST_TXN_REUSES,
+	ST_CARD_RECONNECTS,
+	ST_CAK_AUTHS,
+	ST_CAK_SKIPS,
+	ST__MAX
+};
+
+static const char *stat_counter_names[ST__MAX] = {
+	[ST_REQUESTS] = "requests",
+	[ST_FAILURES] = "failures",
+	[ST_PIN_PROMPTS] = "pin-prompts",
+	[ST_TOUCH_WAITS] = "touch-waits",
+	[ST_TXN_OPENS] = "txn-opens",
+	[ST_TXN_REUSES] = "txn-reuses",
+	[ST_CARD_RECONNECTS] = "card-reconnects",
+	[ST_CAK_AUTHS] = "cak-auths",
+	[ST_CAK_SKIPS] = "cak-skips",
+};
+
+static uint64_t stat_counters[ST__MAX];
+static stat_hist_t msg_stats[STATS_MAX_MSGTYPES];
+static uint msg_stats_n = 0;
+static uint64_t stats_start = 0;
+
+/* State about the message currently being processed, for stats. */
+static const char *cur_msg_name = NULL;
+static boolean_t cur_msg_failed = B_FALSE;
+static boolean_t cur_msg_touch = B_FALSE;
+static boolean_t cur_msg_card = B_FALSE;
 
 int max_fd = 0;
 
@@ -364,6 +463,72 @@ monotime(void)
 	return (msec);
 }
 
+static uint64_t
+monotime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+stat_hist_add(stat_hist_t *sh, uint64_t us, boolean_t failed)
+{
+	uint i = 0;
+	uint64_t v = us;
+
+	while (v > 1 && i < STATS_NBUCKETS - 1) {
+		v >>= 1;
+		++i;
+	}
+	sh->sh_buckets[i]++;
+	sh->sh_count++;
+	if (failed)
+		sh->sh_fail++;
+	sh->sh_total_us += us;
+	if (us > sh->sh_max_us)
+		sh->sh_max_us = us;
+}
+
+/* Records the time taken by a phase of request processing since "start". */
+static void
+stat_phase(enum stat_phase ph, uint64_t start)
+{
+	stat_hist_add(&phase_stats[ph], monotime_us() - start, B_FALSE);
+}
+
+static void
+stat_msg(const char *name, uint64_t us, boolean_t failed)
+{
+	stat_hist_t *sh = NULL;
+	uint i;
+
+	for (i = 0; i < msg_stats_n; ++i) {
+		if (strcmp(msg_stats[i].sh_name, name) == 0) {
+			sh = &msg_stats[i];
+			break;
+		}
+	}
+	if (sh == NULL) {
+		if (msg_stats_n >= STATS_MAX_MSGTYPES)
+			return;
+		sh = &msg_stats[msg_stats_n++];
+		sh->sh_name = name;
+	}
+	stat_hist_add(sh, us, failed);
+}
+
+/*
+ * Card operations on a slot with a touch policy include the time spent
+ * waiting for the user to touch it, so we count those separately.
+ */
+static void
+stat_card_op(uint64_t start)
+{
+	cur_msg_card = B_TRUE;
+	stat_phase(cur_msg_touch ? PH_TOUCH_WAIT : PH_CARD_OP, start);
+}
+
 static inline boolean_t
 is_slot_enabled(struct piv_slot *slot)
 {
@@ -517,24 +682,59 @@ drop_pin(void)
 	set_probe_interval(B_FALSE);
 }
 
+/*
+ * The card session (see piv_token_card_state()) in which we last proved the
+ * card holds the CAK. Until the card is removed, swapped or reset, there's no
+ * need to make it do the private key operation again.
+ */
+static struct piv_card_state *cak_state = NULL;
+
+static void
+forget_cak_state(void)
+{
+	piv_card_state_free(cak_state);
+	cak_state = NULL;
+}
+
 static errf_t *
 auth_cak(void)
 {
 	struct piv_slot *slot;
+	struct piv_card_state *st = NULL;
 	errf_t *err;
+
+	err = piv_token_card_state(selk, &st);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "failed to get card state",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		st = NULL;
+	}
+	if (st != NULL && cak_state != NULL &&
+	    piv_card_state_equal(st, cak_state)) {
+		piv_card_state_free(st);
+		stat_counters[ST_CAK_SKIPS]++;
+		return (NULL);
+	}
+	forget_cak_state();
+
 	slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
 	if (slot == NULL) {
+		piv_card_state_free(st);
 		err = errf("CAKAuthError", NULL, "No key was found in the "
 		    "CARD_AUTH (CAK) slot");
 		return (err);
 	}
+	stat_counters[ST_CAK_AUTHS]++;
 	err = piv_auth_key(selk, slot, cak);
 	if (err) {
+		piv_card_state_free(st);
 		err = errf("CAKAuthError", err, "Key in CARD_AUTH slot (CAK) "
 		    "does not match the configured CAK: this card may be "
 		    "a fake!");
 		return (err);
 	}
+	cak_state = st;
 	return (NULL);
 }
 
@@ -543,15 +743,22 @@ agent_piv_open(void)
 {
 	struct piv_slot *slot;
 	errf_t *err = NULL;
+	uint64_t t0, t1;
 
 	if (txnopen) {
 		txntimeout = monotime() + 2000;
+		stat_counters[ST_TXN_REUSES]++;
 		return (NULL);
 	}
 
+	t0 = monotime_us();
+	stat_counters[ST_TXN_OPENS]++;
+
 	if (selk == NULL || (err = piv_txn_begin(selk))) {
 		errf_free(err);
+		stat_counters[ST_CARD_RECONNECTS]++;
 
+		forget_cak_state();
 		selk = NULL;
 		if (ks != NULL)
 			piv_release(ks);
@@ -589,10 +796,12 @@ findagain:
 			return (err);
 		}
 
+		t1 = monotime_us();
 		if ((err = piv_select(selk))) {
 			piv_txn_end(selk);
 			return (err);
 		}
+		stat_phase(PH_SELECT, t1);
 
 		err = piv_read_all_certs(selk);
 		if (err && !errf_caused_by(err, "NotFoundError") &&
@@ -608,10 +817,12 @@ findagain:
 		last_update = monotime();
 
 	} else {
+		t1 = monotime_us();
 		if ((err = piv_select(selk))) {
 			piv_txn_end(selk);
 			return (err);
 		}
+		stat_phase(PH_SELECT, t1);
 	}
 	if (cak == NULL) {
 		slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
@@ -619,6 +830,7 @@ findagain:
 			VERIFY0(sshkey_demote(piv_slot_pubkey(slot), &cak));
 	}
 	bunyan_log(BNY_TRACE, "opened new txn", NULL);
+	stat_phase(PH_TXN_OPEN, t0);
 	txnopen = B_TRUE;
 	txntimeout = monotime() + 2000;
 	card_probe_fails = 0;
@@ -705,6 +917,7 @@ try_askpass(void)
 	size_t len;
 	errf_t *err;
 	uint retries = 1;
+	uint64_t t0;
 	char prompt[64], buf[1024];
 	char *guid = piv_token_shortid(selk);
 	enum piv_pin auth = piv_token_default_auth(selk);
@@ -716,6 +929,8 @@ try_askpass(void)
 	if (askpass == NULL)
 		return;
 
+	stat_counters[ST_PIN_PROMPTS]++;
+	t0 = monotime_us();
 	if (pipe(p) == -1)
 		return;
 	if ((kid = fork()) == -1)
@@ -745,6 +960,7 @@ try_askpass(void)
 	while ((ret = waitpid(kid, &status, 0)) == -1)
 		if (errno != EINTR)
 			break;
+	stat_phase(PH_ASKPASS, t0);
 	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
 		explicit_bzero(buf, sizeof(buf));
 		bunyan_log(BNY_WARN, "executing askpass failed",
@@ -783,6 +999,341 @@ out:
 	explicit_bzero(buf, sizeof(buf));
 }
 
+static uint64_t
+get_pid_start_time(pid_t pid)
+{
+	uint64_t val = 0;
+#if defined(__sun) || defined(__linux__)
+	FILE *f;
+	char fn[128];
+#endif
+
+#if defined(__OpenBSD__)
+	struct kinfo_proc kp;
+	int mib[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid,
+	    sizeof (kp), 1 };
+	size_t sz = sizeof (kp);
+
+	if (sysctl(mib, 6, &kp, &sz, NULL, 0) == 0)
+		val = kp.p_ustart_sec;
+#endif
+#if defined(__sun)
+	struct psinfo *psinfo;
+
+	psinfo = calloc(1, sizeof (struct psinfo));
+	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
+			val = psinfo->pr_start.tv_sec;
+			val *= 1000;
+			val += psinfo->pr_start.tv_nsec / 1000000;
+		}
+		fclose(f);
+	}
+	free(psinfo);
+#endif
+#if defined(__APPLE__)
+	struct proc_bsdinfo pinfo;
+	int rc;
+
+	rc = proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &pinfo, sizeof (pinfo));
+	if (rc >= sizeof (pinfo)) {
+		val = pinfo.pbi_start_tvsec;
+		val *= 1000;
+		val += pinfo.pbi_start_tvusec / 1000;
+	}
+#endif
+#if defined(__linux__)
+	char ln[1024];
+	size_t len;
+	uint i = 0, j = 0;
+	char *last = ln;
+	char *p;
+
+	snprintf(fn, sizeof (fn), "/proc/%d/stat", (int)pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		len = fread(ln, 1, sizeof (ln) - 1, f);
+		fclose(f);
+
+		/*
+		 * The stat file is an annoying format which we will have to
+		 * parse by hand -- the (cmd) field might have spaces in it.
+		 */
+		for (i = 0; i < len; ++i) {
+			if (ln[i] == ' ') {
+				ln[i] = '\0';
+				++j;
+				if (j == 22) {
+					unsigned long long int parsed;
+					errno = 0;
+					parsed = strtoull(last, &p, 10);
+					if (errno == 0 && *p == '\0') {
+						val = parsed;
+						break;
+					}
+				}
+				last = &ln[i+1];
+			} else if (ln[i] == '(') {
+				for (; i < len; ++i) {
+					if (ln[i] == ')')
+						break;
+				}
+			}
+		}
+	}
+#endif
+	return (val);
+}
+
+/*
+ * A pidfd refers to one specific process, so while one is open and not yet
+ * readable (i.e. the process hasn't exited), the pid can't have been
+ * re-used and we don't need to look at the start time again.
+ */
+static void
+pid_entry_open_pidfd(pid_entry_t *pe)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	if (pe->pe_pid == 0 || pidfds_open >= PIDFD_MAX)
+		return;
+	pe->pe_pidfd = syscall(SYS_pidfd_open, pe->pe_pid, 0);
+	if (pe->pe_pidfd >= 0)
+		++pidfds_open;
+	else
+		pe->pe_pidfd = -1;
+#endif
+}
+
+static void
+pid_entry_close_pidfd(pid_entry_t *pe)
+{
+	if (pe->pe_pidfd == -1)
+		return;
+	close(pe->pe_pidfd);
+	pe->pe_pidfd = -1;
+	--pidfds_open;
+}
+
+/*
+ * Returns B_TRUE if the process this entry was made for is definitely still
+ * running, or B_FALSE if it has exited or we can't tell without checking the
+ * start time.
+ */
+static boolean_t
+pid_entry_alive(pid_entry_t *pe)
+{
+	struct pollfd pfd;
+
+	if (pe->pe_pidfd == -1)
+		return (B_FALSE);
+	bzero(&pfd, sizeof (pfd));
+	pfd.fd = pe->pe_pidfd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, 0) == 0);
+}
+
+static void
+pid_entry_reset(pid_entry_t *pe, uint64_t start_time)
+{
+	pe->pe_start_time = start_time;
+	pe->pe_conn_count = 0;
+	pe->pe_last_auth = 0;
+	pe->pe_resolved = B_FALSE;
+	free(pe->pe_exepath);
+	pe->pe_exepath = NULL;
+	free(pe->pe_exeargs);
+	pe->pe_exeargs = NULL;
+	pid_entry_close_pidfd(pe);
+	pid_entry_open_pidfd(pe);
+}
+
+/*
+ * Frees entries for processes which haven't connected in a while and have
+ * since exited. Entries for live processes have to stay, since their
+ * connection count and last approval time feed into confirm decisions.
+ */
+static void
+expire_pid_entries(uint64_t now)
+{
+	pid_entry_t *pe, **pp;
+	uint slot;
+	uint64_t nstart;
+
+	if (now < pids_next_expire)
+		return;
+	pids_next_expire = now + PID_EXPIRE_TIME;
+
+	for (slot = 0; slot < PID_MOD; ++slot) {
+		pp = &pids[slot];
+		while ((pe = *pp) != NULL) {
+			if (pe->pe_refcnt > 0 ||
+			    now - pe->pe_time <= PID_EXPIRE_TIME ||
+			    pid_entry_alive(pe)) {
+				pp = &pe->pe_next;
+				continue;
+			}
+			if (pe->pe_pidfd == -1) {
+				nstart = get_pid_start_time(pe->pe_pid);
+				if (nstart != 0 &&
+				    nstart == pe->pe_start_time) {
+					pp = &pe->pe_next;
+					continue;
+				}
+			}
+			*pp = pe->pe_next;
+			pid_entry_close_pidfd(pe);
+			free(pe->pe_exepath);
+			free(pe->pe_exeargs);
+			free(pe);
+		}
+	}
+}
+
+/*
+ * Fills in the executable path and arguments of a client process, which we
+ * only use for confirm prompts and logging. This is comparatively expensive
+ * (several reads from /proc on most platforms), so it's only done when
+ * needed and then cached on the pid entry. Callers making authorization
+ * decisions should ask for a refresh, since the process might have exec()d
+ * something else since we last looked.
+ */
+static void
+pid_entry_resolve(pid_entry_t *pe, boolean_t refresh)
+{
+#if defined(__sun)
+	FILE *f;
+	struct psinfo *psinfo;
+	char fn[128];
+#elif defined(__OpenBSD__)
+	struct kinfo_proc kp;
+	int mib[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, 0, sizeof (kp), 1 };
+	size_t sz;
+	errf_t *err;
+#elif defined(__APPLE__)
+	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
+	int rc;
+#elif defined(__linux__)
+	uint i;
+	FILE *f;
+	ssize_t len;
+	char fn[128], ln[1024];
+#endif
+
+	if (pe->pe_resolved && !refresh)
+		return;
+	pe->pe_resolved = B_TRUE;
+	free(pe->pe_exepath);
+	pe->pe_exepath = NULL;
+	free(pe->pe_exeargs);
+	pe->pe_exeargs = NULL;
+
+	if (pe->pe_pid == 0)
+		return;
+
+#if defined(__sun)
+	psinfo = calloc(1, sizeof (struct psinfo));
+	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pe->pe_pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
+			pe->pe_exepath = strndup(psinfo->pr_fname,
+			    sizeof (psinfo->pr_fname));
+			pe->pe_exeargs = strndup(psinfo->pr_psargs,
+			    sizeof (psinfo->pr_psargs));
+		}
+		fclose(f);
+	}
+	free(psinfo);
+#elif defined(__OpenBSD__)
+	mib[3] = (int)pe->pe_pid;
+	sz = sizeof (kp);
+	if (sysctl(mib, 6, &kp, &sz, NULL, 0)) {
+		err = errfno("sysctl", errno, "reading KERN_PROC");
+		bunyan_log(BNY_DEBUG, "failed to get sysctl info about pid",
+		    "pid", BNY_INT, (int)pe->pe_pid,
+		    "error", BNY_ERF, err,
+		    NULL);
+		errf_free(err);
+	} else if (sz >= sizeof (kp)) {
+		pe->pe_exepath = strdup(kp.p_comm);
+	}
+#elif defined(__APPLE__)
+	rc = proc_pidpath(pe->pe_pid, pathBuf, sizeof (pathBuf));
+	if (rc > 0)
+		pe->pe_exepath = strdup(pathBuf);
+#elif defined(__linux__)
+	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pe->pe_pid);
+	len = readlink(fn, ln, sizeof (ln));
+	if (len > 0 && len < sizeof (ln)) {
+		pe->pe_exepath = strndup(ln, len);
+	}
+	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)pe->pe_pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		len = fread(ln, 1, sizeof (ln) - 1, f);
+		fclose(f);
+		for (i = 0; i < len; ++i) {
+			if (ln[i] == '\0')
+				ln[i] = ' ';
+		}
+		pe->pe_exeargs = strndup(ln, len);
+	}
+#endif
+}
+
+static const char *
+client_exepath(socket_entry_t *e)
+{
+	if (e->se_pid_ent == NULL)
+		return (NULL);
+	pid_entry_resolve(e->se_pid_ent, B_FALSE);
+	return (e->se_pid_ent->pe_exepath);
+}
+
+static struct pid_entry *
+find_or_make_pid_entry(pid_t pid)
+{
+	pid_entry_t *pe;
+	uint slot = (uint)pid % PID_MOD;
+	uint64_t now = monotime();
+	uint64_t start_time;
+
+	expire_pid_entries(now);
+
+	for (pe = pids[slot]; pe != NULL; pe = pe->pe_next) {
+		if (pe->pe_pid == pid)
+			break;
+	}
+
+	if (pe != NULL && pid_entry_alive(pe)) {
+		pe->pe_time = now;
+		return (pe);
+	}
+
+	start_time = get_pid_start_time(pid);
+
+	if (pe != NULL) {
+		if (pe->pe_pidfd != -1 || pe->pe_start_time != start_time)
+			pid_entry_reset(pe, start_time);
+		else
+			pid_entry_open_pidfd(pe);
+		pe->pe_time = now;
+		return (pe);
+	}
+
+	pe = calloc(1, sizeof (pid_entry_t));
+	VERIFY(pe != NULL);
+	pe->pe_pid = pid;
+	pe->pe_pidfd = -1;
+	pe->pe_time = now;
+	pid_entry_reset(pe, start_time);
+	pe->pe_next = pids[slot];
+	pids[slot] = pe;
+	return (pe);
+}
+
 static void
 send_touch_notify(socket_entry_t *e, enum piv_slotid slotid)
 {
@@ -792,6 +1343,9 @@ send_touch_notify(socket_entry_t *e, enum piv_slotid slotid)
 	char title[256];
 	char *guid;
 
+	stat_counters[ST_TOUCH_WAITS]++;
+	cur_msg_touch = B_TRUE;
+
 	if (notify == NULL)
 		notify = getenv("SSH_NOTIFY_SEND");
 	if (notify == NULL)
@@ -838,15 +1392,25 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 	size_t len;
 	char *guid;
 	int p[2];
+	pid_entry_t *pe;
+	uint64_t t0;
 
 	if (confirm_mode == C_NEVER) {
 		e->se_authz = AUTHZ_ALLOWED;
 		return;
 	}
 
+	/*
+	 * Always look at the process afresh here, in case it has exec()d
+	 * something else since we cached its details.
+	 */
+	pe = e->se_pid_ent;
+	pid_entry_resolve(pe, B_TRUE);
+
 	if (confirm_mode == C_FORWARDED) {
 		const char *ssh = NULL;
-		const size_t len = strlen(e->se_exepath);
+		const size_t len = (pe->pe_exepath == NULL) ? 0 :
+		    strlen(pe->pe_exepath);
 		const uint64_t now = monotime();
 		const int64_t delta = now - e->se_pid_ent->pe_last_auth;
 		/*
@@ -865,11 +1429,11 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 		 */
 		if (e->se_sbind == SESSBIND_NONE) {
 			if (len >= 4)
-				ssh = &e->se_exepath[len - 4];
+				ssh = &pe->pe_exepath[len - 4];
 			if (ssh != NULL && strcmp(ssh, "/ssh") != 0)
 				ssh = NULL;
-			if (len == 3 && strcmp(e->se_exepath, "ssh") == 0)
-				ssh = e->se_exepath;
+			if (len == 3 && strcmp(pe->pe_exepath, "ssh") == 0)
+				ssh = pe->pe_exepath;
 			if (e->se_pid_idx == 0 || ssh == NULL) {
 				e->se_authz = AUTHZ_ALLOWED;
 				return;
@@ -923,12 +1487,13 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 	    "Slot requested: %02x",
 	    (add_zenity_args ? "--text=" : ""),
 	    guid, (int)e->se_pid,
-	    (e->se_exepath == NULL) ? "(unknown)" : e->se_exepath,
-	    (e->se_exeargs == NULL) ? "(unknown)" : e->se_exeargs,
+	    (pe->pe_exepath == NULL) ? "(unknown)" : pe->pe_exepath,
+	    (pe->pe_exeargs == NULL) ? "(unknown)" : pe->pe_exeargs,
 	    (uint)slotid);
 	free(guid);
 	guid = NULL;
 
+	t0 = monotime_us();
 	if (pipe(p) == -1)
 		return;
 	if ((kid = fork()) == -1)
@@ -971,6 +1536,7 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 	while ((ret = waitpid(kid, &status, 0)) == -1)
 		if (errno != EINTR)
 			break;
+	stat_phase(PH_CONFIRM, t0);
 	if (ret == -1 || !WIFEXITED(status) ||
 	    (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 1)) {
 		bunyan_log(BNY_WARN, "executing confirm failed",
@@ -1006,160 +1572,20 @@ static errf_t *
 agent_piv_try_pin(boolean_t canskip)
 {
 	errf_t *err = NULL;
-	uint retries = 1;
-	if (pin_len == 0 && !canskip)
-		try_askpass();
-	if (pin_len != 0) {
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    pin, &retries, canskip);
-		if (err == ERRF_OK)
-			extend_probe_deadline();
-		err = wrap_pin_error(err, retries);
-	}
-	return (err);
-}
-
-static uint64_t
-get_pid_start_time(pid_t pid)
-{
-	uint64_t val = 0;
-#if defined(__sun) || defined(__linux__)
-	FILE *f;
-	char fn[128];
-#endif
-
-#if defined(__OpenBSD__)
-	struct kinfo_proc kp;
-	int mib[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid,
-	    sizeof (kp), 1 };
-	size_t sz = sizeof (kp);
-
-	if (sysctl(mib, 6, &kp, &sz, NULL, 0) == 0)
-		val = kp.p_ustart_sec;
-#endif
-#if defined(__sun)
-	struct psinfo *psinfo;
-
-	psinfo = calloc(1, sizeof (struct psinfo));
-	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
-			val = psinfo->pr_start.tv_sec;
-			val *= 1000;
-			val += psinfo->pr_start.tv_nsec / 1000000;
-		}
-		fclose(f);
-	}
-	free(psinfo);
-#endif
-#if defined(__APPLE__)
-	struct proc_bsdinfo pinfo;
-	int rc;
-
-	rc = proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &pinfo, sizeof (pinfo));
-	if (rc >= sizeof (pinfo)) {
-		val = pinfo.pbi_start_tvsec;
-		val *= 1000;
-		val += pinfo.pbi_start_tvusec / 1000;
-	}
-#endif
-#if defined(__linux__)
-	char ln[1024];
-	size_t len;
-	uint i = 0, j = 0;
-	char *last = ln;
-	char *p;
-
-	snprintf(fn, sizeof (fn), "/proc/%d/stat", (int)pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		len = fread(ln, 1, sizeof (ln) - 1, f);
-		fclose(f);
-
-		/*
-		 * The stat file is an annoying format which we will have to
-		 * parse by hand -- the (cmd) field might have spaces in it.
-		 */
-		for (i = 0; i < len; ++i) {
-			if (ln[i] == ' ') {
-				ln[i] = '\0';
-				++j;
-				if (j == 22) {
-					unsigned long long int parsed;
-					errno = 0;
-					parsed = strtoull(last, &p, 10);
-					if (errno == 0 && *p == '\0') {
-						val = parsed;
-						break;
-					}
-				}
-				last = &ln[i+1];
-			} else if (ln[i] == '(') {
-				for (; i < len; ++i) {
-					if (ln[i] == ')')
-						break;
-				}
-			}
-		}
-	}
-#endif
-	return (val);
-}
-
-static struct pid_entry *
-find_or_make_pid_entry(pid_t pid, uint64_t start_time)
-{
-	uint i;
-	uint64_t now = monotime();
-	uint npids_alloc;
-
-	for (i = 0; i < pids_alloc; ++i) {
-		if (pids[i].pe_valid && pids[i].pe_pid == pid &&
-		    pids[i].pe_start_time == start_time) {
-			pids[i].pe_time = now;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid && pids[i].pe_pid == pid) {
-			pids[i].pe_time = now;
-			pids[i].pe_start_time = start_time;
-			pids[i].pe_conn_count = 0;
-			pids[i].pe_last_auth = 0;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid) {
-			uint64_t delta = now - pids[i].pe_time;
-			if (delta > 30000) {
-				uint64_t nstart;
-				nstart = get_pid_start_time(pids[i].pe_pid);
-				if (nstart == 0 ||
-				    nstart != pids[i].pe_start_time) {
-					pids[i].pe_valid = B_FALSE;
-				}
-			}
-		}
-	}
-
-	for (i = 0; i < pids_alloc; ++i) {
-		if (!pids[i].pe_valid)
-			goto newpid;
+	uint retries = 1;
+	uint64_t t0;
+	if (pin_len == 0 && !canskip)
+		try_askpass();
+	if (pin_len != 0) {
+		t0 = monotime_us();
+		err = piv_verify_pin(selk, piv_token_default_auth(selk),
+		    pin, &retries, canskip);
+		stat_phase(PH_PIN_VERIFY, t0);
+		if (err == ERRF_OK)
+			extend_probe_deadline();
+		err = wrap_pin_error(err, retries);
 	}
-
-	npids_alloc = pids_alloc + 128;
-	pids = reallocarray(pids, npids_alloc, sizeof (pid_entry_t));
-	VERIFY(pids != NULL);
-	for (i = pids_alloc; i < npids_alloc; ++i)
-		pids[i].pe_valid = B_FALSE;
-	i = pids_alloc;
-	pids_alloc = npids_alloc;
-newpid:
-	pids[i].pe_valid = B_TRUE;
-	pids[i].pe_pid = pid;
-	pids[i].pe_start_time = start_time;
-	pids[i].pe_time = now;
-	pids[i].pe_conn_count = 0;
-	pids[i].pe_last_auth = 0;
-	return (&pids[i]);
+	return (err);
 }
 
 static void
@@ -1179,6 +1605,8 @@ close_socket(socket_entry_t *e)
 	e->se_fd = -1;
 	e->se_type = AUTH_UNUSED;
 	e->se_authz = AUTHZ_NOT_YET;
+	if (e->se_pid_ent != NULL)
+		--e->se_pid_ent->pe_refcnt;
 	e->se_pid_ent = NULL;
 	e->se_sbind = SESSBIND_NONE;
 	sshbuf_free(e->se_input);
@@ -1187,10 +1615,6 @@ close_socket(socket_entry_t *e)
 	e->se_output = NULL;
 	sshbuf_free(e->se_request);
 	e->se_request = NULL;
-	free(e->se_exepath);
-	e->se_exepath = NULL;
-	free(e->se_exeargs);
-	e->se_exeargs = NULL;
 }
 
 static int
@@ -1341,6 +1765,27 @@ out:
 }
 
 /* ssh2 only */
+/* Works out the hash algorithm to use for a signature request. */
+static enum sshdigest_types
+sign_hashalg(const struct sshkey *key, u_int flags)
+{
+	if (key->type == KEY_RSA) {
+		if (flags & SSH_AGENT_RSA_SHA2_256)
+			return (SSH_DIGEST_SHA256);
+		else if (flags & SSH_AGENT_RSA_SHA2_512)
+			return (SSH_DIGEST_SHA512);
+		return (SSH_DIGEST_SHA1);
+	} else if (key->type == KEY_ECDSA) {
+		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
+		case 384:
+			return (SSH_DIGEST_SHA384);
+		case 521:
+			return (SSH_DIGEST_SHA512);
+		}
+	}
+	return (SSH_DIGEST_SHA256);
+}
+
 static errf_t *
 process_sign_request2(socket_entry_t *e)
 {
@@ -1359,6 +1804,7 @@ process_sign_request2(socket_entry_t *e)
 	enum sshdigest_types hashalg, ohashalg;
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
+	uint64_t t0;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -1409,29 +1855,11 @@ pin_again:
 		agent_piv_close(B_TRUE);
 		goto out;
 	}
-	if (key->type == KEY_RSA) {
-		hashalg = SSH_DIGEST_SHA1;
-		if (flags & SSH_AGENT_RSA_SHA2_256)
-			hashalg = SSH_DIGEST_SHA256;
-		else if (flags & SSH_AGENT_RSA_SHA2_512)
-			hashalg = SSH_DIGEST_SHA512;
-	} else if (key->type == KEY_ECDSA) {
-		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
-		case 256:
-			hashalg = SSH_DIGEST_SHA256;
-			break;
-		case 384:
-			hashalg = SSH_DIGEST_SHA384;
-			break;
-		case 521:
-			hashalg = SSH_DIGEST_SHA512;
-			break;
-		default:
-			hashalg = SSH_DIGEST_SHA256;
-		}
-	}
+	hashalg = sign_hashalg(key, flags);
 	ohashalg = hashalg;
+	t0 = monotime_us();
 	err = piv_sign(selk, slot, data, dlen, &hashalg, &rawsig, &rslen);
+	stat_card_op(t0);
 
 	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
 	    piv_token_is_ykpiv(selk) && canskip) {
@@ -1521,6 +1949,7 @@ process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
 	int found = 0;
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
+	uint64_t t0;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -1581,7 +2010,9 @@ pin_again:
 		agent_piv_close(B_TRUE);
 		goto out;
 	}
+	t0 = monotime_us();
 	err = piv_ecdh(selk, slot, partner, &secret, &seclen);
+	stat_card_op(t0);
 	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
 	    piv_token_is_ykpiv(selk) && canskip) {
 		/* Yubikey can have slots other than 9C as "PIN Always" */
@@ -1638,6 +2069,7 @@ process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 	size_t seclen, outlen;
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
+	uint64_t t0;
 	char *slotstr;
 
 	if ((msg = sshbuf_new()) == NULL)
@@ -1702,7 +2134,9 @@ pin_again:
 		agent_piv_close(B_TRUE);
 		goto out;
 	}
+	t0 = monotime_us();
 	err = piv_box_open(selk, slot, box);
+	stat_card_op(t0);
 	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
 	    piv_token_is_ykpiv(selk) && canskip) {
 		/*
@@ -1858,6 +2292,7 @@ process_ext_prehash(socket_entry_t *e, struct sshbuf *inbuf)
 	int found = 0;
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
+	uint64_t t0;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -1909,7 +2344,9 @@ pin_again:
 		agent_piv_close(B_TRUE);
 		goto out;
 	}
+	t0 = monotime_us();
 	err = piv_sign_prehash(selk, slot, data, dlen, &rawsig, &rslen);
+	stat_card_op(t0);
 
 	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
 	    piv_token_is_ykpiv(selk) && canskip) {
@@ -1951,6 +2388,209 @@ out:
 	return (err);
 }
 
+/*
+ * Batched signing: signs a list of payloads with one key, all within one
+ * transaction and with one confirm decision, and returns all of the
+ * signatures in a single reply.
+ *
+ * Request:
+ *   string	key
+ *   uint32	flags (as for SSH2_AGENTC_SIGN_REQUEST, plus SIGN_BATCH_PREHASH)
+ *   uint32	count
+ *   string	data[count]
+ *
+ * Reply:
+ *   byte	SSH_AGENT_SUCCESS
+ *   uint32	count
+ *   string	signature[count]
+ *
+ * With SIGN_BATCH_PREHASH, each data item is a digest and each signature is
+ * the raw signature, as for sign-prehash. Otherwise the data items are
+ * signed and formatted as for SSH2_AGENTC_SIGN_REQUEST.
+ */
+#define	SIGN_BATCH_PREHASH	(1U << 31)
+#define	SIGN_BATCH_MAX		256
+
+static errf_t *
+process_ext_sign_batch(socket_entry_t *e, struct sshbuf *inbuf)
+{
+	const u_char **data = NULL;
+	size_t *dlen = NULL;
+	u_char *rawsig = NULL;
+	size_t rslen = 0;
+	u_int flags, count, i;
+	int r;
+	errf_t *err = NULL;
+	struct sshbuf *msg, *sigbuf;
+	struct sshkey *key = NULL;
+	struct piv_slot *slot = NULL;
+	int found = 0;
+	boolean_t canskip = B_TRUE, pinned = B_FALSE;
+	boolean_t prehash;
+	enum piv_slot_auth rauth;
+	uint64_t t0;
+	enum sshdigest_types hashalg, ohashalg = 0;
+
+	if ((msg = sshbuf_new()) == NULL || (sigbuf = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	if ((r = sshkey_froms(inbuf, &key)) != 0) {
+		err = parserrf("sshkey_froms", r);
+		goto out;
+	}
+	if ((r = sshbuf_get_u32(inbuf, &flags)) != 0 ||
+	    (r = sshbuf_get_u32(inbuf, &count)) != 0) {
+		err = parserrf("sshbuf_get_u32", r);
+		goto out;
+	}
+	if (count < 1 || count > SIGN_BATCH_MAX) {
+		err = errf("ArgumentError", NULL, "batch must contain between "
+		    "1 and %u items (has %u)", SIGN_BATCH_MAX, count);
+		goto out;
+	}
+	prehash = (flags & SIGN_BATCH_PREHASH) != 0;
+
+	/* Parse the whole batch before we touch the card. */
+	data = calloc(count, sizeof (*data));
+	dlen = calloc(count, sizeof (*dlen));
+	if (data == NULL || dlen == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		r = sshbuf_get_string_direct(inbuf, &data[i], &dlen[i]);
+		if (r != 0) {
+			err = parserrf("sshbuf_get_string", r);
+			goto out;
+		}
+	}
+
+	if ((err = agent_piv_open()))
+		goto out;
+
+	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
+			found = 1;
+			break;
+		}
+	}
+	if (!found || slot == NULL || !is_slot_enabled(slot)) {
+		agent_piv_close(B_FALSE);
+		err = errf("NotFoundError", NULL, "specified key not found");
+		goto out;
+	}
+	bunyan_add_vars(msg_log_frame,
+	    "slotid", BNY_UINT, (uint)piv_slot_id(slot),
+	    "count", BNY_UINT, count, NULL);
+
+	try_confirm_client(e, piv_slot_id(slot));
+	if (e->se_authz == AUTHZ_DENIED) {
+		err = errf("AuthzError", NULL, "client blocked");
+		goto out;
+	}
+
+	if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT && !sign_9d) {
+		err = errf("PermissionError", NULL, "key management key (9d) "
+		    "is not allowed to sign data without the -m option");
+		goto out;
+	}
+
+	rauth = piv_slot_get_auth(selk, slot);
+	if (rauth & PIV_SLOT_AUTH_PIN)
+		canskip = B_FALSE;
+	if (rauth & PIV_SLOT_AUTH_TOUCH)
+		send_touch_notify(e, piv_slot_id(slot));
+
+	if (!prehash)
+		ohashalg = sign_hashalg(key, flags);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, count)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	for (i = 0; i < count; ++i) {
+pin_again:
+		/*
+		 * Once the PIN has been verified in this transaction it stays
+		 * verified, unless the slot needs it every time.
+		 */
+		if (!pinned || !canskip) {
+			if ((err = agent_piv_try_pin(canskip))) {
+				agent_piv_close(B_TRUE);
+				goto out;
+			}
+			pinned = B_TRUE;
+		}
+		t0 = monotime_us();
+		if (prehash) {
+			err = piv_sign_prehash(selk, slot, data[i], dlen[i],
+			    &rawsig, &rslen);
+		} else {
+			hashalg = ohashalg;
+			err = piv_sign(selk, slot, data[i], dlen[i], &hashalg,
+			    &rawsig, &rslen);
+		}
+		stat_card_op(t0);
+
+		if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
+		    piv_token_is_ykpiv(selk) && canskip) {
+			/* See process_sign_request2() */
+			errf_free(err);
+			canskip = B_FALSE;
+			goto pin_again;
+		} else if (errf_caused_by(err, "PermissionError")) {
+			try_askpass();
+			if (pin_len != 0) {
+				errf_free(err);
+				canskip = B_FALSE;
+				goto pin_again;
+			}
+			agent_piv_close(B_TRUE);
+			err = nopinerrf(err);
+			goto out;
+		} else if (err) {
+			agent_piv_close(B_TRUE);
+			goto out;
+		}
+
+		if (prehash) {
+			r = sshbuf_put_string(msg, rawsig, rslen);
+		} else {
+			if (hashalg != ohashalg) {
+				agent_piv_close(B_FALSE);
+				err = errf("HashMismatch", NULL,
+				    "PIV device signed with a different hash "
+				    "algorithm to the one requested (wanted "
+				    "%d, got %d)", (int)ohashalg, (int)hashalg);
+				goto out;
+			}
+			sshbuf_reset(sigbuf);
+			VERIFY0(sshkey_sig_from_asn1(piv_slot_pubkey(slot),
+			    hashalg, rawsig, rslen, sigbuf));
+			r = sshbuf_put_stringb(msg, sigbuf);
+		}
+		if (r != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+		freezero(rawsig, rslen);
+		rawsig = NULL;
+		rslen = 0;
+	}
+	agent_piv_close(B_FALSE);
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	sshkey_free(key);
+	sshbuf_free(msg);
+	sshbuf_free(sigbuf);
+	freezero(rawsig, rslen);
+	free(data);
+	free(dlen);
+	return (err);
+}
+
 static errf_t *
 process_ext_sessbind(socket_entry_t *e, struct sshbuf *buf)
 {
@@ -2117,6 +2757,78 @@ process_ext_query(socket_entry_t *e, struct sshbuf *buf)
 	return (NULL);
 }
 
+static void
+put_stat_hist(struct sshbuf *msg, const stat_hist_t *sh)
+{
+	int r;
+	uint i;
+
+	if ((r = sshbuf_put_cstring(msg, sh->sh_name)) != 0 ||
+	    (r = sshbuf_put_u64(msg, sh->sh_count)) != 0 ||
+	    (r = sshbuf_put_u64(msg, sh->sh_fail)) != 0 ||
+	    (r = sshbuf_put_u64(msg, sh->sh_total_us)) != 0 ||
+	    (r = sshbuf_put_u64(msg, sh->sh_max_us)) != 0 ||
+	    (r = sshbuf_put_u32(msg, STATS_NBUCKETS)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < STATS_NBUCKETS; ++i) {
+		if ((r = sshbuf_put_u64(msg, sh->sh_buckets[i])) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+}
+
+/*
+ * Returns the agent's request statistics.
+ *
+ * Reply:
+ *   byte	SSH_AGENT_SUCCESS
+ *   uint64	uptime (ms)
+ *   uint32	ncounters
+ *     cstring	name
+ *     uint64	value
+ *   uint32	nmsgtypes
+ *     histogram (see put_stat_hist())
+ *   uint32	nphases
+ *     histogram
+ *
+ * Histogram buckets are as described at STATS_NBUCKETS.
+ */
+static errf_t *
+process_ext_stats(socket_entry_t *e, struct sshbuf *buf)
+{
+	struct sshbuf *msg;
+	int r;
+	uint i;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u64(msg, monotime() - stats_start)) != 0 ||
+	    (r = sshbuf_put_u32(msg, ST__MAX)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < ST__MAX; ++i) {
+		if ((r = sshbuf_put_cstring(msg, stat_counter_names[i])) != 0 ||
+		    (r = sshbuf_put_u64(msg, stat_counters[i])) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	if ((r = sshbuf_put_u32(msg, msg_stats_n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < msg_stats_n; ++i)
+		put_stat_hist(msg, &msg_stats[i]);
+
+	if ((r = sshbuf_put_u32(msg, PH__MAX)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < PH__MAX; ++i)
+		put_stat_hist(msg, &phase_stats[i]);
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+
+	return (NULL);
+}
+
 struct exthandler exthandlers[] = {
 { "query", 				B_FALSE,	process_ext_query },
 { "ecdh@joyent.com", 			B_TRUE,		process_ext_ecdh },
@@ -2125,6 +2837,8 @@ struct exthandler exthandlers[] = {
 { "ykpiv-attest@joyent.com", 		B_TRUE,		process_ext_attest },
 { "session-bind@openssh.com", 		B_FALSE,	process_ext_sessbind },
 { "sign-prehash@arekinath.github.io",	B_FALSE,	process_ext_prehash },
+{ "sign-batch@arekinath.github.io",	B_FALSE,	process_ext_sign_batch },
+{ "stats@arekinath.github.io",		B_FALSE,	process_ext_stats },
 { NULL, B_FALSE, NULL }
 };
 
@@ -2156,6 +2870,7 @@ process_extension(socket_entry_t *e)
 
 	bunyan_add_vars(msg_log_frame,
 	    "extension", BNY_STRING, h->eh_name, NULL);
+	cur_msg_name = h->eh_name;
 
 	if (h->eh_string) {
 		if ((r = sshbuf_froms(e->se_request, &inner))) {
@@ -2170,6 +2885,7 @@ process_extension(socket_entry_t *e)
 	err = hdlr->eh_handler(e, inner);
 
 	if (err) {
+		cur_msg_failed = B_TRUE;
 		send_extfail(e);
 		bunyan_log(BNY_WARN, "failed to process extension command",
 		    "error", BNY_ERF, err, NULL);
@@ -2293,6 +3009,8 @@ process_message(u_int socknum)
 	int r;
 	errf_t *err;
 	socket_entry_t *e;
+	const char *exepath;
+	uint64_t t0, t1;
 
 	if (socknum >= sockets_alloc) {
 		fatal("%s: socket number %u >= allocated %u",
@@ -2324,6 +3042,15 @@ process_message(u_int socknum)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	}
 
+	t0 = monotime_us();
+	stat_hist_add(&phase_stats[PH_QUEUE], t0 - e->se_rx_us, B_FALSE);
+	cur_msg_name = msg_type_to_name(type);
+	cur_msg_failed = B_FALSE;
+	cur_msg_touch = B_FALSE;
+	cur_msg_card = B_FALSE;
+	PIVY_PROBE3(msg__start, e->se_fd, type, cur_msg_name);
+
+	exepath = client_exepath(e);
 	msg_log_frame = bunyan_push(
 	    "fd", BNY_INT, e->se_fd,
 	    "msg_type", BNY_INT, (int)type,
@@ -2331,7 +3058,7 @@ process_message(u_int socknum)
 	    "remote_uid", BNY_INT, (int)e->se_uid,
 	    "remote_pid", BNY_INT, (int)e->se_pid,
 	    "remote_cmd", BNY_STRING,
-	    (e->se_exepath == NULL) ? "???" : e->se_exepath,
+	    (exepath == NULL) ? "???" : exepath,
 #if defined(__sun)
 	    "remote_zid", BNY_INT, (int)e->se_zid,
 	    "remote_zone", BNY_STRING, e->se_zname,
@@ -2374,12 +3101,21 @@ process_message(u_int socknum)
 		sshbuf_reset(e->se_request);
 		send_status(e, 0);
 		errf_free(err);
+		cur_msg_failed = B_TRUE;
 	} else {
 		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
 	}
 
+	stat_counters[ST_REQUESTS]++;
+	if (cur_msg_failed)
+		stat_counters[ST_FAILURES]++;
+	t1 = monotime_us();
+	stat_msg(cur_msg_name, t1 - t0, cur_msg_failed);
+	PIVY_PROBE4(msg__done, e->se_fd, cur_msg_name, cur_msg_failed,
+	    t1 - t0);
+
 	bunyan_pop(msg_log_frame);
-	return 0;
+	return 1;
 }
 
 extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
@@ -2438,10 +3174,7 @@ static int
 check_socket_access(int fd, socket_entry_t *ent)
 {
 	uid_t euid;
-	FILE *f;
 	ucred_t *peer = NULL;
-	struct psinfo *psinfo;
-	char fn[128];
 
 	if (getpeerucred(fd, &peer) != 0) {
 		error("getpeerucred %d failed: %s", fd, strerror(errno));
@@ -2455,19 +3188,6 @@ check_socket_access(int fd, socket_entry_t *ent)
 	(void) getzonenamebyid(ent->se_zid, ent->se_zname,
 	    sizeof (ent->se_zname));
 	ucred_free(peer);
-	psinfo = calloc(1, sizeof (struct psinfo));
-	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)ent->se_pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
-			ent->se_exepath = strndup(psinfo->pr_fname,
-			    sizeof (psinfo->pr_fname));
-			ent->se_exeargs = strndup(psinfo->pr_psargs,
-			    sizeof (psinfo->pr_psargs));
-		}
-		fclose(f);
-	}
-	free(psinfo);
 	if (!allow_any_zoneid && !check_zid(ent->se_zid)) {
 		error("zoneid mismatch: peer zoneid %u not on allow list",
 		    (u_int) ent->se_zid);
@@ -2492,10 +3212,6 @@ check_socket_access(int fd, socket_entry_t *ent)
 	struct sockpeercred *peer;
 	socklen_t len;
 	uid_t euid;
-	struct kinfo_proc kp;
-	int mib[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, 0, sizeof (kp), 1 };
-	size_t sz;
-	errf_t *err;
 
 	peer = calloc(1, sizeof (struct sockpeercred));
 	len = sizeof (struct sockpeercred);
@@ -2510,19 +3226,6 @@ check_socket_access(int fd, socket_entry_t *ent)
 	ent->se_pid = peer->pid;
 	free(peer);
 
-	mib[3] = (int)ent->se_pid;
-	sz = sizeof (kp);
-	if (sysctl(mib, 6, &kp, &sz, NULL, 0)) {
-		err = errfno("sysctl", errno, "reading KERN_PROC");
-		bunyan_log(BNY_DEBUG, "failed to get sysctl info about pid",
-		    "pid", BNY_INT, (int)ent->se_pid,
-		    "error", BNY_ERF, err,
-		    NULL);
-		errf_free(err);
-	} else if (sz >= sizeof (kp)) {
-		ent->se_exepath = strdup(kp.p_comm);
-	}
-
 	if (!allow_any_uid && (euid != 0) && !check_uid(euid)) {
 		error("uid mismatch: peer euid %u not on allow list",
 		    (u_int) euid);
@@ -2541,8 +3244,6 @@ check_socket_access(int fd, socket_entry_t *ent)
 {
 	struct xucred *peer;
 	socklen_t len;
-	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
-	int rc;
 	uid_t euid;
 #if defined(LOCAL_PEERPID)
 	pid_t pid;
@@ -2563,13 +3264,8 @@ check_socket_access(int fd, socket_entry_t *ent)
 	free(peer);
 #if defined(LOCAL_PEERPID)
 	len = sizeof (pid);
-	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) == 0) {
+	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) == 0)
 		ent->se_pid = pid;
-		rc = proc_pidpath(pid, pathBuf, sizeof (pathBuf));
-		if (rc > 0) {
-			ent->se_exepath = strdup(pathBuf);
-		}
-	}
 #endif
 
 	if (!allow_any_uid && (euid != 0) && !check_uid(euid)) {
@@ -2582,18 +3278,14 @@ check_socket_access(int fd, socket_entry_t *ent)
 }
 #elif defined(SO_PEERCRED)
 /*
- * Linux et al have SO_PEERCRED and it's a struct ucred. We can also read the
- * path to the executable and cmdline out of procfs.
+ * Linux et al have SO_PEERCRED and it's a struct ucred.
  */
 static int
 check_socket_access(int fd, socket_entry_t *ent)
 {
-	uint i;
-	FILE *f;
 	uid_t euid;
 	struct ucred *peer;
 	socklen_t len;
-	char fn[128], ln[1024];
 
 	peer = calloc(1, sizeof (struct ucred));
 	len = sizeof (struct ucred);
@@ -2606,22 +3298,6 @@ check_socket_access(int fd, socket_entry_t *ent)
 	ent->se_gid = peer->gid;
 	ent->se_pid = peer->pid;
 	free(peer);
-	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)ent->se_pid);
-	len = readlink(fn, ln, sizeof (ln));
-	if (len > 0 && len < sizeof (ln)) {
-		ent->se_exepath = strndup(ln, len);
-	}
-	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)ent->se_pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		len = fread(ln, 1, sizeof (ln) - 1, f);
-		fclose(f);
-		for (i = 0; i < len; ++i) {
-			if (ln[i] == '\0')
-				ln[i] = ' ';
-		}
-		ent->se_exeargs = strndup(ln, len);
-	}
 
 	if (!allow_any_uid && (euid != 0) && !check_uid(euid)) {
 		error("uid mismatch: peer euid %u not on allow list",
@@ -2663,7 +3339,6 @@ handle_socket_read(u_int socknum)
 	socklen_t slen;
 	int fd;
 	socket_entry_t *ent;
-	uint64_t start_time;
 
 	slen = sizeof(sunaddr);
 	fd = accept(sockets[socknum].se_fd, (struct sockaddr *)&sunaddr, &slen);
@@ -2679,8 +3354,8 @@ handle_socket_read(u_int socknum)
 		return (0);
 	}
 
-	start_time = get_pid_start_time(ent->se_pid);
-	ent->se_pid_ent = find_or_make_pid_entry(ent->se_pid, start_time);
+	ent->se_pid_ent = find_or_make_pid_entry(ent->se_pid);
+	ent->se_pid_ent->pe_refcnt++;
 	ent->se_pid_idx = ent->se_pid_ent->pe_conn_count++;
 
 	return (0);
@@ -2706,10 +3381,49 @@ handle_conn_read(u_int socknum)
 	if ((r = sshbuf_put(sockets[socknum].se_input, buf, len)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	explicit_bzero(buf, sizeof(buf));
-	process_message(socknum);
+	sockets[socknum].se_rx_us = monotime_us();
+	/* The messages themselves get handled in process_pending(). */
 	return 0;
 }
 
+static boolean_t
+has_pending_message(const socket_entry_t *e)
+{
+	const u_char *cp;
+
+	if (e->se_type != AUTH_CONNECTION || sshbuf_len(e->se_input) < 5)
+		return (B_FALSE);
+	cp = sshbuf_ptr(e->se_input);
+	return (sshbuf_len(e->se_input) >= (size_t)PEEK_U32(cp) + 4);
+}
+
+/*
+ * Clients may pipeline requests (e.g. piv_box_open_agent_many()), so each
+ * connection can have several complete messages buffered. We handle them
+ * in order, but stop after the first one which used the card: card ops take
+ * tens of milliseconds each, and one client's burst shouldn't make everyone
+ * else wait for all of it. Whatever is left gets its turn next time around
+ * the poll loop (prepare_poll() won't sleep while there is any).
+ */
+static void
+process_pending(void)
+{
+	u_int socknum;
+	int r;
+
+	for (socknum = 0; socknum < sockets_alloc; socknum++) {
+		while (has_pending_message(&sockets[socknum])) {
+			r = process_message(socknum);
+			if (r == -1) {
+				close_socket(&sockets[socknum]);
+				break;
+			}
+			if (r != 1 || cur_msg_card)
+				break;
+		}
+	}
+}
+
 static int
 handle_conn_write(u_int socknum)
 {
@@ -2854,6 +3568,12 @@ prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 	    "deadline", BNY_UINT64, deadline,
 	    "poll_timeout", BNY_INT, *timeoutp,
 	    NULL);
+	for (i = 0; i < sockets_alloc; i++) {
+		if (has_pending_message(&sockets[i])) {
+			*timeoutp = 0;
+			break;
+		}
+	}
 	return (1);
 }
 
@@ -3107,6 +3827,7 @@ main(int ac, char **av)
 	bunyan_set_name("pivy-agent");
 
 	__progname = "pivy-agent";
+	stats_start = monotime();
 
 	slot_ena = slotspec_alloc();
 	slotspec_set_default(slot_ena);
@@ -3451,6 +4172,7 @@ skip:
 			fatal("poll: %s", strerror(saved_errno));
 		} else if (result > 0)
 			after_poll(pfd, npfd);
+		process_pending();
 	}
 	/* NOTREACHED */
 }
@@ -22,6 +22,8 @@
 #include <err.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <fcntl.h>
 
 #include "debug.h"
 
@@ -42,6 +44,7 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "openssh/config.h"
 #include "openssh/sshkey.h"
@@ -69,6 +72,12 @@ static boolean_t ebox_raw_out = B_FALSE;
 static boolean_t ebox_interactive = B_FALSE;
 static struct ebox_tpl *ebox_stpl;
 static size_t ebox_keylen = 32;
+static const char *ebox_outdir = NULL;
+static const char *ebox_infile = NULL;
+static const char *ebox_outfile = NULL;
+static uint ebox_nthreads = 0;
+static uint ebox_bench_n = 0;
+static boolean_t ebox_compress = B_FALSE;
 
 static errf_t *
 parse_hex(const char *str, uint8_t **out, size_t *outlen)
@@ -1427,6 +1436,191 @@ cmd_key_lock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
+static uint64_t
+box_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static uint
+box_nthreads(void)
+{
+	long ncpu;
+
+	if (ebox_nthreads > 0)
+		return (ebox_nthreads);
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return ((ncpu < 1) ? 1 : ncpu);
+}
+
+static void
+write_ebox_file(const char *path, struct ebox *ebox)
+{
+	struct sshbuf *buf;
+	FILE *file;
+	char *b64;
+	errf_t *error;
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	error = sshbuf_put_ebox(buf, ebox);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to serialise ebox");
+
+	file = fopen(path, "w");
+	if (file == NULL)
+		err(EXIT_ERROR, "failed to open %s for writing", path);
+	if (ebox_raw_out) {
+		fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, file);
+	} else {
+		b64 = sshbuf_dtob64_string(buf, 0);
+		printwrap(file, b64, BASE64_LINE_LEN);
+		free(b64);
+	}
+	if (fclose(file) != 0)
+		err(EXIT_ERROR, "failed to write %s", path);
+	sshbuf_free(buf);
+}
+
+/*
+ * Compare the throughput of ebox_create() one key at a time with
+ * ebox_create_batch(), on randomly generated keys.
+ */
+static errf_t *
+bench_key_lock(uint n)
+{
+	uint8_t **keys;
+	size_t *keylens;
+	struct ebox **eboxes, *ebox;
+	errf_t *error;
+	uint64_t t0, tserial, tbatch;
+	uint i, nthreads = box_nthreads();
+
+	keys = calloc(n, sizeof (uint8_t *));
+	keylens = calloc(n, sizeof (size_t));
+	eboxes = calloc(n, sizeof (struct ebox *));
+	if (keys == NULL || keylens == NULL || eboxes == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i) {
+		keys[i] = malloc(ebox_keylen);
+		if (keys[i] == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		arc4random_buf(keys[i], ebox_keylen);
+		keylens[i] = ebox_keylen;
+	}
+
+	t0 = box_now_us();
+	for (i = 0; i < n; ++i) {
+		error = ebox_create(ebox_stpl, keys[i], keylens[i], NULL, 0,
+		    &ebox);
+		if (error)
+			return (error);
+		ebox_free(ebox);
+	}
+	tserial = box_now_us() - t0;
+
+	t0 = box_now_us();
+	error = ebox_create_batch(ebox_stpl, (const uint8_t *const *)keys,
+	    keylens, n, nthreads, eboxes);
+	if (error)
+		return (error);
+	tbatch = box_now_us() - t0;
+
+	fprintf(stderr, "ebox_create:       %u keys in %" PRIu64 " ms "
+	    "(%.1f keys/s)\n", n, tserial / 1000,
+	    (double)n * 1000000.0 / (tserial ? tserial : 1));
+	fprintf(stderr, "ebox_create_batch: %u keys in %" PRIu64 " ms "
+	    "(%.1f keys/s, %u threads)\n", n, tbatch / 1000,
+	    (double)n * 1000000.0 / (tbatch ? tbatch : 1), nthreads);
+
+	for (i = 0; i < n; ++i) {
+		ebox_free(eboxes[i]);
+		free(keys[i]);
+	}
+	free(eboxes);
+	free(keylens);
+	free(keys);
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_key_lock_batch(int argc, char *argv[])
+{
+	struct sshbuf **kbufs;
+	const uint8_t **keys;
+	size_t *keylens;
+	struct ebox **eboxes;
+	errf_t *error;
+	FILE *file;
+	const char *base;
+	char path[PATH_MAX];
+	uint64_t t0, tlock;
+	uint i, n, nthreads = box_nthreads();
+
+	if (argc == 0 && ebox_bench_n > 0)
+		return (bench_key_lock(ebox_bench_n));
+	if (argc == 0) {
+		errx(EXIT_USAGE, "pivy-box key lock-batch needs at least "
+		    "one file (or -n for a benchmark)");
+	}
+	n = argc;
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	kbufs = calloc(n, sizeof (struct sshbuf *));
+	keys = calloc(n, sizeof (uint8_t *));
+	keylens = calloc(n, sizeof (size_t));
+	eboxes = calloc(n, sizeof (struct ebox *));
+	if (kbufs == NULL || keys == NULL || keylens == NULL || eboxes == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < n; ++i) {
+		file = fopen(argv[i], "r");
+		if (file == NULL)
+			err(EXIT_USAGE, "failed to open file %s", argv[i]);
+		kbufs[i] = read_file_b64(EBOX_MAX_SIZE, file);
+		fclose(file);
+		keys[i] = sshbuf_ptr(kbufs[i]);
+		keylens[i] = sshbuf_len(kbufs[i]);
+		set_no_dump((void *)keys[i], keylens[i]);
+	}
+
+	t0 = box_now_us();
+	error = ebox_create_batch(ebox_stpl, keys, keylens, n, nthreads,
+	    eboxes);
+	if (error)
+		return (error);
+	tlock = box_now_us() - t0;
+
+	for (i = 0; i < n; ++i) {
+		if (ebox_outdir != NULL) {
+			base = strrchr(argv[i], '/');
+			base = (base == NULL) ? argv[i] : base + 1;
+			snprintf(path, sizeof (path), "%s/%s.ebox",
+			    ebox_outdir, base);
+		} else {
+			snprintf(path, sizeof (path), "%s.ebox", argv[i]);
+		}
+		write_ebox_file(path, eboxes[i]);
+		ebox_free(eboxes[i]);
+		sshbuf_free(kbufs[i]);
+	}
+
+	fprintf(stderr, "Locked %u keys in %" PRIu64 " ms (%.1f keys/s, "
+	    "%u threads)\n", n, tlock / 1000,
+	    (double)n * 1000000.0 / (tlock ? tlock : 1), nthreads);
+
+	free(eboxes);
+	free(keylens);
+	free(keys);
+	free(kbufs);
+	return (ERRF_OK);
+}
+
 static errf_t *
 cmd_key_relock(int argc, char *argv[])
 {
@@ -1616,24 +1810,576 @@ cmd_key_unlock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
+struct unlock_batch_ent {
+	const char		*ube_name;
+	char			*ube_path;	/* output file with -o */
+	struct ebox		*ube_ebox;
+	uint8_t			 ube_guid[GUID_LEN];
+	enum piv_slotid		 ube_slotid;
+	uint64_t		 ube_us;
+	errf_t			*ube_err;
+};
+
+/*
+ * Works out which token and slot a primary config of the ebox needs, so
+ * that we can hand local_unlock_eboxes() all the boxes for one key at once
+ * (and time each group).
+ */
+static void
+unlock_batch_key(struct unlock_batch_ent *ube)
+{
+	struct ebox_config *config = NULL;
+	struct ebox_tpl_config *tconfig;
+	struct piv_ecdh_box *box;
+
+	while ((config = ebox_next_config(ube->ube_ebox, config)) != NULL) {
+		tconfig = ebox_config_tpl(config);
+		if (ebox_tpl_config_type(tconfig) != EBOX_PRIMARY)
+			continue;
+		box = ebox_part_box(ebox_config_next_part(config, NULL));
+		if (!piv_box_has_guidslot(box))
+			continue;
+		bcopy(piv_box_guid(box), ube->ube_guid, GUID_LEN);
+		ube->ube_slotid = piv_box_slot(box);
+		return;
+	}
+}
+
+static int
+unlock_batch_cmp(const void *a, const void *b)
+{
+	const struct unlock_batch_ent *ua = *(struct unlock_batch_ent **)a;
+	const struct unlock_batch_ent *ub = *(struct unlock_batch_ent **)b;
+	int rc;
+
+	rc = memcmp(ua->ube_guid, ub->ube_guid, GUID_LEN);
+	if (rc != 0)
+		return (rc);
+	if (ua->ube_slotid != ub->ube_slotid)
+		return ((ua->ube_slotid < ub->ube_slotid) ? -1 : 1);
+	return (0);
+}
+
+static void
+write_key_file(const char *path, const uint8_t *key, size_t keylen)
+{
+	struct sshbuf *buf;
+	FILE *file;
+	char *b64;
+	int fd;
+
+	/*
+	 * Never replace an existing file: with "-o ." the output path for
+	 * "foo" is the input ebox "./foo" itself.
+	 */
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		err(EXIT_ERROR, "failed to open %s for writing", path);
+	file = fdopen(fd, "w");
+	if (file == NULL)
+		err(EXIT_ERROR, "failed to open %s for writing", path);
+	if (ebox_raw_out) {
+		fwrite(key, keylen, 1, file);
+	} else {
+		buf = sshbuf_from(key, keylen);
+		if (buf == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		b64 = sshbuf_dtob64_string(buf, 0);
+		printwrap(file, b64, BASE64_LINE_LEN);
+		freezero(b64, strlen(b64));
+		sshbuf_free(buf);
+	}
+	if (fclose(file) != 0)
+		err(EXIT_ERROR, "failed to write %s", path);
+}
+
+/*
+ * Reads a stream of length-prefixed (SSH wire format "string") binary eboxes
+ * from stdin.
+ */
+static uint
+read_stdin_frames(struct sshbuf ***pbufs)
+{
+	struct sshbuf *in, *frame, **bufs = NULL;
+	uint8_t chunk[8192];
+	size_t nread;
+	uint n = 0, alloc = 0;
+	int rc;
+
+	in = sshbuf_new();
+	if (in == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	while ((nread = fread(chunk, 1, sizeof (chunk), stdin)) > 0) {
+		if ((rc = sshbuf_put(in, chunk, nread)))
+			errfx(EXIT_ERROR, ssherrf("sshbuf_put", rc),
+			    "error reading input");
+	}
+	if (ferror(stdin))
+		err(EXIT_USAGE, "error reading input");
+
+	while (sshbuf_len(in) > 0) {
+		frame = sshbuf_new();
+		if (frame == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		if ((rc = sshbuf_get_stringb(in, frame))) {
+			errfx(EXIT_USAGE, ssherrf("sshbuf_get_stringb", rc),
+			    "error parsing framed input (frame %u)", n);
+		}
+		if (sshbuf_len(frame) > EBOX_MAX_SIZE) {
+			errx(EXIT_USAGE, "frame %u too long (max %u bytes)",
+			    n, EBOX_MAX_SIZE);
+		}
+		if (n >= alloc) {
+			alloc = (alloc == 0) ? 64 : alloc * 2;
+			bufs = recallocarray(bufs, n, alloc,
+			    sizeof (struct sshbuf *));
+			if (bufs == NULL)
+				errx(EXIT_ERROR, "failed to allocate memory");
+		}
+		bufs[n++] = frame;
+	}
+	sshbuf_free(in);
+	*pbufs = bufs;
+	return (n);
+}
+
+static errf_t *
+cmd_key_unlock_batch(int argc, char *argv[])
+{
+	struct unlock_batch_ent *ents, **sorted;
+	struct sshbuf **bufs = NULL, *out = NULL;
+	struct ebox **run;
+	const uint8_t *key;
+	size_t keylen, len;
+	const char *base;
+	char path[PATH_MAX], **names;
+	FILE *file;
+	errf_t *error;
+	uint64_t t0, tparse, tunlock, tend, tsum = 0, tmax = 0;
+	uint i, j, k, n, nrun, nunlocked, nfailed = 0;
+	boolean_t notty = B_FALSE;
+	int rc;
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	t0 = box_now_us();
+
+	if (argc > 0) {
+		n = argc;
+		bufs = calloc(n, sizeof (struct sshbuf *));
+		if (bufs == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		for (i = 0; i < n; ++i) {
+			file = fopen(argv[i], "r");
+			if (file == NULL)
+				err(EXIT_USAGE, "failed to open file %s", argv[i]);
+			bufs[i] = read_file_b64(EBOX_MAX_SIZE, file);
+			fclose(file);
+		}
+	} else {
+		n = read_stdin_frames(&bufs);
+	}
+	if (n == 0)
+		errx(EXIT_USAGE, "no eboxes given to unlock");
+
+	ents = calloc(n, sizeof (struct unlock_batch_ent));
+	sorted = calloc(n, sizeof (struct unlock_batch_ent *));
+	run = calloc(n, sizeof (struct ebox *));
+	names = calloc(n, sizeof (char *));
+	if (ents == NULL || sorted == NULL || run == NULL || names == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < n; ++i) {
+		if (argc > 0) {
+			ents[i].ube_name = argv[i];
+		} else {
+			if (asprintf(&names[i], "stdin[%u]", i) == -1)
+				errx(EXIT_ERROR, "failed to allocate memory");
+			ents[i].ube_name = names[i];
+		}
+		error = sshbuf_get_ebox(bufs[i], &ents[i].ube_ebox);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to parse %s as an "
+			    "ebox", ents[i].ube_name);
+		}
+		if (ebox_type(ents[i].ube_ebox) != EBOX_KEY) {
+			errx(EXIT_ERROR, "%s is not a key ebox (maybe you "
+			    "want 'stream decrypt'?)", ents[i].ube_name);
+		}
+		sshbuf_free(bufs[i]);
+		unlock_batch_key(&ents[i]);
+		sorted[i] = &ents[i];
+
+		if (ebox_outdir == NULL)
+			continue;
+		base = strrchr(ents[i].ube_name, '/');
+		base = (base == NULL) ? ents[i].ube_name : base + 1;
+		len = strlen(base);
+		if (len > 5 && strcmp(base + len - 5, ".ebox") == 0)
+			len -= 5;
+		snprintf(path, sizeof (path), "%s/%.*s", ebox_outdir,
+		    (int)len, base);
+		for (j = 0; j < i; ++j) {
+			if (strcmp(ents[j].ube_path, path) == 0) {
+				errx(EXIT_USAGE, "%s and %s would both be "
+				    "written to %s", ents[j].ube_name,
+				    ents[i].ube_name, path);
+			}
+		}
+		/* Check now, rather than after asking for PINs. */
+		if (access(path, F_OK) == 0) {
+			errx(EXIT_USAGE, "%s would be written to %s, which "
+			    "already exists", ents[i].ube_name, path);
+		}
+		ents[i].ube_path = strdup(path);
+		if (ents[i].ube_path == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+	}
+	free(bufs);
+	tparse = box_now_us();
+
+	/*
+	 * Unlock one token/slot group at a time, so that each box's latency
+	 * is the time until its group was done. Within a group,
+	 * local_unlock_eboxes() uses one agent burst or card transaction.
+	 */
+	qsort(sorted, n, sizeof (struct unlock_batch_ent *), unlock_batch_cmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && unlock_batch_cmp(&sorted[i],
+		    &sorted[j]) == 0; ++j)
+			run[j - i] = sorted[j]->ube_ebox;
+		nrun = j - i;
+		error = local_unlock_eboxes(run, nrun, &nunlocked);
+		if (error)
+			return (error);
+		tend = box_now_us();
+		for (k = i; k < j; ++k)
+			sorted[k]->ube_us = tend - tparse;
+	}
+
+	/*
+	 * If the eboxes came in on stdin, it's used up by now: any prompts
+	 * below have to be answered on the terminal instead.
+	 */
+	if (argc == 0 && !ebox_batch) {
+		for (i = 0; i < n && ebox_is_unlocked(ents[i].ube_ebox); ++i)
+			;
+		if (i < n && freopen("/dev/tty", "r", stdin) == NULL) {
+			warn("failed to open /dev/tty");
+			notty = B_TRUE;
+		}
+	}
+
+	/* Anything left needs recovery (or a PIN we weren't given). */
+	for (i = 0; i < n; ++i) {
+		if (ebox_is_unlocked(ents[i].ube_ebox))
+			continue;
+		if (ebox_batch) {
+			ents[i].ube_err = errf("InteractiveError", NULL,
+			    "no agent or token could unlock this ebox, and "
+			    "-b batch option was given");
+			continue;
+		}
+		if (notty) {
+			ents[i].ube_err = errf("InteractiveError", NULL,
+			    "no agent or token could unlock this ebox, and "
+			    "there is no terminal to prompt on");
+			continue;
+		}
+		release_context();
+		ents[i].ube_err = interactive_unlock_ebox(ents[i].ube_ebox,
+		    ents[i].ube_name);
+		ents[i].ube_us = box_now_us() - tparse;
+	}
+	tunlock = box_now_us();
+
+	if (ebox_outdir == NULL) {
+		out = sshbuf_new();
+		if (out == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+	}
+	for (i = 0; i < n; ++i) {
+		struct unlock_batch_ent *ube = &ents[i];
+
+		if (ube->ube_err != ERRF_OK) {
+			++nfailed;
+			warnfx(ube->ube_err, "%s: failed to unlock",
+			    ube->ube_name);
+		} else {
+			fprintf(stderr, "%s: unlocked in %" PRIu64 " us\n",
+			    ube->ube_name, ube->ube_us);
+			tsum += ube->ube_us;
+			if (ube->ube_us > tmax)
+				tmax = ube->ube_us;
+		}
+
+		if (out != NULL) {
+			/*
+			 * Framed output: for each input, in order, a status
+			 * byte (0 = ok), the input name and then the key
+			 * (or the error message).
+			 */
+			if (ube->ube_err == ERRF_OK) {
+				key = ebox_key(ube->ube_ebox, &keylen);
+				rc = sshbuf_put_u8(out, 0);
+				if (rc == 0)
+					rc = sshbuf_put_cstring(out,
+					    ube->ube_name);
+				if (rc == 0)
+					rc = sshbuf_put_string(out, key,
+					    keylen);
+			} else {
+				rc = sshbuf_put_u8(out, 1);
+				if (rc == 0)
+					rc = sshbuf_put_cstring(out,
+					    ube->ube_name);
+				if (rc == 0)
+					rc = sshbuf_put_cstring(out,
+					    errf_message(ube->ube_err));
+			}
+			if (rc) {
+				errfx(EXIT_ERROR, ssherrf("sshbuf_put", rc),
+				    "failed to write output");
+			}
+		} else if (ube->ube_err == ERRF_OK) {
+			key = ebox_key(ube->ube_ebox, &keylen);
+			write_key_file(ube->ube_path, key, keylen);
+		}
+	}
+	if (out != NULL) {
+		if (sshbuf_len(out) > 0 &&
+		    fwrite(sshbuf_ptr(out), sshbuf_len(out), 1, stdout) != 1)
+			err(EXIT_ERROR, "failed to write output");
+		sshbuf_free(out);
+	}
+
+	fprintf(stderr, "Unlocked %u/%u eboxes: parse %" PRIu64 " ms, "
+	    "unlock %" PRIu64 " ms (%.1f eboxes/s), per-box mean %" PRIu64
+	    " us, max %" PRIu64 " us\n", n - nfailed, n,
+	    (tparse - t0) / 1000, (tunlock - tparse) / 1000,
+	    (double)(n - nfailed) * 1000000.0 /
+	    ((tunlock - tparse) ? (tunlock - tparse) : 1),
+	    (n > nfailed) ? tsum / (n - nfailed) : 0, tmax);
+
+	for (i = 0; i < n; ++i) {
+		ebox_free(ents[i].ube_ebox);
+		errf_free(ents[i].ube_err);
+		free(ents[i].ube_path);
+		free(names[i]);
+	}
+	free(names);
+	free(run);
+	free(sorted);
+	free(ents);
+
+	if (nfailed > 0) {
+		return (errf("UnlockError", NULL, "%u of %u eboxes could not "
+		    "be unlocked", nfailed, n));
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * The stream commands read their input in blocks of this many whole chunks
+ * at a time, and write out the chunks from each block with one writev().
+ */
+#define	STREAM_IO_CHUNKS	8
+/*
+ * When decrypting, the chunk size comes from the (not yet authenticated)
+ * stream header, so cap the read-ahead at this many bytes rather than
+ * STREAM_IO_CHUNKS whole chunks. We always make room for at least one chunk.
+ */
+#define	STREAM_IO_BUDGET	(1024 * 1024)
+/*
+ * Allowance for the per-chunk framing, padding and MAC on top of the chunk
+ * size when sizing buffers for encrypted chunks.
+ */
+#define	STREAM_CHUNK_SLACK	256
+
+struct stream_rbuf {
+	int		 srb_fd;
+	uint8_t		*srb_buf;
+	size_t		 srb_size;
+	size_t		 srb_off;	/* start of data not yet parsed */
+	size_t		 srb_len;	/* end of data read in */
+	boolean_t	 srb_eof;
+};
+
+static int
+stream_open_in(const char *fname)
+{
+	int fd;
+
+	if (fname == NULL) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(fname, O_RDONLY);
+		if (fd < 0)
+			err(EXIT_USAGE, "failed to open file %s", fname);
+	}
+#if defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return (fd);
+}
+
+static int
+stream_open_out(const char *fname)
+{
+	int fd;
+
+	if (fname == NULL)
+		return (STDOUT_FILENO);
+	fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		err(EXIT_USAGE, "failed to open file %s", fname);
+	return (fd);
+}
+
+static void
+stream_close_out(int fd)
+{
+	if (fd != STDOUT_FILENO && close(fd) != 0)
+		err(EXIT_ERROR, "failed to write output");
+}
+
+/* Reads until buf is full or we hit EOF. */
+static size_t
+stream_read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, &buf[done], len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(EXIT_ERROR, "failed to read input");
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return (done);
+}
+
+static void
+stream_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(EXIT_ERROR, "failed to write output");
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static void
+stream_rbuf_reserve(struct stream_rbuf *rb, size_t size)
+{
+	uint8_t *nbuf;
+
+	if (size <= rb->srb_size)
+		return;
+	nbuf = realloc(rb->srb_buf, size);
+	if (nbuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	rb->srb_buf = nbuf;
+	rb->srb_size = size;
+}
+
+/*
+ * Reads more input into the buffer. Data that hasn't been parsed yet is moved
+ * to the front first, and if that leaves no room (i.e. one record is bigger
+ * than the whole buffer) the buffer is grown.
+ */
+static void
+stream_rbuf_fill(struct stream_rbuf *rb)
+{
+	size_t n, want;
+
+	if (rb->srb_off > 0) {
+		memmove(rb->srb_buf, &rb->srb_buf[rb->srb_off],
+		    rb->srb_len - rb->srb_off);
+		rb->srb_len -= rb->srb_off;
+		rb->srb_off = 0;
+	}
+	if (rb->srb_len == rb->srb_size)
+		stream_rbuf_reserve(rb, rb->srb_size * 2);
+
+	want = rb->srb_size - rb->srb_len;
+	n = stream_read_full(rb->srb_fd, &rb->srb_buf[rb->srb_len], want);
+	rb->srb_len += n;
+	if (n < want)
+		rb->srb_eof = B_TRUE;
+}
+
+/*
+ * Wraps the unparsed part of the read buffer in a read-only sshbuf so that
+ * records can be parsed in place. After parsing, stream_rbuf_consume() skips
+ * over whatever was used.
+ */
+static struct sshbuf *
+stream_rbuf_view(struct stream_rbuf *rb)
+{
+	struct sshbuf *b;
+
+	b = sshbuf_from(&rb->srb_buf[rb->srb_off], rb->srb_len - rb->srb_off);
+	if (b == NULL)
+		errx(EXIT_ERROR, "input record too large");
+	return (b);
+}
+
+static void
+stream_rbuf_consume(struct stream_rbuf *rb, struct sshbuf *b)
+{
+	rb->srb_off = rb->srb_len - sshbuf_len(b);
+	sshbuf_free(b);
+}
+
 static errf_t *
 cmd_stream_encrypt(int argc, char *argv[])
 {
 	struct ebox_stream *es;
-	struct ebox_stream_chunk *esc;
+	struct ebox_stream_chunk *esc[STREAM_IO_CHUNKS];
+	uint8_t hdr[STREAM_IO_CHUNKS][EBOX_STREAM_CHUNK_HDRLEN];
+	struct iovec iov[1 + 2 * STREAM_IO_CHUNKS];
 	errf_t *error;
 	uint8_t *ibuf;
+	const uint8_t *enc;
 	struct sshbuf *obuf;
-	size_t chunksz, nread, nwrote;
+	size_t chunksz, bufsz, nread, off, len, enclen;
 	size_t seq = 0;
+	int infd, outfd, niov, nchunk, i;
+
+	infd = stream_open_in(ebox_infile);
+	outfd = stream_open_out(ebox_outfile);
 
 	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
 
 	error = ebox_stream_new(ebox_stpl, &es);
 	if (error)
 		return (error);
+	if (ebox_compress) {
+		error = ebox_stream_set_compression(es, EBOX_COMPRESS_ZLIB);
+		if (error)
+			return (error);
+	}
 	chunksz = ebox_stream_chunk_size(es);
-	ibuf = malloc(chunksz);
+	bufsz = chunksz * STREAM_IO_CHUNKS;
+	ibuf = malloc(bufsz);
 	if (ibuf == NULL)
 		errx(EXIT_ERROR, "failed to allocate memory");
 	obuf = sshbuf_new();
@@ -1643,34 +2389,52 @@ cmd_stream_encrypt(int argc, char *argv[])
 	error = sshbuf_put_ebox_stream(obuf, es);
 	if (error)
 		return (error);
-	while (sshbuf_len(obuf) > 0) {
-		nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf), stdout);
-		sshbuf_consume(obuf, nwrote);
-	}
-	sshbuf_reset(obuf);
 
-	while (!feof(stdin) && !ferror(stdin)) {
-		nread = fread(ibuf, 1, chunksz, stdin);
-		if (nread < 1)
-			continue;
-		error = ebox_stream_chunk_new(es, ibuf, nread, ++seq, &esc);
-		if (error)
-			return (error);
-		error = ebox_stream_encrypt_chunk(esc);
-		if (error)
-			return (error);
-		error = sshbuf_put_ebox_stream_chunk(obuf, esc);
-		if (error)
-			return (error);
-		while (sshbuf_len(obuf) > 0) {
-			nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf),
-			    stdout);
-			sshbuf_consume(obuf, nwrote);
+	/* The stream header goes out with the first block of chunks. */
+	niov = 0;
+	iov[niov].iov_base = (void *)sshbuf_ptr(obuf);
+	iov[niov].iov_len = sshbuf_len(obuf);
+	++niov;
+
+	do {
+		nread = stream_read_full(infd, ibuf, bufsz);
+
+		nchunk = 0;
+		for (off = 0; off < nread; off += len) {
+			len = nread - off;
+			if (len > chunksz)
+				len = chunksz;
+			error = ebox_stream_chunk_new(es, &ibuf[off], len,
+			    ++seq, &esc[nchunk]);
+			if (error)
+				return (error);
+			error = ebox_stream_encrypt_chunk(esc[nchunk]);
+			if (error)
+				return (error);
+			error = ebox_stream_chunk_frame(esc[nchunk],
+			    hdr[nchunk], &enc, &enclen);
+			if (error)
+				return (error);
+
+			iov[niov].iov_base = hdr[nchunk];
+			iov[niov].iov_len = EBOX_STREAM_CHUNK_HDRLEN;
+			++niov;
+			iov[niov].iov_base = (void *)enc;
+			iov[niov].iov_len = enclen;
+			++niov;
+			++nchunk;
 		}
-		sshbuf_reset(obuf);
-		ebox_stream_chunk_free(esc);
-	}
 
+		if (niov > 0)
+			stream_writev_full(outfd, iov, niov);
+		niov = 0;
+		for (i = 0; i < nchunk; ++i)
+			ebox_stream_chunk_free(esc[i]);
+	} while (nread == bufsz);
+
+	stream_close_out(outfd);
+	freezero(ibuf, bufsz);
+	sshbuf_free(obuf);
 	ebox_stream_free(es);
 	return (ERRF_OK);
 }
@@ -1679,59 +2443,46 @@ static errf_t *
 cmd_stream_decrypt(int argc, char *argv[])
 {
 	struct ebox_stream *es = NULL;
-	struct ebox_stream_chunk *esc = NULL;
+	struct ebox_stream_chunk *esc[STREAM_IO_CHUNKS];
+	struct iovec iov[STREAM_IO_CHUNKS];
+	struct stream_rbuf rb;
 	struct ebox *ebox;
+	struct sshbuf *b;
 	errf_t *error;
-	uint8_t *buf;
 	const uint8_t *data;
-	struct sshbuf *ibuf, *nbuf;
-	size_t nread, nwrote, poff;
-	FILE *file;
-	const char *fname = NULL;
+	size_t len, chunksz;
+	int outfd, nchunk, i;
+	const char *fname = ebox_infile;
 
-	if (argc == 1) {
+	if (argc == 1 && fname == NULL) {
 		fname = argv[0];
-		file = fopen(fname, "r");
-		if (file == NULL)
-			err(EXIT_USAGE, "failed to open file %s", fname);
-	} else if (argc == 0) {
-		file = stdin;
-	} else {
+	} else if (argc != 0) {
 		errx(EXIT_USAGE, "too many arguments for pivy-box "
 		    "stream decrypt");
 	}
 
-	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+	bzero(&rb, sizeof (rb));
+	rb.srb_fd = stream_open_in(fname);
+	outfd = stream_open_out(ebox_outfile);
 
-	buf = malloc(8192);
-	VERIFY(buf != NULL);
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
 
-	ibuf = sshbuf_new();
-	VERIFY(ibuf != NULL);
+	stream_rbuf_reserve(&rb, 8192);
 
 	while (es == NULL) {
-		nread = fread(buf, 1, 8192, file);
-		if (nread < 1 && ferror(file))
-			err(EXIT_ERROR, "failed to read input");
-		VERIFY0(sshbuf_put(ibuf, buf, nread));
-
-		poff = sshbuf_offset(ibuf);
-		error = sshbuf_get_ebox_stream(ibuf, &es);
+		b = stream_rbuf_view(&rb);
+		error = sshbuf_get_ebox_stream(b, &es);
 		if (errf_caused_by(error, "IncompleteMessageError")) {
-			if (feof(file))
+			sshbuf_free(b);
+			if (rb.srb_eof)
 				errfx(EXIT_ERROR, error, "input too short");
-			VERIFY0(sshbuf_rewind(ibuf, poff));
 			errf_free(error);
+			stream_rbuf_fill(&rb);
 			continue;
 		} else if (error) {
 			return (error);
 		}
-		break;
-	}
-
-	if (es == NULL) {
-		return (errf("IncompleteInputError", NULL,
-		    "input was incomplete"));
+		stream_rbuf_consume(&rb, b);
 	}
 
 	ebox = ebox_stream_ebox(es);
@@ -1740,51 +2491,63 @@ cmd_stream_decrypt(int argc, char *argv[])
 	if (error)
 		return (error);
 
-	while (1) {
-		nread = fread(buf, 1, 8192, file);
-		if (nread < 1 && ferror(file))
-			err(EXIT_ERROR, "failed to read input");
-		else if (nread < 1 && feof(file) && sshbuf_len(ibuf) == 0)
-			break;
-		VERIFY0(sshbuf_put(ibuf, buf, nread));
-
-		poff = sshbuf_offset(ibuf);
-		error = sshbuf_get_ebox_stream_chunk(ibuf, es, &esc);
-		if (errf_caused_by(error, "IncompleteMessageError")) {
-			if (feof(file))
-				errfx(EXIT_ERROR, error, "input too short");
-			VERIFY0(sshbuf_rewind(ibuf, poff));
-			errf_free(error);
-			continue;
-		} else if (error) {
-			return (error);
-		}
+	/*
+	 * Now we know the chunk size, make the buffer big enough that each
+	 * read brings in a block of chunks (or at least a whole one).
+	 */
+	chunksz = ebox_stream_chunk_size(es) + STREAM_CHUNK_SLACK;
+	if (chunksz < STREAM_IO_BUDGET / STREAM_IO_CHUNKS)
+		stream_rbuf_reserve(&rb, STREAM_IO_CHUNKS * chunksz);
+	else if (chunksz < STREAM_IO_BUDGET)
+		stream_rbuf_reserve(&rb, STREAM_IO_BUDGET);
+	else
+		stream_rbuf_reserve(&rb, chunksz);
 
-		error = ebox_stream_decrypt_chunk(esc);
-		if (error)
-			return (error);
+	while (1) {
+		nchunk = 0;
+		while (nchunk < STREAM_IO_CHUNKS && rb.srb_off < rb.srb_len) {
+			b = stream_rbuf_view(&rb);
+			error = sshbuf_get_ebox_stream_chunk(b, es,
+			    &esc[nchunk]);
+			if (errf_caused_by(error, "IncompleteMessageError")) {
+				sshbuf_free(b);
+				if (rb.srb_eof) {
+					errfx(EXIT_ERROR, error,
+					    "input too short");
+				}
+				errf_free(error);
+				break;
+			} else if (error) {
+				return (error);
+			}
+			stream_rbuf_consume(&rb, b);
 
-		data = ebox_stream_chunk_data(esc, &nread);
+			error = ebox_stream_decrypt_chunk(esc[nchunk]);
+			if (error)
+				return (error);
 
-		nwrote = fwrite(data, 1, nread, stdout);
-		if (nwrote < nread)
-			err(EXIT_ERROR, "failed to write data");
+			data = ebox_stream_chunk_data(esc[nchunk], &len);
+			iov[nchunk].iov_base = (void *)data;
+			iov[nchunk].iov_len = len;
+			++nchunk;
+		}
 
-		ebox_stream_chunk_free(esc);
-		esc = NULL;
+		if (nchunk > 0)
+			stream_writev_full(outfd, iov, nchunk);
+		for (i = 0; i < nchunk; ++i)
+			ebox_stream_chunk_free(esc[i]);
 
-		if (sshbuf_len(ibuf) > 0) {
-			nbuf = sshbuf_new();
-			VERIFY(nbuf != NULL);
-			VERIFY0(sshbuf_put(nbuf, sshbuf_ptr(ibuf),
-			    sshbuf_len(ibuf)));
-			sshbuf_free(ibuf);
-			ibuf = nbuf;
-		}
+		if (rb.srb_off == rb.srb_len && rb.srb_eof)
+			break;
+		if (nchunk < STREAM_IO_CHUNKS)
+			stream_rbuf_fill(&rb);
 	}
 
+	stream_close_out(outfd);
+	if (rb.srb_fd != STDIN_FILENO)
+		(void) close(rb.srb_fd);
+	free(rb.srb_buf);
 	ebox_stream_free(es);
-	ebox_stream_chunk_free(esc);
 	return (ERRF_OK);
 }
 
@@ -2092,6 +2855,27 @@ usage_key(const char *op)
 		    "  -r         raw input, don't base64-decode stdin\n"
 		    "  -R         raw output, don't base64-encode stdout\n"
 		    "\n");
+	} else if (strcmp(op, "lock-batch") == 0) {
+		fprintf(stderr,
+		    "usage: pivy-box key lock-batch [-rR] [-j threads] "
+		    "[-o outdir] <tpl> file...\n"
+		    "       pivy-box key lock-batch [-l len] [-j threads] "
+		    "-n count <tpl>\n"
+		    "\n"
+		    "Takes pre-generated key material from many files and\n"
+		    "encrypts each with a 'key' ebox, writing <file>.ebox\n"
+		    "(in outdir, if given). The eboxes are created in\n"
+		    "parallel. With -n and no files, benchmarks locking\n"
+		    "random keys one at a time vs in a batch.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -r         raw input, don't base64-decode files\n"
+		    "  -R         raw output, don't base64-encode outputs\n"
+		    "  -j threads number of threads (default: CPU count)\n"
+		    "  -o outdir  directory to write outputs into\n"
+		    "  -n count   benchmark with count random keys\n"
+		    "  -l len     key length for benchmark (default 32)\n"
+		    "\n");
 	} else if (strcmp(op, "unlock") == 0) {
 		fprintf(stderr,
 		    "usage: pivy-box key unlock [-brR] [file]\n"
@@ -2103,6 +2887,36 @@ usage_key(const char *op)
 		    "  -r         raw input, don't base64-decode stdin\n"
 		    "  -R         raw output, don't base64-encode stdout\n"
 		    "\n");
+	} else if (strcmp(op, "unlock-batch") == 0) {
+		fprintf(stderr,
+		    "usage: pivy-box key unlock-batch [-brR] [-o outdir] "
+		    "[file...]\n"
+		    "\n"
+		    "Decrypts many 'key' eboxes at once. Boxes are grouped\n"
+		    "by the token and slot which can open them, and each\n"
+		    "group is unlocked with a single agent connection or\n"
+		    "card transaction. Reports latency for each box and\n"
+		    "for the whole batch on stderr.\n"
+		    "\n"
+		    "With no files, reads eboxes from stdin as a sequence\n"
+		    "of binary eboxes, each preceded by a 32-bit big-endian\n"
+		    "length. With -o, each key is written to outdir under\n"
+		    "its input file's name (minus any .ebox suffix); two\n"
+		    "inputs with the same name, or an output file which\n"
+		    "already exists, are an error. Otherwise\n"
+		    "the results go to stdout as a sequence of frames: a\n"
+		    "status byte (0 = ok), then the input name and the key\n"
+		    "(or error message) as length-prefixed strings.\n"
+		    "\n"
+		    "Without -b, any prompts needed for recovery are read\n"
+		    "from the terminal.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -r         raw input, don't base64-decode files\n"
+		    "  -R         raw output, don't base64-encode key files\n"
+		    "  -o outdir  directory to write keys into\n"
+		    "\n");
 	} else if (strcmp(op, "relock") == 0) {
 		fprintf(stderr,
 		    "usage: pivy-box key relock [-brR] <newtpl> [file]\n"
@@ -2122,8 +2936,10 @@ noop:
 		    "pivy-box key <op>:\n"
 		    "  generate              Generate a random key and ebox it\n"
 		    "  lock                  Ebox a pre-generated key\n"
+		    "  lock-batch            Ebox many pre-generated keys\n"
 		    "  info                  Prints information about a key ebox\n"
 		    "  unlock                Unlock a key ebox\n"
+		    "  unlock-batch          Unlock many key eboxes\n"
 		    "  relock                Unlock + lock to new template\n");
 	}
 }
@@ -2135,13 +2951,22 @@ usage_stream(const char *op)
 		goto noop;
 	} else if (strcmp(op, "encrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream encrypt <tpl>\n"
+		    "usage: pivy-box stream encrypt [-z] [-I file] [-o file] "
+		    "<tpl>\n"
 		    "\n"
 		    "Accepts streaming data on stdin and encrypts it to the\n"
-		    "given template in chunks. Output is binary.\n");
+		    "given template in chunks. Output is binary.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -z         compress each chunk (zlib) before encrypting\n"
+		    "             (not readable by older versions of pivy-box)\n"
+		    "  -I file    read input from file instead of stdin\n"
+		    "  -o file    write output to file instead of stdout\n"
+		    "\n");
 	} else if (strcmp(op, "decrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream decrypt [-b] [file]\n"
+		    "usage: pivy-box stream decrypt [-b] [-o file] "
+		    "[-I file|file]\n"
 		    "\n"
 		    "Accepts output from 'stream encrypt' on stdin, decrypts\n"
 		    "it and outputs the plaintext. Data is only output after\n"
@@ -2149,6 +2974,8 @@ usage_stream(const char *op)
 		    "\n"
 		    "Options:\n"
 		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -I file    read input from file instead of stdin\n"
+		    "  -o file    write output to file instead of stdout\n"
 		    "\n");
 	} else {
 noop:
@@ -2214,7 +3041,7 @@ usage(const char *type, const char *op)
 int
 main(int argc, char *argv[])
 {
-	const char *optstring = "bl:irRP:i:o:f:";
+	const char *optstring = "bl:irRP:i:o:f:j:n:zI:";
 	const char *type = NULL, *op = NULL, *tplname;
 	int c;
 	char tpl[PATH_MAX] = { 0 };
@@ -2258,11 +3085,46 @@ main(int argc, char *argv[])
 		case 'i':
 			ebox_interactive = B_TRUE;
 			break;
+		case 'o':
+			if (strcmp(type, "stream") == 0)
+				ebox_outfile = optarg;
+			else
+				ebox_outdir = optarg;
+			break;
+		case 'I':
+			if (strcmp(type, "stream") != 0) {
+				warnx("option -I only supported with "
+				    "'stream' subcommands");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_infile = optarg;
+			break;
+		case 'j':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed < 1) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -j: '%s'", optarg);
+			}
+			ebox_nthreads = parsed;
+			break;
+		case 'n':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed < 1) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -n: '%s'", optarg);
+			}
+			ebox_bench_n = parsed;
+			break;
 		case 'l':
 			if (strcmp(type, "key") != 0 ||
-			    strcmp(op, "generate") != 0) {
+			    (strcmp(op, "generate") != 0 &&
+			    strcmp(op, "lock-batch") != 0)) {
 				warnx("option -l only supported with "
-				    "'key generate' subcommand");
+				    "'key generate' and 'key lock-batch' "
+				    "subcommands");
 				usage(type, op);
 				return (EXIT_USAGE);
 			}
@@ -2274,6 +3136,16 @@ main(int argc, char *argv[])
 			}
 			ebox_keylen = parsed;
 			break;
+		case 'z':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -z only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_compress = B_TRUE;
+			break;
 		default:
 			usage(type, op);
 			return (EXIT_USAGE);
@@ -2296,6 +3168,9 @@ main(int argc, char *argv[])
 		if (strcmp(op, "unlock") == 0) {
 			error = cmd_key_unlock(argc, argv);
 			goto out;
+		} else if (strcmp(op, "unlock-batch") == 0) {
+			error = cmd_key_unlock_batch(argc, argv);
+			goto out;
 		} else if (strcmp(op, "info") == 0) {
 			error = cmd_key_info(argc, argv);
 			goto out;
@@ -2371,6 +3246,11 @@ main(int argc, char *argv[])
 			error = cmd_key_lock(argc, argv);
 			goto out;
 
+		} else if (strcmp(op, "lock-batch") == 0) {
+			ebox_stpl = read_tpl_file(tpl);
+			error = cmd_key_lock_batch(argc, argv);
+			goto out;
+
 		} else if (strcmp(op, "unlock") == 0) {
 			error = cmd_key_unlock(argc, argv);
 			goto out;
@@ -39,6 +39,14 @@
 #endif
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/un.h>
 
 #include "openssh/config.h"
 #include "openssh/sshkey.h"
@@ -83,6 +91,8 @@ boolean_t debug = B_FALSE;
 static struct cert_var_scope *root_scope = NULL;
 static struct piv_ctx *ctx;
 static boolean_t output_json = B_FALSE;
+static boolean_t ocsp_force = B_FALSE;
+static boolean_t assume_yes = B_FALSE;
 
 #ifndef LINT
 #define	funcerrf(cause, fmt, ...)	\
@@ -138,14 +148,31 @@ usage(void)
 	    "  sign-req [path] [tpl]     Sign a CSR (cert request) from path or stdin\n"
 	    "  revoke-cert [path]        Revoke a certificate\n"
 	    "  revoke-serial [hex]       Revoke using just a serial number\n"
+	    "  revoke-bulk [path]        Revoke a list of serials (one per line)\n"
+	    "                            from path or stdin, then sign a CRL\n"
+	    "  revoke-query <k=glob>...  Revoke all issued certs matching the\n"
+	    "                            filters (on dn, template, serial or\n"
+	    "                            cert vars), then sign a CRL (asks for\n"
+	    "                            confirmation unless -y is given)\n"
 	    "  sign-crl                  Signs a new CRL for the CA\n"
 	    "  rotate-pin                Generates a new PIN for the CA card\n"
+	    "  verify-log [segment]      Verify the full CA log, including sealed\n"
+	    "                            segments (or just one sealed segment)\n"
+	    "  ocsp-refresh              Re-sign cached OCSP responses which are\n"
+	    "                            due (run regularly, e.g. from cron)\n"
+	    "  ocsp-serve [host:]port    Serve cached OCSP responses over HTTP\n"
+	    "  serve <socket>            Run an issuance daemon taking JSON sign\n"
+	    "                            and revoke requests on a unix socket\n"
+	    "  bench-tpl <tpl> [count]   Time populating certs from a template,\n"
+	    "                            with and without compiling it\n"
 	    "\n"
 	    "General options:\n"
 	    "  -p <path>                 Path to dir containing pivy-ca.json\n"
 	    "  -D <key=value>            Defines a certificate variable\n"
 	    "  -J <path>                 Path to a JSON file containing cert vars\n"
 	    "  -j                        Output in JSON format (from e.g. sign-req)\n"
+	    "  -f                        Force re-signing all OCSP responses\n"
+	    "  -y                        Don't ask for confirmation (revoke-query)\n"
 	    "  -d                        Enable debug logging\n"
 	    "\n");
 	exit(EXIT_BAD_ARGS);
@@ -617,7 +644,7 @@ static void
 log_iter(json_object *entry, void *cookie)
 {
 	struct log_iter_state *s = cookie;
-	json_object *obj;
+	json_object *obj, *crls;
 	const char *action;
 
 	obj = json_object_object_get(entry, "action");
@@ -646,6 +673,26 @@ log_iter(json_object *entry, void *cookie)
 		free(s->lis_last_crl);
 		obj = json_object_object_get(entry, "time");
 		s->lis_last_crl = strdup(json_object_get_string(obj));
+
+	} else if (strcmp(action, "segment_head") == 0) {
+		obj = json_object_object_get(entry, "issued");
+		if (obj != NULL)
+			s->lis_issued += json_object_array_length(obj);
+		obj = json_object_object_get(entry, "revoked");
+		if (obj != NULL)
+			s->lis_revoked += json_object_object_length(obj);
+		obj = json_object_object_get(entry, "crls");
+		if (obj == NULL)
+			return;
+		crls = obj;
+		obj = json_object_object_get(crls, "count");
+		if (obj != NULL)
+			s->lis_crls += json_object_get_int64(obj);
+		obj = json_object_object_get(crls, "time");
+		if (obj != NULL) {
+			free(s->lis_last_crl);
+			s->lis_last_crl = strdup(json_object_get_string(obj));
+		}
 	}
 }
 
@@ -735,6 +782,7 @@ cmd_show(const char *ca_path)
 	    s.lis_last_crl == NULL ? "(never)" : s.lis_last_crl);
 	fprintf(stderr, "Last issue:      %s\n",
 	    s.lis_last_issue_json == NULL ? "(none)" : s.lis_last_issue_json);
+	fprintf(stderr, "Sealed segments: %u\n", ca_log_segments(ca));
 	free(s.lis_last_crl);
 	free(s.lis_last_issue_json);
 
@@ -1088,6 +1136,35 @@ cmd_revoke_cert(const char *ca_path, const char *cert_path)
 	return (ERRF_OK);
 }
 
+static errf_t *
+parse_serial(const char *serial, BIGNUM **out)
+{
+	errf_t *err;
+	BIGNUM *serbn = NULL;
+	int rc;
+
+	if (strncmp(serial, "0t", 2) == 0) {
+		rc = BN_dec2bn(&serbn, &serial[2]);
+		if (rc == 0 || (size_t)rc != strlen(&serial[2])) {
+			make_sslerrf(err, "BN_dec2bn", "parsing serial '%s'",
+			    serial);
+			BN_free(serbn);
+			return (err);
+		}
+	} else {
+		rc = BN_hex2bn(&serbn, serial);
+		if (rc == 0 || (size_t)rc != strlen(serial)) {
+			make_sslerrf(err, "BN_hex2bn", "parsing serial '%s'",
+			    serial);
+			BN_free(serbn);
+			return (err);
+		}
+	}
+
+	*out = serbn;
+	return (ERRF_OK);
+}
+
 static errf_t *
 cmd_revoke_serial(const char *ca_path, const char *serial)
 {
@@ -1095,7 +1172,6 @@ cmd_revoke_serial(const char *ca_path, const char *serial)
 	BIGNUM *serbn;
 	struct ca *ca;
 	struct ca_session *sess;
-	int rc;
 
 	err = ca_open(ca_path, &ca);
 	if (err != ERRF_OK)
@@ -1109,21 +1185,9 @@ cmd_revoke_serial(const char *ca_path, const char *serial)
 	if (err != ERRF_OK)
 		return (err);
 
-	if (strncmp(serial, "0t", 2) == 0) {
-		rc = BN_dec2bn(&serbn, &serial[2]);
-		if (rc == 0) {
-			make_sslerrf(err, "BN_dec2bn", "parsing serial '%s'",
-			    serial);
-			return (err);
-		}
-	} else {
-		rc = BN_hex2bn(&serbn, serial);
-		if (rc == 0) {
-			make_sslerrf(err, "BN_hex2bn", "parsing serial '%s'",
-			    serial);
-			return (err);
-		}
-	}
+	err = parse_serial(serial, &serbn);
+	if (err != ERRF_OK)
+		return (err);
 
 	err = ca_revoke_cert_serial(ca, sess, serbn);
 	if (err != ERRF_OK)
@@ -1135,6 +1199,302 @@ cmd_revoke_serial(const char *ca_path, const char *serial)
 	return (ERRF_OK);
 }
 
+struct serial_list {
+	BIGNUM		**sl_serials;
+	uint		  sl_n;
+	uint		  sl_alloc;
+};
+
+static void
+serial_list_add(struct serial_list *sl, BIGNUM *serial)
+{
+	if (sl->sl_n >= sl->sl_alloc) {
+		sl->sl_alloc = (sl->sl_alloc == 0) ? 64 : sl->sl_alloc * 2;
+		sl->sl_serials = recallocarray(sl->sl_serials, sl->sl_n,
+		    sl->sl_alloc, sizeof (BIGNUM *));
+		VERIFY(sl->sl_serials != NULL);
+	}
+	sl->sl_serials[sl->sl_n++] = serial;
+}
+
+static void
+serial_list_free(struct serial_list *sl)
+{
+	uint i;
+
+	for (i = 0; i < sl->sl_n; ++i)
+		BN_free(sl->sl_serials[i]);
+	free(sl->sl_serials);
+	bzero(sl, sizeof (*sl));
+}
+
+/*
+ * Revokes everything in the list in one go, then signs a fresh CRL (once, at
+ * the end) and writes it to stdout.
+ */
+static errf_t *
+revoke_serial_list(struct ca *ca, struct serial_list *sl)
+{
+	errf_t *err;
+	struct ca_session *sess;
+	X509_CRL *crl;
+	uint nrevoked;
+
+	err = ca_open_session(ca, &sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ensure_authed(ca, sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_revoke_cert_serials(ca, sess, sl->sl_serials, sl->sl_n,
+	    &nrevoked);
+	if (err != ERRF_OK)
+		return (err);
+
+	fprintf(stderr, "Revoked %u certificate(s) (%u already revoked or "
+	    "duplicated)\n", nrevoked, sl->sl_n - nrevoked);
+
+	crl = X509_CRL_new();
+	VERIFY(crl != NULL);
+
+	err = ca_generate_crl(ca, sess, crl);
+	if (err != ERRF_OK)
+		return (err);
+
+	PEM_write_X509_CRL(stdout, crl);
+	X509_CRL_free(crl);
+
+	ca_close_session(sess);
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_revoke_bulk(const char *ca_path, const char *list_path)
+{
+	FILE *f = NULL;
+	errf_t *err;
+	struct ca *ca;
+	struct serial_list sl;
+	BIGNUM *serbn;
+	char *line = NULL, *p;
+	size_t linesz = 0;
+	ssize_t llen;
+	uint lineno = 0;
+
+	bzero(&sl, sizeof (sl));
+
+	if (list_path == NULL || strcmp(list_path, "-") == 0) {
+		f = stdin;
+	} else {
+		f = fopen(list_path, "r");
+		if (f == NULL) {
+			err = errfno("fopen", errno, "opening '%s'", list_path);
+			return (err);
+		}
+	}
+
+	/* One serial per line, in hex (or decimal with a "0t" prefix). */
+	while ((llen = getline(&line, &linesz, f)) != -1) {
+		++lineno;
+		while (llen > 0 && isspace(line[llen - 1]))
+			line[--llen] = '\0';
+		p = line;
+		while (isspace(*p))
+			++p;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		err = parse_serial(p, &serbn);
+		if (err != ERRF_OK) {
+			err = errf("SerialListError", err, "Invalid serial "
+			    "on line %u of %s", lineno,
+			    (f == stdin) ? "stdin" : list_path);
+			goto out;
+		}
+		serial_list_add(&sl, serbn);
+	}
+	if (ferror(f)) {
+		err = errfno("getline", errno, "reading serial list");
+		goto out;
+	}
+
+	if (sl.sl_n == 0) {
+		err = errf("SerialListError", NULL, "No serials given to "
+		    "revoke");
+		goto out;
+	}
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		goto out;
+
+	err = revoke_serial_list(ca, &sl);
+	if (err != ERRF_OK)
+		goto out;
+
+	ca_close(ca);
+
+out:
+	free(line);
+	if (f != NULL && f != stdin)
+		fclose(f);
+	serial_list_free(&sl);
+	return (err);
+}
+
+struct revoke_query {
+	char			**rq_keys;
+	char			**rq_pats;
+	uint			  rq_nfilters;
+	struct serial_list	  rq_list;
+	errf_t			 *rq_err;
+};
+
+static void
+revoke_query_iter(json_object *entry, void *cookie)
+{
+	struct revoke_query *rq = cookie;
+	json_object *obj, *vars;
+	const char *v, *serial;
+	BIGNUM *serbn;
+	uint i;
+
+	if (rq->rq_err != ERRF_OK)
+		return;
+
+	obj = json_object_object_get(entry, "action");
+	if (obj == NULL || strcmp(json_object_get_string(obj),
+	    "issue_cert") != 0) {
+		return;
+	}
+
+	obj = json_object_object_get(entry, "serial");
+	if (obj == NULL)
+		return;
+	serial = json_object_get_string(obj);
+
+	vars = json_object_object_get(entry, "variables");
+	for (i = 0; i < rq->rq_nfilters; ++i) {
+		obj = NULL;
+		if (strcmp(rq->rq_keys[i], "dn") == 0 ||
+		    strcmp(rq->rq_keys[i], "template") == 0 ||
+		    strcmp(rq->rq_keys[i], "serial") == 0) {
+			obj = json_object_object_get(entry, rq->rq_keys[i]);
+		} else if (vars != NULL) {
+			obj = json_object_object_get(vars, rq->rq_keys[i]);
+		}
+		if (obj == NULL)
+			return;
+		v = json_object_get_string(obj);
+		if (fnmatch(rq->rq_pats[i], v, 0) != 0)
+			return;
+	}
+
+	rq->rq_err = parse_serial(serial, &serbn);
+	if (rq->rq_err != ERRF_OK)
+		return;
+	serial_list_add(&rq->rq_list, serbn);
+
+	obj = json_object_object_get(entry, "dn");
+	fprintf(stderr, "  %s  %s\n", serial,
+	    (obj == NULL) ? "" : json_object_get_string(obj));
+}
+
+/*
+ * Revokes every cert in the CA log whose issue record matches all of the
+ * given "key=pattern" filters (shell glob patterns, on "dn", "template",
+ * "serial" or any cert variable).
+ */
+static errf_t *
+cmd_revoke_query(const char *ca_path, int nfilters, char *const *filters)
+{
+	errf_t *err;
+	struct ca *ca;
+	struct revoke_query rq;
+	char prompt[64], ans[8];
+	char *p;
+	int i;
+
+	bzero(&rq, sizeof (rq));
+	rq.rq_keys = calloc(nfilters, sizeof (char *));
+	rq.rq_pats = calloc(nfilters, sizeof (char *));
+	VERIFY(rq.rq_keys != NULL);
+	VERIFY(rq.rq_pats != NULL);
+
+	for (i = 0; i < nfilters; ++i) {
+		p = strchr(filters[i], '=');
+		if (p == NULL || p == filters[i]) {
+			err = errf("ArgumentError", NULL, "Invalid filter "
+			    "'%s' (expected key=pattern)", filters[i]);
+			goto out;
+		}
+		rq.rq_keys[i] = strndup(filters[i], p - filters[i]);
+		rq.rq_pats[i] = strdup(p + 1);
+		VERIFY(rq.rq_keys[i] != NULL);
+		VERIFY(rq.rq_pats[i] != NULL);
+		++rq.rq_nfilters;
+	}
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		goto out;
+
+	fprintf(stderr, "Matching certificates:\n");
+	err = ca_log_verify_all(ca, NULL, revoke_query_iter, &rq);
+	if (err == ERRF_OK)
+		err = rq.rq_err;
+	rq.rq_err = ERRF_OK;
+	if (err != ERRF_OK)
+		goto out;
+
+	if (rq.rq_list.sl_n == 0) {
+		err = errf("NoMatchError", NULL, "No issued certificates "
+		    "in the CA log match the given filters");
+		goto out;
+	}
+
+	/*
+	 * A loose pattern can match a lot more than was meant, so without -y
+	 * the list above is a dry run until someone at the terminal says yes.
+	 */
+	if (!assume_yes) {
+		snprintf(prompt, sizeof (prompt), "Revoke these %u "
+		    "certificates? [y/N] ", rq.rq_list.sl_n);
+		if (readpassphrase(prompt, ans, sizeof (ans),
+		    RPP_ECHO_ON | RPP_REQUIRE_TTY) == NULL) {
+			err = errf("ConfirmError", errfno("readpassphrase",
+			    errno, NULL), "Revoking certificates by query "
+			    "needs confirmation on a terminal (or -y)");
+			goto out;
+		}
+		if (ans[0] != 'y' && ans[0] != 'Y') {
+			err = errf("ConfirmError", NULL, "Not revoking "
+			    "anything");
+			goto out;
+		}
+	}
+
+	err = revoke_serial_list(ca, &rq.rq_list);
+	if (err != ERRF_OK)
+		goto out;
+
+	ca_close(ca);
+
+out:
+	for (i = 0; i < (int)rq.rq_nfilters; ++i) {
+		free(rq.rq_keys[i]);
+		free(rq.rq_pats[i]);
+	}
+	free(rq.rq_keys);
+	free(rq.rq_pats);
+	errf_free(rq.rq_err);
+	serial_list_free(&rq.rq_list);
+	return (err);
+}
+
 struct select_tpl_priv {
 	struct ca_cert_tpl	*stp_tpl;
 };
@@ -1289,71 +1649,1641 @@ cmd_sign_req(const char *ca_path, const char *tpl_name, const char *req_path)
 }
 
 static errf_t *
-parse_json_scope(const char *buf, size_t len)
+bench_populate(struct ca_cert_tpl *tpl, struct cert_var_scope *ca_scope,
+    struct cert_tpl_plan *plan, EVP_PKEY *pkey, uint count, double *usper)
 {
-	enum json_tokener_error jerr;
-	struct json_tokener *tok = NULL;
-	json_object *robj = NULL;
-	json_object_iter iter;
-	errf_t *err;
+	struct cert_var_scope *cert_scope;
+	struct timespec start, end;
+	errf_t *err = ERRF_OK;
+	X509 *cert;
+	uint i;
 
-	tok = json_tokener_new();
-	if (tok == NULL) {
-		err = errfno("json_tokener_new", errno, NULL);
-		goto out;
-	}
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &start));
+	for (i = 0; i < count; ++i) {
+		if (plan != NULL) {
+			cert_scope = scope_new_for_tpl(
+			    cert_tpl_plan_scope(plan), ca_cert_tpl_tpl(tpl));
+		} else {
+			cert_scope = ca_cert_tpl_make_scope(tpl, ca_scope);
+		}
+		VERIFY(cert_scope != NULL);
 
-	robj = json_tokener_parse_ex(tok, buf, len + 1);
-	if ((jerr = json_tokener_get_error(tok)) != json_tokener_success) {
-		err = jtokerrf("json_tokener_parse_ex", jerr);
-		goto out;
-	}
-	VERIFY(robj != NULL);
-	if (json_tokener_get_parse_end(tok) < len) {
-		err = errf("LengthError", NULL, "JSON object ended after "
-		    "%zu bytes, expected %zu", json_tokener_get_parse_end(tok),
-		    len);
-		goto out;
-	}
+		cert = X509_new();
+		VERIFY(cert != NULL);
+		VERIFY(X509_set_version(cert, 2) == 1);
+		VERIFY(X509_set_pubkey(cert, pkey) == 1);
 
-	bzero(&iter, sizeof (iter));
-	json_object_object_foreachC(robj, iter) {
-		err = scope_set(root_scope, iter.key,
-		    json_object_get_string(iter.val));
-		if (err != ERRF_OK) {
-			err = errf("JSONError", err, "Input JSON has "
-			    "invalid '%s' property", iter.key);
-			goto out;
+		if (plan != NULL) {
+			err = cert_tpl_plan_populate(plan, cert_scope, cert);
+		} else {
+			err = cert_tpl_populate(ca_cert_tpl_tpl(tpl),
+			    cert_scope, cert);
 		}
+
+		X509_free(cert);
+		scope_free(cert_scope);
+		if (err != ERRF_OK)
+			return (err);
 	}
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &end));
 
-	err = ERRF_OK;
+	*usper = ((end.tv_sec - start.tv_sec) * 1.0e6 +
+	    (end.tv_nsec - start.tv_nsec) / 1.0e3) / count;
 
-out:
-	json_object_put(robj);
-	if (tok != NULL)
-		json_tokener_free(tok);
-	return (err);
+	return (ERRF_OK);
 }
 
-const char *optstring = "p:D:J:jK";
-
-errf_t *read_text_file(const char *path, char **out, size_t *outlen);
-
-int
-main(int argc, char *argv[])
+static errf_t *
+cmd_bench_tpl(const char *ca_path, const char *tpl_name, const char *countstr)
 {
-	errf_t *err = ERRF_OK;
-	extern char *optarg;
-	extern int optind;
-	int c;
-	size_t len;
-	char *ptr;
-	uint d_level = 0;
-	uint K_level = 0;
-	const char *ca_path = ".";
+	errf_t *err;
+	struct ca *ca;
+	struct ca_cert_tpl *tpl;
+	struct cert_var_scope *ca_scope, *tpl_scope = NULL;
+	struct cert_tpl_plan *plan = NULL;
+	struct sshkey *key = NULL;
+	EVP_PKEY *pkey = NULL;
+	unsigned long count = 1000;
+	double plain, compiled;
+	char *p = NULL;
+	int rc;
 
-	bunyan_init();
+	if (countstr != NULL) {
+		errno = 0;
+		count = strtoul(countstr, &p, 10);
+		if (errno != 0 || *p != '\0' || count < 1 ||
+		    count > UINT_MAX) {
+			return (errf("ArgumentError", NULL, "Invalid count: "
+			    "'%s'", countstr));
+		}
+	}
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		return (err);
+
+	tpl = ca_cert_tpl_get(ca, tpl_name);
+	if (tpl == NULL) {
+		return (errf("TemplateNotFound", NULL, "CA does not contain "
+		    "a cert template with name '%s'", tpl_name));
+	}
+
+	ca_scope = ca_make_scope(ca, root_scope);
+	VERIFY(ca_scope != NULL);
+
+	rc = sshkey_generate(KEY_ECDSA, 256, &key);
+	if (rc != 0) {
+		err = ssherrf("sshkey_generate", rc);
+		goto out;
+	}
+	err = sshkey_to_evp_pkey(key, &pkey);
+	if (err != ERRF_OK)
+		goto out;
+
+	err = bench_populate(tpl, ca_scope, NULL, pkey, count, &plain);
+	if (err != ERRF_OK)
+		goto out;
+
+	tpl_scope = ca_cert_tpl_make_scope(tpl, ca_scope);
+	if (tpl_scope == NULL) {
+		err = errf("TemplateError", NULL, "Failed to set up "
+		    "variables for template '%s'", tpl_name);
+		goto out;
+	}
+	err = cert_tpl_compile(ca_cert_tpl_tpl(tpl), tpl_scope, &plan);
+	if (err != ERRF_OK)
+		goto out;
+
+	err = bench_populate(tpl, ca_scope, plan, pkey, count, &compiled);
+	if (err != ERRF_OK)
+		goto out;
+
+	printf("template '%s' (%s), %lu certs\n", ca_cert_tpl_name(tpl),
+	    cert_tpl_name(ca_cert_tpl_tpl(tpl)), count);
+	printf("  populate:          %10.1f us/cert\n", plain);
+	printf("  compiled populate: %10.1f us/cert\n", compiled);
+
+out:
+	cert_tpl_plan_free(plan);
+	scope_free(tpl_scope);
+	EVP_PKEY_free(pkey);
+	sshkey_free(key);
+	ca_close(ca);
+	return (err);
+}
+
+static errf_t *
+cmd_verify_log(const char *ca_path, const char *segstr)
+{
+	errf_t *err;
+	struct ca *ca;
+	unsigned long seg;
+	char *p = NULL;
+	uint n = 0;
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		return (err);
+
+	if (segstr != NULL) {
+		errno = 0;
+		seg = strtoul(segstr, &p, 10);
+		if (errno != 0 || *p != '\0' || seg > UINT_MAX) {
+			return (errf("ArgumentError", NULL, "Invalid log "
+			    "segment number: '%s'", segstr));
+		}
+		err = ca_log_verify_segment(ca, seg, NULL, NULL);
+		if (err != ERRF_OK)
+			return (err);
+		fprintf(stderr, "Log segment %lu verified OK\n", seg);
+	} else {
+		err = ca_log_verify_all(ca, &n, NULL, NULL);
+		if (err != ERRF_OK)
+			return (err);
+		fprintf(stderr, "Verified %u of %u log segments OK\n", n,
+		    ca_log_segments(ca) + 1);
+	}
+
+	ca_close(ca);
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_ocsp_refresh(const char *ca_path)
+{
+	errf_t *err;
+	struct ca *ca;
+	struct ca_session *sess;
+	uint nsigned = 0, ntotal = 0;
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_open_session(ca, &sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ensure_authed(ca, sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_ocsp_refresh(ca, sess, ocsp_force, &nsigned, &ntotal);
+	if (err != ERRF_OK)
+		return (err);
+
+	fprintf(stderr, "Signed %u new OCSP responses (%u serials in log)\n",
+	    nsigned, ntotal);
+
+	ca_close_session(sess);
+	ca_close(ca);
+
+	return (ERRF_OK);
+}
+
+#define	OCSP_MAX_CONNS		64
+#define	OCSP_MAX_REQ		8192
+#define	OCSP_IO_TIMEOUT		10	/* seconds */
+
+struct ocsp_conn {
+	int		 oc_fd;
+	int		 oc_pfd;
+	time_t		 oc_start;
+	size_t		 oc_len;
+	char		 oc_buf[OCSP_MAX_REQ + 1];
+	struct sshbuf	*oc_out;
+};
+
+static volatile sig_atomic_t ocsp_reload = 0;
+
+static void
+ocsp_sighup(int sig)
+{
+	ocsp_reload = 1;
+}
+
+static int
+ocsp_listen(const char *spec)
+{
+	struct addrinfo hints, *res = NULL, *ai;
+	char *buf, *host, *port, *p;
+	int fd = -1, rc, one = 1;
+
+	host = buf = strdup(spec);
+	VERIFY(buf != NULL);
+	if (host[0] == '[' && (p = strchr(host, ']')) != NULL) {
+		*p++ = '\0';
+		port = (*p == ':') ? p + 1 : NULL;
+		++host;
+	} else if ((p = strrchr(host, ':')) != NULL) {
+		*p = '\0';
+		port = p + 1;
+	} else {
+		port = host;
+		host = NULL;
+	}
+	if (port == NULL || *port == '\0')
+		errx(EXIT_BAD_ARGS, "invalid listen address: '%s'", spec);
+	if (host == NULL || *host == '\0')
+		host = "127.0.0.1";
+
+	bzero(&hints, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	rc = getaddrinfo(host, port, &hints, &res);
+	if (rc != 0) {
+		errx(EXIT_BAD_ARGS, "failed to resolve '%s': %s", spec,
+		    gai_strerror(rc));
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+		    sizeof (one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, 128) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	free(buf);
+	if (fd < 0)
+		err(EXIT_ERROR, "failed to listen on '%s'", spec);
+
+	VERIFY0(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+	return (fd);
+}
+
+static void
+ocsp_conn_close(struct ocsp_conn *oc)
+{
+	close(oc->oc_fd);
+	oc->oc_fd = -1;
+	oc->oc_len = 0;
+	sshbuf_free(oc->oc_out);
+	oc->oc_out = NULL;
+}
+
+static void
+ocsp_http_reply(struct ocsp_conn *oc, const char *status, const uint8_t *body,
+    size_t len)
+{
+	oc->oc_out = sshbuf_new();
+	VERIFY(oc->oc_out != NULL);
+	VERIFY0(sshbuf_putf(oc->oc_out, "HTTP/1.0 %s\r\n"
+	    "Connection: close\r\n", status));
+	if (body != NULL) {
+		VERIFY0(sshbuf_putf(oc->oc_out,
+		    "Content-Type: application/ocsp-response\r\n"));
+	}
+	VERIFY0(sshbuf_putf(oc->oc_out, "Content-Length: %zu\r\n\r\n", len));
+	if (body != NULL)
+		VERIFY0(sshbuf_put(oc->oc_out, body, len));
+}
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
+}
+
+/*
+ * Tries to process the request buffered on a connection. Returns 0 if we
+ * need to read more data first, otherwise sets up oc_out with the reply.
+ */
+static int
+ocsp_http_process(struct ocsp_conn *oc, struct ca_ocsp_cache *cache)
+{
+	char *hdr = NULL, *hdrend, *line, *method, *path, *p, *q;
+	char *saveptr = NULL;
+	size_t hdrlen, clen = 0;
+	const uint8_t *req, *resp;
+	size_t reqlen, resplen;
+	struct sshbuf *der = NULL;
+	errf_t *err;
+	int hi, lo, rv = 1;
+
+	oc->oc_buf[oc->oc_len] = '\0';
+	hdrend = strstr(oc->oc_buf, "\r\n\r\n");
+	if (hdrend == NULL) {
+		if (oc->oc_len >= OCSP_MAX_REQ) {
+			ocsp_http_reply(oc, "413 Request Entity Too Large",
+			    NULL, 0);
+			return (1);
+		}
+		return (0);
+	}
+	hdrlen = (hdrend - oc->oc_buf) + 4;
+	hdr = strndup(oc->oc_buf, hdrlen - 4);
+	VERIFY(hdr != NULL);
+
+	line = strtok_r(hdr, "\r\n", &saveptr);
+	if (line == NULL) {
+		ocsp_http_reply(oc, "400 Bad Request", NULL, 0);
+		goto out;
+	}
+	method = strtok_r(line, " ", &p);
+	path = strtok_r(NULL, " ", &p);
+	if (method == NULL || path == NULL || path[0] != '/') {
+		ocsp_http_reply(oc, "400 Bad Request", NULL, 0);
+		goto out;
+	}
+
+	if (strcmp(method, "POST") == 0) {
+		while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
+			if (strncasecmp(line, "Content-Length:", 15) == 0)
+				clen = strtoul(line + 15, NULL, 10);
+		}
+		if (clen == 0 || hdrlen > OCSP_MAX_REQ ||
+		    clen > OCSP_MAX_REQ - hdrlen) {
+			ocsp_http_reply(oc, "400 Bad Request", NULL, 0);
+			goto out;
+		}
+		if (oc->oc_len < hdrlen + clen) {
+			rv = 0;
+			goto out;
+		}
+		req = (const uint8_t *)&oc->oc_buf[hdrlen];
+		reqlen = clen;
+
+	} else if (strcmp(method, "GET") == 0) {
+		/* GET {url}/{url-encoding of base-64 encoding of DER} */
+		for (p = q = path + 1; *p != '\0'; ++p, ++q) {
+			if (*p == '%' && (hi = hexval(p[1])) >= 0 &&
+			    (lo = hexval(p[2])) >= 0) {
+				*q = (hi << 4) | lo;
+				p += 2;
+			} else {
+				*q = *p;
+			}
+		}
+		*q = '\0';
+		der = sshbuf_new();
+		VERIFY(der != NULL);
+		if (sshbuf_b64tod(der, path + 1) != 0) {
+			ocsp_http_reply(oc, "400 Bad Request", NULL, 0);
+			goto out;
+		}
+		req = sshbuf_ptr(der);
+		reqlen = sshbuf_len(der);
+
+	} else {
+		ocsp_http_reply(oc, "405 Method Not Allowed", NULL, 0);
+		goto out;
+	}
+
+	err = ca_ocsp_respond(cache, req, reqlen, &resp, &resplen);
+	if (err != ERRF_OK) {
+		bunyan_log(BNY_DEBUG, "failed to answer OCSP request",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+	ocsp_http_reply(oc, "200 OK", resp, resplen);
+
+out:
+	sshbuf_free(der);
+	free(hdr);
+	return (rv);
+}
+
+static errf_t *
+cmd_ocsp_serve(const char *ca_path, const char *listen_spec)
+{
+	errf_t *err;
+	struct ca *ca;
+	struct ca_ocsp_cache *cache = NULL, *ncache;
+	struct ocsp_conn *conns;
+	struct pollfd pfds[OCSP_MAX_CONNS + 1];
+	struct sigaction sa;
+	int lfd, fd, rc;
+	uint i, nfds;
+	ssize_t done;
+	time_t now;
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_ocsp_cache_load(ca, &cache);
+	if (err != ERRF_OK)
+		return (err);
+
+	conns = calloc(OCSP_MAX_CONNS, sizeof (struct ocsp_conn));
+	VERIFY(conns != NULL);
+	for (i = 0; i < OCSP_MAX_CONNS; ++i) {
+		conns[i].oc_fd = -1;
+		conns[i].oc_pfd = -1;
+	}
+
+	bzero(&sa, sizeof (sa));
+	sa.sa_handler = ocsp_sighup;
+	VERIFY0(sigaction(SIGHUP, &sa, NULL));
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = ocsp_listen(listen_spec);
+
+	fprintf(stderr, "Serving %u cached OCSP responses for CA '%s' on %s\n",
+	    ca_ocsp_cache_count(cache), ca_slug(ca), listen_spec);
+
+	while (1) {
+		if (ocsp_reload || ca_ocsp_cache_stale(cache)) {
+			ocsp_reload = 0;
+			err = ca_ocsp_cache_load(ca, &ncache);
+			if (err != ERRF_OK) {
+				bunyan_log(BNY_WARN, "failed to reload OCSP "
+				    "response cache", "error", BNY_ERF, err,
+				    NULL);
+				errf_free(err);
+			} else {
+				ca_ocsp_cache_free(cache);
+				cache = ncache;
+				bunyan_log(BNY_INFO, "reloaded OCSP cache",
+				    "count", BNY_UINT,
+				    ca_ocsp_cache_count(cache), NULL);
+			}
+		}
+
+		now = time(NULL);
+		nfds = 0;
+		pfds[nfds].fd = lfd;
+		pfds[nfds++].events = POLLIN;
+		for (i = 0; i < OCSP_MAX_CONNS; ++i) {
+			struct ocsp_conn *oc = &conns[i];
+			oc->oc_pfd = -1;
+			if (oc->oc_fd == -1)
+				continue;
+			if (now - oc->oc_start > OCSP_IO_TIMEOUT) {
+				ocsp_conn_close(oc);
+				continue;
+			}
+			oc->oc_pfd = nfds;
+			pfds[nfds].fd = oc->oc_fd;
+			pfds[nfds++].events =
+			    (oc->oc_out != NULL) ? POLLOUT : POLLIN;
+		}
+
+		rc = poll(pfds, nfds, 1000);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return (errfno("poll", errno, NULL));
+
+		for (i = 0; i < OCSP_MAX_CONNS; ++i) {
+			struct ocsp_conn *oc = &conns[i];
+			short revents;
+
+			if (oc->oc_fd == -1 || oc->oc_pfd == -1)
+				continue;
+			revents = pfds[oc->oc_pfd].revents;
+			if (revents == 0)
+				continue;
+			if (revents & (POLLERR | POLLNVAL)) {
+				ocsp_conn_close(oc);
+				continue;
+			}
+
+			if (oc->oc_out != NULL) {
+				done = write(oc->oc_fd,
+				    sshbuf_ptr(oc->oc_out),
+				    sshbuf_len(oc->oc_out));
+				if (done < 0 && (errno == EAGAIN ||
+				    errno == EINTR)) {
+					continue;
+				}
+				if (done <= 0) {
+					ocsp_conn_close(oc);
+					continue;
+				}
+				VERIFY0(sshbuf_consume(oc->oc_out, done));
+				if (sshbuf_len(oc->oc_out) == 0)
+					ocsp_conn_close(oc);
+				continue;
+			}
+
+			done = read(oc->oc_fd, &oc->oc_buf[oc->oc_len],
+			    OCSP_MAX_REQ - oc->oc_len);
+			if (done < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (done <= 0) {
+				ocsp_conn_close(oc);
+				continue;
+			}
+			oc->oc_len += done;
+			(void) ocsp_http_process(oc, cache);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			fd = accept(lfd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			for (i = 0; i < OCSP_MAX_CONNS; ++i) {
+				if (conns[i].oc_fd == -1)
+					break;
+			}
+			if (i == OCSP_MAX_CONNS) {
+				/* Too busy, just drop it. */
+				close(fd);
+				continue;
+			}
+			VERIFY0(fcntl(fd, F_SETFL,
+			    fcntl(fd, F_GETFL) | O_NONBLOCK));
+			conns[i].oc_fd = fd;
+			conns[i].oc_pfd = -1;
+			conns[i].oc_start = now;
+			conns[i].oc_len = 0;
+		}
+	}
+
+	/* NOTREACHED */
+	return (ERRF_OK);
+}
+
+/*
+ * "pivy-ca serve": a long-running issuance daemon for local automation.
+ *
+ * Clients connect to a Unix socket and send requests as single-line JSON
+ * objects, getting back one line of JSON per request (echoing any "id" the
+ * request carried, since responses can come back out of order):
+ *
+ *   {"op": "sign", "template": "name", "csr": "<PEM>", "vars": {...}}
+ *   {"op": "revoke", "serials": ["hex", ...], "crl": true}
+ *   {"op": "stats"}
+ *
+ * "vars" may only set the template's own parameters which the CA and its
+ * cert template leave unset; anything else fails the request.
+ *
+ * The CA, its ebox templates and an authenticated session stay resident. The
+ * main thread does all socket I/O and the host-side work for sign requests
+ * (parsing the CSR, populating the cert from a compiled template plan), then
+ * queues them for a single signer thread which owns the card. The signer
+ * does the card signature, then records the cert in the CA log, so template
+ * population for the next request overlaps with signing of the last one.
+ *
+ * serve_mtx protects the queues and stats. The CA's variable scopes are only
+ * touched by the main thread: the variables which go in the log entry are
+ * snapshotted at prepare time, so the signer never holds serve_mtx while it
+ * is talking to the card or writing the log.
+ *
+ * A client may send a batch of requests and then shut down its write side;
+ * we keep the connection until every reply for it has been written. Replies
+ * are buffered up to SERVE_MAX_OUT, after which we stop reading requests from
+ * that client until it catches up.
+ */
+#define	SERVE_MAX_CONNS		64
+#define	SERVE_MAX_LINE		(256 * 1024)
+#define	SERVE_MAX_OUT		(4 * 1024 * 1024)
+#define	SERVE_MAX_QUEUE		256
+#define	SERVE_LAT_SAMPLES	1024
+
+enum serve_op {
+	SERVE_OP_SIGN,
+	SERVE_OP_REVOKE
+};
+
+struct serve_job {
+	struct serve_job	*sj_next;
+	enum serve_op		 sj_op;
+	uint			 sj_conn;
+	uint64_t		 sj_conn_gen;
+	json_object		*sj_id;
+	uint64_t		 sj_start;
+	uint64_t		 sj_queued;
+	uint64_t		 sj_signed;
+
+	struct serve_tpl	*sj_tpl;
+	json_object		*sj_vars;
+	X509_REQ		*sj_req;
+	X509			*sj_cert;
+
+	struct serial_list	 sj_serials;
+	boolean_t		 sj_want_crl;
+	uint			 sj_nrevoked;
+	X509_CRL		*sj_crl;
+
+	errf_t			*sj_err;
+};
+
+struct serve_tpl {
+	struct serve_tpl	*st_next;
+	struct ca_cert_tpl	*st_tpl;
+	struct cert_var_scope	*st_scope;	/* template's vars */
+	struct cert_tpl_plan	*st_plan;	/* compiled under st_scope */
+	struct cert_var		*st_params;	/* settable by clients */
+};
+
+struct serve_conn {
+	int			 sc_fd;
+	int			 sc_pfd;
+	uint64_t		 sc_gen;
+	uint			 sc_jobs;
+	boolean_t		 sc_eof;
+	struct sshbuf		*sc_in;
+	struct sshbuf		*sc_out;
+};
+
+struct serve_stats {
+	uint64_t		 sst_requests;
+	uint64_t		 sst_errors;
+	uint64_t		 sst_certs;
+	uint64_t		 sst_revoked;
+	uint64_t		 sst_total_us;
+	uint64_t		 sst_prepare_us;
+	uint64_t		 sst_wait_us;
+	uint64_t		 sst_sign_us;
+	uint64_t		 sst_max_us;
+	uint64_t		 sst_lat[SERVE_LAT_SAMPLES];
+	uint			 sst_nlat;
+};
+
+static pthread_mutex_t serve_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serve_cv = PTHREAD_COND_INITIALIZER;
+static struct serve_job *serve_pending = NULL, *serve_pending_tail = NULL;
+static struct serve_job *serve_done = NULL, *serve_done_tail = NULL;
+static uint serve_depth = 0;
+static boolean_t serve_stopping = B_FALSE;
+static int serve_wakefd[2] = { -1, -1 };
+static struct serve_stats serve_stats;
+static volatile sig_atomic_t serve_exit = 0;
+
+static uint64_t
+serve_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static void
+serve_sigterm(int sig)
+{
+	serve_exit = 1;
+}
+
+static void
+serve_job_free(struct serve_job *sj)
+{
+	if (sj == NULL)
+		return;
+	json_object_put(sj->sj_id);
+	json_object_put(sj->sj_vars);
+	X509_REQ_free(sj->sj_req);
+	X509_free(sj->sj_cert);
+	X509_CRL_free(sj->sj_crl);
+	serial_list_free(&sj->sj_serials);
+	errf_free(sj->sj_err);
+	free(sj);
+}
+
+static void
+serve_job_append(struct serve_job **head, struct serve_job **tail,
+    struct serve_job *sj)
+{
+	sj->sj_next = NULL;
+	if (*tail != NULL)
+		(*tail)->sj_next = sj;
+	else
+		*head = sj;
+	*tail = sj;
+}
+
+static struct serve_job *
+serve_job_pop(struct serve_job **head, struct serve_job **tail)
+{
+	struct serve_job *sj = *head;
+
+	if (sj != NULL) {
+		*head = sj->sj_next;
+		if (*head == NULL)
+			*tail = NULL;
+		sj->sj_next = NULL;
+	}
+	return (sj);
+}
+
+struct serve_signer_args {
+	struct ca		*ssa_ca;
+	struct ca_session	*ssa_sess;
+};
+
+static void *
+serve_signer(void *arg)
+{
+	struct serve_signer_args *ssa = arg;
+	struct ca *ca = ssa->ssa_ca;
+	struct ca_session *sess = ssa->ssa_sess;
+	struct serve_job *sj;
+	errf_t *err;
+	ssize_t done;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&serve_mtx));
+		while (serve_pending == NULL && !serve_stopping)
+			VERIFY0(pthread_cond_wait(&serve_cv, &serve_mtx));
+		sj = serve_job_pop(&serve_pending, &serve_pending_tail);
+		VERIFY0(pthread_mutex_unlock(&serve_mtx));
+		if (sj == NULL)
+			break;
+
+		switch (sj->sj_op) {
+		case SERVE_OP_SIGN:
+			err = ca_cert_sign_prepared(sess, sj->sj_cert);
+			sj->sj_signed = serve_now_us();
+			if (err != ERRF_OK)
+				break;
+			err = ca_cert_record_req(sess, sj->sj_tpl->st_tpl,
+			    sj->sj_vars, sj->sj_req, sj->sj_cert);
+			break;
+		case SERVE_OP_REVOKE:
+			err = ca_revoke_cert_serials(ca, sess,
+			    sj->sj_serials.sl_serials, sj->sj_serials.sl_n,
+			    &sj->sj_nrevoked);
+			if (err != ERRF_OK || !sj->sj_want_crl)
+				break;
+			sj->sj_crl = X509_CRL_new();
+			VERIFY(sj->sj_crl != NULL);
+			err = ca_generate_crl(ca, sess, sj->sj_crl);
+			sj->sj_signed = serve_now_us();
+			break;
+		default:
+			VERIFY(0);
+		}
+		sj->sj_err = err;
+
+		VERIFY0(pthread_mutex_lock(&serve_mtx));
+		serve_job_append(&serve_done, &serve_done_tail, sj);
+		VERIFY0(pthread_mutex_unlock(&serve_mtx));
+
+		do {
+			done = write(serve_wakefd[1], "", 1);
+		} while (done < 0 && errno == EINTR);
+	}
+
+	return (NULL);
+}
+
+static void
+serve_reply(struct serve_conn *sc, json_object *resp)
+{
+	const char *line;
+
+	line = json_object_to_json_string_ext(resp, JSON_C_TO_STRING_PLAIN);
+	VERIFY0(sshbuf_put(sc->sc_out, line, strlen(line)));
+	VERIFY0(sshbuf_put_u8(sc->sc_out, '\n'));
+}
+
+static json_object *
+serve_resp_new(json_object *id)
+{
+	json_object *resp;
+
+	resp = json_object_new_object();
+	VERIFY(resp != NULL);
+	if (id != NULL)
+		json_object_object_add(resp, "id", json_object_get(id));
+	return (resp);
+}
+
+static void
+serve_reply_err(struct serve_conn *sc, json_object *id, const errf_t *err)
+{
+	json_object *resp, *eobj;
+
+	resp = serve_resp_new(id);
+	json_object_object_add(resp, "ok", json_object_new_boolean(0));
+
+	eobj = json_object_new_object();
+	VERIFY(eobj != NULL);
+	json_object_object_add(eobj, "name",
+	    json_object_new_string(errf_name(err)));
+	json_object_object_add(eobj, "message",
+	    json_object_new_string(errf_message(err)));
+	if (errf_cause(err) != NULL) {
+		json_object_object_add(eobj, "cause", json_object_new_string(
+		    errf_message(errf_cause(err))));
+	}
+	json_object_object_add(resp, "error", eobj);
+
+	serve_reply(sc, resp);
+	json_object_put(resp);
+}
+
+static int
+serve_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return ((x < y) ? -1 : (x > y) ? 1 : 0);
+}
+
+static void
+serve_record_stats(struct serve_job *sj, uint64_t now)
+{
+	struct serve_stats *st = &serve_stats;
+	uint64_t lat = now - sj->sj_start;
+
+	++st->sst_requests;
+	if (sj->sj_err != ERRF_OK)
+		++st->sst_errors;
+	else if (sj->sj_op == SERVE_OP_SIGN)
+		++st->sst_certs;
+	else
+		st->sst_revoked += sj->sj_nrevoked;
+
+	st->sst_total_us += lat;
+	if (lat > st->sst_max_us)
+		st->sst_max_us = lat;
+	st->sst_lat[st->sst_nlat++ % SERVE_LAT_SAMPLES] = lat;
+
+	if (sj->sj_op == SERVE_OP_SIGN && sj->sj_signed != 0) {
+		st->sst_prepare_us += sj->sj_queued - sj->sj_start;
+		st->sst_sign_us += sj->sj_signed - sj->sj_queued;
+	}
+}
+
+static json_object *
+serve_stats_json(void)
+{
+	struct serve_stats *st = &serve_stats;
+	json_object *robj, *lobj;
+	uint64_t sorted[SERVE_LAT_SAMPLES];
+	uint n;
+
+	robj = json_object_new_object();
+	lobj = json_object_new_object();
+	VERIFY(robj != NULL);
+	VERIFY(lobj != NULL);
+
+	json_object_object_add(robj, "queue_depth",
+	    json_object_new_int64(serve_depth));
+	json_object_object_add(robj, "requests",
+	    json_object_new_int64(st->sst_requests));
+	json_object_object_add(robj, "errors",
+	    json_object_new_int64(st->sst_errors));
+	json_object_object_add(robj, "certs_issued",
+	    json_object_new_int64(st->sst_certs));
+	json_object_object_add(robj, "certs_revoked",
+	    json_object_new_int64(st->sst_revoked));
+
+	n = st->sst_nlat;
+	if (n > SERVE_LAT_SAMPLES)
+		n = SERVE_LAT_SAMPLES;
+	if (n > 0) {
+		bcopy(st->sst_lat, sorted, n * sizeof (uint64_t));
+		qsort(sorted, n, sizeof (uint64_t), serve_cmp_u64);
+		json_object_object_add(lobj, "mean", json_object_new_int64(
+		    st->sst_total_us / st->sst_requests));
+		json_object_object_add(lobj, "p50",
+		    json_object_new_int64(sorted[n / 2]));
+		json_object_object_add(lobj, "p99",
+		    json_object_new_int64(sorted[(n * 99) / 100]));
+		json_object_object_add(lobj, "max",
+		    json_object_new_int64(st->sst_max_us));
+	}
+	if (st->sst_certs > 0) {
+		json_object_object_add(lobj, "prepare_mean",
+		    json_object_new_int64(st->sst_prepare_us / st->sst_certs));
+		json_object_object_add(lobj, "sign_mean",
+		    json_object_new_int64(st->sst_sign_us / st->sst_certs));
+	}
+	json_object_object_add(robj, "latency_us", lobj);
+
+	return (robj);
+}
+
+static void
+serve_finish_job(struct serve_conn *conns, struct serve_job *sj)
+{
+	struct serve_conn *sc = &conns[sj->sj_conn];
+	json_object *resp;
+	uint64_t now;
+	BIO *bio;
+	BUF_MEM *bm;
+	BIGNUM *serbn;
+	char *serial;
+
+	now = serve_now_us();
+	serve_record_stats(sj, now);
+
+	/* The client went away while we were working on it. */
+	if (sc->sc_fd == -1 || sc->sc_gen != sj->sj_conn_gen)
+		return;
+	--sc->sc_jobs;
+
+	if (sj->sj_err != ERRF_OK) {
+		serve_reply_err(sc, sj->sj_id, sj->sj_err);
+		return;
+	}
+
+	resp = serve_resp_new(sj->sj_id);
+	json_object_object_add(resp, "ok", json_object_new_boolean(1));
+	json_object_object_add(resp, "latency_us",
+	    json_object_new_int64(now - sj->sj_start));
+
+	bio = BIO_new(BIO_s_mem());
+	VERIFY(bio != NULL);
+
+	if (sj->sj_op == SERVE_OP_SIGN) {
+		serbn = ASN1_INTEGER_to_BN(X509_get_serialNumber(sj->sj_cert),
+		    NULL);
+		VERIFY(serbn != NULL);
+		serial = BN_bn2hex(serbn);
+		VERIFY(serial != NULL);
+		json_object_object_add(resp, "serial",
+		    json_object_new_string(serial));
+		OPENSSL_free(serial);
+		BN_free(serbn);
+
+		VERIFY(PEM_write_bio_X509(bio, sj->sj_cert) == 1);
+		BIO_get_mem_ptr(bio, &bm);
+		json_object_object_add(resp, "cert",
+		    json_object_new_string_len(bm->data, bm->length));
+	} else {
+		json_object_object_add(resp, "revoked",
+		    json_object_new_int64(sj->sj_nrevoked));
+		if (sj->sj_crl != NULL) {
+			VERIFY(PEM_write_bio_X509_CRL(bio, sj->sj_crl) == 1);
+			BIO_get_mem_ptr(bio, &bm);
+			json_object_object_add(resp, "crl",
+			    json_object_new_string_len(bm->data, bm->length));
+		}
+	}
+	BIO_free(bio);
+
+	serve_reply(sc, resp);
+	json_object_put(resp);
+}
+
+static struct serve_tpl *
+serve_get_tpl(struct ca *ca, struct cert_var_scope *ca_scope,
+    struct serve_tpl **tpls, const char *name, errf_t **errp)
+{
+	struct serve_tpl *st;
+	struct ca_cert_tpl *tpl;
+	errf_t *err;
+
+	for (st = *tpls; st != NULL; st = st->st_next) {
+		if (strcmp(ca_cert_tpl_name(st->st_tpl), name) == 0)
+			return (st);
+	}
+
+	tpl = ca_cert_tpl_get(ca, name);
+	if (tpl == NULL) {
+		*errp = errf("TemplateNotFound", NULL, "CA does not contain "
+		    "a cert template with name '%s'", name);
+		return (NULL);
+	}
+
+	st = calloc(1, sizeof (struct serve_tpl));
+	VERIFY(st != NULL);
+	st->st_tpl = tpl;
+	st->st_params = cert_tpl_vars(ca_cert_tpl_tpl(tpl));
+
+	st->st_scope = ca_cert_tpl_make_scope(tpl, ca_scope);
+	if (st->st_scope == NULL) {
+		cert_var_free_all(st->st_params);
+		free(st);
+		*errp = errf("TemplateError", NULL, "Failed to set up "
+		    "variables for template '%s'", name);
+		return (NULL);
+	}
+
+	err = cert_tpl_compile(ca_cert_tpl_tpl(tpl), st->st_scope,
+	    &st->st_plan);
+	if (err != ERRF_OK) {
+		scope_free(st->st_scope);
+		cert_var_free_all(st->st_params);
+		free(st);
+		*errp = err;
+		return (NULL);
+	}
+
+	st->st_next = *tpls;
+	*tpls = st;
+	return (st);
+}
+
+/*
+ * Sets a variable from a client's request. Clients may only fill in the
+ * template's own parameters, and only those which the CA and the CA's cert
+ * template haven't already fixed: they can't override policy (lifetime,
+ * openssl_config_file etc) that a local user of "pivy-ca sign" couldn't.
+ */
+static errf_t *
+serve_set_var(struct serve_tpl *st, struct cert_var_scope *scope,
+    const char *name, const char *value)
+{
+	struct cert_var *cv;
+
+	for (cv = st->st_params; cv != NULL; cv = cert_var_next(cv)) {
+		if (strcmp(cert_var_name(cv), name) == 0)
+			break;
+	}
+	if (cv == NULL) {
+		return (errf("RequestError", NULL, "Template '%s' has no "
+		    "variable '%s'", ca_cert_tpl_name(st->st_tpl), name));
+	}
+	cv = scope_lookup(scope, name, 1);
+	if (cert_var_defined(cv)) {
+		return (errf("RequestError", NULL, "Variable '%s' is fixed "
+		    "by the CA or template '%s'", name,
+		    ca_cert_tpl_name(st->st_tpl)));
+	}
+	return (scope_set(scope, name, value));
+}
+
+static errf_t *
+serve_prepare_sign(struct ca *ca, struct cert_var_scope *ca_scope,
+    struct serve_tpl **tpls, json_object *robj, struct serve_job *sj)
+{
+	struct cert_var_scope *scope = NULL;
+	json_object *obj, *vars;
+	json_object_iter iter;
+	const char *tplname, *csr;
+	BIO *bio;
+	errf_t *err;
+
+	obj = json_object_object_get(robj, "template");
+	if (obj == NULL || !json_object_is_type(obj, json_type_string)) {
+		return (errf("RequestError", NULL, "Sign request has no "
+		    "'template' property"));
+	}
+	tplname = json_object_get_string(obj);
+
+	obj = json_object_object_get(robj, "csr");
+	if (obj == NULL || !json_object_is_type(obj, json_type_string)) {
+		return (errf("RequestError", NULL, "Sign request has no "
+		    "'csr' property"));
+	}
+	csr = json_object_get_string(obj);
+
+	bio = BIO_new_mem_buf(csr, json_object_get_string_len(obj));
+	VERIFY(bio != NULL);
+	sj->sj_req = PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (sj->sj_req == NULL) {
+		make_sslerrf(err, "PEM_read_bio_X509_REQ", "parsing CSR");
+		return (err);
+	}
+
+	VERIFY0(pthread_mutex_lock(&serve_mtx));
+
+	sj->sj_tpl = serve_get_tpl(ca, ca_scope, tpls, tplname, &err);
+	if (sj->sj_tpl == NULL)
+		goto out;
+
+	scope = scope_new_for_tpl(cert_tpl_plan_scope(sj->sj_tpl->st_plan),
+	    ca_cert_tpl_tpl(sj->sj_tpl->st_tpl));
+	if (scope == NULL) {
+		err = errf("TemplateError", NULL, "Failed to set up "
+		    "variables for template '%s'", tplname);
+		goto out;
+	}
+
+	vars = json_object_object_get(robj, "vars");
+	if (vars != NULL && json_object_is_type(vars, json_type_object)) {
+		bzero(&iter, sizeof (iter));
+		json_object_object_foreachC(vars, iter) {
+			err = serve_set_var(sj->sj_tpl, scope, iter.key,
+			    json_object_get_string(iter.val));
+			if (err != ERRF_OK)
+				goto out;
+		}
+	}
+
+	sj->sj_cert = X509_new();
+	VERIFY(sj->sj_cert != NULL);
+
+	err = ca_cert_prepare_req(ca, sj->sj_tpl->st_tpl, scope,
+	    sj->sj_req, sj->sj_cert);
+	if (err != ERRF_OK)
+		goto out;
+
+	err = ca_cert_log_vars(scope, &sj->sj_vars);
+
+out:
+	scope_free(scope);
+	VERIFY0(pthread_mutex_unlock(&serve_mtx));
+	return (err);
+}
+
+static errf_t *
+serve_prepare_revoke(json_object *robj, struct serve_job *sj)
+{
+	json_object *arr, *obj;
+	BIGNUM *serbn;
+	errf_t *err;
+	size_t i;
+
+	arr = json_object_object_get(robj, "serials");
+	if (arr == NULL || !json_object_is_type(arr, json_type_array) ||
+	    json_object_array_length(arr) < 1) {
+		return (errf("RequestError", NULL, "Revoke request needs a "
+		    "non-empty 'serials' array"));
+	}
+	for (i = 0; i < json_object_array_length(arr); ++i) {
+		obj = json_object_array_get_idx(arr, i);
+		err = parse_serial(json_object_get_string(obj), &serbn);
+		if (err != ERRF_OK)
+			return (err);
+		serial_list_add(&sj->sj_serials, serbn);
+	}
+
+	obj = json_object_object_get(robj, "crl");
+	sj->sj_want_crl = (obj != NULL && json_object_get_boolean(obj));
+
+	return (ERRF_OK);
+}
+
+static void
+serve_process_line(struct ca *ca, struct cert_var_scope *ca_scope,
+    struct serve_tpl **tpls, struct serve_conn *conns, uint idx,
+    const char *line, size_t len)
+{
+	struct serve_conn *sc = &conns[idx];
+	enum json_tokener_error jerr;
+	struct json_tokener *tok;
+	json_object *robj = NULL, *obj, *id = NULL, *resp;
+	struct serve_job *sj = NULL;
+	const char *op;
+	errf_t *err;
+
+	tok = json_tokener_new();
+	VERIFY(tok != NULL);
+	robj = json_tokener_parse_ex(tok, line, len);
+	jerr = json_tokener_get_error(tok);
+	json_tokener_free(tok);
+	if (jerr != json_tokener_success ||
+	    !json_object_is_type(robj, json_type_object)) {
+		if (jerr != json_tokener_success)
+			err = jtokerrf("json_tokener_parse_ex", jerr);
+		else
+			err = errf("RequestError", NULL, "Request is not a "
+			    "JSON object");
+		goto fail;
+	}
+
+	id = json_object_object_get(robj, "id");
+
+	obj = json_object_object_get(robj, "op");
+	op = (obj == NULL) ? "" : json_object_get_string(obj);
+
+	if (strcmp(op, "stats") == 0) {
+		resp = serve_resp_new(id);
+		json_object_object_add(resp, "ok", json_object_new_boolean(1));
+		VERIFY0(pthread_mutex_lock(&serve_mtx));
+		json_object_object_add(resp, "stats", serve_stats_json());
+		VERIFY0(pthread_mutex_unlock(&serve_mtx));
+		serve_reply(sc, resp);
+		json_object_put(resp);
+		goto out;
+	}
+
+	sj = calloc(1, sizeof (struct serve_job));
+	VERIFY(sj != NULL);
+	sj->sj_start = serve_now_us();
+	sj->sj_conn = idx;
+	sj->sj_conn_gen = sc->sc_gen;
+	if (id != NULL)
+		sj->sj_id = json_object_get(id);
+
+	if (strcmp(op, "sign") == 0) {
+		sj->sj_op = SERVE_OP_SIGN;
+		err = serve_prepare_sign(ca, ca_scope, tpls, robj, sj);
+	} else if (strcmp(op, "revoke") == 0) {
+		sj->sj_op = SERVE_OP_REVOKE;
+		err = serve_prepare_revoke(robj, sj);
+	} else {
+		err = errf("RequestError", NULL, "Unknown request op '%s'",
+		    op);
+	}
+	if (err != ERRF_OK)
+		goto fail;
+
+	VERIFY0(pthread_mutex_lock(&serve_mtx));
+	if (serve_depth >= SERVE_MAX_QUEUE) {
+		VERIFY0(pthread_mutex_unlock(&serve_mtx));
+		err = errf("QueueFullError", NULL, "Too many requests are "
+		    "already queued (%u), try again later", SERVE_MAX_QUEUE);
+		goto fail;
+	}
+	sj->sj_queued = serve_now_us();
+	serve_job_append(&serve_pending, &serve_pending_tail, sj);
+	++serve_depth;
+	VERIFY0(pthread_cond_signal(&serve_cv));
+	VERIFY0(pthread_mutex_unlock(&serve_mtx));
+	++sc->sc_jobs;
+	sj = NULL;
+	goto out;
+
+fail:
+	serve_reply_err(sc, id, err);
+	errf_free(err);
+	VERIFY0(pthread_mutex_lock(&serve_mtx));
+	++serve_stats.sst_requests;
+	++serve_stats.sst_errors;
+	VERIFY0(pthread_mutex_unlock(&serve_mtx));
+out:
+	serve_job_free(sj);
+	json_object_put(robj);
+}
+
+static void
+serve_conn_close(struct serve_conn *sc)
+{
+	if (sc->sc_fd != -1)
+		close(sc->sc_fd);
+	sc->sc_fd = -1;
+	sc->sc_pfd = -1;
+	sc->sc_jobs = 0;
+	sc->sc_eof = B_FALSE;
+	sshbuf_reset(sc->sc_in);
+	sshbuf_reset(sc->sc_out);
+}
+
+/*
+ * Closes a connection whose client has stopped sending, once it has nothing
+ * left in flight and every reply has been written.
+ */
+static void
+serve_conn_reap(struct serve_conn *sc)
+{
+	if (sc->sc_fd != -1 && sc->sc_eof && sc->sc_jobs == 0 &&
+	    sshbuf_len(sc->sc_out) == 0) {
+		serve_conn_close(sc);
+	}
+}
+
+/*
+ * Handles every complete request line buffered on a connection, stopping
+ * early while its replies are over SERVE_MAX_OUT (we come back to the rest
+ * once the client has read some of them).
+ */
+static void
+serve_conn_lines(struct ca *ca, struct cert_var_scope *ca_scope,
+    struct serve_tpl **tpls, struct serve_conn *conns, uint idx)
+{
+	struct serve_conn *sc = &conns[idx];
+	const uint8_t *p, *nl;
+	errf_t *err;
+
+	while (sshbuf_len(sc->sc_out) < SERVE_MAX_OUT) {
+		p = sshbuf_ptr(sc->sc_in);
+		nl = memchr(p, '\n', sshbuf_len(sc->sc_in));
+		if (nl == NULL) {
+			if (sshbuf_len(sc->sc_in) <= SERVE_MAX_LINE)
+				return;
+			err = errf("RequestError", NULL, "Request "
+			    "line too long");
+			serve_reply_err(sc, NULL, err);
+			errf_free(err);
+			(void) write(sc->sc_fd, sshbuf_ptr(sc->sc_out),
+			    sshbuf_len(sc->sc_out));
+			serve_conn_close(sc);
+			return;
+		}
+		if (nl > p) {
+			serve_process_line(ca, ca_scope, tpls, conns, idx,
+			    (const char *)p, nl - p);
+		}
+		VERIFY0(sshbuf_consume(sc->sc_in, (nl - p) + 1));
+	}
+}
+
+static int
+serve_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t omask;
+	int fd;
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof (addr.sun_path))
+		errx(EXIT_BAD_ARGS, "socket path too long: %s", path);
+	xstrlcpy(addr.sun_path, path, sizeof (addr.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(EXIT_ERROR, "socket");
+
+	(void) unlink(path);
+	omask = umask(0177);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+		err(EXIT_ERROR, "bind(%s)", path);
+	(void) umask(omask);
+
+	if (listen(fd, 16) != 0)
+		err(EXIT_ERROR, "listen(%s)", path);
+	VERIFY0(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+
+	return (fd);
+}
+
+static errf_t *
+cmd_serve(const char *ca_path, const char *sock_path)
+{
+	errf_t *err;
+	struct ca *ca;
+	struct ca_session *sess;
+	struct cert_var_scope *ca_scope;
+	struct serve_tpl *tpls = NULL, *st;
+	struct serve_conn conns[SERVE_MAX_CONNS];
+	struct pollfd pfds[SERVE_MAX_CONNS + 2];
+	struct serve_job *sj;
+	struct sigaction sa;
+	struct serve_signer_args ssa;
+	pthread_t signer;
+	int lfd, fd, rc;
+	uint i, nfds;
+	short events;
+	ssize_t done;
+	char drain[64];
+
+	err = ca_open(ca_path, &ca);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ca_open_session(ca, &sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	err = ensure_authed(ca, sess);
+	if (err != ERRF_OK)
+		return (err);
+
+	ca_scope = ca_make_scope(ca, root_scope);
+	VERIFY(ca_scope != NULL);
+
+	for (i = 0; i < SERVE_MAX_CONNS; ++i) {
+		conns[i].sc_fd = -1;
+		conns[i].sc_pfd = -1;
+		conns[i].sc_gen = 0;
+		conns[i].sc_jobs = 0;
+		conns[i].sc_eof = B_FALSE;
+		conns[i].sc_in = sshbuf_new();
+		conns[i].sc_out = sshbuf_new();
+		VERIFY(conns[i].sc_in != NULL);
+		VERIFY(conns[i].sc_out != NULL);
+	}
+
+	bzero(&sa, sizeof (sa));
+	sa.sa_handler = serve_sigterm;
+	VERIFY0(sigaction(SIGTERM, &sa, NULL));
+	VERIFY0(sigaction(SIGINT, &sa, NULL));
+	signal(SIGPIPE, SIG_IGN);
+
+	VERIFY0(pipe(serve_wakefd));
+	VERIFY0(fcntl(serve_wakefd[0], F_SETFL,
+	    fcntl(serve_wakefd[0], F_GETFL) | O_NONBLOCK));
+
+	lfd = serve_listen(sock_path);
+
+	ssa.ssa_ca = ca;
+	ssa.ssa_sess = sess;
+	VERIFY0(pthread_create(&signer, NULL, serve_signer, &ssa));
+
+	fprintf(stderr, "Serving CA '%s' on %s\n", ca_slug(ca), sock_path);
+
+	while (!serve_exit) {
+		nfds = 0;
+		pfds[nfds].fd = lfd;
+		pfds[nfds++].events = POLLIN;
+		pfds[nfds].fd = serve_wakefd[0];
+		pfds[nfds++].events = POLLIN;
+		for (i = 0; i < SERVE_MAX_CONNS; ++i) {
+			struct serve_conn *sc = &conns[i];
+			sc->sc_pfd = -1;
+			if (sc->sc_fd == -1)
+				continue;
+			events = 0;
+			if (!sc->sc_eof &&
+			    sshbuf_len(sc->sc_out) < SERVE_MAX_OUT)
+				events |= POLLIN;
+			if (sshbuf_len(sc->sc_out) > 0)
+				events |= POLLOUT;
+			/*
+			 * A half-closed client with nothing to write yet would
+			 * just spin on POLLHUP, so leave it out until the
+			 * signer hands us its next reply.
+			 */
+			if (events == 0)
+				continue;
+			sc->sc_pfd = nfds;
+			pfds[nfds].fd = sc->sc_fd;
+			pfds[nfds++].events = events;
+		}
+
+		rc = poll(pfds, nfds, -1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return (errfno("poll", errno, NULL));
+
+		if (pfds[1].revents & POLLIN) {
+			while (read(serve_wakefd[0], drain, sizeof (drain)) > 0)
+				;
+			while (1) {
+				VERIFY0(pthread_mutex_lock(&serve_mtx));
+				sj = serve_job_pop(&serve_done,
+				    &serve_done_tail);
+				if (sj != NULL)
+					--serve_depth;
+				VERIFY0(pthread_mutex_unlock(&serve_mtx));
+				if (sj == NULL)
+					break;
+				VERIFY0(pthread_mutex_lock(&serve_mtx));
+				serve_finish_job(conns, sj);
+				VERIFY0(pthread_mutex_unlock(&serve_mtx));
+				serve_conn_reap(&conns[sj->sj_conn]);
+				serve_job_free(sj);
+			}
+		}
+
+		for (i = 0; i < SERVE_MAX_CONNS; ++i) {
+			struct serve_conn *sc = &conns[i];
+			short revents;
+
+			if (sc->sc_fd == -1 || sc->sc_pfd == -1)
+				continue;
+			revents = pfds[sc->sc_pfd].revents;
+			if (revents == 0)
+				continue;
+			if (revents & (POLLERR | POLLNVAL)) {
+				serve_conn_close(sc);
+				continue;
+			}
+
+			if ((revents & POLLOUT) && sshbuf_len(sc->sc_out) > 0) {
+				done = write(sc->sc_fd, sshbuf_ptr(sc->sc_out),
+				    sshbuf_len(sc->sc_out));
+				if (done < 0 && errno != EAGAIN &&
+				    errno != EINTR) {
+					serve_conn_close(sc);
+					continue;
+				}
+				if (done > 0) {
+					VERIFY0(sshbuf_consume(sc->sc_out,
+					    done));
+				}
+			}
+
+			if ((revents & (POLLIN | POLLHUP)) && !sc->sc_eof) {
+				uint8_t rbuf[8192];
+
+				done = read(sc->sc_fd, rbuf, sizeof (rbuf));
+				if (done < 0 && errno != EAGAIN &&
+				    errno != EINTR) {
+					serve_conn_close(sc);
+					continue;
+				}
+				/*
+				 * The client has finished sending, but may
+				 * still be waiting for replies to what it sent.
+				 */
+				if (done == 0)
+					sc->sc_eof = B_TRUE;
+				if (done > 0) {
+					VERIFY0(sshbuf_put(sc->sc_in, rbuf,
+					    done));
+				}
+			}
+
+			serve_conn_lines(ca, ca_scope, &tpls, conns, i);
+			serve_conn_reap(sc);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			fd = accept(lfd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			for (i = 0; i < SERVE_MAX_CONNS; ++i) {
+				if (conns[i].sc_fd == -1)
+					break;
+			}
+			if (i == SERVE_MAX_CONNS) {
+				/* Too busy, just drop it. */
+				close(fd);
+				continue;
+			}
+			VERIFY0(fcntl(fd, F_SETFL,
+			    fcntl(fd, F_GETFL) | O_NONBLOCK));
+			conns[i].sc_fd = fd;
+			conns[i].sc_pfd = -1;
+			++conns[i].sc_gen;
+		}
+	}
+
+	fprintf(stderr, "Shutting down, waiting for %u queued requests\n",
+	    serve_depth);
+
+	VERIFY0(pthread_mutex_lock(&serve_mtx));
+	serve_stopping = B_TRUE;
+	VERIFY0(pthread_cond_signal(&serve_cv));
+	VERIFY0(pthread_mutex_unlock(&serve_mtx));
+	VERIFY0(pthread_join(signer, NULL));
+
+	while ((sj = serve_job_pop(&serve_done, &serve_done_tail)) != NULL)
+		serve_job_free(sj);
+
+	for (i = 0; i < SERVE_MAX_CONNS; ++i) {
+		serve_conn_close(&conns[i]);
+		sshbuf_free(conns[i].sc_in);
+		sshbuf_free(conns[i].sc_out);
+	}
+	while ((st = tpls) != NULL) {
+		tpls = st->st_next;
+		cert_tpl_plan_free(st->st_plan);
+		scope_free(st->st_scope);
+		cert_var_free_all(st->st_params);
+		free(st);
+	}
+	close(lfd);
+	(void) unlink(sock_path);
+
+	ca_close_session(sess);
+	ca_close(ca);
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+parse_json_scope(const char *buf, size_t len)
+{
+	enum json_tokener_error jerr;
+	struct json_tokener *tok = NULL;
+	json_object *robj = NULL;
+	json_object_iter iter;
+	errf_t *err;
+
+	tok = json_tokener_new();
+	if (tok == NULL) {
+		err = errfno("json_tokener_new", errno, NULL);
+		goto out;
+	}
+
+	robj = json_tokener_parse_ex(tok, buf, len + 1);
+	if ((jerr = json_tokener_get_error(tok)) != json_tokener_success) {
+		err = jtokerrf("json_tokener_parse_ex", jerr);
+		goto out;
+	}
+	VERIFY(robj != NULL);
+	if (json_tokener_get_parse_end(tok) < len) {
+		err = errf("LengthError", NULL, "JSON object ended after "
+		    "%zu bytes, expected %zu", json_tokener_get_parse_end(tok),
+		    len);
+		goto out;
+	}
+
+	bzero(&iter, sizeof (iter));
+	json_object_object_foreachC(robj, iter) {
+		err = scope_set(root_scope, iter.key,
+		    json_object_get_string(iter.val));
+		if (err != ERRF_OK) {
+			err = errf("JSONError", err, "Input JSON has "
+			    "invalid '%s' property", iter.key);
+			goto out;
+		}
+	}
+
+	err = ERRF_OK;
+
+out:
+	json_object_put(robj);
+	if (tok != NULL)
+		json_tokener_free(tok);
+	return (err);
+}
+
+const char *optstring = "p:D:J:jKfy";
+
+errf_t *read_text_file(const char *path, char **out, size_t *outlen);
+
+int
+main(int argc, char *argv[])
+{
+	errf_t *err = ERRF_OK;
+	extern char *optarg;
+	extern int optind;
+	int c;
+	size_t len;
+	char *ptr;
+	uint d_level = 0;
+	uint K_level = 0;
+	const char *ca_path = ".";
+
+	bunyan_init();
 	bunyan_set_name("pivy-ca");
 
 	root_scope = scope_new_root();
@@ -1389,6 +3319,12 @@ main(int argc, char *argv[])
 		case 'j':
 			output_json = B_TRUE;
 			break;
+		case 'f':
+			ocsp_force = B_TRUE;
+			break;
+		case 'y':
+			assume_yes = B_TRUE;
+			break;
 		case 'p':
 			ca_path = optarg;
 			break;
@@ -1503,6 +3439,25 @@ main(int argc, char *argv[])
 		}
 		err = cmd_revoke_serial(ca_path, serial);
 
+	} else if (strcmp(op, "revoke-bulk") == 0) {
+		const char *list_path = NULL;
+
+		if (optind < argc)
+			list_path = argv[optind++];
+
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_revoke_bulk(ca_path, list_path);
+
+	} else if (strcmp(op, "revoke-query") == 0) {
+		if (optind >= argc) {
+			warnx("not enough arguments for %s", op);
+			usage();
+		}
+		err = cmd_revoke_query(ca_path, argc - optind, &argv[optind]);
+
 	} else if (strcmp(op, "sign-crl") == 0) {
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
@@ -1517,6 +3472,73 @@ main(int argc, char *argv[])
 		}
 		err = cmd_rotate_pin(ca_path);
 
+	} else if (strcmp(op, "verify-log") == 0) {
+		const char *segstr = NULL;
+
+		if (optind < argc)
+			segstr = argv[optind++];
+
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_verify_log(ca_path, segstr);
+
+	} else if (strcmp(op, "bench-tpl") == 0) {
+		const char *tpl_name, *countstr = NULL;
+
+		if (optind >= argc) {
+			warnx("not enough arguments for %s", op);
+			usage();
+		}
+		tpl_name = argv[optind++];
+
+		if (optind < argc)
+			countstr = argv[optind++];
+
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_bench_tpl(ca_path, tpl_name, countstr);
+
+	} else if (strcmp(op, "ocsp-refresh") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_ocsp_refresh(ca_path);
+
+	} else if (strcmp(op, "ocsp-serve") == 0) {
+		const char *listen_spec;
+
+		if (optind >= argc) {
+			warnx("not enough arguments for %s", op);
+			usage();
+		}
+		listen_spec = argv[optind++];
+
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_ocsp_serve(ca_path, listen_spec);
+
+	} else if (strcmp(op, "serve") == 0) {
+		const char *sock_path;
+
+		if (optind >= argc) {
+			warnx("not enough arguments for %s", op);
+			usage();
+		}
+		sock_path = argv[optind++];
+
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_serve(ca_path, sock_path);
+
 	} else {
 		warnx("invalid operation '%s'", op);
 		usage();
@@ -0,0 +1,522 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2026 The pivy Authors
+ */
+
+/*
+ * libcryptsetup external token handler for the "ebox" tokens written by
+ * pivy-luks. It's built as libcryptsetup-token-ebox.so and installed into
+ * libcryptsetup's token directory, after which cryptsetup (and
+ * systemd-cryptsetup) can open pivy-luks volumes in-process, e.g.:
+ *
+ *   cryptsetup open --token-only /dev/sda2 data
+ *
+ * The handler only does non-interactive unlocking with a primary config:
+ * either through an ssh-agent (like pivy-agent) which holds the key, or
+ * directly via PC/SC with the PIN supplied by libcryptsetup. Recovery still
+ * requires the pivy-luks tool.
+ *
+ * libcryptsetup token handlers hand back a passphrase for one of the
+ * keyslots assigned to the token, rather than the volume key. pivy-luks adds
+ * such a keyslot when it formats or rekeys a device, with the passphrase
+ * derived from the ebox key (see luks_token_passphrase() in pivy-luks.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <strings.h>
+#include <limits.h>
+#include <setjmp.h>
+
+#include "debug.h"
+
+#if defined(__APPLE__)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <wintypes.h>
+#include <winscard.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include "openssh/config.h"
+#include "openssh/sshkey.h"
+#include "openssh/sshbuf.h"
+#include "openssh/ssherr.h"
+#include "openssh/authfd.h"
+
+#include <libcryptsetup.h>
+#include <json.h>
+
+#include "tlv.h"
+#include "errf.h"
+#include "ebox.h"
+#include "piv.h"
+#include "bunyan.h"
+
+/* Exported entry points (see pivy-luks-token.version) */
+const char *cryptsetup_token_version(void);
+int cryptsetup_token_open(struct crypt_device *, int, char **, size_t *,
+    void *);
+int cryptsetup_token_open_pin(struct crypt_device *, int, const char *,
+    size_t, char **, size_t *, void *);
+void cryptsetup_token_buffer_free(void *, size_t);
+int cryptsetup_token_validate(struct crypt_device *, const char *);
+void cryptsetup_token_dump(struct crypt_device *, const char *);
+
+/*
+ * The OpenSSH code we link against calls fatal() -> cleanup_exit() on things
+ * it considers impossible. We're running inside cryptsetup or systemd, so
+ * rather than exit() the whole process, cleanup_exit() jumps back to the
+ * entry point that's currently running, which fails the token operation.
+ *
+ * Whatever that operation had open at the time is registered in token_fatal
+ * so that the entry point can still clean it up after the jump: the PC/SC
+ * transaction gets ended (otherwise the card stays locked to this process),
+ * and the ebox and PIN (which may hold unlocked key material by then) get
+ * zeroed and freed.
+ */
+static __thread jmp_buf *token_fatal_jmp = NULL;
+
+struct token_fatal_state {
+	struct ebox		*tfs_ebox;
+	struct piv_ctx		*tfs_ctx;
+	struct piv_token	*tfs_txn;	/* token we're in a txn on */
+	char			*tfs_pin;
+};
+static __thread struct token_fatal_state token_fatal;
+
+static void
+token_fatal_cleanup(void)
+{
+	struct token_fatal_state *tfs = &token_fatal;
+
+	if (tfs->tfs_txn != NULL)
+		piv_txn_end(tfs->tfs_txn);
+	/* piv_close() releases any tokens we had found, too. */
+	if (tfs->tfs_ctx != NULL)
+		piv_close(tfs->tfs_ctx);
+	ebox_free(tfs->tfs_ebox);
+	if (tfs->tfs_pin != NULL)
+		freezero(tfs->tfs_pin, strlen(tfs->tfs_pin));
+	bzero(tfs, sizeof (*tfs));
+}
+
+static errf_t *
+token_json_ebox(const char *json, struct ebox **peb)
+{
+	json_object *obj, *jv;
+	struct sshbuf *buf = NULL;
+	errf_t *err;
+	int rc;
+
+	obj = json_tokener_parse(json);
+	if (obj == NULL) {
+		return (errf("JSONError", NULL, "failed to parse LUKS token "
+		    "json"));
+	}
+
+	jv = json_object_object_get(obj, "ebox");
+	if (jv == NULL) {
+		err = errf("JSONError", NULL, "no 'ebox' property in LUKS "
+		    "token json");
+		goto out;
+	}
+
+	buf = sshbuf_new();
+	if (buf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((rc = sshbuf_b64tod(buf, json_object_get_string(jv)))) {
+		err = ssherrf("sshbuf_b64tod", rc);
+		goto out;
+	}
+	err = sshbuf_get_ebox(buf, peb);
+
+out:
+	sshbuf_free(buf);
+	json_object_put(obj);
+	return (err);
+}
+
+static errf_t *
+token_unlock_agent(struct piv_ecdh_box *box)
+{
+	int fd = -1, rc;
+	errf_t *err;
+
+	if ((rc = ssh_get_authentication_socket(&fd)) != 0)
+		return (ssherrf("ssh_get_authentication_socket", rc));
+	err = piv_box_open_agent(fd, box);
+	close(fd);
+	return (err);
+}
+
+/* This is the same as local_check_cak() in ebox-cmd.c */
+static errf_t *
+token_check_cak(struct piv_token *tk, struct sshkey *cak)
+{
+	struct piv_slot *cakslot;
+	errf_t *err;
+
+	cakslot = piv_get_slot(tk, PIV_SLOT_CARD_AUTH);
+	if (cakslot == NULL) {
+		err = piv_read_cert(tk, PIV_SLOT_CARD_AUTH);
+		if (err) {
+			return (errf("CardAuthenticationError", err,
+			    "Failed to validate CAK"));
+		}
+		cakslot = piv_get_slot(tk, PIV_SLOT_CARD_AUTH);
+	}
+	if (cakslot == NULL) {
+		return (errf("CardAuthenticationError", NULL,
+		    "Failed to validate CAK"));
+	}
+	err = piv_auth_key(tk, cakslot, cak);
+	if (err) {
+		return (errf("CardAuthenticationError", err,
+		    "Failed to validate CAK"));
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * The card's CAK (if the config has one) is checked before we send it the
+ * PIN, so a card which just claims the right GUID can't collect it.
+ */
+static errf_t *
+token_unlock_card(struct piv_ctx *ctx, struct piv_ecdh_box *box,
+    struct sshkey *cak, const char *pin)
+{
+	struct piv_token *tokens = NULL, *tk;
+	struct piv_slot *slot;
+	uint retries = 1;
+	errf_t *err;
+
+	if (!piv_box_has_guidslot(box)) {
+		return (errf("NoGUIDSlot", NULL, "box does not have GUID "
+		    "and slot information, can't unlock with local hardware"));
+	}
+
+	err = piv_find(ctx, piv_box_guid(box), GUID_LEN, &tokens);
+	if (err)
+		return (err);
+	if ((err = piv_box_find_token(tokens, box, &tk, &slot)))
+		goto out;
+
+	if ((err = piv_txn_begin(tk)))
+		goto out;
+	token_fatal.tfs_txn = tk;
+	if ((err = piv_select(tk)))
+		goto outtxn;
+	if (cak != NULL && (err = token_check_cak(tk, cak)))
+		goto outtxn;
+	if (pin != NULL) {
+		err = piv_verify_pin(tk, piv_token_default_auth(tk), pin,
+		    &retries, B_FALSE);
+		if (err)
+			goto outtxn;
+	}
+	err = piv_box_open(tk, slot, box);
+
+outtxn:
+	token_fatal.tfs_txn = NULL;
+	piv_txn_end(tk);
+out:
+	piv_release(tokens);
+	return (err);
+}
+
+/*
+ * This must produce exactly the same passphrase as luks_token_passphrase()
+ * in pivy-luks.c.
+ */
+static int
+token_passphrase(struct ebox *ebox, char **buffer, size_t *buffer_len)
+{
+	struct sshbuf *buf;
+	const uint8_t *key;
+	size_t keylen;
+	char *b64;
+
+	key = ebox_key(ebox, &keylen);
+	buf = sshbuf_new();
+	if (buf == NULL)
+		return (-ENOMEM);
+	if (sshbuf_put(buf, key, keylen) != 0) {
+		sshbuf_free(buf);
+		return (-ENOMEM);
+	}
+	b64 = sshbuf_dtob64_string(buf, 0);
+	sshbuf_free(buf);
+	if (b64 == NULL)
+		return (-ENOMEM);
+
+	*buffer = b64;
+	*buffer_len = strlen(b64);
+	return (0);
+}
+
+static int
+token_open_pin(struct crypt_device *cd, int token, const char *pin,
+    size_t pin_size, char **buffer, size_t *buffer_len)
+{
+	const char *json;
+	struct ebox *ebox = NULL;
+	struct ebox_config *config = NULL;
+	struct ebox_tpl_config *tconfig;
+	struct ebox_part *part;
+	struct piv_ecdh_box *box;
+	struct sshkey *cak;
+	struct piv_ctx *ctx = NULL;
+	char *pinstr = NULL;
+	boolean_t nopcsc = B_FALSE;
+	errf_t *err;
+	int rc = -ENOENT;
+
+	if (crypt_token_json_get(cd, token, &json) < 0)
+		return (-EINVAL);
+	if ((err = token_json_ebox(json, &ebox))) {
+		crypt_logf(cd, CRYPT_LOG_ERROR, "ebox token: %s",
+		    errf_message(err));
+		errf_free(err);
+		return (-EINVAL);
+	}
+	token_fatal.tfs_ebox = ebox;
+
+	if (pin != NULL) {
+		pinstr = strndup(pin, pin_size);
+		if (pinstr == NULL) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		token_fatal.tfs_pin = pinstr;
+	}
+
+	while ((config = ebox_next_config(ebox, config)) != NULL) {
+		tconfig = ebox_config_tpl(config);
+		if (ebox_tpl_config_type(tconfig) != EBOX_PRIMARY)
+			continue;
+		part = ebox_config_next_part(config, NULL);
+		box = ebox_part_box(part);
+		cak = ebox_tpl_part_cak(ebox_part_tpl(part));
+
+		err = token_unlock_agent(box);
+		if (err == ERRF_OK)
+			goto unlock;
+		crypt_logf(cd, CRYPT_LOG_DEBUG, "ebox token: agent unlock "
+		    "failed: %s", errf_message(err));
+		errf_free(err);
+
+		if (nopcsc)
+			continue;
+		if (ctx == NULL) {
+			ctx = piv_open();
+			if (ctx == NULL) {
+				rc = -ENOMEM;
+				goto out;
+			}
+			token_fatal.tfs_ctx = ctx;
+			err = piv_establish_context(ctx, SCARD_SCOPE_SYSTEM);
+			if (err && !errf_caused_by(err, "ServiceError")) {
+				crypt_logf(cd, CRYPT_LOG_DEBUG, "ebox token: "
+				    "PC/SC unavailable: %s",
+				    errf_message(err));
+				errf_free(err);
+				nopcsc = B_TRUE;
+				continue;
+			}
+			errf_free(err);
+		}
+
+		err = token_unlock_card(ctx, box, cak, pinstr);
+		if (err == ERRF_OK)
+			goto unlock;
+		crypt_logf(cd, CRYPT_LOG_DEBUG, "ebox token: card unlock "
+		    "failed: %s", errf_message(err));
+		if (errf_caused_by(err, "PermissionError")) {
+			/*
+			 * With no PIN, ask libcryptsetup to get one and call
+			 * us again (via _open_pin). With a PIN, it was wrong.
+			 */
+			rc = (pinstr == NULL) ? -ENOANO : -EPERM;
+			errf_free(err);
+			goto out;
+		}
+		if (errf_caused_by(err, "MinRetriesError")) {
+			rc = -EPERM;
+			errf_free(err);
+			goto out;
+		}
+		errf_free(err);
+	}
+	goto out;
+
+unlock:
+	if ((err = ebox_unlock(ebox, config))) {
+		crypt_logf(cd, CRYPT_LOG_ERROR, "ebox token: %s",
+		    errf_message(err));
+		errf_free(err);
+		rc = -EINVAL;
+		goto out;
+	}
+	rc = token_passphrase(ebox, buffer, buffer_len);
+
+out:
+	bzero(&token_fatal, sizeof (token_fatal));
+	if (pinstr != NULL)
+		freezero(pinstr, strlen(pinstr));
+	if (ctx != NULL)
+		piv_close(ctx);
+	ebox_free(ebox);
+	return (rc);
+}
+
+int
+cryptsetup_token_open_pin(struct crypt_device *cd, int token,
+    const char *pin, size_t pin_size, char **buffer, size_t *buffer_len,
+    void *usrptr)
+{
+	jmp_buf jb;
+	int rc;
+
+	if (setjmp(jb) != 0) {
+		token_fatal_jmp = NULL;
+		token_fatal_cleanup();
+		crypt_logf(cd, CRYPT_LOG_ERROR, "ebox token: internal error");
+		return (-EINVAL);
+	}
+	token_fatal_jmp = &jb;
+	rc = token_open_pin(cd, token, pin, pin_size, buffer, buffer_len);
+	token_fatal_jmp = NULL;
+	return (rc);
+}
+
+int
+cryptsetup_token_open(struct crypt_device *cd, int token, char **buffer,
+    size_t *buffer_len, void *usrptr)
+{
+	return (cryptsetup_token_open_pin(cd, token, NULL, 0, buffer,
+	    buffer_len, usrptr));
+}
+
+void
+cryptsetup_token_buffer_free(void *buffer, size_t buffer_len)
+{
+	freezero(buffer, buffer_len);
+}
+
+static int
+token_validate(struct crypt_device *cd, const char *json)
+{
+	struct ebox *ebox;
+	errf_t *err;
+
+	if ((err = token_json_ebox(json, &ebox))) {
+		crypt_logf(cd, CRYPT_LOG_ERROR, "ebox token: %s",
+		    errf_message(err));
+		errf_free(err);
+		return (-EINVAL);
+	}
+	ebox_free(ebox);
+	return (0);
+}
+
+int
+cryptsetup_token_validate(struct crypt_device *cd, const char *json)
+{
+	jmp_buf jb;
+	int rc;
+
+	if (setjmp(jb) != 0) {
+		token_fatal_jmp = NULL;
+		token_fatal_cleanup();
+		return (-EINVAL);
+	}
+	token_fatal_jmp = &jb;
+	rc = token_validate(cd, json);
+	token_fatal_jmp = NULL;
+	return (rc);
+}
+
+static void
+token_dump(struct crypt_device *cd, const char *json)
+{
+	struct ebox *ebox;
+	struct ebox_config *config = NULL;
+	struct ebox_tpl_config *tconfig;
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	const char *name;
+	errf_t *err;
+
+	if ((err = token_json_ebox(json, &ebox))) {
+		crypt_logf(cd, CRYPT_LOG_NORMAL, "\tinvalid ebox: %s\n",
+		    errf_message(err));
+		errf_free(err);
+		return;
+	}
+	token_fatal.tfs_ebox = ebox;
+
+	while ((config = ebox_next_config(ebox, config)) != NULL) {
+		tconfig = ebox_config_tpl(config);
+		crypt_logf(cd, CRYPT_LOG_NORMAL, "\t%s config (%u parts "
+		    "required):\n",
+		    ebox_tpl_config_type(tconfig) == EBOX_PRIMARY ?
+		    "primary" : "recovery", ebox_tpl_config_n(tconfig));
+		part = NULL;
+		while ((part = ebox_config_next_part(config, part)) != NULL) {
+			tpart = ebox_part_tpl(part);
+			name = ebox_tpl_part_name(tpart);
+			crypt_logf(cd, CRYPT_LOG_NORMAL, "\t  %s guid %s "
+			    "slot %02X\n", (name == NULL) ? "(unnamed)" : name,
+			    piv_box_guid_hex(ebox_part_box(part)),
+			    piv_box_slot(ebox_part_box(part)));
+		}
+	}
+
+	token_fatal.tfs_ebox = NULL;
+	ebox_free(ebox);
+}
+
+void
+cryptsetup_token_dump(struct crypt_device *cd, const char *json)
+{
+	jmp_buf jb;
+
+	if (setjmp(jb) != 0) {
+		token_fatal_jmp = NULL;
+		token_fatal_cleanup();
+		crypt_logf(cd, CRYPT_LOG_NORMAL, "\tinternal error\n");
+		return;
+	}
+	token_fatal_jmp = &jb;
+	token_dump(cd, json);
+	token_fatal_jmp = NULL;
+}
+
+const char *
+cryptsetup_token_version(void)
+{
+	return (PIVY_VERSION);
+}
+
+void
+cleanup_exit(int i)
+{
+	if (token_fatal_jmp != NULL)
+		longjmp(*token_fatal_jmp, 1);
+	/* Not reachable from outside one of our entry points. */
+	abort();
+}
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "debug.h"
 
@@ -195,6 +196,76 @@ done:
 	return (ERRF_OK);
 }
 
+/*
+ * Besides the ebox token, each device gets a LUKS keyslot assigned to the
+ * token, unlockable with a passphrase derived from the ebox key. pivy-luks
+ * itself doesn't use it (it activates with the volume key directly), but
+ * the libcryptsetup token plugin (pivy-luks-token.c) has to hand back a
+ * keyslot passphrase. The passphrase has the full strength of the volume
+ * key, so there's no point in an expensive KDF on the keyslot: we use
+ * PBKDF2 with a fixed, small iteration count to keep activation fast.
+ *
+ * The token plugin's token_passphrase() must produce the same passphrase.
+ */
+static char *
+luks_token_passphrase(const uint8_t *key, size_t keylen)
+{
+	struct sshbuf *buf;
+	char *b64;
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	VERIFY0(sshbuf_put(buf, key, keylen));
+	b64 = sshbuf_dtob64_string(buf, 0);
+	VERIFY(b64 != NULL);
+	sshbuf_free(buf);
+
+	return (b64);
+}
+
+static void
+luks_token_add_keyslot(struct crypt_device *cd, const char *devname,
+    json_object *obj, const uint8_t *key, size_t keylen)
+{
+	struct crypt_pbkdf_type pbkdf;
+	json_object *slots;
+	char *pass;
+	char slotstr[16];
+	int rc;
+
+	slots = json_object_object_get(obj, "keyslots");
+	if (slots != NULL && json_object_is_type(slots, json_type_array) &&
+	    json_object_array_length(slots) > 0) {
+		return;
+	}
+
+	bzero(&pbkdf, sizeof (pbkdf));
+	pbkdf.type = CRYPT_KDF_PBKDF2;
+	pbkdf.hash = "sha512";
+	pbkdf.iterations = 1000;
+	pbkdf.flags = CRYPT_PBKDF_NO_BENCHMARK;
+	rc = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (rc < 0) {
+		errfx(EXIT_ERROR, lukserrf("crypt_set_pbkdf_type", rc),
+		    "failed to set keyslot parameters on device '%s'", devname);
+	}
+
+	pass = luks_token_passphrase(key, keylen);
+	rc = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT,
+	    (const char *)key, keylen, pass, strlen(pass));
+	freezero(pass, strlen(pass));
+	if (rc < 0) {
+		errfx(EXIT_ERROR, lukserrf("crypt_keyslot_add_by_volume_key",
+		    rc), "failed to add token keyslot on device '%s'", devname);
+	}
+
+	snprintf(slotstr, sizeof (slotstr), "%d", rc);
+	slots = json_object_new_array();
+	VERIFY(slots != NULL);
+	json_object_array_add(slots, json_object_new_string(slotstr));
+	json_object_object_add(obj, "keyslots", slots);
+}
+
 static void
 cmd_rekey(const char *devname)
 {
@@ -289,6 +360,7 @@ cmd_rekey(const char *devname)
 	b64 = sshbuf_dtob64_string(buf, 0);
 
 	json_object_object_add(obj, "ebox", json_object_new_string(b64));
+	luks_token_add_keyslot(cd, devname, obj, key, keylen);
 
 	rc = crypt_token_json_set(cd, 1, json_object_to_json_string(obj));
 	if (rc < 0) {
@@ -462,6 +534,390 @@ done:
 	crypt_free(cd);
 }
 
+/*
+ * State for "unlock-all", which unlocks every pivy-managed device listed in
+ * a crypttab at once. All the eboxes are opened up front (one transaction
+ * and PIN entry per token), and the devices are then handed to an
+ * activation thread, so that activation overlaps with any interactive
+ * unlocks still going on in the main thread.
+ *
+ * libcryptsetup and libdevmapper don't promise that concurrent activations
+ * are safe (even on separate crypt_device handles), so there is only the
+ * one activation thread, which does the devices one at a time.
+ */
+struct luks_unlock {
+	struct luks_unlock	*lu_next;
+	struct luks_unlock	*lu_qnext;
+	char			*lu_name;
+	char			*lu_devname;
+	struct crypt_device	*lu_cd;
+	struct ebox		*lu_ebox;
+	boolean_t		 lu_recovered;
+	int			 lu_rc;
+	boolean_t		 lu_done;
+};
+
+struct luks_workq {
+	pthread_mutex_t		 lwq_mtx;
+	pthread_cond_t		 lwq_cv;
+	struct luks_unlock	*lwq_head;
+	struct luks_unlock	*lwq_tail;
+	boolean_t		 lwq_closed;
+};
+
+static uint64_t
+luks_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+luks_unlock_free(struct luks_unlock *lu)
+{
+	if (lu == NULL)
+		return;
+	ebox_free(lu->lu_ebox);
+	if (lu->lu_cd != NULL)
+		crypt_free(lu->lu_cd);
+	free(lu->lu_name);
+	free(lu->lu_devname);
+	free(lu);
+}
+
+static char *
+crypttab_field(char **p)
+{
+	char *f;
+
+	do {
+		f = strsep(p, " \t\n");
+	} while (f != NULL && *f == '\0');
+	return (f);
+}
+
+/*
+ * Translates the UUID=, PARTUUID= and LABEL= forms used in crypttab into
+ * a device path.
+ */
+static char *
+crypttab_devpath(const char *spec)
+{
+	char *path = NULL;
+
+	if (strncmp(spec, "UUID=", 5) == 0)
+		VERIFY(asprintf(&path, "/dev/disk/by-uuid/%s", spec + 5) > 0);
+	else if (strncmp(spec, "PARTUUID=", 9) == 0)
+		VERIFY(asprintf(&path, "/dev/disk/by-partuuid/%s",
+		    spec + 9) > 0);
+	else if (strncmp(spec, "LABEL=", 6) == 0)
+		VERIFY(asprintf(&path, "/dev/disk/by-label/%s", spec + 6) > 0);
+	else
+		path = strdup(spec);
+	VERIFY(path != NULL);
+
+	return (path);
+}
+
+/*
+ * Opens the device and reads its ebox out of LUKS token slot 1. Returns
+ * ERRF_OK with *plu = NULL if the device is fine but isn't one of ours (or
+ * is already active).
+ */
+static errf_t *
+luks_unlock_load(const char *name, const char *devname,
+    struct luks_unlock **plu)
+{
+	struct luks_unlock *lu;
+	struct sshbuf *buf = NULL;
+	json_object *obj = NULL, *jv;
+	const char *json;
+	errf_t *error;
+	int rc;
+
+	*plu = NULL;
+
+	lu = calloc(1, sizeof (struct luks_unlock));
+	VERIFY(lu != NULL);
+	lu->lu_name = strdup(name);
+	lu->lu_devname = strdup(devname);
+	VERIFY(lu->lu_name != NULL);
+	VERIFY(lu->lu_devname != NULL);
+
+	rc = crypt_init(&lu->lu_cd, devname);
+	if (rc < 0) {
+		error = lukserrf("crypt_init", rc);
+		goto out;
+	}
+
+	if (crypt_status(lu->lu_cd, name) == CRYPT_ACTIVE) {
+		error = ERRF_OK;
+		goto out;
+	}
+
+	/*
+	 * Devices that aren't LUKS2 (plain dm-crypt, LUKS1, swap/tmp entries),
+	 * or that don't have an ebox token, are not ours: skip them.
+	 */
+	rc = crypt_load(lu->lu_cd, CRYPT_LUKS2, NULL);
+	if (rc < 0) {
+		error = ERRF_OK;
+		goto out;
+	}
+
+	rc = crypt_token_json_get(lu->lu_cd, 1, &json);
+	if (rc < 0) {
+		error = ERRF_OK;
+		goto out;
+	}
+	obj = json_tokener_parse(json);
+	if (obj == NULL) {
+		error = errf("JSONError", NULL, "failed to parse LUKS token "
+		    "json");
+		goto out;
+	}
+	jv = json_object_object_get(obj, "type");
+	if (jv == NULL || strcmp("ebox", json_object_get_string(jv)) != 0) {
+		error = ERRF_OK;
+		goto out;
+	}
+	jv = json_object_object_get(obj, "ebox");
+	if (jv == NULL) {
+		error = errf("JSONError", NULL, "no 'ebox' property in LUKS "
+		    "token json");
+		goto out;
+	}
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	if ((rc = sshbuf_b64tod(buf, json_object_get_string(jv)))) {
+		error = ssherrf("sshbuf_b64tod", rc);
+		goto out;
+	}
+	if ((error = sshbuf_get_ebox(buf, &lu->lu_ebox)))
+		goto out;
+
+	*plu = lu;
+	lu = NULL;
+
+out:
+	json_object_put(obj);
+	sshbuf_free(buf);
+	luks_unlock_free(lu);
+	return (error);
+}
+
+static void
+luks_workq_push(struct luks_workq *lwq, struct luks_unlock *lu)
+{
+	VERIFY0(pthread_mutex_lock(&lwq->lwq_mtx));
+	lu->lu_qnext = NULL;
+	if (lwq->lwq_tail != NULL)
+		lwq->lwq_tail->lu_qnext = lu;
+	else
+		lwq->lwq_head = lu;
+	lwq->lwq_tail = lu;
+	VERIFY0(pthread_cond_signal(&lwq->lwq_cv));
+	VERIFY0(pthread_mutex_unlock(&lwq->lwq_mtx));
+}
+
+static void *
+luks_activate_thread(void *arg)
+{
+	struct luks_workq *lwq = arg;
+	struct luks_unlock *lu;
+	const uint8_t *key;
+	size_t keylen;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&lwq->lwq_mtx));
+		while (lwq->lwq_head == NULL && !lwq->lwq_closed)
+			VERIFY0(pthread_cond_wait(&lwq->lwq_cv,
+			    &lwq->lwq_mtx));
+		lu = lwq->lwq_head;
+		if (lu != NULL) {
+			lwq->lwq_head = lu->lu_qnext;
+			if (lwq->lwq_head == NULL)
+				lwq->lwq_tail = NULL;
+		}
+		VERIFY0(pthread_mutex_unlock(&lwq->lwq_mtx));
+		if (lu == NULL)
+			break;
+
+		key = ebox_key(lu->lu_ebox, &keylen);
+		lu->lu_rc = crypt_activate_by_volume_key(lu->lu_cd,
+		    lu->lu_name, (const char *)key, keylen, 0);
+		lu->lu_done = B_TRUE;
+	}
+
+	return (NULL);
+}
+
+static void
+cmd_unlock_all(const char *tabpath)
+{
+	FILE *tabf;
+	char *line = NULL, *p, *name, *dev, *opts, *devpath;
+	size_t linesz = 0;
+	struct luks_unlock *head = NULL, *tail = NULL, *lu;
+	struct luks_workq lwq;
+	struct ebox **eboxes;
+	pthread_t thread;
+	char *descr;
+	size_t desclen;
+	errf_t *error;
+	uint i, n = 0, nerrs = 0, nunlocked, nactive = 0;
+	uint64_t t0, tunbox, tdone;
+
+	t0 = luks_now_ms();
+
+	if (strcmp(tabpath, "-") == 0) {
+		tabf = stdin;
+	} else {
+		tabf = fopen(tabpath, "r");
+		if (tabf == NULL)
+			err(EXIT_ERROR, "failed to open %s", tabpath);
+	}
+
+	/*
+	 * crypttab lines are "name device [keyfile [options]]". We ignore the
+	 * keyfile field (the key comes from the ebox) but honour "noauto".
+	 */
+	while (getline(&line, &linesz, tabf) != -1) {
+		p = line;
+		name = crypttab_field(&p);
+		if (name == NULL || name[0] == '#')
+			continue;
+		dev = crypttab_field(&p);
+		if (dev == NULL) {
+			warnx("crypttab entry '%s' has no device", name);
+			++nerrs;
+			continue;
+		}
+		(void) crypttab_field(&p);
+		opts = crypttab_field(&p);
+		if (opts != NULL && strstr(opts, "noauto") != NULL)
+			continue;
+
+		devpath = crypttab_devpath(dev);
+		error = luks_unlock_load(name, devpath, &lu);
+		if (error) {
+			warnfx(error, "failed to load ebox from device '%s' "
+			    "(%s)", devpath, name);
+			errf_free(error);
+			++nerrs;
+		}
+		free(devpath);
+		if (lu == NULL)
+			continue;
+
+		if (tail != NULL)
+			tail->lu_next = lu;
+		else
+			head = lu;
+		tail = lu;
+		++n;
+	}
+	free(line);
+	if (tabf != stdin)
+		fclose(tabf);
+
+	if (n == 0) {
+		if (nerrs > 0)
+			exit(EXIT_ERROR);
+		errx(EXIT_ALREADY_UNLOCKED, "no inactive pivy-luks devices "
+		    "found in %s", tabpath);
+	}
+
+	fprintf(stderr, "Attempting to unlock %u devices...\n", n);
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	bzero(&lwq, sizeof (lwq));
+	VERIFY0(pthread_mutex_init(&lwq.lwq_mtx, NULL));
+	VERIFY0(pthread_cond_init(&lwq.lwq_cv, NULL));
+	VERIFY0(pthread_create(&thread, NULL, luks_activate_thread, &lwq));
+
+	eboxes = calloc(n, sizeof (struct ebox *));
+	VERIFY(eboxes != NULL);
+	for (lu = head, i = 0; lu != NULL; lu = lu->lu_next)
+		eboxes[i++] = lu->lu_ebox;
+	error = local_unlock_eboxes(eboxes, n, &nunlocked);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to unlock eboxes");
+	free(eboxes);
+
+	/*
+	 * Start activating everything we've unlocked so far, while we deal
+	 * with any stragglers that need the interactive path.
+	 */
+	for (lu = head; lu != NULL; lu = lu->lu_next) {
+		if (ebox_is_unlocked(lu->lu_ebox))
+			luks_workq_push(&lwq, lu);
+	}
+	for (lu = head; lu != NULL; lu = lu->lu_next) {
+		if (ebox_is_unlocked(lu->lu_ebox))
+			continue;
+		desclen = strlen(lu->lu_devname) + 128;
+		descr = calloc(1, desclen);
+		VERIFY(descr != NULL);
+		snprintf(descr, desclen, "LUKS device %s", lu->lu_devname);
+		fprintf(stderr, "Attempting to unlock device '%s'...\n",
+		    lu->lu_devname);
+		error = unlock_or_recover(lu->lu_ebox, descr,
+		    &lu->lu_recovered);
+		free(descr);
+		if (error) {
+			warnfx(error, "failed to unlock ebox for device '%s'",
+			    lu->lu_devname);
+			errf_free(error);
+			++nerrs;
+			continue;
+		}
+		luks_workq_push(&lwq, lu);
+	}
+
+	tunbox = luks_now_ms();
+
+	VERIFY0(pthread_mutex_lock(&lwq.lwq_mtx));
+	lwq.lwq_closed = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&lwq.lwq_cv));
+	VERIFY0(pthread_mutex_unlock(&lwq.lwq_mtx));
+	VERIFY0(pthread_join(thread, NULL));
+	VERIFY0(pthread_cond_destroy(&lwq.lwq_cv));
+	VERIFY0(pthread_mutex_destroy(&lwq.lwq_mtx));
+
+	tdone = luks_now_ms();
+
+	while ((lu = head) != NULL) {
+		head = lu->lu_next;
+		if (lu->lu_done && lu->lu_rc < 0) {
+			warnfx(lukserrf("crypt_activate_by_volume_key",
+			    lu->lu_rc), "failed to activate device '%s'",
+			    lu->lu_devname);
+			++nerrs;
+		} else if (lu->lu_done) {
+			++nactive;
+		}
+		if (lu->lu_done && lu->lu_rc >= 0 && lu->lu_recovered) {
+			fprintf(stderr, "Device '%s' was unlocked using a "
+			    "recovery config: you should use `pivy-luks "
+			    "unlock' or `pivy-luks rekey' on it to add a new "
+			    "primary token.\n", lu->lu_devname);
+		}
+		luks_unlock_free(lu);
+	}
+
+	fprintf(stderr, "Activated %u of %u devices in %llu ms (%u in "
+	    "per-token batches; unbox done at %llu ms)\n",
+	    nactive, n, (unsigned long long)(tdone - t0), nunlocked,
+	    (unsigned long long)(tunbox - t0));
+
+	if (nerrs > 0)
+		exit(EXIT_ERROR);
+}
+
 static void
 cmd_format(const char *devname)
 {
@@ -519,6 +975,7 @@ cmd_format(const char *devname)
 	json_object_object_add(obj, "type", json_object_new_string("ebox"));
 	json_object_object_add(obj, "keyslots", json_object_new_array());
 	json_object_object_add(obj, "ebox", json_object_new_string(b64));
+	luks_token_add_keyslot(cd, devname, obj, key, keylen);
 
 	rc = crypt_token_json_set(cd, 1, json_object_to_json_string(obj));
 	if (rc < 0) {
@@ -546,6 +1003,9 @@ usage(void)
 	    "\n"
 	    "Available operations:\n"
 	    "  unlock <device> <mapper name>         Unlock/activate a LUKS device\n"
+	    "  unlock-all [crypttab]                 Unlock/activate all LUKS devices\n"
+	    "                                        in crypttab (default\n"
+	    "                                        /etc/crypttab, - for stdin)\n"
 	    "  rekey <device>                        Update LUKS metadata to new template\n"
 	    "  format <device>                       Set up a new LUKS device\n");
 	fprintf(stderr, "\nTemplates are stored in:\n");
@@ -603,6 +1063,19 @@ main(int argc, char *argv[])
 		usage();
 	}
 	const char *op = argv[optind++];
+
+	if (strcmp(op, "unlock-all") == 0) {
+		const char *tabpath = "/etc/crypttab";
+		if (optind < argc)
+			tabpath = argv[optind++];
+		if (optind < argc) {
+			warnx("too many arguments");
+			usage();
+		}
+		cmd_unlock_all(tabpath);
+		return (0);
+	}
+
 	if (optind >= argc) {
 		warnx("device required");
 		usage();
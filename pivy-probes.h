@@ -0,0 +1,87 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2026 The pivy Authors
+ */
+
+#if !defined(_PIVY_PROBES_H)
+#define	_PIVY_PROBES_H
+
+/*
+ * Static tracing probes (USDT) in the "pivy" provider. See pivy.d for the
+ * list of probes and their arguments.
+ *
+ * These are only compiled in when built with -DPIVY_USDT (the USE_USDT=yes
+ * make option). On Linux they use the systemtap <sys/sdt.h>, which places a
+ * single nop at each probe site and records it in an ELF note for bpftrace,
+ * perf and friends to find. Otherwise the macros expand to nothing and their
+ * arguments are never evaluated.
+ *
+ * On illumos each probe is a call to an undefined __dtrace_pivy___<name>()
+ * function, the same way the DTRACE_PROBEn macros in <sys/sdt.h> do it.
+ * "dtrace -G -s pivy.d" at link time turns the calls into nops and emits
+ * the provider's DOF; see the Makefile.
+ */
+#if defined(PIVY_USDT) && defined(__sun)
+
+#include <stdint.h>
+
+#define	PIVY_PROBE0(name)	do {					\
+	extern void __dtrace_pivy___##name(void);			\
+	__dtrace_pivy___##name();					\
+} while (0)
+#define	PIVY_PROBE1(name, a1)	do {					\
+	extern void __dtrace_pivy___##name(uintptr_t);			\
+	__dtrace_pivy___##name((uintptr_t)(a1));			\
+} while (0)
+#define	PIVY_PROBE2(name, a1, a2)	do {				\
+	extern void __dtrace_pivy___##name(uintptr_t, uintptr_t);	\
+	__dtrace_pivy___##name((uintptr_t)(a1), (uintptr_t)(a2));	\
+} while (0)
+#define	PIVY_PROBE3(name, a1, a2, a3)	do {				\
+	extern void __dtrace_pivy___##name(uintptr_t, uintptr_t,	\
+	    uintptr_t);							\
+	__dtrace_pivy___##name((uintptr_t)(a1), (uintptr_t)(a2),	\
+	    (uintptr_t)(a3));						\
+} while (0)
+#define	PIVY_PROBE4(name, a1, a2, a3, a4)	do {			\
+	extern void __dtrace_pivy___##name(uintptr_t, uintptr_t,	\
+	    uintptr_t, uintptr_t);					\
+	__dtrace_pivy___##name((uintptr_t)(a1), (uintptr_t)(a2),	\
+	    (uintptr_t)(a3), (uintptr_t)(a4));				\
+} while (0)
+#define	PIVY_PROBE5(name, a1, a2, a3, a4, a5)	do {			\
+	extern void __dtrace_pivy___##name(uintptr_t, uintptr_t,	\
+	    uintptr_t, uintptr_t, uintptr_t);				\
+	__dtrace_pivy___##name((uintptr_t)(a1), (uintptr_t)(a2),	\
+	    (uintptr_t)(a3), (uintptr_t)(a4), (uintptr_t)(a5));		\
+} while (0)
+
+#elif defined(PIVY_USDT)
+
+#include <sys/sdt.h>
+
+#define	PIVY_PROBE0(name)	DTRACE_PROBE(pivy, name)
+#define	PIVY_PROBE1(name, a1)	DTRACE_PROBE1(pivy, name, a1)
+#define	PIVY_PROBE2(name, a1, a2)	DTRACE_PROBE2(pivy, name, a1, a2)
+#define	PIVY_PROBE3(name, a1, a2, a3)	\
+	DTRACE_PROBE3(pivy, name, a1, a2, a3)
+#define	PIVY_PROBE4(name, a1, a2, a3, a4)	\
+	DTRACE_PROBE4(pivy, name, a1, a2, a3, a4)
+#define	PIVY_PROBE5(name, a1, a2, a3, a4, a5)	\
+	DTRACE_PROBE5(pivy, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define	PIVY_PROBE0(name)
+#define	PIVY_PROBE1(name, a1)
+#define	PIVY_PROBE2(name, a1, a2)
+#define	PIVY_PROBE3(name, a1, a2, a3)
+#define	PIVY_PROBE4(name, a1, a2, a3, a4)
+#define	PIVY_PROBE5(name, a1, a2, a3, a4, a5)
+
+#endif
+
+#endif	/* _PIVY_PROBES_H */
@@ -22,6 +22,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "debug.h"
 
@@ -35,6 +36,9 @@
 
 #include <sys/types.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #if defined(__sun)
 #include <sys/fork.h>
 #endif
@@ -45,6 +49,7 @@
 #include "openssh/sshbuf.h"
 #include "openssh/digest.h"
 #include "openssh/ssherr.h"
+#include "openssh/authfd.h"
 
 #include <openssl/err.h>
 #include <openssl/x509.h>
@@ -74,6 +79,7 @@ static boolean_t parseable = B_FALSE;
 static boolean_t json = B_FALSE;
 static boolean_t enum_all_retired = B_FALSE;
 static boolean_t save_pinfo_admin = B_TRUE;
+static uint cert_comp = PIV_COMP_NONE;
 static uint8_t *guid = NULL;
 static size_t guid_len = 0;
 static uint min_retries = 1;
@@ -1400,7 +1406,7 @@ signagain:
 	}
 	cdlen = (size_t)rv;
 
-	flags = PIV_COMP_NONE;
+	flags = cert_comp;
 	err = piv_write_cert(selk, slotid, cdata, cdlen, flags);
 
 	if (err == ERRF_OK &&
@@ -1851,7 +1857,7 @@ admin_again:
 	}
 
 	if (err == ERRF_OK)
-		err = piv_write_cert(selk, slotid, cbuf, clen, PIV_COMP_NONE);
+		err = piv_write_cert(selk, slotid, cbuf, clen, cert_comp);
 
 	if (err == ERRF_OK && slotid >= 0x82 && slotid <= 0x95 &&
 	    piv_token_keyhistory_oncard(selk) <= slotid - 0x82) {
@@ -2071,13 +2077,175 @@ signagain:
 	return (NULL);
 }
 
+/*
+ * Inputs of up to this size (the old limit on "sign") are also kept whole, so
+ * that cards which can only hash-on-card (where piv_sign_digest() fails) can
+ * still sign them with piv_sign().
+ */
+#define	SIGN_INLINE_MAX		16384
+#define	SIGN_READ_CHUNK		65536
+
+struct sign_input {
+	const char		*si_name;	/* NULL for stdin */
+	uint8_t			 si_digest[SSH_DIGEST_MAX_LENGTH];
+	size_t			 si_dglen;
+	uint8_t			*si_data;
+	size_t			 si_datalen;
+	boolean_t		 si_toobig;
+	uint8_t			*si_sig;
+	size_t			 si_siglen;
+};
+
+static void
+sign_input_keep(struct sign_input *si, const uint8_t *data, size_t len)
+{
+	uint8_t *ndata;
+
+	if (si->si_toobig || len == 0)
+		return;
+	if (si->si_datalen + len > SIGN_INLINE_MAX) {
+		free(si->si_data);
+		si->si_data = NULL;
+		si->si_datalen = 0;
+		si->si_toobig = B_TRUE;
+		return;
+	}
+	ndata = realloc(si->si_data, si->si_datalen + len);
+	VERIFY(ndata != NULL);
+	bcopy(data, ndata + si->si_datalen, len);
+	si->si_data = ndata;
+	si->si_datalen += len;
+}
+
+/*
+ * Hashes everything readable from fd. Regular files are mmap'd and hashed in
+ * one go, anything else (or a file we can't map) is read in chunks.
+ */
+static errf_t *
+sign_hash_fd(int fd, enum sshdigest_types hashalg, struct sign_input *si)
+{
+	struct ssh_digest_ctx *hctx;
+	struct stat st;
+	uint8_t *map, *buf = NULL;
+	size_t maplen;
+	ssize_t n;
+	int rc;
+	errf_t *err = ERRF_OK;
+
+	hctx = ssh_digest_start(hashalg);
+	VERIFY(hctx != NULL);
+	si->si_dglen = ssh_digest_bytes(hashalg);
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size <= SIZE_MAX) {
+		maplen = (size_t)st.st_size;
+		map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			(void) posix_madvise(map, maplen,
+			    POSIX_MADV_SEQUENTIAL);
+			rc = ssh_digest_update(hctx, map, maplen);
+			if (rc == 0)
+				sign_input_keep(si, map, maplen);
+			VERIFY0(munmap(map, maplen));
+			if (rc != 0) {
+				err = ssherrf("ssh_digest_update", rc);
+				goto out;
+			}
+			goto final;
+		}
+	}
+
+	buf = malloc(SIGN_READ_CHUNK);
+	VERIFY(buf != NULL);
+	while (1) {
+		n = read(fd, buf, SIGN_READ_CHUNK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			err = errfno("read", errno, NULL);
+			goto out;
+		}
+		if (n == 0)
+			break;
+		if ((rc = ssh_digest_update(hctx, buf, n))) {
+			err = ssherrf("ssh_digest_update", rc);
+			goto out;
+		}
+		sign_input_keep(si, buf, n);
+	}
+
+final:
+	if ((rc = ssh_digest_final(hctx, si->si_digest, si->si_dglen)))
+		err = ssherrf("ssh_digest_final", rc);
+out:
+	ssh_digest_free(hctx);
+	free(buf);
+	return (err);
+}
+
 static errf_t *
-cmd_sign(uint slotid)
+sign_one(struct piv_slot *cert, enum sshdigest_types hashalg,
+    struct sign_input *si)
+{
+	enum sshdigest_types cardhashalg = 0;
+	errf_t *err;
+
+	err = piv_sign_digest(selk, cert, hashalg, si->si_digest,
+	    si->si_dglen, &si->si_sig, &si->si_siglen);
+	if (errf_caused_by(err, "NotSupportedError") && !si->si_toobig) {
+		errf_free(err);
+		err = piv_sign(selk, cert, si->si_data, si->si_datalen,
+		    &cardhashalg, &si->si_sig, &si->si_siglen);
+	}
+	return (err);
+}
+
+static errf_t *
+sign_write_sig(const struct sign_input *si)
+{
+	char *path;
+	size_t len;
+	FILE *f;
+	errf_t *err = ERRF_OK;
+
+	len = strlen(si->si_name) + sizeof (".sig");
+	path = malloc(len);
+	if (path == NULL)
+		return (ERRF_NOMEM);
+	snprintf(path, len, "%s.sig", si->si_name);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		err = errf("WriteError", errfno("fopen", errno, NULL),
+		    "failed to open '%s' for writing", path);
+		free(path);
+		return (err);
+	}
+	if (fwrite(si->si_sig, 1, si->si_siglen, f) != si->si_siglen) {
+		err = errf("WriteError", errfno("fwrite", errno, NULL),
+		    "failed to write '%s'", path);
+	}
+	if (fclose(f) != 0 && err == ERRF_OK) {
+		err = errf("WriteError", errfno("fclose", errno, NULL),
+		    "failed to write '%s'", path);
+	}
+	free(path);
+	return (err);
+}
+
+/*
+ * Signs data on stdin (writing the signature to stdout), or each of "files"
+ * (writing the signature for each to "<file>.sig"). Everything is hashed on
+ * the host first, as a stream, so inputs can be any size, and then all of the
+ * digests are signed by the card in a single transaction.
+ */
+static errf_t *
+cmd_sign(uint slotid, int nfiles, char **files)
 {
 	struct piv_slot *cert;
-	uint8_t *buf, *sig;
+	struct sign_input *inputs, *si;
 	enum sshdigest_types hashalg;
-	size_t inplen, siglen;
+	uint ninputs, i;
+	int fd;
 	errf_t *err = ERRF_OK;
 
 	assert_slotid(slotid);
@@ -2100,31 +2268,80 @@ cmd_sign(uint slotid)
 		return (err);
 	}
 
-	buf = read_stdin(16384, &inplen);
-	assert(buf != NULL);
+	/* The same defaults that piv_sign() picks. */
+	if (piv_slot_alg(cert) == PIV_ALG_ECCP384)
+		hashalg = SSH_DIGEST_SHA384;
+	else
+		hashalg = SSH_DIGEST_SHA256;
+
+	ninputs = (nfiles > 0) ? nfiles : 1;
+	inputs = calloc(ninputs, sizeof (struct sign_input));
+	VERIFY(inputs != NULL);
+
+	for (i = 0; i < ninputs; ++i) {
+		si = &inputs[i];
+		if (nfiles == 0) {
+			err = sign_hash_fd(STDIN_FILENO, hashalg, si);
+			if (err)
+				err = funcerrf(err, "failed to read stdin");
+		} else {
+			si->si_name = files[i];
+			fd = open(si->si_name, O_RDONLY);
+			if (fd == -1) {
+				err = funcerrf(errfno("open", errno, NULL),
+				    "failed to open '%s'", si->si_name);
+				goto out;
+			}
+			err = sign_hash_fd(fd, hashalg, si);
+			(void) close(fd);
+			if (err) {
+				err = funcerrf(err, "failed to read '%s'",
+				    si->si_name);
+			}
+		}
+		if (err)
+			goto out;
+	}
 
 	if ((err = piv_txn_begin(selk)))
-		return (err);
+		goto out;
 	assert_select(selk);
 	assert_pin(selk, cert, B_FALSE);
+	for (i = 0; i < ninputs; ++i) {
+		si = &inputs[i];
 again:
-	hashalg = 0;
-	err = piv_sign(selk, cert, buf, inplen, &hashalg, &sig, &siglen);
-	if (errf_caused_by(err, "PermissionError")) {
-		assert_pin(selk, cert, B_TRUE);
-		goto again;
+		err = sign_one(cert, hashalg, si);
+		if (errf_caused_by(err, "PermissionError")) {
+			errf_free(err);
+			assert_pin(selk, cert, B_TRUE);
+			goto again;
+		}
+		if (err)
+			break;
 	}
 	piv_txn_end(selk);
 	if (err) {
-		err = funcerrf(err, "failed to sign data");
-		return (err);
+		err = funcerrf(err, "failed to sign %s",
+		    (si->si_name == NULL) ? "data" : si->si_name);
+		goto out;
 	}
 
-	fwrite(sig, 1, siglen, stdout);
-	free(sig);
-	free(buf);
+	if (nfiles == 0) {
+		fwrite(inputs[0].si_sig, 1, inputs[0].si_siglen, stdout);
+		goto out;
+	}
+	for (i = 0; i < ninputs; ++i) {
+		if ((err = sign_write_sig(&inputs[i])))
+			goto out;
+	}
 
-	return (ERRF_OK);
+out:
+	for (i = 0; i < ninputs; ++i) {
+		free(inputs[i].si_data);
+		free(inputs[i].si_sig);
+	}
+	free(inputs);
+	return (err);
 }
 
 static errf_t *
@@ -2365,6 +2582,457 @@ cmd_box_info(void)
 	return (ERRF_OK);
 }
 
+/*
+ * Measures how quickly the agent can take new connections: each iteration
+ * connects, lists identities and disconnects, like a short-lived client.
+ */
+static errf_t *
+cmd_agent_bench(uint n)
+{
+	struct ssh_identitylist *idl;
+	struct timespec t0, t1, t2;
+	double d, total, worst = 0;
+	uint i;
+	int fd, rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if ((rc = ssh_get_authentication_socket(&fd)) != 0) {
+			return (ssherrf("ssh_get_authentication_socket",
+			    rc));
+		}
+		rc = ssh_fetch_identitylist(fd, &idl);
+		close(fd);
+		if (rc != 0)
+			return (ssherrf("ssh_fetch_identitylist", rc));
+		ssh_free_identitylist(idl);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		d = (t2.tv_sec - t1.tv_sec) * 1000.0 +
+		    (t2.tv_nsec - t1.tv_nsec) / 1000000.0;
+		if (d > worst)
+			worst = d;
+	}
+	total = (t2.tv_sec - t0.tv_sec) * 1000.0 +
+	    (t2.tv_nsec - t0.tv_nsec) / 1000000.0;
+
+	fprintf(stderr, "%u connections in %.1f ms\n", n, total);
+	fprintf(stderr, "connections/sec = %.0f\n", n / (total / 1000.0));
+	fprintf(stderr, "time per connection = %.3f ms (max %.3f ms)\n",
+	    total / n, worst);
+
+	return (ERRF_OK);
+}
+
+/*
+ * Times n rounds of (begin txn, SELECT, read CHUID, end txn) on the selected
+ * card. This is dominated by the card, so it's most useful against a
+ * software/virtual card when looking at our own per-operation overhead.
+ *
+ * With "cert" set, reads and parses the certificate in "slotid" instead of
+ * the CHUID (e.g. to compare certs written with and without -z).
+ */
+static errf_t *
+cmd_apdu_bench(uint n, boolean_t cert, enum piv_slotid slotid)
+{
+	struct timespec t0, t1, t2;
+	double d, total, worst = 0;
+	uint8_t *data;
+	size_t len;
+	uint64_t alloc0, reuse0, alloc1, allocs, reused, steady = 0;
+	uint i;
+	errf_t *err;
+
+	piv_token_apdu_stats(selk, &alloc0, &reuse0);
+	allocs = alloc0;
+	reused = reuse0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; ++i) {
+		piv_token_apdu_stats(selk, &alloc1, &reused);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if ((err = piv_txn_begin(selk)))
+			return (err);
+		if ((err = piv_select(selk))) {
+			piv_txn_end(selk);
+			return (err);
+		}
+		if (cert) {
+			err = piv_read_cert(selk, slotid);
+		} else {
+			err = piv_read_file(selk, PIV_TAG_CHUID, &data, &len);
+			if (err == ERRF_OK)
+				piv_file_data_free(data, len);
+		}
+		piv_txn_end(selk);
+		if (err)
+			return (err);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		d = (t2.tv_sec - t1.tv_sec) * 1000.0 +
+		    (t2.tv_nsec - t1.tv_nsec) / 1000000.0;
+		if (d > worst)
+			worst = d;
+
+		/* The first round warms up the free list. */
+		piv_token_apdu_stats(selk, &allocs, &reused);
+		if (i > 0)
+			steady += allocs - alloc1;
+	}
+	total = (t2.tv_sec - t0.tv_sec) * 1000.0 +
+	    (t2.tv_nsec - t0.tv_nsec) / 1000000.0;
+
+	fprintf(stderr, "%u rounds in %.1f ms\n", n, total);
+	fprintf(stderr, "rounds/sec = %.0f\n", n / (total / 1000.0));
+	fprintf(stderr, "time per round = %.3f ms (max %.3f ms)\n",
+	    total / n, worst);
+	fprintf(stderr, "apdu buffers allocated = %" PRIu64 " (%" PRIu64
+	    " after the first round), reused = %" PRIu64 "\n",
+	    allocs - alloc0, steady, reused - reuse0);
+	if (n > 1) {
+		fprintf(stderr, "apdu allocations per round = %.2f "
+		    "(steady state)\n", (double)steady / (n - 1));
+	}
+
+	return (ERRF_OK);
+}
+
+struct thread_bench_arg {
+	pthread_t		 tba_thread;
+	uint			 tba_id;
+	struct piv_token	*tba_tk;
+	boolean_t		 tba_own_ctx;
+	uint			 tba_rounds;
+	uint			 tba_done;
+	double			 tba_worst;
+	errf_t			*tba_err;
+};
+
+/*
+ * One thread of "thread-bench": repeated SELECT + read CHUID transactions on
+ * its token, checking each time that it got the same CHUID back and that the
+ * card session hasn't changed under it (which would mean another thread's
+ * commands were interleaved with ours).
+ *
+ * With tba_own_ctx, the thread opens its own piv_ctx and finds its own handle
+ * on the token (by GUID), rather than sharing ours.
+ */
+static void *
+thread_bench_worker(void *arg)
+{
+	struct thread_bench_arg *tba = arg;
+	struct piv_token *tk = tba->tba_tk;
+	struct piv_ctx *ctx = NULL;
+	struct piv_card_state *st0 = NULL, *st = NULL;
+	struct timespec t1, t2;
+	uint8_t *data, *first = NULL;
+	size_t len, firstlen = 0;
+	double d;
+	errf_t *err = ERRF_OK;
+	uint i = 0;
+
+	if (tba->tba_own_ctx) {
+		ctx = piv_open();
+		if (ctx == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		if ((err = piv_establish_context(ctx, SCARD_SCOPE_SYSTEM)))
+			goto out;
+		err = piv_find(ctx, piv_token_guid(tba->tba_tk), GUID_LEN,
+		    &tk);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < tba->tba_rounds; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if ((err = piv_txn_begin(tk)))
+			break;
+		data = NULL;
+		err = piv_select(tk);
+		if (err == ERRF_OK)
+			err = piv_read_file(tk, PIV_TAG_CHUID, &data, &len);
+		if (err == ERRF_OK)
+			err = piv_token_card_state(tk, &st);
+		piv_txn_end(tk);
+		if (err) {
+			if (data != NULL)
+				piv_file_data_free(data, len);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		d = (t2.tv_sec - t1.tv_sec) * 1000.0 +
+		    (t2.tv_nsec - t1.tv_nsec) / 1000000.0;
+		if (d > tba->tba_worst)
+			tba->tba_worst = d;
+
+		bunyan_log(BNY_TRACE, "thread-bench round done",
+		    "thread", BNY_UINT, tba->tba_id,
+		    "round", BNY_UINT, i, NULL);
+
+		if (first == NULL) {
+			first = data;
+			firstlen = len;
+			st0 = st;
+			st = NULL;
+			continue;
+		}
+		if (len != firstlen || bcmp(data, first, len) != 0) {
+			err = errf("ThreadBenchError", NULL, "thread %u read "
+			    "a different CHUID in round %u", tba->tba_id, i);
+		} else if (!piv_card_state_equal(st0, st)) {
+			err = errf("ThreadBenchError", NULL, "thread %u saw "
+			    "the card session change in round %u",
+			    tba->tba_id, i);
+		}
+		piv_file_data_free(data, len);
+		piv_card_state_free(st);
+		st = NULL;
+		if (err)
+			break;
+	}
+
+	if (first != NULL)
+		piv_file_data_free(first, firstlen);
+	piv_card_state_free(st0);
+out:
+	/* piv_close() releases the token we found, too. */
+	piv_close(ctx);
+	tba->tba_done = i;
+	tba->tba_err = err;
+	return (NULL);
+}
+
+/*
+ * Stress test for the libpivy threading model: "nthreads" threads share our
+ * piv_ctx and the tokens in "tks", with thread i using token i % ntokens. With
+ * more threads than tokens, threads also contend for each token's lock.
+ *
+ * With "own_ctx", each thread uses its own piv_ctx instead (the way to get
+ * parallelism out of pcsclite), so threads on the same token contend in the
+ * PC/SC daemon rather than on our lock.
+ */
+static errf_t *
+cmd_thread_bench(struct piv_token *tks, uint nthreads, uint n,
+    boolean_t own_ctx)
+{
+	struct thread_bench_arg *tbas;
+	struct piv_token *tk;
+	struct timespec t0, t1;
+	double total, worst = 0;
+	uint i, ntoks = 0, done = 0, nfailed = 0;
+	errf_t *err = ERRF_OK;
+
+	for (tk = tks; tk != NULL; tk = piv_token_next(tk))
+		++ntoks;
+	VERIFY(ntoks > 0);
+
+	tbas = calloc(nthreads, sizeof (struct thread_bench_arg));
+	if (tbas == NULL)
+		return (ERRF_NOMEM);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0, tk = tks; i < nthreads; ++i) {
+		tbas[i].tba_id = i;
+		tbas[i].tba_tk = tk;
+		tbas[i].tba_own_ctx = own_ctx;
+		tbas[i].tba_rounds = n;
+		VERIFY0(pthread_create(&tbas[i].tba_thread, NULL,
+		    thread_bench_worker, &tbas[i]));
+		if ((tk = piv_token_next(tk)) == NULL)
+			tk = tks;
+	}
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(tbas[i].tba_thread, NULL));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	total = (t1.tv_sec - t0.tv_sec) * 1000.0 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+
+	for (i = 0; i < nthreads; ++i) {
+		done += tbas[i].tba_done;
+		if (tbas[i].tba_worst > worst)
+			worst = tbas[i].tba_worst;
+		if (tbas[i].tba_err == ERRF_OK)
+			continue;
+		warnfx(tbas[i].tba_err, "thread %u failed after %u rounds",
+		    i, tbas[i].tba_done);
+		if (nfailed++ == 0)
+			err = tbas[i].tba_err;
+		else
+			errf_free(tbas[i].tba_err);
+	}
+	if (nfailed > 0) {
+		err = errf("ThreadBenchError", err, "%u of %u threads failed",
+		    nfailed, nthreads);
+	}
+
+	fprintf(stderr, "%u threads on %u tokens (%s), %u rounds in "
+	    "%.1f ms\n", nthreads, ntoks, own_ctx ? "a context each" :
+	    "shared context", done, total);
+	fprintf(stderr, "rounds/sec = %.0f\n", done / (total / 1000.0));
+	fprintf(stderr, "max time per round = %.3f ms\n", worst);
+
+	free(tbas);
+	return (err);
+}
+
+/*
+ * Returns an upper bound (in us) on the p'th percentile of a pivy-agent
+ * latency histogram, where bucket i covers [2^i, 2^(i+1)) us.
+ */
+static uint64_t
+stat_hist_pct(const uint64_t *buckets, uint nbuckets, uint64_t count,
+    uint64_t max, double p)
+{
+	uint64_t want, seen = 0, bound;
+	uint i;
+
+	if (count == 0)
+		return (0);
+	want = (uint64_t)(count * p + 0.5);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < nbuckets; ++i) {
+		seen += buckets[i];
+		if (seen >= want)
+			break;
+	}
+	bound = (i >= 63) ? UINT64_MAX : (2ULL << i);
+	return ((bound < max) ? bound : max);
+}
+
+static errf_t *
+print_agent_stat_hists(struct sshbuf *reply, const char *title)
+{
+	uint32_t n, nbuckets, i, j;
+	uint64_t count, fail, total, max;
+	uint64_t *buckets = NULL;
+	char *name = NULL;
+	int rc;
+
+	if ((rc = sshbuf_get_u32(reply, &n)))
+		return (ssherrf("sshbuf_get_u32", rc));
+
+	printf("\n%-28s %8s %6s %9s %9s %9s %9s %9s\n", title, "COUNT",
+	    "FAIL", "MEAN(ms)", "P50(ms)", "P90(ms)", "P99(ms)", "MAX(ms)");
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u64(reply, &count)) ||
+		    (rc = sshbuf_get_u64(reply, &fail)) ||
+		    (rc = sshbuf_get_u64(reply, &total)) ||
+		    (rc = sshbuf_get_u64(reply, &max)) ||
+		    (rc = sshbuf_get_u32(reply, &nbuckets)))
+			goto out;
+		if (nbuckets > 64) {
+			free(name);
+			return (errf("SSHAgentError", NULL, "too many "
+			    "histogram buckets in agent stats (%u)", nbuckets));
+		}
+		buckets = calloc(nbuckets, sizeof (uint64_t));
+		if (buckets == NULL) {
+			free(name);
+			return (ERRF_NOMEM);
+		}
+		for (j = 0; j < nbuckets; ++j) {
+			if ((rc = sshbuf_get_u64(reply, &buckets[j])))
+				goto out;
+		}
+		printf("%-28s %8llu %6llu %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+		    name, (unsigned long long)count, (unsigned long long)fail,
+		    (count == 0) ? 0.0 : total / 1000.0 / count,
+		    stat_hist_pct(buckets, nbuckets, count, max, 0.5) / 1000.0,
+		    stat_hist_pct(buckets, nbuckets, count, max, 0.9) / 1000.0,
+		    stat_hist_pct(buckets, nbuckets, count, max, 0.99) / 1000.0,
+		    max / 1000.0);
+		free(name);
+		name = NULL;
+		free(buckets);
+		buckets = NULL;
+	}
+	return (ERRF_OK);
+
+out:
+	free(name);
+	free(buckets);
+	return (ssherrf("sshbuf_get", rc));
+}
+
+/*
+ * Fetches and prints request statistics from pivy-agent (through the
+ * stats@arekinath.github.io extension). Percentiles are upper bounds, since
+ * the agent only keeps power-of-two histogram buckets.
+ */
+static errf_t *
+cmd_agent_stats(void)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	errf_t *err = NULL;
+	uint64_t uptime, val;
+	uint32_t n, i;
+	uint8_t code;
+	char *name;
+	int fd = -1, rc;
+
+	if ((rc = ssh_get_authentication_socket(&fd)) != 0)
+		return (ssherrf("ssh_get_authentication_socket", rc));
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	if (req == NULL || reply == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((rc = sshbuf_put_u8(req, SSH_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "stats@arekinath.github.io"))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	if ((rc = ssh_request_reply(fd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "agent does not support "
+		    "the stats extension (is it pivy-agent?)");
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_u64(reply, &uptime)) ||
+	    (rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto out;
+	}
+	printf("%-28s %llu s\n", "uptime",
+	    (unsigned long long)(uptime / 1000));
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u64(reply, &val))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		printf("%-28s %llu\n", name, (unsigned long long)val);
+		free(name);
+	}
+
+	if ((err = print_agent_stat_hists(reply, "MESSAGE TYPE")))
+		goto out;
+	if ((err = print_agent_stat_hists(reply, "PHASE")))
+		goto out;
+
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	close(fd);
+	return (err);
+}
+
 static errf_t *
 cmd_bench(uint slotid)
 {
@@ -2851,7 +3519,8 @@ usage(void)
 	    "  update-keyhist         Scan all retired key slots and then\n"
 	    "                         re-generate the PIV Key History object\n"
 	    "\n"
-	    "  sign <slot>            Signs data on stdin\n"
+	    "  sign <slot> [file...]  Signs data on stdin, or each file\n"
+	    "                         (writing <file>.sig)\n"
 	    "  ecdh <slot>            Do ECDH with pubkey on stdin\n"
 	    "  auth <slot>            Does a round-trip signature test to\n"
 	    "                         verify that the pubkey on stdin\n"
@@ -2864,6 +3533,21 @@ usage(void)
 	    "                         Chooses token and slot automatically\n"
 	    "  box-info               Prints metadata about a box from stdin\n"
 	    "\n"
+	    "  apdu-bench [count]     Benchmark SELECT + read CHUID rounds\n"
+	    "                         on the card\n"
+	    "  cert-bench <slot> [count]\n"
+	    "                         Benchmark SELECT + read cert rounds\n"
+	    "  thread-bench [threads] [count] [shared|own]\n"
+	    "                         Run apdu-bench rounds from several\n"
+	    "                         threads at once, sharing the tokens\n"
+	    "                         (all of them, unless -g is given).\n"
+	    "                         With 'own', each thread opens its own\n"
+	    "                         PC/SC context and token handle\n"
+	    "  agent-bench [count]    Benchmark connections to the ssh-agent\n"
+	    "                         in SSH_AUTH_SOCK (e.g. pivy-agent)\n"
+	    "  agent-stats            Print request counters and latency\n"
+	    "                         percentiles from pivy-agent\n"
+	    "\n"
 	    "General options:\n"
 	    "  -g <hex>               GUID of the PIV token to use\n"
 	    "                         (Required if >1 token on system)\n"
@@ -2887,6 +3571,11 @@ usage(void)
 	    "  -p                     Generate parseable output\n"
 	    "  -j                     Generate JSON output\n"
 	    "\n"
+	    "Options for 'generate'/'write-cert':\n"
+	    "  -z                     Store the certificate gzip-compressed\n"
+	    "                         if it's over 1k and that makes it\n"
+	    "                         smaller (fewer round trips to read)\n"
+	    "\n"
 	    "Options for 'generate'/'req-cert':\n"
 	    "  -a <algo>              Choose algorithm of new key\n"
 	    "                         EC algos: eccp256, eccp384\n"
@@ -2918,7 +3607,7 @@ usage(void)
 	exit(EXIT_BAD_ARGS);
 }
 
-const char *optstring = "djpg:P:a:fK:k:n:t:i:u:RXA:N:r:D:T:";
+const char *optstring = "djpg:P:a:fK:k:n:t:i:u:RXzA:N:r:D:T:";
 
 int
 main(int argc, char *argv[])
@@ -2972,6 +3661,9 @@ main(int argc, char *argv[])
 		case 'X':
 			enum_all_retired = B_TRUE;
 			break;
+		case 'z':
+			cert_comp = PIV_CI_COMPAUTO;
+			break;
 		case 'A':
 			err = piv_alg_from_string(optarg, &key_alg);
 			if (err != ERRF_OK)
@@ -3219,15 +3911,10 @@ main(int argc, char *argv[])
 		if (err != ERRF_OK)
 			errfx(EXIT_BAD_ARGS, err, "failed to parse slot id");
 
-		if (optind < argc) {
-			warnx("too many arguments for %s", op);
-			usage();
-		}
-
 		check_select_key();
 		if (hasover)
 			override = piv_force_slot(selk, slotid, overalg);
-		err = cmd_sign(slotid);
+		err = cmd_sign(slotid, argc - optind, &argv[optind]);
 
 	} else if (strcmp(op, "bench") == 0) {
 		enum piv_slotid slotid;
@@ -3531,6 +4218,127 @@ main(int argc, char *argv[])
 			override = piv_force_slot(selk, slotid, overalg);
 		err = cmd_req_cert(slotid);
 
+	} else if (strcmp(op, "apdu-bench") == 0) {
+		unsigned long int parsed = 1000;
+
+		if (optind < argc) {
+			errno = 0;
+			parsed = strtoul(argv[optind++], &ptr, 0);
+			if (errno != 0 || *ptr != '\0' || parsed < 1 ||
+			    parsed > UINT_MAX) {
+				warnx("invalid count for %s", op);
+				usage();
+			}
+		}
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		check_select_key();
+		err = cmd_apdu_bench(parsed, B_FALSE, 0);
+
+	} else if (strcmp(op, "cert-bench") == 0) {
+		unsigned long int parsed = 1000;
+		enum piv_slotid slotid;
+
+		if (optind >= argc) {
+			warnx("not enough arguments for %s (slot required)",
+			    op);
+			usage();
+		}
+		err = piv_slotid_from_string(argv[optind++], &slotid);
+		if (err != ERRF_OK)
+			errfx(EXIT_BAD_ARGS, err, "failed to parse slot id");
+		if (optind < argc) {
+			errno = 0;
+			parsed = strtoul(argv[optind++], &ptr, 0);
+			if (errno != 0 || *ptr != '\0' || parsed < 1 ||
+			    parsed > UINT_MAX) {
+				warnx("invalid count for %s", op);
+				usage();
+			}
+		}
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		check_select_key();
+		err = cmd_apdu_bench(parsed, B_TRUE, slotid);
+
+	} else if (strcmp(op, "thread-bench") == 0) {
+		unsigned long int parsed = 100, nthreads = 4;
+		boolean_t own_ctx = B_FALSE;
+
+		if (optind < argc) {
+			errno = 0;
+			nthreads = strtoul(argv[optind++], &ptr, 0);
+			if (errno != 0 || *ptr != '\0' || nthreads < 1 ||
+			    nthreads > 1024) {
+				warnx("invalid thread count for %s", op);
+				usage();
+			}
+		}
+		if (optind < argc) {
+			errno = 0;
+			parsed = strtoul(argv[optind++], &ptr, 0);
+			if (errno != 0 || *ptr != '\0' || parsed < 1 ||
+			    parsed > UINT_MAX) {
+				warnx("invalid count for %s", op);
+				usage();
+			}
+		}
+		if (optind < argc) {
+			if (strcmp(argv[optind], "own") == 0) {
+				own_ctx = B_TRUE;
+			} else if (strcmp(argv[optind], "shared") != 0) {
+				warnx("invalid context mode for %s: '%s'", op,
+				    argv[optind]);
+				usage();
+			}
+			++optind;
+		}
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		if (guid_len == 0) {
+			err = piv_enumerate(piv_ctx, &ks);
+			if (err) {
+				errfx(EXIT_IO_ERROR, err,
+				    "failed to enumerate PIV tokens");
+			}
+			if (ks == NULL)
+				errx(EXIT_NO_CARD, "no PIV cards/tokens found");
+		} else {
+			check_select_key();
+		}
+		err = cmd_thread_bench(ks, nthreads, parsed, own_ctx);
+
+	} else if (strcmp(op, "agent-bench") == 0) {
+		unsigned long int parsed = 1000;
+
+		if (optind < argc) {
+			errno = 0;
+			parsed = strtoul(argv[optind++], &ptr, 0);
+			if (errno != 0 || *ptr != '\0' || parsed < 1 ||
+			    parsed > UINT_MAX) {
+				warnx("invalid count for %s", op);
+				usage();
+			}
+		}
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_agent_bench(parsed);
+
+	} else if (strcmp(op, "agent-stats") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_agent_stats();
+
 	} else if (strcmp(op, "version") == 0) {
 		fprintf(stdout, "%s\n", PIVY_VERSION);
 
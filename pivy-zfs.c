@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "debug.h"
 
@@ -412,6 +413,345 @@ done:
 	zfs_close(ds);
 }
 
+/*
+ * State for "unlock -r" and "unlock-all", which unlock every encrypted
+ * dataset under a root in one go, rather than paying for a full token
+ * lookup and PIN verify per dataset.
+ */
+#define	UNLOCK_LOAD_THREADS	8
+
+struct zfs_unlock {
+	struct zfs_unlock	*zu_next;
+	zfs_handle_t		*zu_ds;
+	char			*zu_fsname;
+	char			*zu_b64;
+	const char		*zu_propname;
+	struct ebox		*zu_ebox;
+	boolean_t		 zu_recovered;
+	int			 zu_rc;
+};
+
+struct zfs_unlock_set {
+	struct zfs_unlock	*zus_head;
+	struct zfs_unlock	*zus_tail;
+	uint			 zus_n;
+	uint			 zus_nerrs;
+};
+
+struct zfs_load_state {
+	pthread_mutex_t		 zls_mtx;
+	struct zfs_unlock	*zls_next;
+};
+
+static uint64_t
+zfs_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+zfs_unlock_free(struct zfs_unlock *zu)
+{
+	if (zu == NULL)
+		return;
+	ebox_free(zu->zu_ebox);
+	free(zu->zu_fsname);
+	free(zu->zu_b64);
+	if (zu->zu_ds != NULL)
+		zfs_close(zu->zu_ds);
+	free(zu);
+}
+
+/*
+ * Examine one dataset to see if it's one we should unlock: it must be an
+ * encrypted dataset with its key not already loaded, and have the ebox
+ * property set on it directly (children which merely inherit the property
+ * from their encryption root get their key along with it).
+ */
+static int
+collect_unlock(zfs_handle_t *ds, void *arg)
+{
+	struct zfs_unlock_set *zus = arg;
+	struct zfs_unlock *zu;
+	nvlist_t *props, *prop;
+	struct sshbuf *buf = NULL;
+	errf_t *error;
+	const char *fsname = zfs_get_name(ds);
+	const char *propname;
+#if defined(__sun)
+	char *b64, *source;
+#else
+	const char *b64, *source;
+#endif
+	int rc;
+
+	/* Look at our children first so we always recurse. */
+	(void) zfs_iter_filesystems(ds, collect_unlock, zus);
+
+#if defined(DMU_OT_ENCRYPTED)
+	if (zfs_prop_get_int(ds, zprop_keystatus) == keystatus_available)
+		goto skip;
+#endif
+
+	props = zfs_get_user_props(ds);
+	VERIFY(props != NULL);
+
+	propname = PROP_RFD77_TEMP;
+	rc = nvlist_lookup_nvlist(props, propname, &prop);
+	if (rc) {
+		propname = PROP_RFD77;
+		rc = nvlist_lookup_nvlist(props, propname, &prop);
+	}
+	if (rc) {
+		propname = PROP_JOYENT;
+		rc = nvlist_lookup_nvlist(props, propname, &prop);
+	}
+	if (rc)
+		goto skip;
+	if (nvlist_lookup_string(prop, "source", &source) == 0 &&
+	    strcmp(source, fsname) != 0) {
+		goto skip;
+	}
+	VERIFY0(nvlist_lookup_string(prop, "value", &b64));
+
+	zu = calloc(1, sizeof (struct zfs_unlock));
+	VERIFY(zu != NULL);
+	zu->zu_ds = ds;
+	zu->zu_fsname = strdup(fsname);
+	zu->zu_b64 = strdup(b64);
+	VERIFY(zu->zu_fsname != NULL);
+	VERIFY(zu->zu_b64 != NULL);
+	zu->zu_propname = propname;
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	if ((rc = sshbuf_b64tod(buf, b64))) {
+		error = ssherrf("sshbuf_b64tod", rc);
+		warnfx(error, "failed to parse %s property on %s as base64",
+		    propname, fsname);
+		goto bad;
+	}
+	if ((error = sshbuf_get_ebox(buf, &zu->zu_ebox))) {
+		warnfx(error, "failed to parse %s property on %s as a valid "
+		    "ebox", propname, fsname);
+		goto bad;
+	}
+	sshbuf_free(buf);
+
+	if (zus->zus_tail != NULL)
+		zus->zus_tail->zu_next = zu;
+	else
+		zus->zus_head = zu;
+	zus->zus_tail = zu;
+	++zus->zus_n;
+	return (0);
+
+bad:
+	errf_free(error);
+	sshbuf_free(buf);
+	zfs_unlock_free(zu);
+	++zus->zus_nerrs;
+	return (0);
+
+skip:
+	zfs_close(ds);
+	return (0);
+}
+
+static void *
+load_key_thread(void *arg)
+{
+	struct zfs_load_state *zls = arg;
+	struct zfs_unlock *zu;
+	const uint8_t *key;
+	size_t keylen;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&zls->zls_mtx));
+		zu = zls->zls_next;
+		while (zu != NULL && !ebox_is_unlocked(zu->zu_ebox))
+			zu = zu->zu_next;
+		if (zu != NULL)
+			zls->zls_next = zu->zu_next;
+		VERIFY0(pthread_mutex_unlock(&zls->zls_mtx));
+		if (zu == NULL)
+			break;
+
+		key = ebox_key(zu->zu_ebox, &keylen);
+#if defined(DMU_OT_ENCRYPTED)
+		zu->zu_rc = lzc_load_key(zu->zu_fsname, B_FALSE,
+		    (uint8_t *)key, keylen);
+#else
+		zu->zu_rc = ENOTSUP;
+#endif
+	}
+
+	return (NULL);
+}
+
+static void
+cmd_unlock_many(const char *root)
+{
+	struct zfs_unlock_set zus;
+	struct zfs_unlock *zu;
+	struct zfs_load_state zls;
+	struct ebox **eboxes;
+	pthread_t threads[UNLOCK_LOAD_THREADS];
+	zfs_handle_t *ds;
+	zpool_handle_t *pool;
+	char *description;
+	size_t desclen;
+	errf_t *error;
+	uint i, nthreads, nunlocked, nloaded = 0;
+	uint64_t t0, tunbox, tload;
+	int rc;
+
+#if !defined(DMU_OT_ENCRYPTED)
+	errx(EXIT_ERROR, "this ZFS implementation does not support encryption");
+#endif
+
+	load_keystatus();
+
+	t0 = zfs_now_ms();
+
+	bzero(&zus, sizeof (zus));
+	if (root != NULL) {
+		ds = zfs_open(zfshdl, root, ZFS_TYPE_FILESYSTEM);
+		if (ds == NULL)
+			err(EXIT_ERROR, "failed to open dataset %s", root);
+		(void) collect_unlock(ds, &zus);
+	} else {
+		(void) zfs_iter_root(zfshdl, collect_unlock, &zus);
+	}
+
+	if (zus.zus_n == 0) {
+		if (zus.zus_nerrs > 0)
+			exit(EXIT_ERROR);
+		errx(EXIT_ALREADY_UNLOCKED, "no locked datasets with ebox "
+		    "properties found under %s", root ? root : "any pool");
+	}
+
+	fprintf(stderr, "Attempting to unlock %u ZFS datasets...\n",
+	    zus.zus_n);
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	/*
+	 * First do everything we can without interaction: group the boxes by
+	 * the token they need and open each group with one PIN entry.
+	 */
+	eboxes = calloc(zus.zus_n, sizeof (struct ebox *));
+	VERIFY(eboxes != NULL);
+	for (zu = zus.zus_head, i = 0; zu != NULL; zu = zu->zu_next)
+		eboxes[i++] = zu->zu_ebox;
+	error = local_unlock_eboxes(eboxes, zus.zus_n, &nunlocked);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to unlock eboxes");
+	free(eboxes);
+
+	/* Then fall back to the one-by-one (and recovery) path for the rest. */
+	for (zu = zus.zus_head; zu != NULL; zu = zu->zu_next) {
+		if (ebox_is_unlocked(zu->zu_ebox))
+			continue;
+		desclen = strlen(zu->zu_fsname) + 128;
+		description = calloc(1, desclen);
+		VERIFY(description != NULL);
+		snprintf(description, desclen, "ZFS filesystem %s",
+		    zu->zu_fsname);
+		fprintf(stderr, "Attempting to unlock ZFS '%s'...\n",
+		    zu->zu_fsname);
+		error = unlock_or_recover(zu->zu_ebox, description,
+		    &zu->zu_recovered);
+		free(description);
+		if (error) {
+			warnfx(error, "failed to unlock ebox for %s",
+			    zu->zu_fsname);
+			errf_free(error);
+			++zus.zus_nerrs;
+		}
+	}
+
+	tunbox = zfs_now_ms();
+
+	/*
+	 * The key loads are independent ioctls which each take a while for
+	 * the kernel to process (wrapping key checks etc), so issue them in
+	 * parallel.
+	 */
+	bzero(&zls, sizeof (zls));
+	VERIFY0(pthread_mutex_init(&zls.zls_mtx, NULL));
+	zls.zls_next = zus.zus_head;
+	nthreads = zus.zus_n;
+	if (nthreads > UNLOCK_LOAD_THREADS)
+		nthreads = UNLOCK_LOAD_THREADS;
+	for (i = 0; i < nthreads; ++i) {
+		VERIFY0(pthread_create(&threads[i], NULL, load_key_thread,
+		    &zls));
+	}
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+	VERIFY0(pthread_mutex_destroy(&zls.zls_mtx));
+
+	tload = zfs_now_ms();
+
+	while ((zu = zus.zus_head) != NULL) {
+		zus.zus_head = zu->zu_next;
+
+		if (!ebox_is_unlocked(zu->zu_ebox))
+			goto next;
+		if (zu->zu_rc != 0) {
+			errno = zu->zu_rc;
+			warn("failed to load key material into ZFS for %s",
+			    zu->zu_fsname);
+			++zus.zus_nerrs;
+			goto next;
+		}
+		++nloaded;
+
+		/* Best-effort mount of pool roots, as in cmd_unlock(). */
+		if (strchr(zu->zu_fsname, '/') == NULL) {
+			pool = zpool_open_canfail(zfshdl, zu->zu_fsname);
+			if (pool != NULL) {
+				(void) zpool_enable_datasets(pool, NULL, 0);
+				zpool_close(pool);
+			}
+		}
+
+		if (zu->zu_propname == PROP_RFD77_TEMP) {
+			rc = zfs_prop_set(zu->zu_ds, PROP_RFD77, zu->zu_b64);
+			if (rc == 0) {
+				rc = zfs_prop_inherit(zu->zu_ds,
+				    PROP_RFD77_TEMP, B_FALSE);
+			}
+			if (rc != 0) {
+				errno = rc;
+				warn("failed to update ebox property on "
+				    "dataset %s", zu->zu_fsname);
+			}
+		}
+
+		if (zu->zu_recovered) {
+			fprintf(stderr, "Dataset %s was unlocked using a "
+			    "recovery config: you should use `pivy-zfs "
+			    "unlock' or `pivy-zfs rekey' on it to add a new "
+			    "primary token.\n", zu->zu_fsname);
+		}
+next:
+		zfs_unlock_free(zu);
+	}
+
+	fprintf(stderr, "Unlocked %u of %u datasets in %llu ms (%u in "
+	    "per-token batches; unbox %llu ms, key load %llu ms)\n", nloaded,
+	    zus.zus_n, (unsigned long long)(tload - t0), nunlocked,
+	    (unsigned long long)(tunbox - t0),
+	    (unsigned long long)(tload - tunbox));
+
+	if (zus.zus_nerrs > 0)
+		exit(EXIT_ERROR);
+}
+
 static void
 cmd_rekey(const char *fsname)
 {
@@ -713,6 +1053,11 @@ usage(void)
 	    "\n"
 	    "Available operations:\n"
 	    "  unlock <zfs>            Unlock an encrypted ZFS filesystem\n"
+	    "  unlock -r <zfs>         Unlock all encrypted filesystems under\n"
+	    "                          <zfs> (a pool or dataset), using each\n"
+	    "                          token only once\n"
+	    "  unlock-all              Unlock all encrypted filesystems on\n"
+	    "                          all imported pools\n"
 	    "  zfs-create -- <args>    Run 'zfs create' with arguments and\n"
 	    "                          input transformed to provide keys for\n"
 	    "                          encryption.\n"
@@ -774,6 +1119,12 @@ main(int argc, char *argv[])
 
 	if (strcmp(op, "unlock") == 0) {
 		const char *fsname;
+		boolean_t recursive = B_FALSE;
+
+		if (optind < argc && strcmp(argv[optind], "-r") == 0) {
+			recursive = B_TRUE;
+			++optind;
+		}
 
 		if (optind >= argc) {
 			warnx("target zfs required");
@@ -786,7 +1137,18 @@ main(int argc, char *argv[])
 			usage();
 		}
 
-		cmd_unlock(fsname);
+		if (recursive)
+			cmd_unlock_many(fsname);
+		else
+			cmd_unlock(fsname);
+
+	} else if (strcmp(op, "unlock-all") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments");
+			usage();
+		}
+
+		cmd_unlock_many(NULL);
 
 	} else if (strcmp(op, "rekey") == 0) {
 		const char *fsname;